@@ -24,6 +24,7 @@
 #include "eavesdroppermodel.h"
 
 #include "arguments.h"
+#include "capturefile.h"
 #include "message.h"
 
 #include <QDataStream>
@@ -179,7 +180,20 @@ void EavesdropperModel::addMessage(Message *message, qint64 timestamp)
     beginInsertRows(QModelIndex(), m_messages.size(), m_messages.size());
     m_messages.push_back(MessageRecord(message, timestamp));
 
-    const uint currentMessageIndex = m_messages.size() - 1;
+    const int originalMessageIndex = linkToConversation(&m_messages, &m_callsAwaitingResponse,
+                                                        m_messages.size() - 1);
+    if (originalMessageIndex >= 0 && m_messages[originalMessageIndex].couldHaveNicerDestination(m_messages)) {
+        const QModelIndex index = createIndex(originalMessageIndex, DestinationColumn);
+        emit dataChanged(index, index);
+    }
+    endInsertRows();
+}
+
+// static
+int EavesdropperModel::linkToConversation(std::vector<MessageRecord> *messages,
+                                          std::map<Call, uint32> *callsAwaitingResponse, uint32 currentMessageIndex)
+{
+    const Message *message = (*messages)[currentMessageIndex].message;
 
     // Connect responses with previously spotted calls because information from one is useful for the other.
     // We must match the call sender with the reply receiver, instead of the call receiver with the reply
@@ -191,24 +205,21 @@ void EavesdropperModel::addMessage(Message *message, qint64 timestamp)
         // ### it would be nice to clean up m_callsAwaitingResponse periodically, but we allocate
         //     memory that is not freed before shutdown left and right so it doesn't make much of
         //     a difference. it does make a difference when serials overflow.
-        m_callsAwaitingResponse[Call(message->serial(), message->sender())] = currentMessageIndex;
+        (*callsAwaitingResponse)[Call(message->serial(), message->sender())] = currentMessageIndex;
     } else if (message->type() == Message::MethodReturnMessage || message->type() == Message::ErrorMessage) {
         Call key(message->replySerial(), message->destination());
-        std::map<Call, uint32>::iterator it = m_callsAwaitingResponse.find(key);
+        std::map<Call, uint32>::iterator it = callsAwaitingResponse->find(key);
         // we could have missed the initial call because it happened before we connected to the bus...
         // theoretically we could assert the presence of the call after one d-bus timeout has passed
-        if (it != m_callsAwaitingResponse.end()) {
+        if (it != callsAwaitingResponse->end()) {
             const uint originalMessageIndex = it->second;
-            m_messages.back().otherMessageIndex = originalMessageIndex;
-            m_messages[originalMessageIndex].otherMessageIndex = currentMessageIndex;
-            m_callsAwaitingResponse.erase(it);
-            if (m_messages[originalMessageIndex].couldHaveNicerDestination(m_messages)) {
-                const QModelIndex index = createIndex(originalMessageIndex, DestinationColumn);
-                emit dataChanged(index, index);
-            }
+            (*messages)[currentMessageIndex].otherMessageIndex = originalMessageIndex;
+            (*messages)[originalMessageIndex].otherMessageIndex = currentMessageIndex;
+            callsAwaitingResponse->erase(it);
+            return originalMessageIndex;
         }
     }
-    endInsertRows();
+    return -1;
 }
 
 QVariant EavesdropperModel::data(const QModelIndex &index, int role) const
@@ -325,40 +336,64 @@ void EavesdropperModel::clearInternal()
     m_messages.clear();
 }
 
-static const char *fileHeader = "Dferry binary DBus dump v0001";
-
 void EavesdropperModel::saveToFile(const QString &path)
 {
-    QFile file(path);
-    file.open(QIODevice::WriteOnly | QIODevice::Truncate);
-    file.write(fileHeader);
-
+    // Messages are stored as they appear on the bus. Calls and replies are connected again on loading.
+    CaptureWriter writer;
+    if (!writer.open(path.toStdString())) {
+        return;
+    }
     for (MessageRecord &msgRecord : m_messages) {
-        std::vector<byte> msgData = msgRecord.message->save();
+        writer.append(*msgRecord.message, msgRecord.timestamp);
+    }
+    writer.finish();
+}
 
-        // auxiliary data from MessageRecord, length prefix
-        {
-            QDataStream auxStream(&file);
-            auxStream.setVersion(12);
-            auxStream << msgRecord.otherMessageIndex;
-            auxStream << msgRecord.timestamp;
-            auxStream << quint32(msgData.size());
-        }
+static const char *legacyFileHeader = "Dferry binary DBus dump v0001";
 
-        // serialized message just like it would appear on the bus
-        file.write(reinterpret_cast<const char*>(&msgData[0]), msgData.size());
+bool EavesdropperModel::loadFromFile(const QString &path)
+{
+    std::vector<MessageRecord> loadedRecords;
+    {
+        CaptureReader reader;
+        if (!reader.open(path.toStdString())) {
+            if (reader.error().code() != Error::MalformedCaptureFile || !loadLegacyFile(path, &loadedRecords)) {
+                return false;
+            }
+        }
+        // The messages keep pointing into the file mapping, so loading is quick
+        loadedRecords.reserve(reader.messageCount());
+        for (uint32 i = 0; i < reader.messageCount(); i++) {
+            loadedRecords.push_back(MessageRecord(new Message(reader.message(i)),
+                                                  reader.indexEntry(i).timestamp));
+        }
+    }
+    std::map<Call, uint32> callsAwaitingResponse;
+    for (uint32 i = 0; i < loadedRecords.size(); i++) {
+        loadedRecords[i].otherMessageIndex = -1;
+    }
+    for (uint32 i = 0; i < loadedRecords.size(); i++) {
+        linkToConversation(&loadedRecords, &callsAwaitingResponse, i);
     }
+
+    beginResetModel();
+    clearInternal();
+    m_messages = loadedRecords;
+    endResetModel();
+    // TODO disable capture or make sure that our call-reply matching features work in the
+    //      presence of data loaded from a different session...
+    return true;
 }
 
-bool EavesdropperModel::loadFromFile(const QString &path)
+// static
+bool EavesdropperModel::loadLegacyFile(const QString &path, std::vector<MessageRecord> *records)
 {
     QFile file(path);
     file.open(QIODevice::ReadOnly);
-    if (file.read(strlen(fileHeader)) != QByteArray(fileHeader)) {
+    if (file.read(strlen(legacyFileHeader)) != QByteArray(legacyFileHeader)) {
         return false;
     }
 
-    std::vector<MessageRecord> loadedRecords;
     while (!file.atEnd()) {
         MessageRecord record;
         quint32 messageDataSize;
@@ -381,14 +416,7 @@ bool EavesdropperModel::loadFromFile(const QString &path)
         }
         record.message = new Message();
         record.message->load(msgData);
-        loadedRecords.push_back(record);
+        records->push_back(record);
     }
-
-    beginResetModel();
-    clearInternal();
-    m_messages = loadedRecords;
-    endResetModel();
-    // TODO disable capture or make sure that our call-reply matching features work in the
-    //      presence of data loaded from a different session...
     return true;
 }
@@ -113,6 +113,13 @@ private:
         std::string endpoint;
     };
 
+    // Connects the message at currentMessageIndex with its call if it is a reply, or remembers it as
+    // a call awaiting a reply. Returns the index of the call if one was found, else -1.
+    static int linkToConversation(std::vector<MessageRecord> *messages,
+                                  std::map<Call, uint32> *callsAwaitingResponse, uint32 currentMessageIndex);
+    // for files saved before the capture file format
+    static bool loadLegacyFile(const QString &path, std::vector<MessageRecord> *records);
+
     bool m_isRecording;
     std::map<Call, uint32> m_callsAwaitingResponse; // the value is an index in m_messages
     std::vector<MessageRecord> m_messages;
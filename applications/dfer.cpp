@@ -22,6 +22,7 @@
 */
 
 #include "arguments.h"
+#include "capturefile.h"
 #include "connectioninfo.h"
 #include "error.h"
 #include "eventdispatcher.h"
@@ -29,6 +30,9 @@
 #include "message.h"
 #include "transceiver.h"
 
+#include <csignal>
+#include <ctime>
+#include <iomanip>
 #include <iostream>
 #include <string>
 
@@ -48,21 +52,65 @@ static Message createEavesdropMessage(const char *messageType)
 
 class ReplyPrinter : public IMessageReceiver
 {
+public:
+    // if captureWriter is not null, messages are written to it instead of printed
+    CaptureWriter *m_captureWriter = nullptr;
+
     // reimplemented from IMessageReceiver
     void spontaneousMessageReceived(Message m) override;
 };
 
+// nanoseconds since the Unix epoch
+static int64 captureTimestamp()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return int64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 void ReplyPrinter::spontaneousMessageReceived(Message m)
 {
-    cout << '\n' << m.prettyPrint();
+    if (m_captureWriter) {
+        if (!m_captureWriter->append(m, captureTimestamp()) && m_captureWriter->error().isError()) {
+            std::cerr << "Writing the capture file failed.\n";
+            exit(1);
+        }
+    } else {
+        cout << '\n' << m.prettyPrint();
+    }
+}
+
+static EventDispatcher *s_dispatcher = nullptr;
+
+static void stopCapture(int)
+{
+    s_dispatcher->interrupt();
+}
+
+static int printCaptureFile(const string &fileName)
+{
+    CaptureReader reader;
+    if (!reader.open(fileName)) {
+        std::cerr << "Could not read capture file \"" << fileName << "\".\n";
+        return 1;
+    }
+    for (uint32 i = 0; i < reader.messageCount(); i++) {
+        const int64 timestamp = reader.indexEntry(i).timestamp;
+        cout << '\n' << timestamp / 1000000000 << '.' << setw(6) << setfill('0')
+             << (timestamp / 1000) % 1000000 << '\n' << reader.message(i).prettyPrint();
+    }
+    return 0;
 }
 
 static void printHelp()
 {
     std::cout << "dfer options:\n"
-                 "  --session-bus  Monitor the session bus [the default]\n"
-                 "  --system-bus   Monitor the system bus\n"
-                 "  --help         Show this help and exit\n";
+                 "  --session-bus   Monitor the session bus [the default]\n"
+                 "  --system-bus    Monitor the system bus\n"
+                 "  --capture FILE  Write the messages to a capture file instead of printing them,\n"
+                 "                  until interrupted\n"
+                 "  --print FILE    Print the messages in a capture file and exit\n"
+                 "  --help          Show this help and exit\n";
 }
 
 int main(int argc, char *argv[])
@@ -70,6 +118,7 @@ int main(int argc, char *argv[])
     EventDispatcher dispatcher;
 
     ConnectionInfo::Bus bus = ConnectionInfo::Bus::Session;
+    string captureFileName;
     for (int i = 1; i < argc; i++) {
         string s = argv[i];
         if (s == "--help") {
@@ -79,6 +128,11 @@ int main(int argc, char *argv[])
             bus = ConnectionInfo::Bus::System;
         } else if (s == "--session-bus") {
             bus = ConnectionInfo::Bus::Session;
+        } else if ((s == "--capture" || s == "--print") && i + 1 < argc) {
+            if (s == "--print") {
+                return printCaptureFile(argv[i + 1]);
+            }
+            captureFileName = argv[++i];
         } else {
             std::cerr << "Unknown option \"" << s << "\".\n";
             printHelp();
@@ -86,8 +140,21 @@ int main(int argc, char *argv[])
         }
     }
 
+    CaptureWriter captureWriter;
+    if (!captureFileName.empty() && !captureWriter.open(captureFileName)) {
+        std::cerr << "Could not create capture file \"" << captureFileName << "\".\n";
+        exit(1);
+    }
+
     Transceiver transceiver(&dispatcher, bus);
     ReplyPrinter receiver;
+    if (captureWriter.isOpen()) {
+        receiver.m_captureWriter = &captureWriter;
+        // finish the file properly when interrupted
+        s_dispatcher = &dispatcher;
+        signal(SIGINT, stopCapture);
+        signal(SIGTERM, stopCapture);
+    }
     transceiver.setSpontaneousMessageReceiver(&receiver);
     {
         static const int messageTypeCount = 4;
@@ -102,9 +169,12 @@ int main(int argc, char *argv[])
         }
     }
 
-    while (true) {
-        dispatcher.poll();
+    while (dispatcher.poll()) {
     }
 
+    if (!captureWriter.finish()) {
+        std::cerr << "Writing the capture file failed.\n";
+        return 1;
+    }
     return 0;
 }
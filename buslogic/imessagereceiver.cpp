@@ -39,3 +39,7 @@ void IMessageReceiver::pendingReplyFinished(PendingReply * /* pendingReply */)
     // if we get here that might be bad! but it also might not be under special circumstances, so
     // don't complain.
 }
+
+void IMessageReceiver::signalReceived(Message /* signal */, uint32 /* subscriptionId */)
+{
+}
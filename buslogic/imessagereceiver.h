@@ -24,7 +24,7 @@
 #ifndef IMESSAGERECEIVER_H
 #define IMESSAGERECEIVER_H
 
-#include "export.h"
+#include "types.h"
 
 class Message;
 class PendingReply;
@@ -41,6 +41,11 @@ public:
     // The default implementation does nothing since somebody must still have the PendingReply, so the
     // Message is still reachable. That's a somewhat strange but valid situation.
     virtual void pendingReplyFinished(PendingReply *pendingReply);
+    // For a signal that matches a subscription from Transceiver::subscribeToSignal(). If several
+    // subscriptions of a receiver match, it is called once for each. Signals that match no
+    // subscription go to spontaneousMessageReceived() of the Transceiver's spontaneous message
+    // receiver instead. The default implementation does nothing.
+    virtual void signalReceived(Message signal, uint32 subscriptionId);
 };
 
 #endif // IMESSAGERECEIVER_H
@@ -0,0 +1,50 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef IOBJECTHANDLER_H
+#define IOBJECTHANDLER_H
+
+#include "arguments.h"
+
+class Message;
+
+// Implements the interface of one or more objects, see Transceiver::registerObject().
+// Indices are those returned by the ObjectInterface methods of the registered interface.
+class DFERRY_EXPORT IObjectHandler
+{
+public:
+    virtual ~IObjectHandler();
+    // The signature of the call's arguments has already been checked. Sending the reply, if the call
+    // expects one, is up to the handler; it can be sent later, too.
+    virtual void methodCalled(Message call, uint32 methodIndex) = 0;
+    // For org.freedesktop.DBus.Properties.Get and GetAll: write the value of the property, which
+    // must have the registered signature, for the object at the path of call. Return false to reply
+    // with an error. The default implementation returns false.
+    virtual bool readProperty(const Message &call, uint32 propertyIndex, Arguments::Writer *writer);
+    // For org.freedesktop.DBus.Properties.Set: read the new value, which has the registered signature,
+    // from reader. Return false to reply with an error. The default implementation returns false.
+    virtual bool writeProperty(const Message &call, uint32 propertyIndex, Arguments::Reader *reader);
+};
+
+#endif // IOBJECTHANDLER_H
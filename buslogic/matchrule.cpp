@@ -0,0 +1,212 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "matchrule.h"
+
+#include "validation.h"
+
+#include <map>
+
+using namespace std;
+
+class MatchRule::Private
+{
+public:
+    string sender;
+    string path;
+    string pathNamespace;
+    string interface;
+    string member;
+    map<uint32, string> arguments; // sorted, for toString()
+};
+
+MatchRule::MatchRule()
+   : d(new Private)
+{
+}
+
+MatchRule::MatchRule(const MatchRule &other)
+   : d(new Private(*other.d))
+{
+}
+
+MatchRule &MatchRule::operator=(const MatchRule &other)
+{
+    if (this != &other) {
+        *d = *other.d;
+    }
+    return *this;
+}
+
+MatchRule::~MatchRule()
+{
+    delete d;
+    d = nullptr;
+}
+
+void MatchRule::setSender(const string &sender)
+{
+    d->sender = sender;
+}
+
+string MatchRule::sender() const
+{
+    return d->sender;
+}
+
+void MatchRule::setPath(const string &path)
+{
+    d->path = path;
+}
+
+string MatchRule::path() const
+{
+    return d->path;
+}
+
+void MatchRule::setPathNamespace(const string &pathNamespace)
+{
+    d->pathNamespace = pathNamespace;
+}
+
+string MatchRule::pathNamespace() const
+{
+    return d->pathNamespace;
+}
+
+void MatchRule::setInterface(const string &interface)
+{
+    d->interface = interface;
+}
+
+string MatchRule::interface() const
+{
+    return d->interface;
+}
+
+void MatchRule::setMember(const string &member)
+{
+    d->member = member;
+}
+
+string MatchRule::member() const
+{
+    return d->member;
+}
+
+void MatchRule::setArgument(uint32 index, const string &value)
+{
+    d->arguments[index] = value;
+}
+
+void MatchRule::clearArgument(uint32 index)
+{
+    d->arguments.erase(index);
+}
+
+string MatchRule::argument(uint32 index, bool *isPresent) const
+{
+    const auto it = d->arguments.find(index);
+    const bool found = it != d->arguments.end();
+    if (isPresent) {
+        *isPresent = found;
+    }
+    return found ? it->second : string();
+}
+
+static cstring toCstring(const string &str)
+{
+    return cstring(str.c_str(), str.length());
+}
+
+Error MatchRule::error() const
+{
+    if (!d->sender.empty() && !validation::isBusName(toCstring(d->sender))) {
+        return Error::MessageSender;
+    }
+    if (!d->path.empty() && !d->pathNamespace.empty()) {
+        return Error::MatchRulePathConflict;
+    }
+    if ((!d->path.empty() && !validation::isObjectPath(toCstring(d->path))) ||
+        (!d->pathNamespace.empty() && !validation::isObjectPath(toCstring(d->pathNamespace)))) {
+        return Error::MessagePath;
+    }
+    if (!d->interface.empty() && !validation::isInterfaceName(toCstring(d->interface))) {
+        return Error::MessageInterface;
+    }
+    if (!d->member.empty() && !validation::isMemberName(toCstring(d->member))) {
+        return Error::MessageMethod;
+    }
+    for (const auto &argument : d->arguments) {
+        if (argument.first > MaxArgumentIndex) {
+            return Error::MatchRuleArgumentIndex;
+        }
+        if (!validation::isUtf8(toCstring(argument.second))) {
+            return Error::InvalidString;
+        }
+    }
+    return Error::NoError;
+}
+
+static void appendField(string *rule, const char *key, const string &value)
+{
+    *rule += ',';
+    *rule += key;
+    *rule += "='";
+    // There is no escaping inside quotes, so an apostrophe ends the quoted part and is escaped
+    // outside of it.
+    for (char c : value) {
+        if (c == '\'') {
+            *rule += "'\\''";
+        } else {
+            *rule += c;
+        }
+    }
+    *rule += '\'';
+}
+
+string MatchRule::toString() const
+{
+    string ret = "type='signal'";
+    if (!d->sender.empty()) {
+        appendField(&ret, "sender", d->sender);
+    }
+    if (!d->interface.empty()) {
+        appendField(&ret, "interface", d->interface);
+    }
+    if (!d->member.empty()) {
+        appendField(&ret, "member", d->member);
+    }
+    if (!d->path.empty()) {
+        appendField(&ret, "path", d->path);
+    }
+    if (!d->pathNamespace.empty()) {
+        appendField(&ret, "path_namespace", d->pathNamespace);
+    }
+    for (const auto &argument : d->arguments) {
+        const string key = "arg" + to_string(argument.first);
+        appendField(&ret, key.c_str(), argument.second);
+    }
+    return ret;
+}
@@ -0,0 +1,82 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef MATCHRULE_H
+#define MATCHRULE_H
+
+#include "error.h"
+
+#include <string>
+
+// A rule for Transceiver::subscribeToSignal(), which adds it to the bus with AddMatch and uses it to
+// pick the subscriber(s) of each received signal. Unset (empty) fields match anything, so the
+// default-constructed rule matches all signals. Validation is done by error(), not by the setters.
+class DFERRY_EXPORT MatchRule
+{
+public:
+    enum {
+        MaxArgumentIndex = 63 // from the D-Bus spec
+    };
+
+    MatchRule();
+    MatchRule(const MatchRule &other);
+    MatchRule &operator=(const MatchRule &other);
+    ~MatchRule();
+
+    // A unique name (":1.42") or a well-known name. Signals carry the unique name of their sender,
+    // so for a well-known name, Transceiver follows which unique name currently owns it.
+    void setSender(const std::string &sender);
+    std::string sender() const;
+
+    // Only one of path and path namespace can be set. A path namespace matches the path itself and
+    // all paths below it.
+    void setPath(const std::string &path);
+    std::string path() const;
+    void setPathNamespace(const std::string &pathNamespace);
+    std::string pathNamespace() const;
+
+    void setInterface(const std::string &interface);
+    std::string interface() const;
+    void setMember(const std::string &member);
+    std::string member() const;
+
+    // argN='value': the signal's argument number index must be a string equal to value, which
+    // may be empty.
+    void setArgument(uint32 index, const std::string &value);
+    void clearArgument(uint32 index);
+    std::string argument(uint32 index, bool *isPresent = nullptr) const;
+
+    Error error() const;
+    bool isValid() const { return !error().isError(); }
+
+    // The rule in the string format of AddMatch and RemoveMatch, with the fields in a fixed order so
+    // that equal rules give equal strings.
+    std::string toString() const;
+
+private:
+    class Private;
+    Private *d;
+};
+
+#endif // MATCHRULE_H
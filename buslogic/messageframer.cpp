@@ -0,0 +1,247 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "messageframer.h"
+
+#include "icompletionclient.h"
+#include "iconnection.h"
+#include "message.h"
+#include "message_p.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Small messages share a slab. A message keeps all of its slab alive, so the slab should not be huge.
+static const uint32 s_slabSize = 65536;
+// messages longer than this that don't arrive in one piece get their own buffer
+static const uint32 s_maxSlabMessageLength = s_slabSize / 4;
+// don't bother to read into less space than this, start over with an empty slab instead
+static const uint32 s_minReadSpace = 4096;
+
+MessageFramer::MessageFramer(IConnection *connection, ICompletionClient *completionClient,
+                             ICompletionClient *errorClient)
+   : m_completionClient(completionClient),
+     m_errorClient(errorClient),
+     m_slab(nullptr),
+     m_readPos(0),
+     m_writePos(0),
+     m_nextMessageLength(0),
+     m_largeMessage(nullptr),
+     m_largeMessageLength(0),
+     m_largeMessageReceived(0),
+     m_isError(false),
+     m_deletionGuard(nullptr)
+{
+    connection->addClient(this);
+    setReadNotificationEnabled(true);
+}
+
+MessageFramer::~MessageFramer()
+{
+    if (m_deletionGuard) {
+        *m_deletionGuard = true;
+    }
+    if (m_slab) {
+        m_slab->deref();
+    }
+    if (m_largeMessage) {
+        m_largeMessage->deref();
+    }
+}
+
+void MessageFramer::notifyConnectionReadyRead()
+{
+    if (m_isError) {
+        return;
+    }
+    if (m_largeMessage) {
+        // read exactly the rest so that the following data goes into the slab
+        const chunk in = connection()->read(m_largeMessage->data() + m_largeMessageReceived,
+                                            m_largeMessageLength - m_largeMessageReceived);
+        m_largeMessageReceived += in.length;
+    } else if (prepareSlab()) {
+        const chunk in = connection()->read(m_slab->data() + m_writePos, m_slab->capacity() - m_writePos);
+        m_writePos += in.length;
+    } else {
+        stop();
+    }
+
+    // The completion client may delete us, or handle events which call this method recursively
+    bool isDeleted = false;
+    bool *const outerDeletionGuard = m_deletionGuard;
+    m_deletionGuard = &isDeleted;
+    while (Message *message = takeMessage()) {
+        m_completionClient->notifyCompletion(message);
+        if (isDeleted) {
+            if (outerDeletionGuard) {
+                *outerDeletionGuard = true;
+            }
+            return;
+        }
+    }
+    m_deletionGuard = outerDeletionGuard;
+
+    if (!m_isError && !connection()->isOpen()) {
+        stop();
+    }
+    if (m_isError) {
+        // replies can't arrive anymore, so the connection is useless
+        if (connection()->isOpen()) {
+            connection()->close();
+        }
+        if (m_errorClient) {
+            m_errorClient->notifyCompletion(this);
+        }
+    }
+}
+
+bool MessageFramer::prepareSlab()
+{
+    if (m_slab && m_readPos == m_writePos && !m_slab->isShared()) {
+        m_readPos = 0;
+        m_writePos = 0;
+    }
+    if (m_slab && m_slab->capacity() - m_writePos >= s_minReadSpace &&
+        m_readPos + m_nextMessageLength <= m_slab->capacity()) {
+        return true;
+    }
+    // move any incomplete message to the beginning of the slab, or of a new one if messages still
+    // point into the current one
+    SharedBuffer *slab = m_slab;
+    if (!slab || slab->isShared()) {
+        slab = SharedBuffer::create(s_slabSize);
+        if (!slab) {
+            return false;
+        }
+    }
+    const uint32 pending = m_writePos - m_readPos;
+    assert(pending <= s_maxSlabMessageLength || !m_nextMessageLength);
+    if (pending) {
+        memmove(slab->data(), m_slab->data() + m_readPos, pending);
+    }
+    if (slab != m_slab) {
+        if (m_slab) {
+            m_slab->deref();
+        }
+        m_slab = slab;
+    }
+    m_readPos = 0;
+    m_writePos = pending;
+    return true;
+}
+
+Message *MessageFramer::takeMessage()
+{
+    if (m_isError) {
+        return nullptr;
+    }
+    if (m_largeMessage) {
+        if (m_largeMessageReceived < m_largeMessageLength) {
+            return nullptr;
+        }
+        SharedBuffer *const buffer = m_largeMessage;
+        const chunk data(buffer->data(), m_largeMessageLength);
+        m_largeMessage = nullptr;
+        m_largeMessageLength = 0;
+        m_largeMessageReceived = 0;
+        return createMessage(data, buffer);
+    }
+    if (!m_slab) {
+        return nullptr;
+    }
+
+    byte *const begin = m_slab->data() + m_readPos;
+    const uint32 available = m_writePos - m_readPos;
+    if (!m_nextMessageLength) {
+        if (!MessagePrivate::peekMessageLength(chunk(begin, available), &m_nextMessageLength)) {
+            stop();
+            return new Message;
+        }
+        if (!m_nextMessageLength) {
+            return nullptr;
+        }
+    }
+    const uint32 length = m_nextMessageLength;
+
+    if (available < length) {
+        if (length > s_maxSlabMessageLength) {
+            m_largeMessage = SharedBuffer::create(length);
+            if (!m_largeMessage) {
+                stop();
+                return new Message;
+            }
+            memcpy(m_largeMessage->data(), begin, available);
+            m_largeMessageLength = length;
+            m_largeMessageReceived = available;
+            m_readPos = m_writePos;
+            m_nextMessageLength = 0;
+        }
+        return nullptr;
+    }
+
+    m_readPos += length;
+    m_nextMessageLength = 0;
+    // Readers hand out pointers to array data, so the data must be aligned like it is in the message.
+    // Messages following a message with an odd length have to be copied.
+    if (reinterpret_cast<uintptr_t>(begin) & 7) {
+        SharedBuffer *copy = SharedBuffer::create(length);
+        if (!copy) {
+            stop();
+            return new Message;
+        }
+        memcpy(copy->data(), begin, length);
+        return createMessage(chunk(copy->data(), length), copy);
+    }
+    m_slab->ref();
+    return createMessage(chunk(begin, length), m_slab);
+}
+
+Message *MessageFramer::createMessage(chunk data, SharedBuffer *buffer)
+{
+    Message *message = new Message;
+    MessagePrivate *const mpriv = MessagePrivate::get(message);
+    // If the message is invalid, it stays empty. The framing is still intact, so carry on.
+    if (mpriv->adoptReceivedData(data, buffer) && message->unixFdCount()) {
+        std::vector<int> fds;
+        if (connection()->takeFileDescriptors(message->unixFdCount(), &fds)) {
+            mpriv->adoptFileDescriptors(&fds);
+        } else {
+            // the fds arrive with the beginning of the message, so they are missing for good
+            *message = Message();
+            stop();
+        }
+    }
+    return message;
+}
+
+void MessageFramer::stop()
+{
+    // there is no way to recover the message boundaries after garbage or a failed allocation.
+    // notifyConnectionReadyRead() reports it when done with the messages received before.
+    m_isError = true;
+    setReadNotificationEnabled(false);
+}
@@ -0,0 +1,76 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef MESSAGEFRAMER_H
+#define MESSAGEFRAMER_H
+
+#include "iconnectionclient.h"
+#include "types.h"
+
+class ICompletionClient;
+class IConnection;
+class Message;
+class SharedBuffer;
+
+// Receives all messages from a connection. It reads into a large buffer, as much as is available in
+// one read() call, and cuts out as many messages as that data contains. Messages are handed out
+// without copying them again if they are suitably aligned in the buffer. Unix fds received from the
+// connection are attached to the messages that announce them in their header.
+class MessageFramer : public IConnectionClient
+{
+public:
+    // completionClient->notifyCompletion() is called with each received Message *, which it then owns.
+    // It may delete the framer from there. Errors are reported as an empty message. If the data
+    // can't be split into messages anymore, or the connection was closed, receiving stops, the
+    // connection is closed, and errorClient (if not null) is notified with this. It must not delete
+    // the framer.
+    MessageFramer(IConnection *connection, ICompletionClient *completionClient,
+                  ICompletionClient *errorClient = nullptr);
+    ~MessageFramer();
+
+    void notifyConnectionReadyRead() override;
+
+private:
+    // makes room to read into the slab; returns false if out of memory
+    bool prepareSlab();
+    // returns the next complete message, an empty message on error, or nullptr
+    Message *takeMessage();
+    Message *createMessage(chunk data, SharedBuffer *buffer);
+    void stop();
+
+    ICompletionClient *m_completionClient;
+    ICompletionClient *m_errorClient;
+    SharedBuffer *m_slab;
+    uint32 m_readPos; // beginning of the first message not taken yet
+    uint32 m_writePos; // end of received data
+    uint32 m_nextMessageLength; // length of the message at m_readPos if known, else 0
+    // a message too large for the slab is received directly into its own buffer
+    SharedBuffer *m_largeMessage;
+    uint32 m_largeMessageLength;
+    uint32 m_largeMessageReceived;
+    bool m_isError;
+    bool *m_deletionGuard;
+};
+
+#endif // MESSAGEFRAMER_H
@@ -0,0 +1,208 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "messagesender.h"
+
+#include "icompletionclient.h"
+#include "iconnection.h"
+#include "message_p.h"
+
+#include <cassert>
+
+MessageSender::MessageSender(ICompletionClient *completionClient, ICompletionClient *failureClient)
+   : m_completionClient(completionClient),
+     m_failureClient(failureClient),
+     m_isUnixFdPassingEnabled(false),
+     m_hasConnection(false),
+     m_isWriting(false),
+     m_isSocketFull(false),
+     m_frontWritten(0)
+{
+}
+
+void MessageSender::send(Message message)
+{
+    assert(MessagePrivate::get(&message)->m_buffer.length);
+    {
+        SpinLocker locker(&m_lock);
+        m_queue.push_back(std::move(message));
+    }
+    updateWriteNotification();
+}
+
+bool MessageSender::sendFromOtherThread(Message message)
+{
+    assert(MessagePrivate::get(&message)->m_buffer.length);
+    {
+        SpinLocker locker(&m_lock);
+        m_queue.push_back(std::move(message));
+        // otherwise, the writing thread or the connection's thread will get to it
+        if (m_isWriting || m_isSocketFull || !m_hasConnection) {
+            return false;
+        }
+        m_isWriting = true;
+    }
+    return !writeQueue(true);
+}
+
+void MessageSender::setConnection(IConnection *connection)
+{
+    assert(!this->connection());
+    connection->addClient(this);
+    {
+        SpinLocker locker(&m_lock);
+        m_hasConnection = true;
+    }
+    updateWriteNotification();
+}
+
+uint32 MessageSender::queueLength() const
+{
+    SpinLocker locker(&m_lock);
+    return m_queue.size();
+}
+
+void MessageSender::updateWriteNotification()
+{
+    if (connection()) {
+        bool isQueueWaiting;
+        {
+            SpinLocker locker(&m_lock);
+            // a writing thread either empties the queue or calls for resumeWriting()
+            isQueueWaiting = !m_queue.empty() && !m_isWriting;
+        }
+        setWriteNotificationEnabled(isQueueWaiting && connection()->isOpen());
+    }
+}
+
+void MessageSender::notifyConnectionReadyWrite()
+{
+    bool isOtherThreadWriting;
+    {
+        SpinLocker locker(&m_lock);
+        m_isSocketFull = false;
+        isOtherThreadWriting = m_isWriting;
+        m_isWriting = true; // no change if another thread is writing
+    }
+    if (!isOtherThreadWriting) {
+        writeQueue(false);
+    }
+    updateWriteNotification();
+}
+
+bool MessageSender::writeQueue(bool isOtherThread)
+{
+    bool isAllWritten = true;
+    while (isAllWritten) {
+        m_batch.clear();
+        uint32 batchLength = 0;
+        const std::vector<int> *fds = nullptr;
+        {
+            // other threads only append to the queue, which doesn't move the queued messages
+            SpinLocker locker(&m_lock);
+            if (m_queue.empty()) {
+                m_isWriting = false;
+                break;
+            }
+            for (Message &message : m_queue) {
+                if (m_batch.size() >= IConnection::MaxWriteChunks) {
+                    break;
+                }
+                MessagePrivate *const mpriv = MessagePrivate::get(&message);
+                const std::vector<int> &messageFds = mpriv->m_mainArguments.fileDescriptors();
+                if (!messageFds.empty()) {
+                    // fds are sent with the first byte of a write, so a message with fds must start a batch
+                    if (!m_batch.empty()) {
+                        break;
+                    }
+                    if (!m_frontWritten) {
+                        fds = &messageFds;
+                    }
+                }
+                chunk data = mpriv->m_buffer;
+                if (m_batch.empty()) {
+                    data.ptr += m_frontWritten;
+                    data.length -= m_frontWritten;
+                }
+                m_batch.push_back(data);
+                batchLength += data.length;
+                if (batchLength >= 1024 * 1024) {
+                    break; // plenty for the socket buffer
+                }
+            }
+        }
+
+        if (fds && !m_isUnixFdPassingEnabled) {
+            // it was queued before it was known whether the peer accepts fds
+            Message failed;
+            {
+                SpinLocker locker(&m_lock);
+                failed = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            if (m_failureClient) {
+                m_failureClient->notifyCompletion(&failed);
+            }
+            continue;
+        }
+        const int *const fdData = fds ? &(*fds)[0] : nullptr;
+        const uint32 fdCount = fds ? fds->size() : 0;
+        uint32 written = isOtherThread
+                ? connection()->writeFromOtherThread(&m_batch[0], m_batch.size(), fdData, fdCount)
+                : fds ? connection()->writeVectoredWithFileDescriptors(&m_batch[0], m_batch.size(),
+                                                                       fdData, fdCount)
+                      : connection()->writeVectored(&m_batch[0], m_batch.size());
+        isAllWritten = written == batchLength;
+
+        {
+            SpinLocker locker(&m_lock);
+            while (written) {
+                Message &front = m_queue.front();
+                const uint32 remaining = MessagePrivate::get(&front)->m_buffer.length - m_frontWritten;
+                if (written < remaining) {
+                    m_frontWritten += written;
+                    break;
+                }
+                written -= remaining;
+                m_frontWritten = 0;
+                m_written.push_back(std::move(front));
+                m_queue.pop_front();
+            }
+            if (!isAllWritten) {
+                // wait for the connection's thread to be notified
+                m_isSocketFull = true;
+                m_isWriting = false;
+            }
+        }
+
+        // outside of the lock
+        if (m_completionClient) {
+            for (Message &message : m_written) {
+                m_completionClient->notifyCompletion(&message);
+            }
+        }
+        m_written.clear();
+    }
+    return isAllWritten;
+}
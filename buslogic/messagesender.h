@@ -0,0 +1,91 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef MESSAGESENDER_H
+#define MESSAGESENDER_H
+
+#include "iconnectionclient.h"
+#include "message.h"
+#include "spinlock.h"
+#include "types.h"
+
+#include <deque>
+#include <vector>
+
+class ICompletionClient;
+
+// Sends the messages queued in it, in order. It writes as many of them as possible with one
+// vectored write, so that bursts of messages don't need one syscall each.
+// Other threads can queue messages too, and then write them right away if no other thread is
+// writing. Only when the socket is full does the connection's thread need to take over.
+class MessageSender : public IConnectionClient
+{
+public:
+    // completionClient may be null. If not, its notifyCompletion() is called with each Message *
+    // that has been sent completely, just before it is destroyed, in the thread that wrote it.
+    // It must not delete the sender.
+    // failureClient may be null. If not, its notifyCompletion() is called in the same way with each
+    // Message * that can't be sent because it has Unix fds and the peer doesn't accept them.
+    explicit MessageSender(ICompletionClient *completionClient,
+                           ICompletionClient *failureClient = nullptr);
+
+    // Messages must be serialized. They are only queued until there is a connection.
+    void send(Message message);
+    // For threads other than the connection's, which must keep the sender and the connection alive
+    // meanwhile. Returns true if the connection's thread must call resumeWriting() because the
+    // socket is full.
+    bool sendFromOtherThread(Message message);
+    void resumeWriting() { updateWriteNotification(); }
+
+    void setConnection(IConnection *connection);
+    // Whether the peer accepts Unix fds; if not, messages with fds fail. Off by default.
+    void setUnixFdPassingEnabled(bool enabled) { m_isUnixFdPassingEnabled = enabled; }
+    uint32 queueLength() const;
+
+    void notifyConnectionReadyWrite() override;
+
+private:
+    void updateWriteNotification();
+    // call as the writing thread; returns false if the socket is full
+    bool writeQueue(bool isOtherThread);
+
+    ICompletionClient *m_completionClient;
+    ICompletionClient *m_failureClient;
+    bool m_isUnixFdPassingEnabled;
+
+    mutable Spinlock m_lock;
+    // BEGIN variables protected by m_lock
+    std::deque<Message> m_queue;
+    bool m_hasConnection;
+    bool m_isWriting; // a thread is in writeQueue(), the only place where messages are removed
+    bool m_isSocketFull; // until the connection's thread is notified that it's writable again
+    // END variables protected by m_lock
+
+    // only used by the writing thread
+    uint32 m_frontWritten; // number of bytes of the first message already written
+    std::vector<chunk> m_batch; // only to avoid reallocation
+    std::vector<Message> m_written;
+};
+
+#endif // MESSAGESENDER_H
@@ -0,0 +1,195 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "objectinterface.h"
+#include "objectinterface_p.h"
+
+#include "arguments.h"
+#include "validation.h"
+
+using namespace std;
+
+static cstring toCstring(const string &str)
+{
+    return cstring(str.c_str(), str.length());
+}
+
+ObjectInterface::ObjectInterface(const string &name)
+   : d(make_shared<ObjectInterfacePrivate>())
+{
+    d->m_name = name;
+    if (!validation::isInterfaceName(toCstring(name))) {
+        d->m_error = Error::MessageInterface;
+    }
+}
+
+ObjectInterface::ObjectInterface(const ObjectInterface &other)
+   : d(other.d)
+{
+}
+
+ObjectInterface &ObjectInterface::operator=(const ObjectInterface &other)
+{
+    d = other.d;
+    return *this;
+}
+
+ObjectInterface::~ObjectInterface()
+{
+}
+
+string ObjectInterface::name() const
+{
+    return d->m_name;
+}
+
+// returns the private data for changing it, which is not shared anymore then
+static ObjectInterfacePrivate *detached(shared_ptr<ObjectInterfacePrivate> *d)
+{
+    if (d->use_count() > 1) {
+        *d = make_shared<ObjectInterfacePrivate>(**d);
+    }
+    return d->get();
+}
+
+// checks name and adds it to indices; records the first error in priv
+static uint32 addName(ObjectInterfacePrivate *priv, CStringMap<uint32> *indices, const string &name,
+                      uint32 index)
+{
+    if (!validation::isMemberName(toCstring(name))) {
+        if (!priv->m_error.isError()) {
+            priv->m_error = Error::MessageMethod;
+        }
+    } else if (indices->find(toCstring(name))) {
+        if (!priv->m_error.isError()) {
+            priv->m_error = Error::DuplicateInterfaceMember;
+        }
+    } else {
+        (*indices)[name] = index;
+    }
+    return index;
+}
+
+static void checkSignature(ObjectInterfacePrivate *priv, const string &signature,
+                           Arguments::SignatureType type)
+{
+    if (!priv->m_error.isError() && !Arguments::isSignatureValid(toCstring(signature), type)) {
+        priv->m_error = Error::InvalidSignature;
+    }
+}
+
+uint32 ObjectInterface::addMethod(const string &name, const string &inSignature,
+                                  const string &outSignature)
+{
+    ObjectInterfacePrivate *const priv = detached(&d);
+    checkSignature(priv, inSignature, Arguments::MethodSignature);
+    checkSignature(priv, outSignature, Arguments::MethodSignature);
+    priv->m_methods.push_back(ObjectInterfacePrivate::Method{ name, inSignature, outSignature });
+    return addName(priv, &priv->m_methodIndices, name, priv->m_methods.size() - 1);
+}
+
+uint32 ObjectInterface::addSignal(const string &name, const string &signature)
+{
+    ObjectInterfacePrivate *const priv = detached(&d);
+    checkSignature(priv, signature, Arguments::MethodSignature);
+    priv->m_signals.push_back(ObjectInterfacePrivate::Signal{ name, signature });
+    return addName(priv, &priv->m_signalIndices, name, priv->m_signals.size() - 1);
+}
+
+uint32 ObjectInterface::addProperty(const string &name, const string &signature, PropertyAccess access)
+{
+    ObjectInterfacePrivate *const priv = detached(&d);
+    checkSignature(priv, signature, Arguments::VariantSignature);
+    priv->m_properties.push_back(ObjectInterfacePrivate::Property{ name, signature, access });
+    return addName(priv, &priv->m_propertyIndices, name, priv->m_properties.size() - 1);
+}
+
+Error ObjectInterface::error() const
+{
+    return d->m_error;
+}
+
+// splits a valid signature into its single complete types
+static vector<string> splitSignature(const string &signature)
+{
+    vector<string> ret;
+    size_t i = 0;
+    while (i < signature.length()) {
+        const size_t begin = i;
+        while (signature[i] == 'a') {
+            i++;
+        }
+        if (signature[i] == '(' || signature[i] == '{') {
+            int depth = 0;
+            do {
+                if (signature[i] == '(' || signature[i] == '{') {
+                    depth++;
+                } else if (signature[i] == ')' || signature[i] == '}') {
+                    depth--;
+                }
+                i++;
+            } while (depth);
+        } else {
+            i++;
+        }
+        ret.push_back(signature.substr(begin, i - begin));
+    }
+    return ret;
+}
+
+static void appendArgs(string *xml, const string &signature, const char *direction)
+{
+    for (const string &type : splitSignature(signature)) {
+        *xml += "      <arg type=\"" + type + '"';
+        if (direction) {
+            *xml += " direction=\"";
+            *xml += direction;
+            *xml += '"';
+        }
+        *xml += "/>\n";
+    }
+}
+
+void ObjectInterfacePrivate::appendIntrospectionXml(string *xml) const
+{
+    // names and signatures can't contain any characters that would need escaping in XML
+    *xml += "  <interface name=\"" + m_name + "\">\n";
+    for (const Method &method : m_methods) {
+        *xml += "    <method name=\"" + method.name + "\">\n";
+        appendArgs(xml, method.inSignature, "in");
+        appendArgs(xml, method.outSignature, "out");
+        *xml += "    </method>\n";
+    }
+    for (const Signal &signal : m_signals) {
+        *xml += "    <signal name=\"" + signal.name + "\">\n";
+        appendArgs(xml, signal.signature, nullptr);
+        *xml += "    </signal>\n";
+    }
+    for (const Property &property : m_properties) {
+        static const char *accessNames[4] = { "", "read", "write", "readwrite" };
+        *xml += "    <property name=\"" + property.name + "\" type=\"" + property.signature +
+                "\" access=\"" + accessNames[property.access & ObjectInterface::ReadWrite] + "\"/>\n";
+    }
+    *xml += "  </interface>\n";
+}
@@ -0,0 +1,74 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef OBJECTINTERFACE_H
+#define OBJECTINTERFACE_H
+
+#include "error.h"
+
+#include <memory>
+#include <string>
+
+class ObjectInterfacePrivate;
+
+// The methods, signals and properties of a D-Bus interface that an object implements, for
+// Transceiver::registerObject(). Method calls are dispatched according to it, and the replies to
+// org.freedesktop.DBus.Introspectable and org.freedesktop.DBus.Properties calls are generated
+// from it. Copies are cheap and share the data until one of them is changed.
+class DFERRY_EXPORT ObjectInterface
+{
+public:
+    enum PropertyAccess : byte
+    {
+        ReadOnly = 1,
+        WriteOnly = 2,
+        ReadWrite = 3
+    };
+
+    explicit ObjectInterface(const std::string &name);
+    ObjectInterface(const ObjectInterface &other);
+    ObjectInterface &operator=(const ObjectInterface &other);
+    ~ObjectInterface();
+
+    std::string name() const;
+
+    // These return the index of the new member, which is how IObjectHandler refers to it. Indices
+    // are counted separately for methods, signals and properties, starting at 0. The first invalid
+    // name or signature, or name that is added twice, is reported by error().
+    uint32 addMethod(const std::string &name, const std::string &inSignature = std::string(),
+                     const std::string &outSignature = std::string());
+    // only for introspection
+    uint32 addSignal(const std::string &name, const std::string &signature = std::string());
+    // signature must be a single complete type
+    uint32 addProperty(const std::string &name, const std::string &signature, PropertyAccess access);
+
+    Error error() const;
+    bool isValid() const { return !error().isError(); }
+
+private:
+    friend class ObjectInterfacePrivate;
+    std::shared_ptr<ObjectInterfacePrivate> d;
+};
+
+#endif // OBJECTINTERFACE_H
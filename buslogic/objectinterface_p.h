@@ -0,0 +1,75 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef OBJECTINTERFACE_P_H
+#define OBJECTINTERFACE_P_H
+
+#include "objectinterface.h"
+
+#include "cstringmap.h"
+
+#include <string>
+#include <vector>
+
+// Immutable once registered; ObjectInterface copies it before changing it if it is shared.
+class ObjectInterfacePrivate
+{
+public:
+    static std::shared_ptr<const ObjectInterfacePrivate> get(const ObjectInterface &interface)
+    {
+        return interface.d;
+    }
+
+    struct Method
+    {
+        std::string name;
+        std::string inSignature;
+        std::string outSignature;
+    };
+    struct Signal
+    {
+        std::string name;
+        std::string signature;
+    };
+    struct Property
+    {
+        std::string name;
+        std::string signature;
+        ObjectInterface::PropertyAccess access;
+    };
+
+    // the <interface> element of introspection data, indented for a top-level <node>
+    void appendIntrospectionXml(std::string *xml) const;
+
+    std::string m_name;
+    Error m_error; // the first error
+    std::vector<Method> m_methods;
+    std::vector<Signal> m_signals;
+    std::vector<Property> m_properties;
+    CStringMap<uint32> m_methodIndices; // by name
+    CStringMap<uint32> m_propertyIndices;
+    CStringMap<uint32> m_signalIndices; // only to find duplicates
+};
+
+#endif // OBJECTINTERFACE_P_H
@@ -0,0 +1,452 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "objectregistry.h"
+
+#include "arguments.h"
+#include "iobjecthandler.h"
+#include "message.h"
+#include "objectinterface.h"
+#include "objectinterface_p.h"
+#include "stringtools.h"
+#include "validation.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+static const char *s_introspectableInterface = "org.freedesktop.DBus.Introspectable";
+static const char *s_propertiesInterface = "org.freedesktop.DBus.Properties";
+
+static const char *s_introspectionHeader =
+    "<!DOCTYPE node PUBLIC \"-//freedesktop//DTD D-BUS Object Introspection 1.0//EN\"\n"
+    " \"http://www.freedesktop.org/standards/dbus/1.0/introspect.dtd\">\n"
+    "<node>\n"
+    "  <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
+    "    <method name=\"Introspect\">\n"
+    "      <arg type=\"s\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "  </interface>\n";
+
+static const char *s_propertiesXml =
+    "  <interface name=\"org.freedesktop.DBus.Properties\">\n"
+    "    <method name=\"Get\">\n"
+    "      <arg type=\"s\" direction=\"in\"/>\n"
+    "      <arg type=\"s\" direction=\"in\"/>\n"
+    "      <arg type=\"v\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetAll\">\n"
+    "      <arg type=\"s\" direction=\"in\"/>\n"
+    "      <arg type=\"a{sv}\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"Set\">\n"
+    "      <arg type=\"s\" direction=\"in\"/>\n"
+    "      <arg type=\"s\" direction=\"in\"/>\n"
+    "      <arg type=\"v\" direction=\"in\"/>\n"
+    "    </method>\n"
+    "  </interface>\n";
+
+static bool equals(cstring a, const char *b)
+{
+    const size_t length = strlen(b);
+    return a.length == length && (!length || !memcmp(a.ptr, b, length));
+}
+
+static bool equals(cstring a, const string &b)
+{
+    return a.length == b.length() && (!a.length || !memcmp(a.ptr, b.c_str(), a.length));
+}
+
+// static
+Message ObjectRegistry::errorReply(const Message &call, const char *errorName, const string &text)
+{
+    Message reply = Message::createErrorReplyTo(call, string("org.freedesktop.DBus.Error.") + errorName);
+    Arguments::Writer writer;
+    writer.writeString(cstring(text.c_str(), text.length()));
+    reply.setArguments(writer.finish());
+    return reply;
+}
+
+ObjectRegistry::ObjectRegistry()
+   : m_nextId(1),
+     m_subtreeCount(0)
+{
+}
+
+ObjectRegistry::~ObjectRegistry()
+{
+}
+
+uint32 ObjectRegistry::add(const string &path, const ObjectInterface &interface,
+                           IObjectHandler *handler, bool isSubtree)
+{
+    const string name = interface.name();
+    if (!handler || !interface.isValid() ||
+        !validation::isObjectPath(cstring(path.c_str(), path.length())) ||
+        name == s_introspectableInterface || name == s_propertiesInterface) {
+        return 0;
+    }
+    const vector<string> elements = split(path, '/', false);
+    PathNode *node = &m_root;
+    for (const string &element : elements) {
+        unique_ptr<PathNode> &child = node->children[element];
+        if (!child) {
+            child.reset(new PathNode);
+        }
+        node = child.get();
+    }
+    CStringMap<Registration *> &interfaces = isSubtree ? node->subtreeInterfaces : node->interfaces;
+    Registration *&registration = interfaces[name];
+    if (registration) {
+        return 0; // already registered; any nodes on the way exist for that registration, too
+    }
+
+    uint32 id = m_nextId++;
+    while (!id || m_registrations.count(id)) { // wrapped around
+        id = m_nextId++;
+    }
+    registration = &m_registrations[id];
+    registration->path = path;
+    registration->isSubtree = isSubtree;
+    registration->interface = ObjectInterfacePrivate::get(interface);
+    registration->handler = handler;
+    if (isSubtree) {
+        m_subtreeCount++;
+    } else {
+        m_objects[path] = node;
+    }
+    return id;
+}
+
+bool ObjectRegistry::remove(uint32 id)
+{
+    const auto it = m_registrations.find(id);
+    if (it == m_registrations.end()) {
+        return false;
+    }
+    const Registration &registration = it->second;
+    const vector<string> elements = split(registration.path, '/', false);
+    vector<PathNode *> nodes(1, &m_root);
+    for (const string &element : elements) {
+        unique_ptr<PathNode> *child = nodes.back()->children.find(cstring(element.c_str(),
+                                                                          element.length()));
+        assert(child);
+        nodes.push_back(child->get());
+    }
+    PathNode *const node = nodes.back();
+    if (registration.isSubtree) {
+        node->subtreeInterfaces.erase(registration.interface->m_name);
+        m_subtreeCount--;
+    } else {
+        node->interfaces.erase(registration.interface->m_name);
+        if (node->interfaces.empty()) {
+            m_objects.erase(registration.path);
+        }
+    }
+    // prune the nodes that have become empty
+    for (size_t i = elements.size(); i > 0 && nodes[i]->isEmpty(); i--) {
+        nodes[i - 1]->children.erase(elements[i - 1]);
+    }
+    m_registrations.erase(it);
+    return true;
+}
+
+ObjectRegistry::PathNode *ObjectRegistry::findNode(cstring path, vector<PathNode *> *ancestors)
+{
+    if (!path.length) {
+        return nullptr; // no path header; the message is invalid anyway
+    }
+    PathNode *node = &m_root;
+    uint32 begin = 1;
+    while (begin < path.length) {
+        const char *const endPtr = static_cast<const char *>(memchr(path.ptr + begin, '/',
+                                                                    path.length - begin));
+        const uint32 end = endPtr ? endPtr - path.ptr : path.length;
+        unique_ptr<PathNode> *child = node->children.find(cstring(path.ptr + begin, end - begin));
+        ancestors->push_back(node);
+        if (!child) {
+            return nullptr;
+        }
+        node = child->get();
+        begin = end + 1;
+    }
+    return node;
+}
+
+vector<const ObjectRegistry::Registration *> ObjectRegistry::registrationsFor(
+    PathNode *node, const vector<PathNode *> &ancestors)
+{
+    vector<const Registration *> ret;
+    const auto addAll = [&ret](CStringMap<Registration *> *interfaces) {
+        interfaces->forEach([&ret](const string &name, Registration *registration) {
+            const bool isCovered = any_of(ret.begin(), ret.end(), [&name](const Registration *r) {
+                return r->interface->m_name == name;
+            });
+            if (!isCovered) {
+                ret.push_back(registration);
+            }
+        });
+    };
+    if (node) {
+        addAll(&node->interfaces);
+        addAll(&node->subtreeInterfaces);
+    }
+    if (m_subtreeCount) {
+        for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+            addAll(&(*it)->subtreeInterfaces);
+        }
+    }
+    return ret;
+}
+
+bool ObjectRegistry::dispatch(Message *call, Message *reply)
+{
+    if (m_registrations.empty()) {
+        return false;
+    }
+    const cstring path = call->stringHeaderRaw(Message::PathHeader);
+    const cstring interface = call->stringHeaderRaw(Message::InterfaceHeader);
+
+    // the common case
+    if (interface.length) {
+        if (PathNode **object = m_objects.find(path)) {
+            if (Registration **registration = (*object)->interfaces.find(interface)) {
+                callMethod(*registration, call, reply);
+                return true;
+            }
+        }
+    }
+
+    vector<PathNode *> ancestors;
+    PathNode *const node = findNode(path, &ancestors);
+    const vector<const Registration *> registrations = registrationsFor(node, ancestors);
+    if (!node && registrations.empty()) {
+        return false;
+    }
+
+    const cstring method = call->stringHeaderRaw(Message::MethodHeader);
+    if (equals(interface, s_introspectableInterface) ||
+        (!interface.length && equals(method, "Introspect"))) {
+        if (equals(method, "Introspect")) {
+            introspect(node, registrations, *call, reply);
+        } else {
+            *reply = errorReply(*call, "UnknownMethod", "No such method \"" + toStdString(method) + '"');
+        }
+        return true;
+    }
+    if (registrations.empty()) {
+        // a node that only exists because there are objects below it
+        *reply = errorReply(*call, "UnknownObject", "No such object \"" + toStdString(path) + '"');
+        return true;
+    }
+    if (equals(interface, s_propertiesInterface)) {
+        handlePropertiesCall(registrations, *call, reply);
+        return true;
+    }
+
+    for (const Registration *registration : registrations) {
+        // without an interface, the first one that has the method
+        if (interface.length ? equals(interface, registration->interface->m_name)
+                             : registration->interface->m_methodIndices.find(method) != nullptr) {
+            callMethod(registration, call, reply);
+            return true;
+        }
+    }
+    if (interface.length) {
+        *reply = errorReply(*call, "UnknownInterface",
+                            "No such interface \"" + toStdString(interface) + '"');
+    } else {
+        *reply = errorReply(*call, "UnknownMethod", "No such method \"" + toStdString(method) + '"');
+    }
+    return true;
+}
+
+void ObjectRegistry::callMethod(const Registration *registration, Message *call, Message *reply)
+{
+    const cstring method = call->stringHeaderRaw(Message::MethodHeader);
+    const uint32 *index = registration->interface->m_methodIndices.find(method);
+    if (!index) {
+        *reply = errorReply(*call, "UnknownMethod", "No such method \"" + toStdString(method) + '"');
+        return;
+    }
+    const ObjectInterfacePrivate::Method &info = registration->interface->m_methods[*index];
+    if (!equals(call->stringHeaderRaw(Message::SignatureHeader), info.inSignature)) {
+        *reply = errorReply(*call, "InvalidArgs",
+                            "Expected arguments of type \"" + info.inSignature + '"');
+        return;
+    }
+    // the handler may remove the registration, so don't touch it anymore afterwards
+    registration->handler->methodCalled(std::move(*call), *index);
+}
+
+void ObjectRegistry::introspect(PathNode *node, const vector<const Registration *> &registrations,
+                                const Message &call, Message *reply)
+{
+    string xml = s_introspectionHeader;
+    if (!registrations.empty()) {
+        xml += s_propertiesXml;
+    }
+    for (const Registration *registration : registrations) {
+        registration->interface->appendIntrospectionXml(&xml);
+    }
+    if (node) {
+        vector<string> children;
+        node->children.forEach([&children](const string &name, unique_ptr<PathNode> &) {
+            children.push_back(name);
+        });
+        std::sort(children.begin(), children.end());
+        for (const string &child : children) {
+            xml += "  <node name=\"" + child + "\"/>\n";
+        }
+    }
+    xml += "</node>\n";
+
+    *reply = Message::createReplyTo(call);
+    Arguments::Writer writer;
+    writer.writeString(cstring(xml.c_str(), xml.length()));
+    reply->setArguments(writer.finish());
+}
+
+// writes the value of a property as a variant
+static bool writePropertyValue(IObjectHandler *handler, const Message &call, uint32 index,
+                               const ObjectInterfacePrivate::Property &property,
+                               Arguments::Writer *writer)
+{
+    writer->beginVariant();
+    const bool ok = handler->readProperty(call, index, writer) &&
+                    equals(writer->currentSignature(), property.signature);
+    writer->endVariant();
+    return ok && writer->isValid();
+}
+
+void ObjectRegistry::handlePropertiesCall(const vector<const Registration *> &registrations,
+                                          const Message &call, Message *reply)
+{
+    const cstring method = call.stringHeaderRaw(Message::MethodHeader);
+    const char *signature = nullptr;
+    if (equals(method, "Get")) {
+        signature = "ss";
+    } else if (equals(method, "GetAll")) {
+        signature = "s";
+    } else if (equals(method, "Set")) {
+        signature = "ssv";
+    } else {
+        *reply = errorReply(call, "UnknownMethod", "No such method \"" + toStdString(method) + '"');
+        return;
+    }
+    if (!equals(call.stringHeaderRaw(Message::SignatureHeader), signature)) {
+        *reply = errorReply(call, "InvalidArgs", string("Expected arguments of type \"") + signature + '"');
+        return;
+    }
+
+    Arguments::Reader reader(call);
+    const cstring interface = reader.readString();
+    const Registration *registration = nullptr;
+    for (const Registration *r : registrations) {
+        if (equals(interface, r->interface->m_name)) {
+            registration = r;
+            break;
+        }
+    }
+    if (!registration) {
+        *reply = errorReply(call, "UnknownInterface",
+                            "No such interface \"" + toStdString(interface) + '"');
+        return;
+    }
+    const ObjectInterfacePrivate &info = *registration->interface;
+    Arguments::Writer writer;
+
+    if (equals(method, "GetAll")) {
+        const bool hasReadable = any_of(info.m_properties.begin(), info.m_properties.end(),
+                                        [](const ObjectInterfacePrivate::Property &property) {
+            return property.access & ObjectInterface::ReadOnly;
+        });
+        bool ok = true;
+        writer.beginDict(hasReadable ? Arguments::Writer::NonEmptyArray
+                                     : Arguments::Writer::WriteTypesOfEmptyArray);
+        if (!hasReadable) {
+            writer.writeString(cstring(""));
+            writer.beginVariant();
+            writer.endVariant();
+        }
+        for (uint32 i = 0; ok && i < info.m_properties.size(); i++) {
+            const ObjectInterfacePrivate::Property &property = info.m_properties[i];
+            if (property.access & ObjectInterface::ReadOnly) {
+                writer.writeString(cstring(property.name.c_str(), property.name.length()));
+                ok = writePropertyValue(registration->handler, call, i, property, &writer);
+            }
+        }
+        writer.endDict();
+        Arguments values = writer.finish();
+        if (!ok || values.error().isError()) {
+            *reply = errorReply(call, "Failed", "Failed to read the properties");
+            return;
+        }
+        *reply = Message::createReplyTo(call);
+        reply->setArguments(std::move(values));
+        return;
+    }
+
+    const cstring name = reader.readString();
+    const uint32 *index = info.m_propertyIndices.find(name);
+    if (!index) {
+        *reply = errorReply(call, "UnknownProperty", "No such property \"" + toStdString(name) + '"');
+        return;
+    }
+    const ObjectInterfacePrivate::Property &property = info.m_properties[*index];
+
+    if (equals(method, "Get")) {
+        if (!(property.access & ObjectInterface::ReadOnly)) {
+            *reply = errorReply(call, "AccessDenied", "Property \"" + property.name + "\" is write-only");
+            return;
+        }
+        const bool ok = writePropertyValue(registration->handler, call, *index, property, &writer);
+        Arguments value = writer.finish();
+        if (!ok || value.error().isError()) {
+            *reply = errorReply(call, "Failed", "Failed to read property \"" + property.name + '"');
+            return;
+        }
+        *reply = Message::createReplyTo(call);
+        reply->setArguments(std::move(value));
+        return;
+    }
+
+    // Set
+    if (!(property.access & ObjectInterface::WriteOnly)) {
+        *reply = errorReply(call, "PropertyReadOnly", "Property \"" + property.name + "\" is read-only");
+        return;
+    }
+    reader.beginVariant();
+    if (!equals(reader.currentSignature(), property.signature)) {
+        *reply = errorReply(call, "InvalidArgs", "Expected a value of type \"" + property.signature + '"');
+        return;
+    }
+    if (!registration->handler->writeProperty(call, *index, &reader)) {
+        *reply = errorReply(call, "Failed", "Failed to write property \"" + property.name + '"');
+        return;
+    }
+    *reply = Message::createReplyTo(call);
+}
@@ -0,0 +1,104 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef OBJECTREGISTRY_H
+#define OBJECTREGISTRY_H
+
+#include "cstringmap.h"
+#include "types.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class IObjectHandler;
+class Message;
+class ObjectInterface;
+class ObjectInterfacePrivate;
+
+// The objects that a Transceiver serves. A call to an interface registered at exactly the call's
+// path takes three hash lookups: path, interface and method. Only calls to subtree registrations,
+// to the standard interfaces and to unknown interfaces walk the trie of path elements.
+class ObjectRegistry
+{
+public:
+    ObjectRegistry();
+    ~ObjectRegistry();
+    ObjectRegistry(const ObjectRegistry &) = delete;
+    void operator=(const ObjectRegistry &) = delete;
+
+    // Returns the id of the registration, or 0 if path or interface is invalid or the interface
+    // is already registered at path
+    uint32 add(const std::string &path, const ObjectInterface &interface, IObjectHandler *handler,
+               bool isSubtree);
+    bool remove(uint32 id);
+    bool isEmpty() const { return m_registrations.empty(); }
+
+    // Handles *call if there is an object at its path or below it: calls a handler, which takes
+    // over *call, or puts an automatic reply (introspection, properties or an error) into *reply.
+    // Returns false if there is no such object.
+    bool dispatch(Message *call, Message *reply);
+
+    // an error reply with one of the standard D-Bus error names, like "UnknownObject"
+    static Message errorReply(const Message &call, const char *errorName, const std::string &text);
+
+private:
+    struct Registration
+    {
+        std::string path;
+        bool isSubtree;
+        std::shared_ptr<const ObjectInterfacePrivate> interface;
+        IObjectHandler *handler;
+    };
+
+    // A node of the path trie; the root is "/"
+    struct PathNode
+    {
+        bool isEmpty() const { return interfaces.empty() && subtreeInterfaces.empty() && children.empty(); }
+
+        CStringMap<std::unique_ptr<PathNode>> children; // by path element
+        CStringMap<Registration *> interfaces; // by interface name
+        CStringMap<Registration *> subtreeInterfaces; // for this path and everything below
+    };
+
+    void callMethod(const Registration *registration, Message *call, Message *reply);
+    PathNode *findNode(cstring path, std::vector<PathNode *> *ancestors);
+    // the registrations for path, most specific first, each interface only once
+    std::vector<const Registration *> registrationsFor(PathNode *node,
+                                                       const std::vector<PathNode *> &ancestors);
+    void introspect(PathNode *node, const std::vector<const Registration *> &registrations,
+                    const Message &call, Message *reply);
+    void handlePropertiesCall(const std::vector<const Registration *> &registrations,
+                              const Message &call, Message *reply);
+
+    uint32 m_nextId;
+    std::unordered_map<uint32, Registration> m_registrations;
+    PathNode m_root;
+    // the nodes with registrations for exactly their path, by full path, to skip walking the trie
+    CStringMap<PathNode *> m_objects;
+    uint32 m_subtreeCount;
+};
+
+#endif // OBJECTREGISTRY_H
@@ -25,12 +25,43 @@
 #include "pendingreply_p.h"
 
 #include "imessagereceiver.h"
+#include "malloccache.h"
+#include "platformtime.h"
 #include "transceiver.h"
 #include "transceiver_p.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 
+thread_local static MallocCache<sizeof(PendingReplyPrivate), 32> pendingReplyAllocCache;
+
+// static
+PendingReplyPrivate *PendingReplyPrivate::create(TransceiverPrivate *transceiver, uint32 serial)
+{
+    PendingReplyPrivate *ret = new(pendingReplyAllocCache.allocate()) PendingReplyPrivate;
+    ret->m_owner = nullptr;
+    ret->m_transceiverOrReply.transceiver = transceiver;
+    ret->m_cookie = nullptr;
+    ret->m_receiver = nullptr;
+    ret->m_serial = serial;
+    ret->m_isFinished = false;
+    ret->m_hasTimeout = false;
+    ret->m_reserved = 0;
+    ret->m_timeoutBucket = 0;
+    ret->m_previousInBucket = nullptr;
+    ret->m_nextInBucket = nullptr;
+    return ret;
+}
+
+// static
+void PendingReplyPrivate::destroy(PendingReplyPrivate *priv)
+{
+    assert(!priv->m_hasTimeout);
+    priv->~PendingReplyPrivate();
+    pendingReplyAllocCache.free(priv);
+}
+
 PendingReply::PendingReply()
    : d(nullptr)
 {
@@ -50,7 +81,7 @@ PendingReply::~PendingReply()
             delete d->m_transceiverOrReply.reply;
         }
     }
-    delete d;
+    PendingReplyPrivate::destroy(d);
     d = nullptr;
 }
 
@@ -74,7 +105,7 @@ PendingReply &PendingReply::operator=(PendingReply &&other)
     if (this == &other) {
         return *this;
     }
-    delete d;
+    PendingReply discarded(std::move(*this)); // cleans up our old state like the destructor
     d = other.d;
     other.d = nullptr;
     // note that in this class, !d is a valid state; otherwise this check wouldn't be necessary because
@@ -87,10 +118,10 @@ PendingReply &PendingReply::operator=(PendingReply &&other)
 
 void PendingReplyPrivate::notifyDone(Message *reply)
 {
-    m_isFinished = true;
     // Transceiver has already unregistered us because it knows this reply is done
+    m_transceiverOrReply.transceiver->m_replyTimeouts.remove(this);
+    m_isFinished = true;
     m_transceiverOrReply.reply = reply;
-    m_replyTimeout.stop();
     if (m_receiver) {
         m_receiver->pendingReplyFinished(m_owner);
     }
@@ -169,10 +200,8 @@ Message PendingReply::takeReply()
     return reply;
 }
 
-void PendingReplyPrivate::notifyCompletion(void *task)
+void PendingReplyPrivate::notifyTimedOut()
 {
-    assert(task == &m_replyTimeout);
-    (void) task;
     assert(!m_isFinished);
     // if a reply comes after the timout, it's too late and the reply is probably served as a spontaneous
     // message by Transceiver
@@ -190,9 +219,122 @@ void PendingReplyPrivate::doErrorCompletion(Error error)
     if (!m_error.isError()) {
         m_error = error;
     }
+    if (!m_isFinished && m_transceiverOrReply.transceiver) {
+        m_transceiverOrReply.transceiver->m_replyTimeouts.remove(this);
+    }
     m_isFinished = true;
     m_transceiverOrReply.reply = nullptr;
     if (m_receiver) {
         m_receiver->pendingReplyFinished(m_owner);
     }
 }
+
+ReplyTimeouts::ReplyTimeouts(EventDispatcher *dispatcher)
+   : m_timer(dispatcher),
+     m_timerBucket(0),
+     m_deletionGuard(nullptr)
+{
+    m_timer.setRepeating(false);
+    m_timer.setCompletionClient(this);
+}
+
+ReplyTimeouts::~ReplyTimeouts()
+{
+    if (m_deletionGuard) {
+        *m_deletionGuard = false;
+    }
+    // the replies may be destroyed later, and they shouldn't find themselves in a list then
+    while (!m_buckets.empty()) {
+        unlink(m_buckets.begin()->second);
+    }
+}
+
+void ReplyTimeouts::add(PendingReplyPrivate *reply, int msecs)
+{
+    remove(reply);
+    // round up so that timeouts are never early
+    const uint64 due = PlatformTime::monotonicMsecs() + uint64(std::max(msecs, 0));
+    reply->m_timeoutBucket = (due + s_granularity - 1) / s_granularity;
+    reply->m_hasTimeout = true;
+    reply->m_previousInBucket = nullptr;
+    PendingReplyPrivate *&first = m_buckets[reply->m_timeoutBucket];
+    reply->m_nextInBucket = first;
+    if (first) {
+        first->m_previousInBucket = reply;
+    }
+    first = reply;
+    updateTimer();
+}
+
+void ReplyTimeouts::remove(PendingReplyPrivate *reply)
+{
+    if (!reply->m_hasTimeout) {
+        return;
+    }
+    unlink(reply);
+    updateTimer();
+}
+
+void ReplyTimeouts::unlink(PendingReplyPrivate *reply)
+{
+    assert(reply->m_hasTimeout);
+    if (reply->m_nextInBucket) {
+        reply->m_nextInBucket->m_previousInBucket = reply->m_previousInBucket;
+    }
+    if (reply->m_previousInBucket) {
+        reply->m_previousInBucket->m_nextInBucket = reply->m_nextInBucket;
+    } else {
+        const auto it = m_buckets.find(reply->m_timeoutBucket);
+        assert(it != m_buckets.end() && it->second == reply);
+        if (reply->m_nextInBucket) {
+            it->second = reply->m_nextInBucket;
+        } else {
+            m_buckets.erase(it);
+        }
+    }
+    reply->m_hasTimeout = false;
+    reply->m_previousInBucket = nullptr;
+    reply->m_nextInBucket = nullptr;
+}
+
+void ReplyTimeouts::updateTimer()
+{
+    if (m_deletionGuard) {
+        return; // notifyCompletion() does it when done
+    }
+    if (m_buckets.empty()) {
+        m_timerBucket = 0;
+        m_timer.stop();
+        return;
+    }
+    const uint64 bucket = m_buckets.begin()->first;
+    if (bucket == m_timerBucket && m_timer.isRunning()) {
+        return;
+    }
+    m_timerBucket = bucket;
+    const uint64 now = PlatformTime::monotonicMsecs();
+    const uint64 due = bucket * s_granularity;
+    m_timer.start(due > now ? int(due - now) : 0);
+}
+
+void ReplyTimeouts::notifyCompletion(void *task)
+{
+    assert(task == &m_timer);
+    (void) task;
+    bool alive = true;
+    m_deletionGuard = &alive;
+    const uint64 nowBucket = PlatformTime::monotonicMsecs() / s_granularity;
+    // one at a time because a reply's receiver may do anything, including destroying other replies
+    // or the Transceiver
+    while (!m_buckets.empty() && m_buckets.begin()->first <= nowBucket) {
+        PendingReplyPrivate *const reply = m_buckets.begin()->second;
+        unlink(reply);
+        reply->notifyTimedOut();
+        if (!alive) {
+            return;
+        }
+    }
+    m_deletionGuard = nullptr;
+    m_timerBucket = 0;
+    updateTimer();
+}
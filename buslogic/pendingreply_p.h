@@ -29,28 +29,23 @@
 #include "message.h"
 #include "timer.h"
 
+#include <map>
+
 class PendingReply;
 class TransceiverPrivate;
 
-class PendingReplyPrivate : public ICompletionClient
+class PendingReplyPrivate
 {
 public:
-    PendingReplyPrivate(EventDispatcher *dispatcher, int timeout)
-       : m_replyTimeout(dispatcher),
-         m_isFinished(false)
-    {
-        if (timeout >= 0) {
-            m_replyTimeout.setRepeating(false);
-            m_replyTimeout.setCompletionClient(this);
-            m_replyTimeout.start(timeout);
-        }
-    }
+    // objects are pooled, so use these instead of new and delete
+    static PendingReplyPrivate *create(TransceiverPrivate *transceiver, uint32 serial);
+    static void destroy(PendingReplyPrivate *priv);
 
     // for Transceiver
     void notifyDone(Message *reply);
     void doErrorCompletion(Error error);
-    // for m_replyTimeout
-    void notifyCompletion(void *task) override;
+    // for ReplyTimeouts
+    void notifyTimedOut();
 
     PendingReply *m_owner;
     union {
@@ -58,12 +53,47 @@ public:
         Message *reply;
     } m_transceiverOrReply;
     void *m_cookie;
-    Timer m_replyTimeout;
     IMessageReceiver *m_receiver;
     Error m_error;
     uint32 m_serial;
     bool m_isFinished : 1;
-    uint32 m_reserved : 31;
+    bool m_hasTimeout : 1;
+    uint32 m_reserved : 30;
+    // for ReplyTimeouts: due time in units of its granularity, and the other replies due then
+    uint64 m_timeoutBucket;
+    PendingReplyPrivate *m_previousInBucket;
+    PendingReplyPrivate *m_nextInBucket;
+
+private:
+    PendingReplyPrivate() = default;
+};
+
+// The reply timeouts of a Transceiver. Each Timer would cost a tree insertion and removal in
+// EventDispatcher, so timeouts are rounded up to a coarse granularity and kept in one list per due
+// time, and there is only one Timer for the earliest due time.
+class ReplyTimeouts : public ICompletionClient
+{
+public:
+    explicit ReplyTimeouts(EventDispatcher *dispatcher);
+    ~ReplyTimeouts();
+
+    // (re)starts the timeout of reply
+    void add(PendingReplyPrivate *reply, int msecs);
+    // does nothing if reply has no timeout
+    void remove(PendingReplyPrivate *reply);
+
+    void notifyCompletion(void *task) override;
+
+private:
+    void unlink(PendingReplyPrivate *reply);
+    void updateTimer();
+
+    static const uint32 s_granularity = 16; // msecs
+
+    Timer m_timer;
+    std::map<uint64, PendingReplyPrivate *> m_buckets; // due time -> first reply in the list
+    uint64 m_timerBucket; // the due time that m_timer is set to, 0 if not running
+    bool *m_deletionGuard;
 };
 
 #endif // PENDINGREPLY_P_H
@@ -0,0 +1,373 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "signalsubscriptions.h"
+
+#include "arguments.h"
+#include "imessagereceiver.h"
+#include "matchrule.h"
+#include "message.h"
+#include "stringtools.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+static const char *s_busName = "org.freedesktop.DBus";
+
+static bool equals(cstring a, const char *b)
+{
+    const size_t length = strlen(b);
+    return a.length == length && !memcmp(a.ptr, b, length);
+}
+
+static void removeId(vector<uint32> *ids, uint32 id)
+{
+    ids->erase(std::remove(ids->begin(), ids->end(), id), ids->end());
+}
+
+SignalSubscriptions::SignalSubscriptions()
+   : m_nextId(1)
+{
+}
+
+SignalSubscriptions::~SignalSubscriptions()
+{
+}
+
+uint32 SignalSubscriptions::add(const MatchRule &rule, IMessageReceiver *receiver,
+                                vector<string> *newRules, string *nameToLookUp)
+{
+    assert(rule.isValid());
+    newRules->clear();
+    nameToLookUp->clear();
+    Subscription subscription;
+    subscription.receiver = receiver;
+    subscription.rule = rule.toString();
+    subscription.interface = rule.interface();
+    subscription.member = rule.member();
+    subscription.isPathNamespace = rule.path().empty();
+    subscription.path = subscription.isPathNamespace ? rule.pathNamespace() : rule.path();
+    if (subscription.path.empty()) {
+        subscription.path = "/"; // the namespace of all paths
+    }
+    subscription.sender = rule.sender();
+    subscription.isSenderUniqueName = !subscription.sender.empty() && subscription.sender[0] == ':';
+    for (uint32 i = 0; i <= MatchRule::MaxArgumentIndex; i++) {
+        bool isPresent = false;
+        string value = rule.argument(i, &isPresent);
+        if (isPresent) {
+            subscription.arguments.emplace_back(i, move(value));
+        }
+    }
+
+    uint32 id = m_nextId++;
+    while (!id || m_subscriptions.count(id)) { // wrapped around
+        id = m_nextId++;
+    }
+
+    PathNode *node = &m_index[subscription.interface][subscription.member];
+    for (const string &element : split(subscription.path, '/', false)) {
+        unique_ptr<PathNode> &child = node->children[element];
+        if (!child) {
+            child.reset(new PathNode);
+        }
+        node = child.get();
+    }
+    (subscription.isPathNamespace ? node->namespaceIds : node->exactIds).push_back(id);
+
+    if (refRule(subscription.rule)) {
+        newRules->push_back(subscription.rule);
+    }
+    if (!subscription.sender.empty() && !subscription.isSenderUniqueName) {
+        NameOwner &nameOwner = m_nameOwners[subscription.sender];
+        if (nameOwner.refCount++ == 0) {
+            const string ownerRule = nameOwnerRule(subscription.sender);
+            if (refRule(ownerRule)) {
+                newRules->push_back(ownerRule);
+            }
+            *nameToLookUp = subscription.sender;
+        }
+    }
+    m_subscriptions.emplace(id, move(subscription));
+    return id;
+}
+
+bool SignalSubscriptions::remove(uint32 id, vector<string> *unusedRules)
+{
+    unusedRules->clear();
+    const auto it = m_subscriptions.find(id);
+    if (it == m_subscriptions.end()) {
+        return false;
+    }
+    const Subscription &subscription = it->second;
+
+    CStringMap<PathNode> *members = m_index.find(cstring(subscription.interface.c_str(),
+                                                         subscription.interface.length()));
+    assert(members);
+    PathNode *root = members->find(cstring(subscription.member.c_str(), subscription.member.length()));
+    assert(root);
+    const vector<string> elements = split(subscription.path, '/', false);
+    vector<PathNode *> nodes(1, root);
+    for (const string &element : elements) {
+        unique_ptr<PathNode> *child = nodes.back()->children.find(cstring(element.c_str(),
+                                                                          element.length()));
+        assert(child);
+        nodes.push_back(child->get());
+    }
+    PathNode *node = nodes.back();
+    removeId(subscription.isPathNamespace ? &node->namespaceIds : &node->exactIds, id);
+
+    // prune the nodes that have become empty
+    for (size_t i = elements.size(); i > 0; i--) {
+        PathNode *const child = nodes[i];
+        if (!child->exactIds.empty() || !child->namespaceIds.empty() || !child->children.empty()) {
+            break;
+        }
+        nodes[i - 1]->children.erase(elements[i - 1]);
+    }
+    if (root->exactIds.empty() && root->namespaceIds.empty() && root->children.empty()) {
+        members->erase(subscription.member);
+        if (members->empty()) {
+            m_index.erase(subscription.interface);
+        }
+    }
+
+    if (derefRule(subscription.rule)) {
+        unusedRules->push_back(subscription.rule);
+    }
+    if (!subscription.sender.empty() && !subscription.isSenderUniqueName) {
+        const auto nameOwner = m_nameOwners.find(subscription.sender);
+        assert(nameOwner != m_nameOwners.end());
+        if (--nameOwner->second.refCount == 0) {
+            m_nameOwners.erase(nameOwner);
+            const string ownerRule = nameOwnerRule(subscription.sender);
+            if (derefRule(ownerRule)) {
+                unusedRules->push_back(ownerRule);
+            }
+        }
+    }
+    m_subscriptions.erase(it);
+    return true;
+}
+
+vector<string> SignalSubscriptions::rules() const
+{
+    // the bus counts rules like we do, so one RemoveMatch per AddMatch that we sent
+    vector<string> ret;
+    ret.reserve(m_ruleRefCounts.size());
+    for (const auto &refCount : m_ruleRefCounts) {
+        ret.push_back(refCount.first);
+    }
+    return ret;
+}
+
+void SignalSubscriptions::setNameOwner(const string &name, const string &owner)
+{
+    const auto nameOwner = m_nameOwners.find(name);
+    if (nameOwner != m_nameOwners.end()) {
+        nameOwner->second.owner = owner;
+    }
+}
+
+// static
+string SignalSubscriptions::nameOwnerRule(const string &name)
+{
+    MatchRule rule;
+    rule.setSender(s_busName);
+    rule.setPath("/org/freedesktop/DBus");
+    rule.setInterface(s_busName);
+    rule.setMember("NameOwnerChanged");
+    rule.setArgument(0, name);
+    return rule.toString();
+}
+
+bool SignalSubscriptions::refRule(const string &rule)
+{
+    return m_ruleRefCounts[rule]++ == 0;
+}
+
+bool SignalSubscriptions::derefRule(const string &rule)
+{
+    const auto refCount = m_ruleRefCounts.find(rule);
+    assert(refCount != m_ruleRefCounts.end());
+    if (--refCount->second == 0) {
+        m_ruleRefCounts.erase(refCount);
+        return true;
+    }
+    return false;
+}
+
+bool SignalSubscriptions::maybeUpdateNameOwner(const Message &signal)
+{
+    if (m_nameOwners.empty() ||
+        !equals(signal.stringHeaderRaw(Message::MethodHeader), "NameOwnerChanged") ||
+        !equals(signal.stringHeaderRaw(Message::SenderHeader), s_busName) ||
+        !equals(signal.stringHeaderRaw(Message::InterfaceHeader), s_busName)) {
+        return false;
+    }
+    Arguments::Reader reader(signal);
+    cstring names[3];
+    for (cstring &name : names) {
+        if (reader.state() != Arguments::String) {
+            return false;
+        }
+        name = reader.readString();
+    }
+    const auto nameOwner = m_nameOwners.find(toStdString(names[0]));
+    if (nameOwner == m_nameOwners.end()) {
+        return false;
+    }
+    nameOwner->second.owner = toStdString(names[2]);
+    return true;
+}
+
+void SignalSubscriptions::collectCandidates(PathNode *root, cstring path, vector<uint32> *ids)
+{
+    PathNode *node = root;
+    ids->insert(ids->end(), node->namespaceIds.begin(), node->namespaceIds.end());
+    if (!path.length) {
+        return; // no path header; the message is invalid anyway
+    }
+    uint32 begin = 1;
+    while (begin < path.length) {
+        const char *const endPtr = static_cast<const char *>(memchr(path.ptr + begin, '/',
+                                                                    path.length - begin));
+        const uint32 end = endPtr ? endPtr - path.ptr : path.length;
+        unique_ptr<PathNode> *child = node->children.find(cstring(path.ptr + begin, end - begin));
+        if (!child) {
+            return;
+        }
+        node = child->get();
+        ids->insert(ids->end(), node->namespaceIds.begin(), node->namespaceIds.end());
+        begin = end + 1;
+    }
+    ids->insert(ids->end(), node->exactIds.begin(), node->exactIds.end());
+}
+
+// The top-level string arguments of a signal, read only as far as needed and only once for all
+// subscriptions that look at them
+class SignalArguments
+{
+public:
+    explicit SignalArguments(const Message &signal) : m_signal(signal) {}
+
+    // returns false if the argument is not present or not a string
+    bool get(uint32 index, cstring *value)
+    {
+        if (!m_reader) {
+            m_reader.reset(new Arguments::Reader(m_signal));
+        }
+        while (m_arguments.size() <= index) {
+            const Arguments::IoState state = m_reader->state();
+            if (state == Arguments::String) {
+                m_arguments.emplace_back(true, m_reader->readString());
+            } else if (state == Arguments::Finished || m_reader->isError()) {
+                return false;
+            } else {
+                m_arguments.emplace_back(false, cstring());
+                m_reader->skipCurrentElement();
+            }
+        }
+        *value = m_arguments[index].second;
+        return m_arguments[index].first;
+    }
+
+private:
+    const Message &m_signal;
+    unique_ptr<Arguments::Reader> m_reader;
+    vector<pair<bool, cstring>> m_arguments;
+};
+
+bool SignalSubscriptions::dispatch(const Message &signal)
+{
+    if (m_subscriptions.empty() || signal.type() != Message::SignalMessage) {
+        return false;
+    }
+    // before dispatching, subscriptions to the new owner may match the signal itself
+    const bool isNameOwnerChange = maybeUpdateNameOwner(signal);
+    const cstring interface = signal.stringHeaderRaw(Message::InterfaceHeader);
+    const cstring member = signal.stringHeaderRaw(Message::MethodHeader);
+    const cstring path = signal.stringHeaderRaw(Message::PathHeader);
+    const cstring any("", 0);
+
+    vector<uint32> ids;
+    // first the exact interface and member, then the wildcards
+    for (int i = interface.length ? 0 : 1; i < 2; i++) {
+        CStringMap<PathNode> *members = m_index.find(i ? any : interface);
+        if (!members) {
+            continue;
+        }
+        for (int j = member.length ? 0 : 1; j < 2; j++) {
+            if (PathNode *root = members->find(j ? any : member)) {
+                collectCandidates(root, path, &ids);
+            }
+        }
+    }
+    if (ids.empty()) {
+        return isNameOwnerChange;
+    }
+    std::sort(ids.begin(), ids.end());
+
+    const cstring sender = signal.stringHeaderRaw(Message::SenderHeader);
+    SignalArguments arguments(signal);
+    bool isMatched = false;
+    for (uint32 id : ids) {
+        // a subscriber may have removed subscriptions
+        const auto it = m_subscriptions.find(id);
+        if (it == m_subscriptions.end()) {
+            continue;
+        }
+        const Subscription &subscription = it->second;
+        if (!subscription.sender.empty()) {
+            const string *expectedSender = &subscription.sender;
+            if (!subscription.isSenderUniqueName) {
+                const auto nameOwner = m_nameOwners.find(subscription.sender);
+                assert(nameOwner != m_nameOwners.end());
+                expectedSender = &nameOwner->second.owner;
+            }
+            if (expectedSender->empty() || expectedSender->length() != sender.length ||
+                memcmp(expectedSender->c_str(), sender.ptr, sender.length)) {
+                continue;
+            }
+        }
+        bool argumentsMatch = true;
+        for (const pair<uint32, string> &expected : subscription.arguments) {
+            cstring value;
+            if (!arguments.get(expected.first, &value) || expected.second.length() != value.length ||
+                memcmp(expected.second.c_str(), value.ptr, value.length)) {
+                argumentsMatch = false;
+                break;
+            }
+        }
+        if (!argumentsMatch) {
+            continue;
+        }
+        isMatched = true;
+        subscription.receiver->signalReceived(signal, id);
+    }
+    return isMatched || isNameOwnerChange;
+}
@@ -0,0 +1,123 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef SIGNALSUBSCRIPTIONS_H
+#define SIGNALSUBSCRIPTIONS_H
+
+#include "cstringmap.h"
+#include "types.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class IMessageReceiver;
+class MatchRule;
+class Message;
+
+// The signal subscriptions of one Transceiver. Subscriptions are indexed by interface and member,
+// then by path in a trie of path elements, so the cost of dispatching a signal depends on the
+// number of matching subscriptions and not on the total number of them. Only sender and argument
+// matches are checked one by one, for the subscriptions that are found in the index.
+// Signals carry the unique name of their sender, so for well-known sender names, the owner of the
+// name is followed through NameOwnerChanged. Until the owner is known, such subscriptions get
+// no signals.
+class SignalSubscriptions
+{
+public:
+    SignalSubscriptions();
+    ~SignalSubscriptions();
+    SignalSubscriptions(const SignalSubscriptions &) = delete;
+    void operator=(const SignalSubscriptions &) = delete;
+
+    // rule must be valid. Returns the id of the new subscription. *newRules is set to the rules that
+    // no other subscription needs yet, i.e. that must be added to the bus. If the sender is a
+    // well-known name that wasn't followed yet, *nameToLookUp is set to it, and the caller should
+    // ask the bus for its current owner and pass that to setNameOwner(). Otherwise it is cleared.
+    uint32 add(const MatchRule &rule, IMessageReceiver *receiver, std::vector<std::string> *newRules,
+               std::string *nameToLookUp);
+    // Returns false if there is no such subscription. Sets *unusedRules to the rules that are no
+    // longer needed by any subscription, i.e. that must be removed from the bus.
+    bool remove(uint32 id, std::vector<std::string> *unusedRules);
+    // the rules to remove from the bus when all subscriptions go away at once, each one once
+    std::vector<std::string> rules() const;
+    // Sets the unique name that owns the well-known name, empty if none. Does nothing if the name
+    // isn't followed (anymore).
+    void setNameOwner(const std::string &name, const std::string &owner);
+
+    // Calls IMessageReceiver::signalReceived() for each subscription that matches signal, in the
+    // order of subscription. Subscribers may add and remove subscriptions meanwhile. Returns whether
+    // any subscription matched, or whether the signal was a change of a followed name's owner.
+    bool dispatch(const Message &signal);
+
+private:
+    struct Subscription
+    {
+        IMessageReceiver *receiver;
+        std::string rule;
+        std::string interface;
+        std::string member;
+        std::string path;
+        bool isPathNamespace;
+        std::string sender;
+        bool isSenderUniqueName;
+        std::vector<std::pair<uint32, std::string>> arguments; // sorted by index
+    };
+
+    // A node of the path trie; the root is "/"
+    struct PathNode
+    {
+        CStringMap<std::unique_ptr<PathNode>> children; // by path element
+        std::vector<uint32> exactIds; // subscriptions for this path
+        std::vector<uint32> namespaceIds; // subscriptions for this path and everything below
+    };
+
+    struct NameOwner
+    {
+        std::string owner; // empty if unknown or none
+        uint32 refCount;
+    };
+
+    // the subscriptions in the trie at root that match path, not checking the other fields
+    static void collectCandidates(PathNode *root, cstring path, std::vector<uint32> *ids);
+    // the rule for the NameOwnerChanged signals about name
+    static std::string nameOwnerRule(const std::string &name);
+    // returns true if the rule wasn't used before
+    bool refRule(const std::string &rule);
+    // returns true if the rule isn't used anymore
+    bool derefRule(const std::string &rule);
+    // returns true if signal is a NameOwnerChanged about a followed name
+    bool maybeUpdateNameOwner(const Message &signal);
+
+    uint32 m_nextId;
+    std::unordered_map<uint32, Subscription> m_subscriptions;
+    std::unordered_map<std::string, uint32> m_ruleRefCounts;
+    std::unordered_map<std::string, NameOwner> m_nameOwners; // by well-known name
+    // interface -> member -> paths, where empty strings are the wildcards of unset fields
+    CStringMap<CStringMap<PathNode>> m_index;
+};
+
+#endif // SIGNALSUBSCRIPTIONS_H
@@ -32,8 +32,11 @@
 #include "imessagereceiver.h"
 #include "iserver.h"
 #include "localsocket.h"
+#include "matchrule.h"
 #include "message.h"
 #include "message_p.h"
+#include "messageframer.h"
+#include "messagesender.h"
 #include "pendingreply.h"
 #include "pendingreply_p.h"
 #include "stringtools.h"
@@ -58,6 +61,19 @@ public:
     TransceiverPrivate *m_parent;
 };
 
+class NameOwnerLookup : public IMessageReceiver
+{
+public:
+    void pendingReplyFinished(PendingReply *) override
+    {
+        m_parent->handleNameOwnerReply(this);
+    }
+
+    PendingReply m_reply;
+    std::string m_name;
+    TransceiverPrivate *m_parent;
+};
+
 class ClientConnectedHandler : public ICompletionClient
 {
 public:
@@ -78,14 +94,23 @@ public:
 TransceiverPrivate::TransceiverPrivate(EventDispatcher *dispatcher)
    : m_state(Unconnected),
      m_client(nullptr),
-     m_receivingMessage(nullptr),
+     m_connectionLostHandler([this](void *) { handleConnectionLost(); }),
+     m_messageFramer(nullptr),
+     m_unsendableMessageHandler([this](void *task) {
+         handleUnsendableMessage(static_cast<Message *>(task)); }),
+     // nothing to do when a message has been sent
+     m_messageSender(new MessageSender(nullptr, &m_unsendableMessageHandler)),
      m_connection(nullptr),
      m_helloReceiver(nullptr),
      m_clientConnectedHandler(nullptr),
      m_eventDispatcher(dispatcher),
      m_authNegotiator(nullptr),
      m_defaultTimeout(25000),
+     m_convertsToHostByteOrder(false),
+     m_isUnixFdPassingEnabled(false),
+     m_replyTimeouts(dispatcher),
      m_sendSerial(1),
+     m_isConnectionLost(false),
      m_mainThreadTransceiver(nullptr)
 {
 }
@@ -124,7 +149,11 @@ Transceiver::Transceiver(EventDispatcher *dispatcher, const ConnectionInfo &ci)
             d->authAndHello(this);
             d->m_state = TransceiverPrivate::Authenticating;
         } else if (ci.bus() == ConnectionInfo::Bus::PeerToPeer) {
-            d->receiveNextMessage();
+            // no authentication, so nothing to negotiate
+            d->m_isUnixFdPassingEnabled = d->m_connection->supportsFileDescriptors();
+            d->m_messageSender->setUnixFdPassingEnabled(d->m_isUnixFdPassingEnabled);
+            d->m_messageSender->setConnection(d->m_connection);
+            d->startReceiving();
             d->m_state = TransceiverPrivate::Connected;
         }
     }
@@ -167,10 +196,14 @@ Transceiver::~Transceiver()
 {
     d->close();
 
+    delete d->m_messageFramer;
+    delete d->m_messageSender;
     delete d->m_connection;
     delete d->m_authNegotiator;
     delete d->m_helloReceiver;
-    delete d->m_receivingMessage;
+    for (NameOwnerLookup *lookup : d->m_nameOwnerLookups) {
+        delete lookup;
+    }
 
     delete d;
     d = nullptr;
@@ -182,8 +215,15 @@ void TransceiverPrivate::close()
     assert(m_secondaryThreadLinks.empty() || !m_mainThreadTransceiver);
 
     if (m_mainThreadTransceiver) {
+        // the connection stays open, so the bus would keep sending signals for our rules
+        for (const string &rule : m_signalSubscriptions.rules()) {
+            sendMatchRule("RemoveMatch", rule);
+        }
+
         CommutexUnlinker unlinker(&m_mainThreadLink);
         if (unlinker.hasLock()) {
+            // from now on, the main thread won't forward replies to us
+            m_mainThreadTransceiver->discardPendingRepliesForSecondaryThread(this);
             SecondaryTransceiverDisconnectEvent *evt = new SecondaryTransceiverDisconnectEvent();
             evt->transceiver = this;
             EventDispatcherPrivate::get(m_mainThreadTransceiver->m_eventDispatcher)
@@ -277,7 +317,10 @@ void TransceiverPrivate::handleClientConnected()
 
     assert(m_connection);
     m_connection->setEventDispatcher(m_eventDispatcher);
-    receiveNextMessage();
+    m_isUnixFdPassingEnabled = m_connection->supportsFileDescriptors();
+    m_messageSender->setUnixFdPassingEnabled(m_isUnixFdPassingEnabled);
+    m_messageSender->setConnection(m_connection);
+    startReceiving();
 
     m_state = Connected;
 }
@@ -292,14 +335,34 @@ int Transceiver::defaultReplyTimeout() const
     return d->m_defaultTimeout;
 }
 
+void Transceiver::setConvertsToHostByteOrder(bool enable)
+{
+    d->m_convertsToHostByteOrder = enable;
+}
+
+bool Transceiver::convertsToHostByteOrder() const
+{
+    return d->m_convertsToHostByteOrder;
+}
+
 uint32 TransceiverPrivate::takeNextSerial()
 {
+    // Secondary threads register their pending replies here too, so this skips all serials that
+    // are still waiting for a reply.
     SpinLocker locker(&m_lock);
-    return m_sendSerial++;
+    if (m_isConnectionLost) {
+        return 0;
+    }
+    return m_pendingReplies.takeFreeSerial(&m_sendSerial);
 }
 
 Error TransceiverPrivate::prepareSend(Message *msg)
 {
+    // if it isn't known yet, MessageSender fails the message if necessary
+    if (!msg->arguments().fileDescriptors().empty() && !m_isUnixFdPassingEnabled &&
+        (m_state == AwaitingUniqueName || m_state == Connected)) {
+        return Error::UnixFdPassingUnavailable;
+    }
     if (!m_mainThreadTransceiver) {
         msg->setSerial(takeNextSerial());
     } else {
@@ -313,6 +376,9 @@ Error TransceiverPrivate::prepareSend(Message *msg)
             return Error::LocalDisconnect;
         }
     }
+    if (!msg->serial()) {
+        return Error::Connection;
+    }
 
     MessagePrivate *const mpriv = MessagePrivate::get(msg); // this is unchanged by move()ing the owning Message.
     if (!mpriv->serialize()) {
@@ -323,12 +389,68 @@ Error TransceiverPrivate::prepareSend(Message *msg)
 
 void TransceiverPrivate::sendPreparedMessage(Message msg)
 {
-    MessagePrivate *const mpriv = MessagePrivate::get(&msg);
-    mpriv->setCompletionClient(this);
-    m_sendQueue.push_back(std::move(msg));
-    if (m_state == TransceiverPrivate::Connected && m_sendQueue.size() == 1) {
-        // first in queue, don't wait for some other event to trigger sending
-        mpriv->send(m_connection);
+    m_messageSender->send(std::move(msg));
+}
+
+void TransceiverPrivate::sendFromSecondaryThread(Message msg)
+{
+    // The main thread's Transceiver and connection stay alive while m_mainThreadLink is locked.
+    // We write right away if we can, the main thread only needs to help when the socket is full.
+    if (m_mainThreadTransceiver->m_messageSender->sendFromOtherThread(std::move(msg))) {
+        EventPool *const pool = EventDispatcherPrivate::get(m_eventDispatcher)->m_eventPool;
+        EventDispatcherPrivate::get(m_mainThreadTransceiver->m_eventDispatcher)
+            ->queueEvent(std::unique_ptr<Event>(new(pool) SendQueueBlockedEvent));
+    }
+}
+
+void TransceiverPrivate::handleUnsendableMessage(Message *msg)
+{
+    // Only the thread that waits for the reply, if any, may complete it, so it is told by an event.
+    // Secondary threads remove their records under the lock before they go away.
+    SpinLocker locker(&m_lock);
+    const PendingReplyRecord *record = m_pendingReplies.find(msg->serial());
+    if (!record) {
+        return;
+    }
+    TransceiverPrivate *receiver = record->asTransceiver();
+    if (receiver) {
+        m_pendingReplies.take(msg->serial());
+    } else {
+        receiver = this;
+    }
+    PendingReplyFailureEvent *evt = new PendingReplyFailureEvent;
+    evt->m_serial = msg->serial();
+    evt->m_error = Error::UnixFdPassingUnavailable;
+    EventDispatcherPrivate::get(receiver->m_eventDispatcher)->queueEvent(std::unique_ptr<Event>(evt));
+}
+
+void TransceiverPrivate::handleConnectionLost()
+{
+    m_state = Unconnected;
+    std::vector<PendingReplyPrivate *> ownReplies;
+    {
+        SpinLocker locker(&m_lock);
+        m_isConnectionLost = true;
+        // replies of secondary threads fail there, like in handleUnsendableMessage()
+        m_pendingReplies.eraseIf([&ownReplies](uint32 serial, const PendingReplyRecord &record) {
+            if (TransceiverPrivate *transceiver = record.asTransceiver()) {
+                PendingReplyFailureEvent *evt = new PendingReplyFailureEvent;
+                evt->m_serial = serial;
+                evt->m_error = Error::Connection;
+                EventDispatcherPrivate::get(transceiver->m_eventDispatcher)
+                    ->queueEvent(std::unique_ptr<Event>(evt));
+                return true;
+            }
+            ownReplies.push_back(record.asPendingReply());
+            return false;
+        });
+    }
+    // asynchronously, like the errors in send(); the timeouts remove the records
+    for (PendingReplyPrivate *reply : ownReplies) {
+        if (!reply->m_error.isError()) {
+            reply->m_error = Error::Connection;
+        }
+        m_replyTimeouts.add(reply, 0);
     }
 }
 
@@ -340,33 +462,48 @@ PendingReply Transceiver::send(Message m, int timeoutMsecs)
 
     Error error = d->prepareSend(&m);
 
-    PendingReplyPrivate *pendingPriv = new PendingReplyPrivate(d->m_eventDispatcher, timeoutMsecs);
-    pendingPriv->m_transceiverOrReply.transceiver = d;
-    pendingPriv->m_receiver = nullptr;
-    pendingPriv->m_serial = m.serial();
+    PendingReplyPrivate *pendingPriv = PendingReplyPrivate::create(d, m.serial());
+    if (timeoutMsecs >= 0) {
+        d->m_replyTimeouts.add(pendingPriv, timeoutMsecs);
+    }
 
     // even if we're handing off I/O to a main Transceiver, keep a record because that simplifies
     // aborting all pending replies when we disconnect from the main Transceiver, no matter which
-    // side initiated the disconnection.
-    d->m_pendingReplies.emplace(m.serial(), pendingPriv);
+    // side initiated the disconnection. Messages that failed before taking a serial can't get a reply.
+    if (m.serial()) {
+        SpinLocker locker(&d->m_lock);
+        d->m_pendingReplies.insert(m.serial(), pendingPriv);
+    }
 
     if (error.isError()) {
         // Signal the error asynchronously, in order to get the same delayed completion callback as in
         // the non-error case. This should make the behavior more predictable and client code harder to
         // accidentally get wrong. To detect errors immediately, PendingReply::error() can be used.
         pendingPriv->m_error = error;
-        pendingPriv->m_replyTimeout.start(0);
+        d->m_replyTimeouts.add(pendingPriv, 0);
     } else {
         if (!d->m_mainThreadTransceiver) {
             d->sendPreparedMessage(std::move(m));
         } else {
             CommutexLocker locker(&d->m_mainThreadLink);
             if (locker.hasLock()) {
-                std::unique_ptr<SendMessageWithPendingReplyEvent> evt(new SendMessageWithPendingReplyEvent);
-                evt->message = std::move(m);
-                evt->transceiver = d;
-                EventDispatcherPrivate::get(d->m_mainThreadTransceiver->m_eventDispatcher)
-                    ->queueEvent(std::move(evt));
+                // the main thread forwards the reply to us
+                TransceiverPrivate *const mainD = d->m_mainThreadTransceiver;
+                bool isConnectionLost;
+                {
+                    SpinLocker mainLocker(&mainD->m_lock);
+                    // it may have been lost since we took the serial
+                    isConnectionLost = mainD->m_isConnectionLost;
+                    if (!isConnectionLost) {
+                        mainD->m_pendingReplies.insert(m.serial(), d);
+                    }
+                }
+                if (isConnectionLost) {
+                    pendingPriv->m_error = Error::Connection;
+                    d->m_replyTimeouts.add(pendingPriv, 0);
+                } else {
+                    d->sendFromSecondaryThread(std::move(m));
+                }
             } else {
                 pendingPriv->m_error = Error::LocalDisconnect;
             }
@@ -377,10 +514,15 @@ PendingReply Transceiver::send(Message m, int timeoutMsecs)
 }
 
 Error Transceiver::sendNoReply(Message m)
+{
+    return d->sendNoReply(std::move(m));
+}
+
+Error TransceiverPrivate::sendNoReply(Message m)
 {
     // ### (when not called from send()) warn if sending a message without the noreply flag set?
     //     doing that is wasteful, but might be common. needs investigation.
-    Error error = d->prepareSend(&m);
+    Error error = prepareSend(&m);
     if (error.isError()) {
         return error;
     }
@@ -389,15 +531,12 @@ Error Transceiver::sendNoReply(Message m)
     // going through an event loop iteration, notifyCompletion would be called and expects the message to
     // be in the queue
 
-    if (!d->m_mainThreadTransceiver) {
-        d->sendPreparedMessage(std::move(m));
+    if (!m_mainThreadTransceiver) {
+        sendPreparedMessage(std::move(m));
     } else {
-        CommutexLocker locker(&d->m_mainThreadLink);
+        CommutexLocker locker(&m_mainThreadLink);
         if (locker.hasLock()) {
-            std::unique_ptr<SendMessageEvent> evt(new SendMessageEvent);
-            evt->message = std::move(m);
-            EventDispatcherPrivate::get(d->m_mainThreadTransceiver->m_eventDispatcher)
-                ->queueEvent(std::move(evt));
+            sendFromSecondaryThread(std::move(m));
         } else {
             return Error::LocalDisconnect;
         }
@@ -420,6 +559,11 @@ bool Transceiver::isConnected() const
     return d->m_connection && d->m_connection->isOpen();
 }
 
+bool Transceiver::supportsUnixFdPassing() const
+{
+    return d->m_isUnixFdPassingEnabled;
+}
+
 EventDispatcher *Transceiver::eventDispatcher() const
 {
     return d->m_eventDispatcher;
@@ -435,17 +579,141 @@ void Transceiver::setSpontaneousMessageReceiver(IMessageReceiver *receiver)
     d->m_client = receiver;
 }
 
+uint32 Transceiver::subscribeToSignal(const MatchRule &rule, IMessageReceiver *receiver)
+{
+    if (!receiver || !rule.isValid()) {
+        return 0;
+    }
+    vector<string> newRules;
+    string nameToLookUp;
+    const uint32 id = d->m_signalSubscriptions.add(rule, receiver, &newRules, &nameToLookUp);
+    for (const string &newRule : newRules) {
+        d->sendMatchRule("AddMatch", newRule);
+    }
+    if (!nameToLookUp.empty()) {
+        // after AddMatch, so that NameOwnerChanged signals that arrive after the reply are newer
+        d->lookUpNameOwner(this, nameToLookUp);
+    }
+    return id;
+}
+
+bool Transceiver::unsubscribeFromSignal(uint32 subscriptionId)
+{
+    vector<string> unusedRules;
+    if (!d->m_signalSubscriptions.remove(subscriptionId, &unusedRules)) {
+        return false;
+    }
+    for (const string &unusedRule : unusedRules) {
+        d->sendMatchRule("RemoveMatch", unusedRule);
+    }
+    return true;
+}
+
+void TransceiverPrivate::sendMatchRule(const char *method, const std::string &rule)
+{
+    if (m_connectionInfo.bus() != ConnectionInfo::Bus::Session &&
+        m_connectionInfo.bus() != ConnectionInfo::Bus::System) {
+        return; // a peer sends us all its signals anyway
+    }
+    // No reply: the bus processes messages in order, so the rule is in effect for anything that
+    // happens after sending this. Errors (like too many rules) can't be handled sensibly anyway.
+    Message msg = Message::createCall("/org/freedesktop/DBus", "org.freedesktop.DBus", method);
+    msg.setDestination("org.freedesktop.DBus");
+    msg.setExpectsReply(false);
+    Arguments::Writer writer;
+    writer.writeString(cstring(rule.c_str(), rule.length()));
+    msg.setArguments(writer.finish());
+    sendNoReply(std::move(msg));
+}
+
+void TransceiverPrivate::lookUpNameOwner(Transceiver *parent, const std::string &name)
+{
+    if (m_connectionInfo.bus() != ConnectionInfo::Bus::Session &&
+        m_connectionInfo.bus() != ConnectionInfo::Bus::System) {
+        return; // there are no names without a bus
+    }
+    Message msg = Message::createCall("/org/freedesktop/DBus", "org.freedesktop.DBus", "GetNameOwner");
+    msg.setDestination("org.freedesktop.DBus");
+    Arguments::Writer writer;
+    writer.writeString(cstring(name.c_str(), name.length()));
+    msg.setArguments(writer.finish());
+
+    NameOwnerLookup *lookup = new NameOwnerLookup;
+    lookup->m_name = name;
+    lookup->m_parent = this;
+    m_nameOwnerLookups.push_back(lookup);
+    lookup->m_reply = parent->send(std::move(msg));
+    lookup->m_reply.setReceiver(lookup);
+}
+
+void TransceiverPrivate::handleNameOwnerReply(NameOwnerLookup *lookup)
+{
+    // an error reply means that the name has no owner
+    string owner;
+    const Message *reply = lookup->m_reply.reply();
+    if (reply && reply->type() == Message::MethodReturnMessage) {
+        Arguments::Reader reader(*reply);
+        if (reader.state() == Arguments::String) {
+            owner = toStdString(reader.readString());
+        }
+    }
+    m_signalSubscriptions.setNameOwner(lookup->m_name, owner);
+
+    m_nameOwnerLookups.erase(find(m_nameOwnerLookups.begin(), m_nameOwnerLookups.end(), lookup));
+    delete lookup;
+}
+
+uint32 Transceiver::registerObject(const std::string &path, const ObjectInterface &interface,
+                                   IObjectHandler *handler, bool isSubtree)
+{
+    return d->m_objectRegistry.add(path, interface, handler, isSubtree);
+}
+
+bool Transceiver::unregisterObject(uint32 registrationId)
+{
+    return d->m_objectRegistry.remove(registrationId);
+}
+
+void TransceiverPrivate::dispatchSpontaneousMessage(Message msg)
+{
+    if (msg.type() == Message::SignalMessage) {
+        if (m_signalSubscriptions.dispatch(msg)) {
+            return;
+        }
+    } else if (msg.type() == Message::MethodCallMessage && !m_objectRegistry.isEmpty()) {
+        const bool expectsReply = msg.expectsReply();
+        Message reply;
+        if (m_objectRegistry.dispatch(&msg, &reply)) {
+            if (expectsReply && reply.type() != Message::InvalidMessage) {
+                sendNoReply(std::move(reply));
+            }
+            return;
+        }
+        // the objects of other threads' Transceivers might be there
+        if (!m_client && expectsReply && !m_mainThreadTransceiver && m_secondaryThreadLinks.empty()) {
+            sendNoReply(ObjectRegistry::errorReply(msg, "UnknownObject",
+                                                   "No such object \"" + msg.path() + '"'));
+            return;
+        }
+    }
+    if (m_client) {
+        m_client->spontaneousMessageReceived(std::move(msg));
+    }
+}
+
 void TransceiverPrivate::notifyCompletion(void *task)
 {
     switch (m_state) {
     case Authenticating: {
         assert(task == m_authNegotiator);
+        m_isUnixFdPassingEnabled = m_authNegotiator->isUnixFdPassingEnabled();
         delete m_authNegotiator;
         m_authNegotiator = nullptr;
         // cout << "Authenticated.\n";
-        assert(!m_sendQueue.empty()); // the hello message should be in the queue
-        MessagePrivate::get(&m_sendQueue.front())->send(m_connection);
-        receiveNextMessage();
+        assert(m_messageSender->queueLength()); // the hello message should be in the queue
+        m_messageSender->setUnixFdPassingEnabled(m_isUnixFdPassingEnabled);
+        m_messageSender->setConnection(m_connection);
+        startReceiving();
 
         m_state = AwaitingUniqueName;
         break;
@@ -453,41 +721,35 @@ void TransceiverPrivate::notifyCompletion(void *task)
     case AwaitingUniqueName: // the code path for this only diverges in the PendingReply callback
     case Connected: {
         assert(!m_authNegotiator);
-        if (!m_sendQueue.empty() && task == &m_sendQueue.front()) {
-            //cout << "Sent message.\n";
-            m_sendQueue.pop_front();
-            if (!m_sendQueue.empty()) {
-                MessagePrivate::get(&m_sendQueue.front())->send(m_connection);
-            }
-        } else {
-            assert(task == m_receivingMessage);
-            Message *const receivedMessage = m_receivingMessage;
+        // a message from m_messageFramer, which hands over ownership
+        Message *const receivedMessage = static_cast<Message *>(task);
 
-            receiveNextMessage();
+        if (m_convertsToHostByteOrder) {
+            // on failure, the message stays as it is and readers will find the error
+            receivedMessage->convertToHostByteOrder();
+        }
 
-            if (!maybeDispatchToPendingReply(receivedMessage)) {
-                if (m_client) {
-                    m_client->spontaneousMessageReceived(Message(move(*receivedMessage)));
-                }
-                // dispatch to other threads listening to spontaneous messages, if any
-                for (auto it = m_secondaryThreadLinks.begin(); it != m_secondaryThreadLinks.end(); ) {
-                    SpontaneousMessageReceivedEvent *evt = new SpontaneousMessageReceivedEvent();
-                    evt->message = *receivedMessage;
-
-                    CommutexLocker otherLocker(&it->second);
-                    if (otherLocker.hasLock()) {
-                        EventDispatcherPrivate::get(it->first->m_eventDispatcher)
-                            ->queueEvent(std::unique_ptr<Event>(evt));
-                        ++it;
-                    } else {
-                        TransceiverPrivate *transceiver = it->first;
-                        it = m_secondaryThreadLinks.erase(it);
-                        discardPendingRepliesForSecondaryThread(transceiver);
-                        delete evt;
-                    }
+        if (!maybeDispatchToPendingReply(receivedMessage)) {
+            // dispatch to other threads listening to spontaneous messages, if any; copies share the
+            // message buffer
+            for (auto it = m_secondaryThreadLinks.begin(); it != m_secondaryThreadLinks.end(); ) {
+                SpontaneousMessageReceivedEvent *evt = new SpontaneousMessageReceivedEvent();
+                evt->message = *receivedMessage;
+
+                CommutexLocker otherLocker(&it->second);
+                if (otherLocker.hasLock()) {
+                    EventDispatcherPrivate::get(it->first->m_eventDispatcher)
+                        ->queueEvent(std::unique_ptr<Event>(evt));
+                    ++it;
+                } else {
+                    TransceiverPrivate *transceiver = it->first;
+                    it = m_secondaryThreadLinks.erase(it);
+                    discardPendingRepliesForSecondaryThread(transceiver);
+                    delete evt;
                 }
-                delete receivedMessage;
             }
+            dispatchSpontaneousMessage(move(*receivedMessage));
+            delete receivedMessage;
         }
         break;
     }
@@ -504,34 +766,36 @@ bool TransceiverPrivate::maybeDispatchToPendingReply(Message *receivedMessage)
         return false;
     }
 
-    auto it = m_pendingReplies.find(receivedMessage->replySerial());
-    if (it == m_pendingReplies.end()) {
-        return false;
+    PendingReplyRecord record;
+    {
+        SpinLocker locker(&m_lock);
+        if (!m_pendingReplies.take(receivedMessage->replySerial(), &record)) {
+            return false;
+        }
+        if (TransceiverPrivate *transceiver = record.asTransceiver()) {
+            // Forward to other thread's Transceiver. It removes its records under the lock before
+            // it goes away, so it is still there.
+            EventPool *const pool = EventDispatcherPrivate::get(m_eventDispatcher)->m_eventPool;
+            PendingReplySuccessEvent *evt = new(pool) PendingReplySuccessEvent;
+            evt->reply = std::move(*receivedMessage);
+            EventDispatcherPrivate::get(transceiver->m_eventDispatcher)
+                ->queueEvent(std::unique_ptr<Event>(evt));
+        }
     }
 
-    if (PendingReplyPrivate *pr = it->second.asPendingReply()) {
-        m_pendingReplies.erase(it);
+    if (PendingReplyPrivate *pr = record.asPendingReply()) {
         assert(!pr->m_isFinished);
         pr->notifyDone(receivedMessage);
     } else {
-        // forward to other thread's Transceiver
-        TransceiverPrivate *transceiver = it->second.asTransceiver();
-        m_pendingReplies.erase(it);
-        assert(transceiver);
-        PendingReplySuccessEvent *evt = new PendingReplySuccessEvent;
-        evt->reply = std::move(*receivedMessage);
         delete receivedMessage;
-        EventDispatcherPrivate::get(transceiver->m_eventDispatcher)->queueEvent(std::unique_ptr<Event>(evt));
     }
     return true;
 }
 
-void TransceiverPrivate::receiveNextMessage()
+void TransceiverPrivate::startReceiving()
 {
-    m_receivingMessage = new Message;
-    MessagePrivate *const mpriv = MessagePrivate::get(m_receivingMessage);
-    mpriv->setCompletionClient(this);
-    mpriv->receive(m_connection);
+    assert(!m_messageFramer);
+    m_messageFramer = new MessageFramer(m_connection, this, &m_connectionLostHandler);
 }
 
 void TransceiverPrivate::unregisterPendingReply(PendingReplyPrivate *p)
@@ -539,21 +803,26 @@ void TransceiverPrivate::unregisterPendingReply(PendingReplyPrivate *p)
     if (m_mainThreadTransceiver) {
         CommutexLocker otherLocker(&m_mainThreadLink);
         if (otherLocker.hasLock()) {
-            PendingReplyCancelEvent *evt = new PendingReplyCancelEvent;
-            evt->serial = p->m_serial;
-            EventDispatcherPrivate::get(m_mainThreadTransceiver->m_eventDispatcher)
-                ->queueEvent(std::unique_ptr<Event>(evt));
+            TransceiverPrivate *const mainD = m_mainThreadTransceiver;
+            SpinLocker mainLocker(&mainD->m_lock);
+            // it isn't there if sending failed
+            const PendingReplyRecord *record = mainD->m_pendingReplies.find(p->m_serial);
+            if (record && record->asTransceiver() == this) {
+                mainD->m_pendingReplies.take(p->m_serial);
+            }
         }
     }
+    m_replyTimeouts.remove(p);
+    SpinLocker locker(&m_lock);
 #ifndef NDEBUG
-    auto it = m_pendingReplies.find(p->m_serial);
-    assert(it != m_pendingReplies.end());
-    if (!m_mainThreadTransceiver) {
-        assert(it->second.asPendingReply());
-        assert(it->second.asPendingReply() == p);
+    const PendingReplyRecord *record = m_pendingReplies.find(p->m_serial);
+    assert(record || !p->m_serial); // see send()
+    if (record && !m_mainThreadTransceiver) {
+        assert(record->asPendingReply());
+        assert(record->asPendingReply() == p);
     }
 #endif
-    m_pendingReplies.erase(p->m_serial);
+    m_pendingReplies.take(p->m_serial);
 }
 
 void TransceiverPrivate::cancelAllPendingReplies()
@@ -564,9 +833,22 @@ void TransceiverPrivate::cancelAllPendingReplies()
     // In case we have pending replies for secondary threads, and we cancel all pending replies,
     // that is because we're shutting down, which we told the secondary thread, and it will deal
     // with bulk cancellation of replies. We just throw away our records about them.
-    for (auto it = m_pendingReplies.begin() ; it != m_pendingReplies.end(); ) {
-        PendingReplyPrivate *pendingPriv = it->second.asPendingReply();
-        it = m_pendingReplies.erase(it);
+    // Replies that are added from the callbacks are not canceled, to avoid looping forever.
+    uint32 count;
+    {
+        SpinLocker locker(&m_lock);
+        count = m_pendingReplies.size();
+    }
+    for (; count; count--) {
+        uint32 serial;
+        PendingReplyRecord record;
+        {
+            SpinLocker locker(&m_lock);
+            if (!m_pendingReplies.takeAny(&serial, &record)) {
+                break;
+            }
+        }
+        PendingReplyPrivate *pendingPriv = record.asPendingReply();
         if (pendingPriv) { // if from this thread
             pendingPriv->doErrorCompletion(Error::LocalDisconnect);
         }
@@ -575,14 +857,11 @@ void TransceiverPrivate::cancelAllPendingReplies()
 
 void TransceiverPrivate::discardPendingRepliesForSecondaryThread(TransceiverPrivate *transceiver)
 {
-    for (auto it = m_pendingReplies.begin() ; it != m_pendingReplies.end(); ) {
-        if (it->second.asTransceiver() == transceiver) {
-            it = m_pendingReplies.erase(it);
-            // notification and deletion are handled on the event's source thread
-        } else {
-            ++it;
-        }
-    }
+    // notification and deletion are handled on the event's source thread
+    SpinLocker locker(&m_lock);
+    m_pendingReplies.eraseIf([transceiver](uint32, const PendingReplyRecord &record) {
+        return record.asTransceiver() == transceiver;
+    });
 }
 
 void TransceiverPrivate::processEvent(Event *evt)
@@ -590,46 +869,38 @@ void TransceiverPrivate::processEvent(Event *evt)
     // cerr << "TransceiverPrivate::processEvent() with event type " << evt->type << std::endl;
 
     switch (evt->type) {
-    case Event::SendMessage:
-        sendPreparedMessage(std::move(static_cast<SendMessageEvent *>(evt)->message));
+    case Event::SendQueueBlocked:
+        m_messageSender->resumeWriting();
         break;
 
-    case Event::SendMessageWithPendingReply: {
-        SendMessageWithPendingReplyEvent *pre = static_cast<SendMessageWithPendingReplyEvent *>(evt);
-        m_pendingReplies.emplace(pre->message.serial(), pre->transceiver);
-        sendPreparedMessage(std::move(pre->message));
-        break;
-    }
     case Event::SpontaneousMessageReceived:
-        if (m_client) {
-            SpontaneousMessageReceivedEvent *smre = static_cast<SpontaneousMessageReceivedEvent *>(evt);
-            m_client->spontaneousMessageReceived(Message(move(smre->message)));
-        }
+        dispatchSpontaneousMessage(move(static_cast<SpontaneousMessageReceivedEvent *>(evt)->message));
         break;
 
-    case Event::PendingReplySuccess:
-        maybeDispatchToPendingReply(&static_cast<PendingReplySuccessEvent *>(evt)->reply);
+    case Event::PendingReplySuccess: {
+        // ownership passes on like for messages from m_messageFramer, and evt is deleted after this
+        Message *reply = new Message(move(static_cast<PendingReplySuccessEvent *>(evt)->reply));
+        if (!maybeDispatchToPendingReply(reply)) {
+            delete reply;
+        }
         break;
+    }
 
     case Event::PendingReplyFailure: {
         PendingReplyFailureEvent *prfe = static_cast<PendingReplyFailureEvent *>(evt);
-        const auto it = m_pendingReplies.find(prfe->m_serial);
-        if (it == m_pendingReplies.end()) {
-            // not a disaster, but when it happens in debug mode I want to check it out
-            assert(false);
-            break;
+        PendingReplyRecord record;
+        bool isFound;
+        {
+            SpinLocker locker(&m_lock);
+            isFound = m_pendingReplies.take(prfe->m_serial, &record);
+        }
+        if (!isFound) {
+            break; // the PendingReply has been destroyed meanwhile
         }
-        PendingReplyPrivate *pendingPriv = it->second.asPendingReply();
-        m_pendingReplies.erase(it);
-        pendingPriv->doErrorCompletion(prfe->m_error);
+        record.asPendingReply()->doErrorCompletion(prfe->m_error);
         break;
     }
 
-    case Event::PendingReplyCancel:
-        // This comes from a secondary thread, which handles PendingReply notification itself.
-        m_pendingReplies.erase(static_cast<PendingReplyCancelEvent *>(evt)->serial);
-        break;
-
     case Event::SecondaryTransceiverConnect: {
         SecondaryTransceiverConnectEvent *sce = static_cast<SecondaryTransceiverConnectEvent *>(evt);
 
@@ -33,7 +33,10 @@ class ConnectionInfo;
 class Error;
 class EventDispatcher;
 class IMessageReceiver;
+class IObjectHandler;
+class MatchRule;
 class Message;
+class ObjectInterface;
 class PendingReply;
 class TransceiverPrivate;
 
@@ -68,6 +71,11 @@ public:
 
     void setDefaultReplyTimeout(int msecs);
     int defaultReplyTimeout() const;
+    // If enabled, received messages in the other byte order are converted to host byte order once,
+    // on receipt, so that zero-copy accessors like Arguments::Reader::readPrimitiveArray() work
+    // for them. Disabled by default because it costs a pass over each such message.
+    void setConvertsToHostByteOrder(bool enable);
+    bool convertsToHostByteOrder() const;
     enum TimeoutSpecialValues {
         DefaultTimeout = -1,
         NoTimeout = -2
@@ -84,12 +92,32 @@ public:
     ConnectionInfo connectionInfo() const;
     std::string uniqueName() const;
     bool isConnected() const;
+    // Whether messages sent through this Transceiver's own connection may contain Unix fds, as
+    // negotiated with the bus, or for peer-to-peer connections, as supported by the socket type.
+    bool supportsUnixFdPassing() const;
 
     EventDispatcher *eventDispatcher() const;
 
-    // TODO matching patterns for subscription; note that a signal requires path, interface and
-    //      "method" (signal name) of sender
-    void subscribeToSignal();
+    // Subscribes receiver to the signals matching rule, see IMessageReceiver::signalReceived().
+    // On a bus, the rule is added with AddMatch when no other subscription of this Transceiver
+    // has an equal rule, and removed with RemoveMatch when the last one is gone. Returns the id of
+    // the subscription, or 0 if rule is invalid or receiver is null.
+    uint32 subscribeToSignal(const MatchRule &rule, IMessageReceiver *receiver);
+    // Returns false if there is no such subscription. It is okay to call this from
+    // IMessageReceiver::signalReceived().
+    bool unsubscribeFromSignal(uint32 subscriptionId);
+
+    // Serves interface at path, or if isSubtree, at path and all paths below it, e.g. for objects
+    // that are only created on demand. Method calls are dispatched to handler. Introspection and
+    // property access through the standard interfaces are handled automatically, as are error
+    // replies for unknown objects, interfaces and methods. Calls to paths without any registration
+    // still go to the spontaneous message receiver, if there is one.
+    // Returns the id of the registration, or 0 if path or interface is invalid, handler is null or
+    // interface is already registered at path.
+    uint32 registerObject(const std::string &path, const ObjectInterface &interface,
+                          IObjectHandler *handler, bool isSubtree = false);
+    // Returns false if there is no such registration. It is okay to call this from the handler.
+    bool unregisterObject(uint32 registrationId);
 
     IMessageReceiver *spontaneousMessageReceiver() const;
     void setSpontaneousMessageReceiver(IMessageReceiver *receiver);
@@ -29,9 +29,12 @@
 #include "connectioninfo.h"
 #include "eventdispatcher_p.h"
 #include "icompletionclient.h"
+#include "objectregistry.h"
+#include "pendingreply_p.h"
+#include "serialmap.h"
+#include "signalsubscriptions.h"
 #include "spinlock.h"
 
-#include <deque>
 #include <unordered_map>
 #include <vector>
 
@@ -40,6 +43,9 @@ class HelloReceiver;
 class IConnection;
 class IMessageReceiver;
 class ClientConnectedHandler;
+class MessageFramer;
+class MessageSender;
+class NameOwnerLookup;
 
 /*
  How to handle destruction of connected Transceivers
@@ -87,14 +93,28 @@ public:
     void handleHelloReply();
     void handleClientConnected();
 
-    uint32 takeNextSerial();
+    uint32 takeNextSerial(); // returns 0 if the connection was lost
 
     Error prepareSend(Message *msg);
     void sendPreparedMessage(Message msg);
+    // for secondary threads, with m_mainThreadLink locked
+    void sendFromSecondaryThread(Message msg);
+    Error sendNoReply(Message msg);
+    // from MessageSender in the writing thread, which may be a secondary thread
+    void handleUnsendableMessage(Message *msg);
+    // from MessageFramer when it can't receive anymore; fails all pending replies
+    void handleConnectionLost();
+    // sends AddMatch or RemoveMatch to the bus, if any
+    void sendMatchRule(const char *method, const std::string &rule);
+    // asks the bus for the owner of a well-known sender name of signal subscriptions
+    void lookUpNameOwner(Transceiver *parent, const std::string &name);
+    void handleNameOwnerReply(NameOwnerLookup *lookup);
+    // to the signal subscriptions or registered objects, or if none matches, to m_client
+    void dispatchSpontaneousMessage(Message msg);
 
     void notifyCompletion(void *task) override;
     bool maybeDispatchToPendingReply(Message *m);
-    void receiveNextMessage();
+    void startReceiving();
 
     void unregisterPendingReply(PendingReplyPrivate *p);
     void cancelAllPendingReplies();
@@ -113,9 +133,14 @@ public:
     } m_state;
 
     IMessageReceiver *m_client;
-    Message *m_receivingMessage;
+    SignalSubscriptions m_signalSubscriptions;
+    std::vector<NameOwnerLookup *> m_nameOwnerLookups;
+    ObjectRegistry m_objectRegistry;
+    CompletionFunc m_connectionLostHandler;
+    MessageFramer *m_messageFramer;
 
-    std::deque<Message> m_sendQueue; // waiting to be sent
+    CompletionFunc m_unsendableMessageHandler;
+    MessageSender *m_messageSender; // has the queue of messages waiting to be sent
 
     // only one of them can be non-null. exception: in the main thread, m_mainThreadTransceiver
     // equals this, so that the main thread knows it's the main thread and not just a thread-local
@@ -131,10 +156,13 @@ public:
     AuthNegotiator *m_authNegotiator;
 
     int m_defaultTimeout;
+    bool m_convertsToHostByteOrder;
+    bool m_isUnixFdPassingEnabled;
 
     class PendingReplyRecord
     {
     public:
+        PendingReplyRecord() : isForSecondaryThread(false), ptr(nullptr) {}
         PendingReplyRecord(PendingReplyPrivate *pr) : isForSecondaryThread(false), ptr(pr) {}
         PendingReplyRecord(TransceiverPrivate *tp) : isForSecondaryThread(true), ptr(tp) {}
 
@@ -147,14 +175,17 @@ public:
         bool isForSecondaryThread;
         void *ptr;
     };
-    std::unordered_map<uint32, PendingReplyRecord> m_pendingReplies; // replies we're waiting for
+    ReplyTimeouts m_replyTimeouts; // of the PendingReplies of this thread
 
     Spinlock m_lock; // only one lock because things done with lock held are quick, and anyway you shouldn't
                      // be using one connection from multiple threads if you need best performance
 
     // here we break the grouping by topic area to group together the variables protected by m_lock
     // BEGIN variables protected by m_lock
-    uint32 m_sendSerial; // TODO handle recycling of serials
+    uint32 m_sendSerial; // wraps around, see SerialMap::takeFreeSerial()
+    bool m_isConnectionLost; // then no more messages are sent
+    // replies we're waiting for; secondary threads add and remove their records directly
+    SerialMap<PendingReplyRecord> m_pendingReplies;
     // END variables protected by m_lock
 
     std::unordered_map<TransceiverPrivate *, CommutexPeer> m_secondaryThreadLinks;
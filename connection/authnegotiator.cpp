@@ -47,6 +47,7 @@ using namespace std;
 
 AuthNegotiator::AuthNegotiator(IConnection *connection)
    : m_state(InitialState),
+     m_isUnixFdPassingEnabled(false),
      m_completionClient(nullptr)
 {
     cerr << "AuthNegotiator constructing\n";
@@ -88,6 +89,11 @@ bool AuthNegotiator::isAuthenticated() const
     return m_state == AuthenticatedState;
 }
 
+bool AuthNegotiator::isUnixFdPassingEnabled() const
+{
+    return m_isUnixFdPassingEnabled;
+}
+
 void AuthNegotiator::setCompletionClient(ICompletionClient *client)
 {
     m_completionClient = client;
@@ -139,24 +145,32 @@ void AuthNegotiator::advanceState()
     cout << "> " << m_line;
 
     switch (m_state) {
-    case ExpectOkState: {
+    case ExpectOkState:
         // TODO check the OK
-#ifdef __unix__
-        cstring negotiateLine("NEGOTIATE_UNIX_FD\r\n");
-        cout << negotiateLine.ptr;
-        connection()->write(chunk(negotiateLine.ptr, negotiateLine.length));
-        m_state = ExpectUnixFdResponseState;
-        break; }
-    case ExpectUnixFdResponseState: {
-#endif
-        // TODO check the response
-        cstring beginLine("BEGIN\r\n");
-        cout << beginLine.ptr;
-        connection()->write(chunk(beginLine.ptr, beginLine.length));
-        m_state = AuthenticatedState;
-        break; }
+        if (connection()->supportsFileDescriptors()) {
+            cstring negotiateLine("NEGOTIATE_UNIX_FD\r\n");
+            cout << negotiateLine.ptr;
+            connection()->write(chunk(negotiateLine.ptr, negotiateLine.length));
+            m_state = ExpectUnixFdResponseState;
+        } else {
+            sendBegin();
+        }
+        break;
+    case ExpectUnixFdResponseState:
+        // the alternative is an ERROR line, which just means no fd passing
+        m_isUnixFdPassingEnabled = m_line == "AGREE_UNIX_FD\r\n";
+        sendBegin();
+        break;
     default:
         m_state = AuthenticationFailedState;
         connection()->close();
     }
 }
+
+void AuthNegotiator::sendBegin()
+{
+    cstring beginLine("BEGIN\r\n");
+    cout << beginLine.ptr;
+    connection()->write(chunk(beginLine.ptr, beginLine.length));
+    m_state = AuthenticatedState;
+}
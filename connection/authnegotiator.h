@@ -44,6 +44,8 @@ public:
 
     bool isFinished() const;
     bool isAuthenticated() const;
+    // whether the server agreed to NEGOTIATE_UNIX_FD, which is only tried if the connection supports it
+    bool isUnixFdPassingEnabled() const;
 
     void setCompletionClient(ICompletionClient *);
 
@@ -51,6 +53,7 @@ private:
     bool readLine();
     bool isEndOfLine() const;
     void advanceState();
+    void sendBegin();
 
     enum State {
         InitialState,
@@ -61,6 +64,7 @@ private:
     };
 
     State m_state;
+    bool m_isUnixFdPassingEnabled;
     std::string m_line;
     ICompletionClient *m_completionClient;
 };
@@ -41,7 +41,8 @@ using namespace std;
 IConnection::IConnection()
    : m_eventDispatcher(0),
      m_readNotificationEnabled(false),
-     m_writeNotificationEnabled(false)
+     m_writeNotificationEnabled(false),
+     m_isWritingFromOtherThread(false)
 {
 }
 
@@ -100,6 +101,54 @@ void IConnection::updateReadWriteInterest()
     }
 }
 
+uint32 IConnection::writeVectored(const chunk *data, uint32 count)
+{
+    count = std::min(count, uint32(MaxWriteChunks));
+    uint32 ret = 0;
+    for (uint32 i = 0; i < count; i++) {
+        const uint32 written = write(data[i]);
+        ret += written;
+        if (written < data[i].length) {
+            break;
+        }
+    }
+    return ret;
+}
+
+bool IConnection::supportsFileDescriptors() const
+{
+    return false;
+}
+
+uint32 IConnection::writeVectoredWithFileDescriptors(const chunk *data, uint32 count,
+                                                     const int *, uint32 fdCount)
+{
+    return fdCount ? 0 : writeVectored(data, count);
+}
+
+bool IConnection::takeFileDescriptors(uint32 count, std::vector<int> *)
+{
+    return count == 0;
+}
+
+uint32 IConnection::writeFromOtherThread(const chunk *data, uint32 count,
+                                         const int *fds, uint32 fdCount)
+{
+    SpinLocker locker(&m_otherThreadWriteLock);
+    m_isWritingFromOtherThread = true;
+    const uint32 ret = writeVectoredWithFileDescriptors(data, count, fds, fdCount);
+    m_isWritingFromOtherThread = false;
+    return ret;
+}
+
+void IConnection::closeAfterWriteError()
+{
+    // closing touches the event dispatcher, which belongs to another thread
+    if (!m_isWritingFromOtherThread) {
+        close();
+    }
+}
+
 void IConnection::setEventDispatcher(EventDispatcher *ed)
 {
     if (m_eventDispatcher == ed) {
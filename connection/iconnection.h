@@ -26,6 +26,7 @@
 
 #include "iioeventclient.h"
 #include "platform.h"
+#include "spinlock.h"
 #include "types.h"
 
 #include <vector>
@@ -51,6 +52,29 @@ public:
     virtual uint32 availableBytesForReading() = 0;
     virtual chunk read(byte *buffer, uint32 maxSize) = 0;
     virtual uint32 write(chunk data) = 0;
+    // Writes the chunks in order, as much as possible without blocking, and returns the number of
+    // bytes written. At most MaxWriteChunks chunks are written. The default implementation calls
+    // write() for each chunk.
+    virtual uint32 writeVectored(const chunk *data, uint32 count);
+    enum
+    {
+        MaxWriteChunks = 1024 // IOV_MAX on Linux
+    };
+
+    // Unix file descriptor passing, which only local sockets support - the default implementations
+    // don't. The fds are sent with the first byte written, and the caller may close its copies as
+    // soon as anything was written.
+    virtual bool supportsFileDescriptors() const;
+    virtual uint32 writeVectoredWithFileDescriptors(const chunk *data, uint32 count,
+                                                    const int *fds, uint32 fdCount);
+    // Received fds are queued in the order they arrive. Moves the first count of them to the end of
+    // *fds, or returns false and does nothing if fewer than count have been received.
+    virtual bool takeFileDescriptors(uint32 count, std::vector<int> *fds);
+    // Like writeVectoredWithFileDescriptors(), but for threads other than the event dispatcher's,
+    // which must keep the connection alive meanwhile. Only one write at a time, from any thread.
+    // Write errors don't close the connection here; the next write in the dispatcher's thread
+    // finds them again.
+    uint32 writeFromOtherThread(const chunk *data, uint32 count, const int *fds, uint32 fdCount);
     virtual void close() = 0;
 
     virtual bool isOpen() = 0;
@@ -67,6 +91,12 @@ protected:
     void notifyRead() override;
     void notifyWrite() override;
 
+    // for subclasses: call this instead of close() after a write error
+    void closeAfterWriteError();
+    // held during writeFromOtherThread(); subclasses must hold it in close() while closing the
+    // file descriptor
+    Spinlock m_otherThreadWriteLock;
+
 private:
     friend class IConnectionClient;
     friend class SelectEventPoller;
@@ -76,6 +106,7 @@ private:
     std::vector<IConnectionClient *> m_clients;
     bool m_readNotificationEnabled;
     bool m_writeNotificationEnabled;
+    bool m_isWritingFromOtherThread;
 };
 
 #endif // ICONNECTION_H
@@ -131,6 +131,7 @@ IpSocket::~IpSocket()
 void IpSocket::close()
 {
     setEventDispatcher(nullptr);
+    SpinLocker locker(&m_otherThreadWriteLock);
     if (isValidFileDescriptor(m_fd)) {
 #ifdef _WIN32
         closesocket(m_fd);
@@ -160,7 +161,7 @@ uint32 IpSocket::write(chunk a)
             if (errno == EAGAIN) {
                 break;
             }
-            close();
+            closeAfterWriteError();
             return false;
         }
 
@@ -209,6 +210,9 @@ chunk IpSocket::read(byte *buffer, uint32 maxSize)
             return ret;
         }
         ret.length += uint32(nbytes);
+        if (uint32(nbytes) < maxSize) {
+            break; // see LocalSocket
+        }
         buffer += nbytes;
         maxSize -= uint32(nbytes);
     }
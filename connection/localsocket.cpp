@@ -31,13 +31,15 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
 
-// HACK, put this somewhere else (get the value from original d-bus? or is it infinite?)
-static const int maxFds = 12;
+// SCM_MAX_FD of Linux, the most that can be passed with one sendmsg(). Receiving that many fits
+// into the control message buffer of one recvmsg().
+static const uint32 maxFds = 253;
 
 using namespace std;
 
@@ -80,10 +82,17 @@ LocalSocket::~LocalSocket()
 void LocalSocket::close()
 {
     setEventDispatcher(nullptr);
-    if (m_fd >= 0) {
-        ::close(m_fd);
+    {
+        SpinLocker locker(&m_otherThreadWriteLock);
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+        m_fd = -1;
+    }
+    for (int fd : m_receivedFds) {
+        ::close(fd);
     }
-    m_fd = -1;
+    m_receivedFds.clear();
 }
 
 uint32 LocalSocket::write(chunk a)
@@ -101,38 +110,12 @@ uint32 LocalSocket::write(chunk a)
     send_msg.msg_flags = 0;
     send_msg.msg_iov = &iov;
     send_msg.msg_iovlen = 1;
+    send_msg.msg_control = 0;
+    send_msg.msg_controllen = 0;
 
     iov.iov_base = a.ptr;
     iov.iov_len = a.length;
 
-    // we can only send a fixed number of fds anyway due to the non-flexible size of the control message
-    // receive buffer, so we set an arbitrary limit.
-    const int numFds = 0; // TODO - how many should we get? do we need to know?
-    assert(numFds <= maxFds);
-
-    char cmsgBuf[CMSG_SPACE(sizeof(int) * maxFds)];
-
-    if (numFds) {
-        // fill in a control message
-        send_msg.msg_control = cmsgBuf;
-        send_msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
-
-        struct cmsghdr *c_msg = CMSG_FIRSTHDR(&send_msg);
-        c_msg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
-        c_msg->cmsg_level = SOL_SOCKET;
-        c_msg->cmsg_type = SCM_RIGHTS;
-
-        // set the control data to pass - this is why we don't use the simpler write()
-        for (int i = 0; i < numFds; i++) {
-            // TODO
-            // reinterpret_cast<int *>(CMSG_DATA(c_msg))[i] = message.m_fileDescriptors[i];
-        }
-    } else {
-        // no file descriptor to send, no control message
-        send_msg.msg_control = 0;
-        send_msg.msg_controllen = 0;
-    }
-
     while (iov.iov_len > 0) {
         ssize_t nbytes = sendmsg(m_fd, &send_msg, MSG_DONTWAIT);
         if (nbytes < 0) {
@@ -143,7 +126,7 @@ uint32 LocalSocket::write(chunk a)
             if (errno == EAGAIN /* && iov.iov_len < a.length */ ) {
                 break;
             }
-            close();
+            closeAfterWriteError();
             return false;
         }
 
@@ -154,6 +137,82 @@ uint32 LocalSocket::write(chunk a)
     return a.length - iov.iov_len;
 }
 
+uint32 LocalSocket::writeVectored(const chunk *data, uint32 count)
+{
+    return writeVectoredWithFileDescriptors(data, count, nullptr, 0);
+}
+
+bool LocalSocket::supportsFileDescriptors() const
+{
+    return true;
+}
+
+uint32 LocalSocket::writeVectoredWithFileDescriptors(const chunk *data, uint32 count,
+                                                     const int *fds, uint32 fdCount)
+{
+    if (m_fd < 0 || fdCount > maxFds) {
+        return 0;
+    }
+    count = std::min(count, uint32(MaxWriteChunks));
+#ifdef IOV_MAX
+    count = std::min(count, uint32(IOV_MAX));
+#endif
+
+    struct iovec iov[MaxWriteChunks];
+    for (uint32 i = 0; i < count; i++) {
+        iov[i].iov_base = data[i].ptr;
+        iov[i].iov_len = data[i].length;
+    }
+
+    struct msghdr send_msg;
+    memset(&send_msg, 0, sizeof(send_msg));
+    send_msg.msg_iov = iov;
+    send_msg.msg_iovlen = count;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * maxFds)];
+        struct cmsghdr align; // CMSG_FIRSTHDR() & co. need it aligned
+    } cmsgBuf;
+    if (fdCount) {
+        // fill in a control message - this is why we don't use the simpler writev()
+        send_msg.msg_control = cmsgBuf.buf;
+        send_msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+        struct cmsghdr *c_msg = CMSG_FIRSTHDR(&send_msg);
+        c_msg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        c_msg->cmsg_level = SOL_SOCKET;
+        c_msg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(c_msg), fds, sizeof(int) * fdCount);
+    }
+
+    // Only one syscall: after a short write, the socket buffer is full and another attempt would
+    // most likely just return EAGAIN.
+    while (true) {
+        ssize_t nbytes = sendmsg(m_fd, &send_msg, MSG_DONTWAIT);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            closeAfterWriteError();
+            return 0;
+        }
+        return uint32(nbytes);
+    }
+}
+
+bool LocalSocket::takeFileDescriptors(uint32 count, std::vector<int> *fds)
+{
+    if (m_receivedFds.size() < count) {
+        return false;
+    }
+    fds->insert(fds->end(), m_receivedFds.begin(), m_receivedFds.begin() + count);
+    m_receivedFds.erase(m_receivedFds.begin(), m_receivedFds.begin() + count);
+    return true;
+}
+
 uint32 LocalSocket::availableBytesForReading()
 {
     uint32 available = 0;
@@ -172,19 +231,24 @@ chunk LocalSocket::read(byte *buffer, uint32 maxSize)
 
     // recvmsg-with-control-message boilerplate
     struct msghdr recv_msg;
-    char cmsgBuf[CMSG_SPACE(sizeof(int) * maxFds)];
-    memset(cmsgBuf, 0, sizeof(cmsgBuf));
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * maxFds)];
+        struct cmsghdr align;
+    } cmsgBuf;
 
-    recv_msg.msg_control = cmsgBuf;
-    recv_msg.msg_controllen = sizeof(cmsgBuf);
     recv_msg.msg_name = 0;
     recv_msg.msg_namelen = 0;
-    recv_msg.msg_flags = 0;
 
     struct iovec iov;
     recv_msg.msg_iov = &iov;
     recv_msg.msg_iovlen = 1;
 
+#ifdef MSG_CMSG_CLOEXEC
+    const int flags = MSG_DONTWAIT | MSG_CMSG_CLOEXEC;
+#else
+    const int flags = MSG_DONTWAIT;
+#endif
+
     // end boilerplate
 
     ret.ptr = buffer;
@@ -192,7 +256,10 @@ chunk LocalSocket::read(byte *buffer, uint32 maxSize)
     iov.iov_base = ret.ptr;
     iov.iov_len = maxSize;
     while (iov.iov_len > 0) {
-        ssize_t nbytes = recvmsg(m_fd, &recv_msg, MSG_DONTWAIT);
+        recv_msg.msg_control = cmsgBuf.buf;
+        recv_msg.msg_controllen = sizeof(cmsgBuf.buf);
+        recv_msg.msg_flags = 0;
+        ssize_t nbytes = recvmsg(m_fd, &recv_msg, flags);
         if (nbytes < 0) {
             if (errno == EINTR) {
                 continue;
@@ -209,22 +276,34 @@ chunk LocalSocket::read(byte *buffer, uint32 maxSize)
             close();
             return ret;
         }
-        ret.length += size_t(nbytes);
-        iov.iov_base = static_cast<char *>(iov.iov_base) + nbytes;
-        iov.iov_len -= size_t(nbytes);
-    }
 
-    // done reading "regular data", now read any file descriptors passed via control messages
+        // file descriptors passed via control messages arrive with the first byte sent along with them
+        for (struct cmsghdr *c_msg = CMSG_FIRSTHDR(&recv_msg); c_msg; c_msg = CMSG_NXTHDR(&recv_msg, c_msg)) {
+            if (c_msg->cmsg_level == SOL_SOCKET && c_msg->cmsg_type == SCM_RIGHTS) {
+                const size_t fdCount = (c_msg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const byte *fdData = CMSG_DATA(c_msg);
+                for (size_t i = 0; i < fdCount; i++) {
+                    int fd;
+                    memcpy(&fd, fdData + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+                    m_receivedFds.push_back(fd);
+                }
+            }
+        }
+        if (recv_msg.msg_flags & MSG_CTRUNC) {
+            // some file descriptors were lost, so the remaining ones can't be matched to messages
+            close();
+            return ret;
+        }
 
-    struct cmsghdr *c_msg = CMSG_FIRSTHDR(&recv_msg);
-    if (c_msg && c_msg->cmsg_level == SOL_SOCKET && c_msg->cmsg_type == SCM_RIGHTS) {
-        /* TODO
-        const int len = c_msg->cmsg_len / sizeof(int);
-        int *data = reinterpret_cast<int *>(CMSG_DATA(c_msg));
-        for (int i = 0; i < len; i++) {
-            message.appendFileDescriptor(data[i]);
+        ret.length += size_t(nbytes);
+        if (size_t(nbytes) < iov.iov_len) {
+            break; // that was all available data, no need for another syscall to find out
         }
-        */
+        iov.iov_base = static_cast<char *>(iov.iov_base) + nbytes;
+        iov.iov_len -= size_t(nbytes);
     }
 
     return ret;
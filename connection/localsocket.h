@@ -26,6 +26,7 @@
 
 #include "iconnection.h"
 
+#include <deque>
 #include <string>
 
 class IConnectionListener;
@@ -42,6 +43,11 @@ public:
 
     // pure virtuals from IConnection
     uint32 write(chunk data) override;
+    uint32 writeVectored(const chunk *data, uint32 count) override;
+    bool supportsFileDescriptors() const override;
+    uint32 writeVectoredWithFileDescriptors(const chunk *data, uint32 count,
+                                            const int *fds, uint32 fdCount) override;
+    bool takeFileDescriptors(uint32 count, std::vector<int> *fds) override;
     uint32 availableBytesForReading() override;
     chunk read(byte *buffer, uint32 maxSize) override;
     void close() override;
@@ -59,6 +65,7 @@ private:
     friend class IConnectionListener;
 
     int m_fd;
+    std::deque<int> m_receivedFds;
 };
 
 #endif // LOCALSOCKET_H
@@ -27,7 +27,7 @@
 #include "iconnection.h"
 
 #include <sys/epoll.h>
-#include <fcntl.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include <cassert>
@@ -35,23 +35,22 @@
 
 EpollEventPoller::EpollEventPoller(EventDispatcher *dispatcher)
    : IEventPoller(dispatcher),
-     m_epollFd(epoll_create(10))
+     m_epollFd(epoll_create(10)),
+     m_interruptFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+     m_isStopRequested(false)
 {
-    // set up a pipe that can interrupt the polling from another thread
-    // (we could also use the Linux-only eventfd() - pipes are at least portable to epoll-like mechanisms)
-    pipe2(m_interruptPipe, O_NONBLOCK);
-
+    // set up an eventfd that can interrupt the polling from another thread; unlike a pipe, it
+    // doesn't fill up with one byte per interruption
     struct epoll_event epevt;
     epevt.events = EPOLLIN;
     epevt.data.u64 = 0; // clear high bits in the union
-    epevt.data.fd = m_interruptPipe[0];
-    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_interruptPipe[0], &epevt);
+    epevt.data.fd = m_interruptFd;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_interruptFd, &epevt);
 }
 
 EpollEventPoller::~EpollEventPoller()
 {
-    close(m_interruptPipe[0]);
-    close(m_interruptPipe[1]);
+    close(m_interruptFd);
     close(m_epollFd);
 }
 
@@ -70,16 +69,15 @@ IEventPoller::InterruptAction EpollEventPoller::poll(int timeout)
     for (int i = 0; i < nresults; i++) {
         struct epoll_event *evt = results + i;
         if (evt->events & EPOLLIN) {
-            if (evt->data.fd != m_interruptPipe[0]) {
+            if (evt->data.fd != m_interruptFd) {
                 EventDispatcherPrivate::get(m_dispatcher)->notifyClientForReading(evt->data.fd);
             } else {
-                // interrupt; read bytes from pipe to clear buffers and get the interrupt type
+                // interrupt; reset the counter and get the interrupt type
                 ret = IEventPoller::ProcessAuxEvents;
-                char buf;
-                while (read(m_interruptPipe[0], &buf, 1) > 0) {
-                    if (buf == 'S') {
-                        ret = IEventPoller::Stop;
-                    }
+                uint64_t count;
+                (void) read(m_interruptFd, &count, sizeof(count));
+                if (m_isStopRequested.exchange(false)) {
+                    ret = IEventPoller::Stop;
                 }
                 // ### discarding the rest of the events
                 // this works in our currently only use case, interrupting poll once to reap a thread
@@ -99,9 +97,12 @@ void EpollEventPoller::interrupt(IEventPoller::InterruptAction action)
 {
     assert(action == IEventPoller::ProcessAuxEvents || action == IEventPoller::Stop);
 
-    // write a byte to the write end so the poll waiting on the read end returns
-    char buf = (action == IEventPoller::Stop) ? 'S' : 'N';
-    write(m_interruptPipe[1], &buf, 1);
+    if (action == IEventPoller::Stop) {
+        m_isStopRequested = true;
+    }
+    // increment the counter so that the poll waiting for it returns
+    const uint64_t one = 1;
+    (void) write(m_interruptFd, &one, sizeof(one));
 }
 
 FileDescriptor EpollEventPoller::pollDescriptor() const
@@ -26,6 +26,7 @@
 
 #include "ieventpoller.h"
 
+#include <atomic>
 #include <map>
 
 class EpollEventPoller : public IEventPoller
@@ -49,8 +50,9 @@ public:
 private:
     void notifyRead(int fd);
 
-    int m_interruptPipe[2];
     FileDescriptor m_epollFd;
+    int m_interruptFd; // an eventfd
+    std::atomic<bool> m_isStopRequested;
 };
 
 #endif // EPOLLEVENTPOLLER_H
@@ -1,5 +1,115 @@
 #include "event.h"
 
+#include <algorithm>
+#include <cassert>
+#include <new>
+
 Event::~Event()
 {
 }
+
+const size_t EventPool::s_blockSize = EventPool::s_headerSize +
+                                      std::max(sizeof(SendQueueBlockedEvent), sizeof(PendingReplySuccessEvent));
+
+void *Event::operator new(size_t size)
+{
+    static_assert(sizeof(EventPool::BlockHeader) <= EventPool::s_headerSize, "header doesn't fit");
+    EventPool::BlockHeader *block =
+        static_cast<EventPool::BlockHeader *>(::operator new(EventPool::s_headerSize + size));
+    block->pool = nullptr;
+    return reinterpret_cast<byte *>(block) + EventPool::s_headerSize;
+}
+
+void *Event::operator new(size_t size, EventPool *pool)
+{
+    return pool->allocate(size);
+}
+
+void Event::operator delete(void *event)
+{
+    if (!event) {
+        return;
+    }
+    EventPool::BlockHeader *block = EventPool::header(event);
+    if (block->pool) {
+        EventPool::free(event);
+    } else {
+        ::operator delete(block);
+    }
+}
+
+void Event::operator delete(void *event, EventPool *)
+{
+    Event::operator delete(event);
+}
+
+EventPool::EventPool()
+   : m_refCount(1),
+     m_blocks(nullptr),
+     m_returnedBlocks(nullptr)
+{
+}
+
+// static
+void EventPool::deleteBlocks(BlockHeader *list)
+{
+    while (list) {
+        BlockHeader *next = list->next;
+        ::operator delete(list);
+        list = next;
+    }
+}
+
+EventPool::~EventPool()
+{
+    deleteBlocks(m_blocks);
+    deleteBlocks(m_returnedBlocks.load(std::memory_order_relaxed));
+}
+
+void EventPool::release()
+{
+    deref();
+}
+
+void EventPool::deref()
+{
+    if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+// static
+EventPool::BlockHeader *EventPool::header(void *event)
+{
+    return reinterpret_cast<BlockHeader *>(static_cast<byte *>(event) - s_headerSize);
+}
+
+void *EventPool::allocate(size_t size)
+{
+    assert(size + s_headerSize <= s_blockSize);
+    (void) size;
+    if (!m_blocks) {
+        m_blocks = m_returnedBlocks.exchange(nullptr, std::memory_order_acquire);
+    }
+    BlockHeader *block = m_blocks;
+    if (block) {
+        m_blocks = block->next;
+    } else {
+        block = static_cast<BlockHeader *>(::operator new(s_blockSize));
+    }
+    block->pool = this;
+    m_refCount.fetch_add(1, std::memory_order_relaxed);
+    return reinterpret_cast<byte *>(block) + s_headerSize;
+}
+
+// static
+void EventPool::free(void *event)
+{
+    BlockHeader *block = header(event);
+    EventPool *const pool = block->pool;
+    block->next = pool->m_returnedBlocks.load(std::memory_order_relaxed);
+    while (!pool->m_returnedBlocks.compare_exchange_weak(block->next, block, std::memory_order_release,
+                                                          std::memory_order_relaxed)) {
+    }
+    pool->deref();
+}
@@ -3,9 +3,13 @@
 
 #include "error.h"
 #include "message.h"
+
+#include <atomic>
+#include <cstddef>
 #include <string>
 
 class Commutex;
+class EventPool;
 class TransceiverPrivate;
 
 // these are exclusively sent from and to Transceiver instances so far, nevertheless it seems logical
@@ -13,35 +17,68 @@ class TransceiverPrivate;
 struct Event
 {
     enum Type : uint32 {
-        SendMessage = 0,
-        SendMessageWithPendingReply,
+        SendQueueBlocked = 0,
         SpontaneousMessageReceived,
         PendingReplySuccess,
         PendingReplyFailure,
-        PendingReplyCancel, // 5
         MainTransceiverDisconnect,
-        SecondaryTransceiverConnect,
+        SecondaryTransceiverConnect, // 5
         SecondaryTransceiverDisconnect,
         UniqueNameReceived
     };
 
-    Event(Type t) : type(t) {}
+    Event(Type t) : type(t), next(nullptr) {}
     virtual ~Event() = 0;
 
+    // The memory of all events has a header that says if it is from an EventPool, so all events
+    // can be deleted the same way. Only use the pool of the current thread's EventDispatcher, and
+    // only for the event types that fit EventPool's blocks.
+    static void *operator new(size_t size);
+    static void *operator new(size_t size, EventPool *pool);
+    static void operator delete(void *event);
+    static void operator delete(void *event, EventPool *pool);
+
     Type type;
+    Event *next; // for the queue in EventDispatcher
 };
 
-struct SendMessageEvent : public Event
+// Recycles the memory of the most frequent events. Those are usually deleted in another thread than
+// the one that created them, so a thread-local cache wouldn't help. Freed blocks are returned to
+// their pool through a lock-free stack, from which the owner thread takes all of them at once.
+class EventPool
 {
-    SendMessageEvent() : Event(Event::SendMessage) {}
-    Message message;
+public:
+    EventPool();
+    // for the owner; the pool is destroyed when the owner and all events from it are gone
+    void release();
+
+    void *allocate(size_t size); // only from the owner thread
+    static void free(void *event); // from any thread
+
+private:
+    struct BlockHeader
+    {
+        EventPool *pool; // null if not from a pool
+        BlockHeader *next;
+    };
+    friend struct Event;
+    static const size_t s_headerSize = 16; // keeps the event as aligned as the allocation
+    static const size_t s_blockSize;
+
+    ~EventPool();
+    void deref();
+    static BlockHeader *header(void *event);
+    static void deleteBlocks(BlockHeader *list);
+
+    std::atomic<uint32> m_refCount;
+    BlockHeader *m_blocks; // only used by the owner thread
+    std::atomic<BlockHeader *> m_returnedBlocks;
 };
 
-struct SendMessageWithPendingReplyEvent : public Event
+// a secondary thread found the socket full while sending, see MessageSender::resumeWriting()
+struct SendQueueBlockedEvent : public Event
 {
-    SendMessageWithPendingReplyEvent() : Event(Event::SendMessageWithPendingReply) {}
-    Message message;
-    TransceiverPrivate *transceiver;
+    SendQueueBlockedEvent() : Event(Event::SendQueueBlocked) {}
 };
 
 struct SpontaneousMessageReceivedEvent : public Event
@@ -63,12 +100,6 @@ struct PendingReplyFailureEvent : public Event
     Error m_error;
 };
 
-struct PendingReplyCancelEvent : public Event
-{
-    PendingReplyCancelEvent() : Event(Event::PendingReplyCancel) {}
-    uint32 serial;
-};
-
 struct MainTransceiverDisconnectEvent : public Event
 {
     MainTransceiverDisconnectEvent() : Event(Event::MainTransceiverDisconnect) {}
@@ -59,6 +59,13 @@ EventDispatcher::EventDispatcher()
 #endif
 }
 
+EventDispatcherPrivate::EventDispatcherPrivate()
+   : m_queuedEvents(nullptr),
+     m_isWaitingForEvents(false),
+     m_eventPool(new EventPool)
+{
+}
+
 EventDispatcherPrivate::~EventDispatcherPrivate()
 {
     for (const pair<FileDescriptor, IioEventClient*> &fdCon : m_ioClients) {
@@ -71,6 +78,13 @@ EventDispatcherPrivate::~EventDispatcherPrivate()
     }
 
     delete m_poller;
+
+    for (Event *evt = m_queuedEvents.exchange(nullptr); evt; ) {
+        Event *next = evt->next;
+        delete evt;
+        evt = next;
+    }
+    m_eventPool->release();
 }
 
 EventDispatcher::~EventDispatcher()
@@ -88,14 +102,21 @@ bool EventDispatcher::poll(int timeout)
         timeout = min(timeout, nextDue);
     }
 
+    // see queueEvent() - after announcing that we'll wait, we must not miss any queued events
+    d->m_isWaitingForEvents.store(true);
+    if (d->m_queuedEvents.load()) {
+        timeout = 0;
+    }
+
 #ifdef EVENTDISPATCHER_DEBUG
     printf("EventDispatcher::poll(): timeout=%d, nextDue=%d.\n", timeout, nextDue);
 #endif
     IEventPoller::InterruptAction interrupAction = d->m_poller->poll(timeout);
+    d->m_isWaitingForEvents.store(false, std::memory_order_relaxed);
 
     if (interrupAction == IEventPoller::Stop) {
         return false;
-    } else if (interrupAction == IEventPoller::ProcessAuxEvents && d->m_transceiverToNotify) {
+    } else if (d->hasQueuedEvents()) {
         d->processAuxEvents();
     }
     d->triggerDueTimers();
@@ -300,25 +321,37 @@ void EventDispatcherPrivate::triggerDueTimers()
 void EventDispatcherPrivate::queueEvent(std::unique_ptr<Event> evt)
 {
     // std::cerr << "EventDispatcherPrivate::queueEvent() " << evt->type << " " << this << std::endl;
-    {
-        SpinLocker locker(&m_queuedEventsLock);
-        m_queuedEvents.emplace_back(std::move(evt));
+    Event *const event = evt.release();
+    Event *previous = m_queuedEvents.load(std::memory_order_relaxed);
+    do {
+        event->next = previous;
+    } while (!m_queuedEvents.compare_exchange_weak(previous, event));
+    // event may be gone already, so don't touch it anymore.
+    // Both this and poll() first write and then read what the other side writes, with sequential
+    // consistency. So either we see that it waits, or it sees the event before waiting.
+    // If the queue wasn't empty, whoever queued the first event has taken care of waking.
+    if (!previous && m_isWaitingForEvents.load()) {
+        wakeForEvents();
     }
-    wakeForEvents();
 }
 
 void EventDispatcherPrivate::processAuxEvents()
 {
     // std::cerr << "EventDispatcherPrivate::processAuxEvents() " << this << std::endl;
-    // don't hog the lock while processing the events
-    std::vector<std::unique_ptr<Event>> events;
-    {
-        SpinLocker locker(&m_queuedEventsLock);
-        std::swap(events, m_queuedEvents);
+    // take all events at once and restore their order
+    Event *events = nullptr;
+    for (Event *evt = m_queuedEvents.exchange(nullptr, std::memory_order_acquire); evt; ) {
+        Event *next = evt->next;
+        evt->next = events;
+        events = evt;
+        evt = next;
     }
-    if (m_transceiverToNotify) {
-        for (const std::unique_ptr<Event> &evt : events) {
-            m_transceiverToNotify->processEvent(evt.get());
+    while (events) {
+        Event *evt = events;
+        events = evt->next;
+        if (m_transceiverToNotify) {
+            m_transceiverToNotify->processEvent(evt);
         }
+        delete evt;
     }
 }
@@ -28,15 +28,15 @@
 
 #include "message.h"
 #include "platform.h"
-#include "spinlock.h"
 #include "types.h"
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <unordered_map>
-#include <vector>
 
 struct Event;
+class EventPool;
 class IioEventClient;
 class IEventPoller;
 class Message;
@@ -51,6 +51,7 @@ class EventDispatcherPrivate
 public:
     static EventDispatcherPrivate *get(EventDispatcher *ed) { return ed->d; }
 
+    EventDispatcherPrivate();
     ~EventDispatcherPrivate();
 
     int timeToFirstDueTimer() const;
@@ -71,10 +72,11 @@ public:
     void addTimer(Timer *timer);
     void removeTimer(Timer *timer);
     // for Transceiver
-    // this is similar to interrupt(), but doesn't make poll() return false and will call
-    // m_transceiverToNotify() -> processQueuedEvents()
+    // this is similar to interrupt(), but doesn't make poll() return false
     void wakeForEvents();
     void queueEvent(std::unique_ptr<Event> evt); // safe to call from any thread
+    bool hasQueuedEvents() const { return m_queuedEvents.load(std::memory_order_relaxed); }
+    // passes all queued events to m_transceiverToNotify, in the order they were queued
     void processAuxEvents();
 
     IEventPoller *m_poller = nullptr;
@@ -95,8 +97,13 @@ public:
     // for inter thread event delivery to Transceiver
     TransceiverPrivate *m_transceiverToNotify = nullptr;
 
-    Spinlock m_queuedEventsLock;
-    std::vector<std::unique_ptr<Event>> m_queuedEvents;
+    // Lock-free, intrusive stack of queued events, newest first. Only the event that makes it
+    // non-empty wakes the dispatcher, and only if it is waiting in poll(); otherwise poll() will
+    // find the events before it waits.
+    std::atomic<Event *> m_queuedEvents;
+    std::atomic<bool> m_isWaitingForEvents;
+    // for the frequent events that this thread sends to other threads
+    EventPool *m_eventPool;
 };
 
 #endif
@@ -24,18 +24,28 @@
 #include "arguments.h"
 
 #include "basictypeio.h"
+#include "byteswap.h"
+#include "datawalker.h"
 #include "error.h"
 #include "malloccache.h"
 #include "message.h"
+#include "signatureprogram.h"
 #include "stringtools.h"
+#include "validation.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <sstream>
 
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // Maximum message length is a good upper bound for maximum Arguments data length. In order to limit
 // excessive memory consumption in error cases and prevent integer overflow exploits, enforce a maximum
 // data length already in Arguments.
@@ -44,6 +54,27 @@ enum {
     SpecMaxMessageLength = 134217728 // 128 MiB
 };
 
+// File descriptors are duplicated so that the Arguments owns them, independent of the caller's
+// copies. Without Unix fd support, they are just numbers.
+static int duplicateFd(int fd)
+{
+#ifdef __unix__
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else
+    return fd;
+#endif
+}
+
+static void closeFds(std::vector<int> *fds)
+{
+#ifdef __unix__
+    for (int fd : *fds) {
+        ::close(fd);
+    }
+#endif
+    fds->clear();
+}
+
 static byte alignmentLog2(uint32 alignment)
 {
     static const byte alignLog[9] = { 0, 0, 1, 0, 2, 0, 0, 0, 3 };
@@ -102,10 +133,40 @@ static cstring printableState(Arguments::IoState state)
 // the first error occurred
 // TODO: that text above belongs into a "Reader and Writer state / errors" explanation of the docs
 
+// In CopyWholeAggregates mode, copies the rest of the aggregate that was just entered, including
+// its end
+static void copyAggregateContents(Arguments::Reader *reader, Arguments::Writer *writer,
+                                  Arguments::IoState endState)
+{
+    while (true) {
+        const Arguments::IoState state = reader->state();
+        if (state == endState || state == Arguments::InvalidData || state == Arguments::NeedMoreData ||
+            state == Arguments::Finished) {
+            break;
+        }
+        Arguments::copyOneElement(reader, writer, Arguments::CopyWholeAggregates);
+    }
+    Arguments::copyOneElement(reader, writer, Arguments::CopyElementWise);
+}
+
 // static
-void Arguments::copyOneElement(Arguments::Reader *reader, Arguments::Writer *writer)
+void Arguments::copyOneElement(Arguments::Reader *reader, Arguments::Writer *writer, CopyMode mode)
 {
-    switch(reader->state()) {
+    const IoState state = reader->state();
+    if (mode == CopyWholeAggregates && (state == BeginStruct || state == BeginVariant ||
+                                        state == BeginArray || state == BeginDict)) {
+        if (writer->copyAggregateRaw(reader)) {
+            return;
+        }
+        const bool isPrimitiveArray = state == BeginArray && reader->peekPrimitiveArray() != BeginArray;
+        copyOneElement(reader, writer, CopyElementWise);
+        if (!isPrimitiveArray) { // which has been copied completely
+            copyAggregateContents(reader, writer, IoState(state + 1));
+        }
+        return;
+    }
+
+    switch(state) {
     case Arguments::BeginStruct:
         reader->beginStruct();
         writer->beginStruct();
@@ -225,6 +286,12 @@ struct Nesting
     bool beginVariant() { variant++; return likely(total() <= totalMax); }
     void endVariant() { assert(variant >= 1); variant--; }
     uint32 total() { return array + paren + variant; }
+    // whether the single complete type ins can be entered without exceeding the limits
+    bool canContain(const SignatureProgram::Instruction &ins)
+    {
+        return likely(array + ins.arrayDepth <= arrayMax && paren + ins.parenDepth <= parenMax &&
+                      total() + ins.totalDepth <= totalMax);
+    }
 
     uint32 array;
     uint32 paren;
@@ -241,24 +308,39 @@ struct NestingWithParenCounter : public Nesting
     uint32 parenCount;
 };
 
+// Copies of an Arguments share the Private if its data is in owned memory. It is never changed while
+// shared, the few methods that change it detach() first.
 class Arguments::Private
 {
 public:
     Private()
        : m_isByteSwapped(false),
-         m_memOwnership(nullptr)
+         m_memOwnership(nullptr),
+         m_refCount(1)
     {}
 
-    Private(const Private &other);
-    Private &operator=(const Private &other);
+    Private(const Private &other); // deep copy
+    void operator=(const Private &other) = delete;
     void initFrom(const Private &other);
     ~Private();
 
+    // Borrowed memory may not live as long as a copy, and copies should have their own fds
+    bool isShareable() const
+    {
+        return (m_memOwnership || (!m_data.length && !m_signature.length)) && m_fileDescriptors.empty();
+    }
+    bool isShared() const { return m_refCount.load(std::memory_order_acquire) > 1; }
+    void ref() { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+    // returns true if this was the last reference and must be destroyed
+    bool deref() { return m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
     chunk m_data;
     bool m_isByteSwapped;
     byte *m_memOwnership;
     cstring m_signature;
+    std::vector<int> m_fileDescriptors; // owned
     Error m_error;
+    std::atomic<uint32> m_refCount;
 };
 
 class Arguments::Reader::Private
@@ -266,13 +348,20 @@ class Arguments::Reader::Private
 public:
     Private()
        : m_args(nullptr),
+         m_program(nullptr),
+         m_variantProgram(nullptr),
          m_signaturePosition(uint32(-1)),
          m_dataPosition(0),
          m_nilArrayNesting(0)
     {}
 
+    // Get the program for signature, keeping it alive if it's not interned
+    const SignatureProgram *getProgram(cstring signature);
+
     const Arguments *m_args;
     cstring m_signature;
+    const SignatureProgram *m_program; // compiled m_signature
+    const SignatureProgram *m_variantProgram; // from BeginVariant state until beginVariant()
     uint32 m_signaturePosition;
     chunk m_data;
     uint32 m_dataPosition;
@@ -290,6 +379,7 @@ public:
     {
         podCstring prevSignature;     // a variant switches the currently parsed signature, so we
         uint32 prevSignaturePosition; // need to store the old signature and parse position.
+        const SignatureProgram *prevProgram;
     };
 
     // for structs, we don't need to know more than that we are in a struct
@@ -305,23 +395,36 @@ public:
 
     // this keeps track of which aggregates we are currently in
     std::vector<AggregateInfo> m_aggregateStack;
+    // only used when the signature cache is full; in variant nesting order
+    std::vector<std::shared_ptr<const SignatureProgram>> m_uncachedPrograms;
 };
 
+const SignatureProgram *Arguments::Reader::Private::getProgram(cstring signature)
+{
+    std::shared_ptr<const SignatureProgram> uncached;
+    const SignatureProgram *program = SignatureProgram::get(signature, &uncached);
+    if (unlikely(uncached)) {
+        m_uncachedPrograms.push_back(std::move(uncached));
+    }
+    return program;
+}
+
 class Arguments::Writer::Private
 {
 public:
     Private()
        : m_signature(m_initialDataBuffer, 0),
          m_signaturePosition(0),
-         m_variantSignaturesWastedSpace(0),
          m_data(m_initialDataBuffer),
          m_dataCapacity(InitialDataCapacity),
          m_dataPosition(MaxFullSignatureLength),
-         m_nilArrayNesting(0)
+         m_dataStart(MaxFullSignatureLength),
+         m_nilArrayNesting(0),
+         m_variantSignatures(nullptr),
+         m_variantSignaturesCapacity(0)
     {
         m_signature.ptr = reinterpret_cast<char *>(m_data + 1); // reserve a byte for length prefix
         m_signature.length = 0;
-        m_elements.reserve(16);
     }
 
     Private(const Private &other);
@@ -337,7 +440,8 @@ public:
             newCapacity *= 2;
         } while (size > newCapacity);
 
-        byte *const oldDataPointer = m_data;
+        // the main signature lives at the start of m_data, variant signatures live elsewhere
+        const bool isMainSignature = m_signature.ptr == reinterpret_cast<char *>(m_data) + 1;
         if (m_data == m_initialDataBuffer) {
             byte *newAlloc = reinterpret_cast<byte *>(malloc(newCapacity));
             memcpy(newAlloc, m_data, m_dataCapacity);
@@ -345,30 +449,52 @@ public:
         } else {
             m_data = reinterpret_cast<byte *>(realloc(m_data, newCapacity));
         }
-        m_signature.ptr += m_data - oldDataPointer;
+        if (isMainSignature) {
+            m_signature.ptr = reinterpret_cast<char *>(m_data) + 1;
+        }
         m_dataCapacity = newCapacity;
     }
 
-    uint32 m_dataElementsCountBeforeNilArray;
-    uint32 m_dataPositionBeforeNilArray;
+    // pads with zeros to @p alignment and makes sure that there is room for @p size more bytes
+    void alignData(uint32 alignment, uint32 size)
+    {
+        reserveData(align(m_dataPosition, alignment) + size);
+        zeroPad(m_data, alignment, &m_dataPosition);
+    }
+
+    // returns the signature storage for variant nesting level @p level, 0 is the main signature
+    char *signatureStorage(uint32 level);
+
+    bool finishVariant(uint32 variantStart, cstring signature);
+    bool relayoutElement(const byte *src, uint32 *srcPos, const SignatureProgram *program,
+                         uint32 *signaturePosition);
 
     Arguments m_args;
     NestingWithParenCounter m_nesting;
     cstring m_signature;
     uint32 m_signaturePosition;
-    int32 m_variantSignaturesWastedSpace;
 
     byte *m_data;
     uint32 m_dataCapacity;
     uint32 m_dataPosition;
+    uint32 m_dataStart; // the signature area plus room for a message header, if requested
+
+    std::vector<int> m_fileDescriptors; // owned, handed over to m_args in finish()
 
     int m_nilArrayNesting;
     Error m_error;
 
+    // Variant signatures are only known at the end of a variant, but they must be in the data stream
+    // before the variant's contents. The signatures are built here, one slot of MaxFullSignatureLength
+    // per variant nesting level, and copied into the data stream when the variant ends.
+    byte *m_variantSignatures;
+    uint32 m_variantSignaturesCapacity; // in slots
+
     enum {
         InitialDataCapacity = 512,
-        // max signature length w/ length prefix (1 byte) and terminator (1 byte)
-        MaxFullSignatureLength = MaxSignatureLength + 1
+        // max signature length w/ length prefix (1 byte) and terminator (1 byte), rounded up to keep
+        // the data after it 8 byte aligned
+        MaxFullSignatureLength = (MaxSignatureLength + 2 + 7) & ~7
     };
 
 #ifdef WITH_DICT_ENTRY
@@ -383,6 +509,7 @@ public:
     struct ArrayInfo
     {
         uint32 containedTypeBegin; // to rewind when reading the next element
+        uint32 lengthFieldPosition; // to fill in the length when the array ends
 #ifdef WITH_DICT_ENTRY
         DictEntryState dictEntryState;
 #endif
@@ -390,10 +517,10 @@ public:
 
     struct VariantInfo
     {
-        // a variant switches the currently parsed signature, so we
-        // need to store the old signature and parse position.
-        uint32 prevSignatureOffset; // relative to m_data
+        // a variant switches the currently parsed signature, so we need to store the old parse
+        // position; the old signature is found by nesting level.
         uint32 prevSignaturePosition;
+        uint32 dataStart; // position of the signature length prefix in the data stream
     };
 
     struct StructInfo
@@ -411,41 +538,13 @@ public:
         };
     };
 
-    std::vector<cstring> m_variantSignatures;
-
     // this keeps track of which aggregates we are currently in
     std::vector<AggregateInfo> m_aggregateStack;
 
-
-    // we don't know how long a variant signature is when starting the variant, but we have to
-    // insert the signature into the datastream before the data. for that reason, we need a
-    // postprocessing pass to insert the signatures when the stream is otherwise finished.
-
-    // - need to split up long string data: all unaligned, arbitrary length
-    // - need to fix up array length because even the length excluding the padding before and
-    //   after varies with alignment of the first byte - for that the alignment parameters as
-    //   described in plan.txt need to be solved (we can use a worst-case estimate at first)
-    struct ElementInfo
-    {
-        ElementInfo(byte alignment, byte size_)
-            : size(size_)
-        {
-            alignmentExponent = alignmentLog2(alignment);
-        }
-        byte alignment() const { return 1 << alignmentExponent; }
-
-        byte alignmentExponent : 2; // powers of 2, so 1, 2, 4, 8
-        byte size : 6; // that's up to 63
-        enum SizeCode {
-            LargestSize = 60,
-            ArrayLengthField,
-            ArrayLengthEndMark,
-            VariantSignature
-        };
-    };
-
+    // Data is written in its final form, with array lengths filled in when the array ends. The first
+    // MaxFullSignatureLength bytes are reserved for the main signature, so that finish() can just hand
+    // over the buffer. Since that area has a size divisible by 8, alignment is the same as in the output.
     byte m_initialDataBuffer[InitialDataCapacity];
-    std::vector<ElementInfo> m_elements;
 };
 
 struct ArgAllocCaches
@@ -457,22 +556,29 @@ struct ArgAllocCaches
 thread_local static ArgAllocCaches allocCaches;
 
 Arguments::Private::Private(const Private &other)
+   : m_refCount(1)
 {
     initFrom(other);
+    m_error = other.m_error;
 }
 
-Arguments::Private &Arguments::Private::operator=(const Private &other)
+static void derefPrivate(Arguments::Private *d)
 {
-    if (this != &other) {
-        initFrom(other);
+    if (d && d->deref()) {
+        d->~Private();
+        allocCaches.argsPrivate.free(d);
     }
-    return *this;
 }
 
 void Arguments::Private::initFrom(const Private &other)
 {
     m_isByteSwapped = other.m_isByteSwapped;
 
+    m_fileDescriptors.reserve(other.m_fileDescriptors.size());
+    for (int fd : other.m_fileDescriptors) {
+        m_fileDescriptors.push_back(duplicateFd(fd));
+    }
+
     // make a deep copy
     // use only one malloced block for signature and main data - this saves one malloc and free
     // and also saves a pointer
@@ -513,6 +619,7 @@ Arguments::Private::~Private()
     if (m_memOwnership) {
         free(m_memOwnership);
     }
+    closeFds(&m_fileDescriptors);
 }
 
 // Macros are icky, but here every use saves three lines.
@@ -553,15 +660,18 @@ Arguments::Arguments(const Arguments &other)
    : d(nullptr)
 {
     if (other.d) {
-        d = new(allocCaches.argsPrivate.allocate()) Private(*other.d);
+        if (other.d->isShareable()) {
+            other.d->ref();
+            d = other.d;
+        } else {
+            d = new(allocCaches.argsPrivate.allocate()) Private(*other.d);
+        }
     }
 }
 
 Arguments &Arguments::operator=(const Arguments &other)
 {
-    if (d && other.d) {
-        *d = *other.d;
-    } else {
+    if (d != other.d) {
         Arguments temp(other);
         std::swap(d, temp.d);
     }
@@ -570,11 +680,28 @@ Arguments &Arguments::operator=(const Arguments &other)
 
 Arguments::~Arguments()
 {
-    if (d) {
-        d->~Private();
-        allocCaches.argsPrivate.free(d);
-        d = nullptr;
+    derefPrivate(d);
+    d = nullptr;
+}
+
+void Arguments::detach()
+{
+    if (d->isShared()) {
+        Private *copy = new(allocCaches.argsPrivate.allocate()) Private(*d);
+        derefPrivate(d);
+        d = copy;
+    }
+}
+
+Arguments Arguments::withData(cstring signature, chunk data) const
+{
+    Arguments ret(nullptr, signature, data, d->m_isByteSwapped);
+    ret.d->m_fileDescriptors.reserve(d->m_fileDescriptors.size());
+    for (int fd : d->m_fileDescriptors) {
+        ret.d->m_fileDescriptors.push_back(duplicateFd(fd));
     }
+    ret.d->m_error = d->m_error;
+    return ret;
 }
 
 Error Arguments::error() const
@@ -592,6 +719,53 @@ chunk Arguments::data() const
     return d->m_data;
 }
 
+uint32 Arguments::spaceBeforeData() const
+{
+    // the space can only be used by writing into it, which a shared Private forbids
+    if (!d->m_memOwnership || !d->m_data.length || d->isShared()) {
+        return 0;
+    }
+    // the signature, if any, is usually in the same block, in front of the data
+    const byte *begin = d->m_memOwnership;
+    const byte *signatureEnd = reinterpret_cast<const byte *>(d->m_signature.ptr) + d->m_signature.length + 1;
+    if (d->m_signature.length && reinterpret_cast<const byte *>(d->m_signature.ptr) >= begin) {
+        begin = signatureEnd;
+    }
+    return begin <= d->m_data.ptr ? d->m_data.ptr - begin : 0;
+}
+
+bool Arguments::isByteSwapped() const
+{
+    return d->m_isByteSwapped;
+}
+
+const std::vector<int> &Arguments::fileDescriptors() const
+{
+    return d->m_fileDescriptors;
+}
+
+void Arguments::swapFileDescriptors(std::vector<int> *fds)
+{
+    detach();
+    std::swap(d->m_fileDescriptors, *fds);
+}
+
+bool Arguments::convertToHostByteOrder()
+{
+    if (!d->m_isByteSwapped) {
+        return true;
+    }
+    std::shared_ptr<const SignatureProgram> uncached;
+    const SignatureProgram *program = SignatureProgram::get(d->m_signature, &uncached);
+    if (!program || !DataWalker(d->m_data, true).skipAll(program)) {
+        return false;
+    }
+    detach();
+    DataWalker(d->m_data, true, DataWalker::ConvertToHostByteOrder).skipAll(program);
+    d->m_isByteSwapped = false;
+    return true;
+}
+
 
 static void printMaybeNilProlog(std::stringstream *out, const std::string &nestingPrefix, bool isNil,
                                 const char *typeName)
@@ -787,25 +961,13 @@ std::string Arguments::prettyPrint() const
     return ret.str();
 }
 
-static void chopFirst(cstring *s)
-{
-    s->ptr++;
-    s->length--;
-}
-
 // static
 bool Arguments::isStringValid(cstring string)
 {
     if (!string.ptr || string.length + 1 >= SpecMaxArrayLength || string.ptr[string.length] != 0) {
         return false;
     }
-    // check that there are no embedded nulls, exploiting the highly optimized strlen...
-    return strlen(string.ptr) == string.length;
-}
-
-static inline bool isObjectNameLetter(char c)
-{
-    return likely((c >= 'a' && c <= 'z') || c == '_' || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+    return validation::isUtf8(string);
 }
 
 // static
@@ -814,178 +976,27 @@ bool Arguments::isObjectPathValid(cstring path)
     if (!path.ptr || path.length + 1 >= SpecMaxArrayLength || path.ptr[path.length] != 0) {
         return false;
     }
-    char prevLetter = path.ptr[0];
-    if (prevLetter != '/') {
-        return false;
-    }
-    if (path.length == 1) {
-        return true; // "/" special case
-    }
-    for (uint32 i = 1; i < path.length; i++) {
-        char currentLetter = path.ptr[i];
-        if (prevLetter == '/') {
-            if (!isObjectNameLetter(currentLetter)) {
-                return false;
-            }
-        } else {
-            if (currentLetter != '/' && !isObjectNameLetter(currentLetter)) {
-                return false;
-            }
-        }
-        prevLetter = currentLetter;
-    }
-    return prevLetter != '/';
+    return validation::isObjectPath(path);
 }
 
 // static
 bool Arguments::isObjectPathElementValid(cstring pathElement)
 {
-    if (!pathElement.length) {
-        return false;
-    }
-    for (uint32 i = 0; i < pathElement.length; i++) {
-        if (!isObjectNameLetter(pathElement.ptr[i])) {
-            return false;
-        }
-    }
-    return true;
-}
-
-static bool parseBasicType(cstring *s)
-{
-    // ### not checking if zero-terminated
-    assert(s->ptr);
-    if (s->length == 0) {
-        return false;
-    }
-    switch (*s->ptr) {
-    case 'y':
-    case 'b':
-    case 'n':
-    case 'q':
-    case 'i':
-    case 'u':
-    case 'x':
-    case 't':
-    case 'd':
-    case 's':
-    case 'o':
-    case 'g':
-    case 'h':
-        chopFirst(s);
-        return true;
-    default:
-        return false;
-    }
-}
-
-static bool parseSingleCompleteType(cstring *s, Nesting *nest)
-{
-    assert(s->ptr);
-    // ### not cheching if zero-terminated
-
-    switch (*s->ptr) {
-    case 'y':
-    case 'b':
-    case 'n':
-    case 'q':
-    case 'i':
-    case 'u':
-    case 'x':
-    case 't':
-    case 'd':
-    case 's':
-    case 'o':
-    case 'g':
-    case 'h':
-        chopFirst(s);
-        return true;
-    case 'v':
-        if (!nest->beginVariant()) {
-            return false;
-        }
-        chopFirst(s);
-        nest->endVariant();
-        return true;
-    case '(': {
-        if (!nest->beginParen()) {
-            return false;
-        }
-        chopFirst(s);
-        bool isEmptyStruct = true;
-        while (parseSingleCompleteType(s, nest)) {
-            isEmptyStruct = false;
-        }
-        if (!s->length || *s->ptr != ')' || isEmptyStruct) {
-            return false;
-        }
-        chopFirst(s);
-        nest->endParen();
-        return true; }
-    case 'a':
-        if (!nest->beginArray()) {
-            return false;
-        }
-        chopFirst(s);
-        if (*s->ptr == '{') { // an "array of dict entries", i.e. a dict
-            if (!nest->beginParen() || s->length < 4) {
-                return false;
-            }
-            chopFirst(s);
-            // key must be a basic type
-            if (!parseBasicType(s)) {
-                return false;
-            }
-            // value can be any type
-            if (!parseSingleCompleteType(s, nest)) {
-                return false;
-            }
-            if (!s->length || *s->ptr != '}') {
-                return false;
-            }
-            chopFirst(s);
-            nest->endParen();
-        } else { // regular array
-            if (!parseSingleCompleteType(s, nest)) {
-                return false;
-            }
-        }
-        nest->endArray();
-        return true;
-    default:
-        return false;
-    }
+    return validation::isObjectPathElement(pathElement);
 }
 
 //static
 bool Arguments::isSignatureValid(cstring signature, SignatureType type)
 {
-    Nesting nest;
     if (!signature.ptr || signature.ptr[signature.length] != 0) {
         return false;
     }
-    if (type == VariantSignature) {
-        if (!signature.length) {
-            return false;
-        }
-        if (!parseSingleCompleteType(&signature, &nest)) {
-            return false;
-        }
-        if (signature.length) {
-            return false;
-        }
-    } else {
-        while (signature.length) {
-            if (!parseSingleCompleteType(&signature, &nest)) {
-                return false;
-            }
-        }
+    std::shared_ptr<const SignatureProgram> uncached;
+    const SignatureProgram *program = SignatureProgram::get(signature, &uncached);
+    if (!program) {
+        return false;
     }
-    // all aggregates must be closed at the end; if those asserts trigger the parsing code is not correct
-    assert(!nest.array);
-    assert(!nest.paren);
-    assert(!nest.variant);
-    return true;
+    return type != VariantSignature || program->completeTypeCount() == 1;
 }
 
 Arguments::Reader::Reader(const Arguments &al)
@@ -1004,6 +1015,22 @@ Arguments::Reader::Reader(const Message &msg)
     beginRead();
 }
 
+Arguments::Reader::Reader(const Arguments &al, cstring signature, uint32 signaturePosition,
+                          uint32 dataPosition)
+   : d(new Private),
+     m_state(NotStarted)
+{
+    d->m_args = &al;
+    VALID_IF(signature.ptr, Error::NotAttachedToArguments);
+    d->m_signature = signature;
+    d->m_data = al.d->m_data;
+    d->m_program = d->getProgram(d->m_signature);
+    VALID_IF(d->m_program, Error::InvalidSignature);
+    d->m_signaturePosition = signaturePosition - 1; // advanceState() increments it first
+    d->m_dataPosition = dataPosition;
+    advanceState();
+}
+
 Arguments::Reader::Reader(Reader &&other)
    : d(other.d),
      m_state(other.m_state),
@@ -1063,8 +1090,10 @@ void Arguments::Reader::beginRead()
     d->m_data = d->m_args->d->m_data;
     // as a slightly hacky optimizaton, we allow empty Argumentss to allocate no space for d->m_buffer.
     if (d->m_signature.length) {
-        VALID_IF(Arguments::isSignatureValid(d->m_signature), Error::InvalidSignature);
+        VALID_IF(d->m_signature.ptr[d->m_signature.length] == '\0', Error::InvalidSignature);
     }
+    d->m_program = d->getProgram(d->m_signature);
+    VALID_IF(d->m_program, Error::InvalidSignature);
     advanceState();
 }
 
@@ -1095,16 +1124,15 @@ cstring Arguments::Reader::currentSignature() const
 
 cstring Arguments::Reader::currentSingleCompleteTypeSignature() const
 {
-    const uint32 startingLength = d->m_signature.length - d->m_signaturePosition;
-    cstring sigCopy = { d->m_signature.ptr + d->m_signaturePosition, startingLength };
-    Nesting nest;
-    if (!parseSingleCompleteType(&sigCopy, &nest)) {
-        // the signature should have been validated before, but e.g. in Finished state this may happen
+    // e.g. in Finished state, there is no complete type at the current position
+    if (!d->m_program || d->m_signaturePosition >= d->m_signature.length) {
         return cstring();
     }
-    sigCopy.ptr = d->m_signature.ptr + d->m_signaturePosition;
-    sigCopy.length = startingLength - sigCopy.length;
-    return sigCopy;
+    const SignatureProgram::Instruction &ins = d->m_program->at(d->m_signaturePosition);
+    if (ins.state() == EndStruct || ins.state() == EndDict) {
+        return cstring();
+    }
+    return cstring(d->m_signature.ptr + d->m_signaturePosition, ins.end - d->m_signaturePosition);
 }
 
 void Arguments::Reader::replaceData(chunk data)
@@ -1135,62 +1163,6 @@ void Arguments::Reader::replaceData(chunk data)
     }
 }
 
-struct TypeInfo
-{
-    Arguments::IoState state() const { return static_cast<Arguments::IoState>(_state); }
-    byte _state;
-    byte alignment : 6;
-    bool isPrimitive : 1;
-    bool isString : 1;
-};
-
-static const TypeInfo &typeInfo(char letterCode)
-{
-    assert(letterCode >= '(');
-    static const TypeInfo low[2] = {
-        { Arguments::BeginStruct,  8, false, false }, // (
-        { Arguments::EndStruct,    1, false, false }  // )
-    };
-    if (letterCode <= ')') {
-        return low[letterCode - '('];
-    }
-    assert(letterCode >= 'a' && letterCode <= '}');
-    // entries for invalid letters are designed to be as inert as possible in the code using the data,
-    // which may make it possible to catch errors at a common point with less special case code.
-    static const TypeInfo high['}' - 'a' + 1] = {
-        { Arguments::BeginArray,   4, false, false }, // a
-        { Arguments::Boolean,      4, true,  false }, // b
-        { Arguments::InvalidData,  1, true,  false }, // c
-        { Arguments::Double,       8, true,  false }, // d
-        { Arguments::InvalidData,  1, true,  false }, // e
-        { Arguments::InvalidData,  1, true,  false }, // f
-        { Arguments::Signature,    1, false, true  }, // g
-        { Arguments::UnixFd,       4, true,  false }, // h
-        { Arguments::Int32,        4, true,  false }, // i
-        { Arguments::InvalidData,  1, true,  false }, // j
-        { Arguments::InvalidData,  1, true,  false }, // k
-        { Arguments::InvalidData,  1, true,  false }, // l
-        { Arguments::InvalidData,  1, true,  false }, // m
-        { Arguments::Int16,        2, true,  false }, // n
-        { Arguments::ObjectPath,   4, false, true  }, // o
-        { Arguments::InvalidData,  1, true,  false }, // p
-        { Arguments::Uint16,       2, true,  false }, // q
-        { Arguments::InvalidData,  1, true,  false }, // r
-        { Arguments::String,       4, false, true  }, // s
-        { Arguments::Uint64,       8, true,  false }, // t
-        { Arguments::Uint32,       4, true,  false }, // u
-        { Arguments::BeginVariant, 1, false, false }, // v
-        { Arguments::InvalidData,  1, true,  false }, // w
-        { Arguments::Int64,        8, true,  false }, // x
-        { Arguments::Byte,         1, true,  false }, // y
-        { Arguments::InvalidData,  1, true,  false }, // z
-        { Arguments::BeginDict,    8, false, false }, // {
-        { Arguments::InvalidData,  1, true,  false }, // |
-        { Arguments::EndDict,      1, false, false }  // }
-    };
-    return high[letterCode - 'a'];
-}
-
 static char letterForPrimitiveIoState(Arguments::IoState ios)
 {
     if (ios < Arguments::Boolean || ios > Arguments::Double) {
@@ -1243,9 +1215,11 @@ void Arguments::Reader::doReadPrimitiveType()
         m_u.Double = basic::readDouble(d->m_data.ptr + d->m_dataPosition, d->m_args->d->m_isByteSwapped);
         break;
     case UnixFd: {
-        uint32 index = basic::readUint32(d->m_data.ptr + d->m_dataPosition, d->m_args->d->m_isByteSwapped);
-        uint32 ret = index; // ### highly bogus; TODO use index to retrieve the actual file descriptor
-        m_u.Uint32 = ret;
+        const uint32 index = basic::readUint32(d->m_data.ptr + d->m_dataPosition,
+                                               d->m_args->d->m_isByteSwapped);
+        const std::vector<int> &fds = d->m_args->d->m_fileDescriptors;
+        VALID_IF(index < fds.size(), Error::InvalidUnixFd);
+        m_u.Uint32 = uint32(fds[index]);
         break; }
     default:
         assert(false);
@@ -1271,13 +1245,16 @@ void Arguments::Reader::doReadString(uint32 lengthPrefixSize)
     m_u.String.ptr = reinterpret_cast<char *>(d->m_data.ptr) + d->m_dataPosition;
     m_u.String.length = stringLength - 1; // terminating null is not counted
     d->m_dataPosition += stringLength;
+    const cstring str(m_u.String.ptr, m_u.String.length);
     bool isValidString = false;
-    if (m_state == String) {
-        isValidString = Arguments::isStringValid(cstring(m_u.String.ptr, m_u.String.length));
-    } else if (m_state == ObjectPath) {
-        isValidString = Arguments::isObjectPathValid(cstring(m_u.String.ptr, m_u.String.length));
-    } else if (m_state == Signature) {
-        isValidString = Arguments::isSignatureValid(cstring(m_u.String.ptr, m_u.String.length));
+    if (likely(str.ptr[str.length] == '\0')) {
+        if (m_state == String) {
+            isValidString = validation::isUtf8(str);
+        } else if (m_state == ObjectPath) {
+            isValidString = validation::isObjectPath(str);
+        } else if (m_state == Signature) {
+            isValidString = Arguments::isSignatureValid(str);
+        }
     }
     VALID_IF(isValidString, Error::MalformedMessageData);
 }
@@ -1370,7 +1347,7 @@ void Arguments::Reader::advanceState()
 
     // for aggregate types, ty.alignment is just the alignment.
     // for primitive types, it's also the actual size.
-    const TypeInfo ty = typeInfo(d->m_signature.ptr[d->m_signaturePosition]);
+    const SignatureProgram::Instruction &ty = d->m_program->at(d->m_signaturePosition);
     m_state = ty.state();
 
     VALID_IF(m_state != InvalidData, Error::MalformedMessageData);
@@ -1422,7 +1399,8 @@ void Arguments::Reader::advanceState()
 
     case BeginVariant: {
         cstring signature;
-        if (unlikely(d->m_nilArrayNesting)) {
+        const bool isNil = d->m_nilArrayNesting;
+        if (unlikely(isNil)) {
             static const char *emptyString = "";
             signature = cstring(emptyString, 0);
         } else {
@@ -1435,9 +1413,12 @@ void Arguments::Reader::advanceState()
             if (unlikely(d->m_dataPosition > d->m_data.length)) {
                 goto out_needMoreData;
             }
-            VALID_IF(Arguments::isSignatureValid(signature, Arguments::VariantSignature),
-                     Error::MalformedMessageData);
+            VALID_IF(signature.ptr[signature.length] == '\0', Error::MalformedMessageData);
         }
+        // the pending program is not part of the saved state, so it's fine to set it here
+        d->m_variantProgram = d->getProgram(signature);
+        VALID_IF(d->m_variantProgram && (isNil || d->m_variantProgram->completeTypeCount() == 1),
+                 Error::MalformedMessageData);
         // do not clobber nesting before potentially going to out_needMoreData!
         VALID_IF(d->m_nesting.beginVariant(), Error::MalformedMessageData);
 
@@ -1459,7 +1440,7 @@ void Arguments::Reader::advanceState()
             d->m_dataPosition += sizeof(uint32);
         }
 
-        const TypeInfo firstElementTy = typeInfo(d->m_signature.ptr[d->m_signaturePosition + 1]);
+        const SignatureProgram::Instruction &firstElementTy = d->m_program->at(d->m_signaturePosition + 1);
         m_state = firstElementTy.state() == BeginDict ? BeginDict : BeginArray;
 
         uint32 dataEnd = d->m_dataPosition;
@@ -1507,23 +1488,19 @@ out_needMoreData:
 
 void Arguments::Reader::skipArrayOrDictSignature(bool isDict)
 {
-    // Note that we cannot just pass a dummy Nesting instance to parseSingleCompleteType, it must
-    // actually check the nesting because an array may contain other nested aggregates. So we must
-    // compensate for the already raised nesting levels from BeginArray handling in advanceState().
+    // The nesting levels inside the array must still be checked, but the program knows them. Compensate
+    // for the already raised nesting levels from BeginArray handling in advanceState().
     d->m_nesting.endArray();
     if (isDict) {
         d->m_nesting.endParen();
-        // the Reader ad-hoc parsing code moved at ahead by one to skip the '{', but parseSingleCompleteType()
-        // needs to see the full dict signature, so fix it up
+        // the Reader ad-hoc parsing code moved at ahead by one to skip the '{', but we need the position
+        // of the 'a'
         d->m_signaturePosition--;
     }
 
-    // parse the full (i.e. starting with the 'a') array (or dict) signature in order to skip it -
-    // barring bugs, must have been too deep nesting inside variants if parsing fails
-    cstring remainingSig(d->m_signature.ptr + d->m_signaturePosition,
-                         d->m_signature.length - d->m_signaturePosition);
-    VALID_IF(parseSingleCompleteType(&remainingSig, &d->m_nesting), Error::MalformedMessageData);
-    d->m_signaturePosition = d->m_signature.length - remainingSig.length;
+    const SignatureProgram::Instruction &ins = d->m_program->at(d->m_signaturePosition);
+    VALID_IF(d->m_nesting.canContain(ins), Error::MalformedMessageData);
+    d->m_signaturePosition = ins.end;
 
     // Compensate for pre-increment in advanceState()
     d->m_signaturePosition--;
@@ -1532,7 +1509,6 @@ void Arguments::Reader::skipArrayOrDictSignature(bool isDict)
     if (isDict) {
         d->m_nesting.beginParen();
         // Compensate for code in advanceState() that kind of ignores the '}' at the end of a dict.
-        // Unlike advanceState(), parseSingleCompleteType() does properly parse that one.
         d->m_signaturePosition--;
     }
 }
@@ -1612,66 +1588,177 @@ static bool isAligned(uint32 value, uint32 alignment)
     return (value & (0x7u >> (3 - zeroBits))) == 0;
 }
 
-std::pair<Arguments::IoState, chunk> Arguments::Reader::readPrimitiveArray()
+Arguments::IoState Arguments::Reader::primitiveArrayType(uint32 *elementSize) const
 {
-    auto ret = std::make_pair(InvalidData, chunk());
-
     if (m_state != BeginArray) {
-        return ret;
+        return InvalidData;
     }
-
     // the point of "primitive array" accessors is that the data can be just memcpy()ed, so we
     // reject anything that needs validation, including booleans
-
-    const TypeInfo elementType = typeInfo(d->m_signature.ptr[d->m_signaturePosition + 1]);
+    const SignatureProgram::Instruction &elementType = d->m_program->at(d->m_signaturePosition + 1);
     if (!elementType.isPrimitive || elementType.state() == Boolean || elementType.state() == UnixFd) {
-        return ret;
+        return InvalidData;
     }
-    if (d->m_args->d->m_isByteSwapped && elementType.state() != Byte) {
-        return ret;
+    // does the end of data line up with the end of the last data element?
+    if (!isAligned(m_u.Uint32 - d->m_dataPosition, elementType.alignment)) {
+        return InvalidData;
     }
+    *elementSize = elementType.alignment;
+    return elementType.state();
+}
 
-    const uint32 size = m_u.Uint32 - d->m_dataPosition;
-    // does the end of data line up with the end of the last data element?
-    if (!isAligned(size, elementType.alignment)) {
+void Arguments::Reader::leaveFixedArray()
+{
+    // No need to change  d->m_nilArrayNesting - it can't be observed while "in" the current array
+    // move to the last letter of the element type, as if we'd just read the last element
+    d->m_signaturePosition = d->m_program->at(d->m_signaturePosition + 1).end - 1;
+    d->m_dataPosition = m_u.Uint32;
+    m_state = EndArray;
+    d->m_nesting.endArray();
+
+    // ... leave the array, there is nothing more to do in it
+    advanceState();
+}
+
+std::pair<Arguments::IoState, chunk> Arguments::Reader::readPrimitiveArray()
+{
+    auto ret = std::make_pair(InvalidData, chunk());
+
+    uint32 elementSize = 0;
+    const IoState type = primitiveArrayType(&elementSize);
+    if (type == InvalidData || (elementSize > 1 && d->m_args->d->m_isByteSwapped)) {
         return ret;
     }
+
+    const uint32 size = m_u.Uint32 - d->m_dataPosition;
     if (size) {
         ret.second.ptr = d->m_data.ptr + d->m_dataPosition;
         ret.second.length = size;
     }
-    // No need to change  d->m_nilArrayNesting - it can't be observed while "in" the current array
+    ret.first = type;
+    leaveFixedArray();
+    return ret;
+}
 
-    ret.first = elementType.state();
-    d->m_signaturePosition += 1;
-    d->m_dataPosition = m_u.Uint32;
-    m_state = EndArray;
-    d->m_nesting.endArray();
+std::pair<Arguments::IoState, uint32> Arguments::Reader::readPrimitiveArray(void *buffer,
+                                                                             uint32 bufferSize)
+{
+    auto ret = std::make_pair(InvalidData, uint32(0));
 
-    // ... leave the array, there is nothing more to do in it
-    advanceState();
+    uint32 elementSize = 0;
+    const IoState type = primitiveArrayType(&elementSize);
+    const uint32 size = primitiveArraySize();
+    if (type == InvalidData || size > bufferSize) {
+        return ret;
+    }
 
+    const byte *const src = d->m_data.ptr + d->m_dataPosition;
+    if (elementSize > 1 && d->m_args->d->m_isByteSwapped) {
+        byteswap::copySwapped(static_cast<byte *>(buffer), src, size / elementSize, elementSize);
+    } else if (size) {
+        memcpy(buffer, src, size);
+    }
+    ret.first = type;
+    ret.second = size;
+    leaveFixedArray();
     return ret;
 }
 
+uint32 Arguments::Reader::primitiveArraySize() const
+{
+    return m_state == BeginArray ? m_u.Uint32 - d->m_dataPosition : 0;
+}
+
+struct PaddingRange
+{
+    uint32 begin;
+    uint32 end;
+};
+
+// Computes the layout of elements of the type at program position begin, if it has fixed size.
+// padding receives the ranges of padding in an element, including the trailing padding up to stride.
+static bool fixedArrayLayout(const SignatureProgram *program, uint32 begin, Arguments::FixedArray *array,
+                             std::vector<PaddingRange> *padding)
+{
+    const SignatureProgram::Instruction &element = program->at(begin);
+    if (!element.isFixedSize || element.state() == Arguments::BeginDict) {
+        return false;
+    }
+    array->fields.clear();
+    padding->clear();
+    uint32 offset = 0;
+    for (uint32 i = begin; i < element.end; i++) {
+        const SignatureProgram::Instruction &ins = program->at(i);
+        if (ins.state() == Arguments::Boolean || ins.state() == Arguments::UnixFd) {
+            return false;
+        }
+        const uint32 fieldBegin = align(offset, ins.alignment);
+        if (fieldBegin != offset) {
+            padding->push_back(PaddingRange{ offset, fieldBegin });
+        }
+        offset = fieldBegin;
+        if (ins.isPrimitive) {
+            array->fields.push_back(Arguments::FixedArray::Field{ ins.state(), offset });
+            offset += ins.alignment;
+        }
+    }
+    assert(offset == element.fixedSize);
+    array->elementSignature = cstring(program->signature().ptr + begin, element.end - begin);
+    array->elementSize = offset;
+    array->stride = align(offset, element.alignment);
+    if (array->stride != offset) {
+        padding->push_back(PaddingRange{ offset, array->stride });
+    }
+    return true;
+}
+
+bool Arguments::Reader::readFixedArray(FixedArray *array)
+{
+    if (m_state != BeginArray || d->m_args->d->m_isByteSwapped) {
+        return false;
+    }
+    std::vector<PaddingRange> padding;
+    if (!fixedArrayLayout(d->m_program, d->m_signaturePosition + 1, array, &padding)) {
+        return false;
+    }
+    const uint32 size = m_u.Uint32 - d->m_dataPosition;
+    // the last element has no trailing padding
+    if (size && (size < array->elementSize || (size - array->elementSize) % array->stride)) {
+        return false;
+    }
+    const byte *const data = d->m_data.ptr + d->m_dataPosition;
+    array->count = size ? (size - array->elementSize) / array->stride + 1 : 0;
+    if (!padding.empty()) {
+        for (uint32 i = 0; i < array->count; i++) {
+            const byte *const elementData = data + i * array->stride;
+            for (const PaddingRange &range : padding) {
+                // the range past the end of the last element is not in the data
+                if (i * array->stride + range.begin < size &&
+                    !validation::isZero(elementData + range.begin, range.end - range.begin)) {
+                    return false;
+                }
+            }
+        }
+    }
+    array->data = size ? chunk(const_cast<byte *>(data), size) : chunk();
+    leaveFixedArray();
+    return true;
+}
+
 Arguments::IoState Arguments::Reader::peekPrimitiveArray(EmptyArrayOption option) const
 {
-    // almost duplicated from readPrimitiveArray(), so keep it in sync
     if (m_state != BeginArray) {
         return InvalidData;
     }
-    const uint32 arrayLength = m_u.Uint32 - d->m_dataPosition;
-    if (option == SkipIfEmpty && !arrayLength) {
-        return BeginArray;
-    }
-    const TypeInfo elementType = typeInfo(d->m_signature.ptr[d->m_signaturePosition + 1]);
-    if (!elementType.isPrimitive || elementType.state() == Boolean || elementType.state() == UnixFd) {
+    if (option == SkipIfEmpty && !primitiveArraySize()) {
         return BeginArray;
     }
-    if (d->m_args->d->m_isByteSwapped && elementType.state() != Byte) {
+    uint32 elementSize = 0;
+    const IoState type = primitiveArrayType(&elementSize);
+    if (type == InvalidData || (elementSize > 1 && d->m_args->d->m_isByteSwapped)) {
         return BeginArray;
     }
-    return elementType.state();
+    return type;
 }
 
 bool Arguments::Reader::beginDict(EmptyArrayOption option)
@@ -1804,9 +1891,11 @@ void Arguments::Reader::beginVariant()
     variantInfo.prevSignature.ptr = d->m_signature.ptr;
     variantInfo.prevSignature.length = d->m_signature.length;
     variantInfo.prevSignaturePosition = d->m_signaturePosition;
+    variantInfo.prevProgram = d->m_program;
     d->m_aggregateStack.push_back(aggregateInfo);
     d->m_signature.ptr = m_u.String.ptr;
     d->m_signature.length = m_u.String.length;
+    d->m_program = d->m_variantProgram;
     d->m_signaturePosition = uint32(-1); // we increment d->m_signaturePosition before reading a char
 
     advanceState();
@@ -1832,6 +1921,11 @@ void Arguments::Reader::endVariant()
     d->m_signature.ptr = variantInfo.prevSignature.ptr;
     d->m_signature.length = variantInfo.prevSignature.length;
     d->m_signaturePosition = variantInfo.prevSignaturePosition;
+    if (unlikely(!d->m_program->isInterned())) {
+        assert(d->m_uncachedPrograms.back().get() == d->m_program);
+        d->m_uncachedPrograms.pop_back();
+    }
+    d->m_program = variantInfo.prevProgram;
     d->m_aggregateStack.pop_back();
 
     advanceState();
@@ -1984,6 +2078,8 @@ Arguments::IoState Arguments::Reader::currentAggregate() const
 }
 
 Arguments::Writer::Private::Private(const Private &other)
+   : m_data(m_initialDataBuffer),
+     m_variantSignatures(nullptr)
 {
     *this = other;
 }
@@ -1995,21 +2091,24 @@ void Arguments::Writer::Private::operator=(const Private &other)
         return;
     }
 
-    m_dataElementsCountBeforeNilArray = other.m_dataElementsCountBeforeNilArray;
-    m_dataPositionBeforeNilArray = other.m_dataPositionBeforeNilArray;
-
-    // Arguments m_args can only be default initialized empty or moved-from, in both cases
-    // copying it is okay and fairly cheap.
-    m_args = other.m_args;
+    // Arguments m_args can only be default initialized empty or moved-from. finish() changes its
+    // Private, so it must not be shared with other's.
+    if (other.m_args.d) {
+        m_args = Arguments();
+    } else {
+        Arguments movedFrom = std::move(m_args);
+    }
 
     m_nesting = other.m_nesting;
-    m_signature.ptr = other.m_signature.ptr; // ### still needs adjustment, done after allocating m_data
     m_signature.length = other.m_signature.length;
     m_signaturePosition = other.m_signaturePosition;
-    m_variantSignaturesWastedSpace = other.m_variantSignaturesWastedSpace;
 
+    if (m_data != m_initialDataBuffer) {
+        free(m_data);
+    }
     m_dataCapacity = other.m_dataCapacity;
     m_dataPosition = other.m_dataPosition;
+    m_dataStart = other.m_dataStart;
     // handle *m_data and the data it's pointing to
     if (m_dataCapacity == InitialDataCapacity) {
         m_data = m_initialDataBuffer;
@@ -2017,15 +2116,383 @@ void Arguments::Writer::Private::operator=(const Private &other)
         m_data = reinterpret_cast<byte *>(malloc(m_dataCapacity));
     }
     memcpy(m_data, other.m_data, m_dataPosition);
-    m_signature.ptr += m_data - other.m_data;
+
+    free(m_variantSignatures);
+    m_variantSignatures = nullptr;
+    m_variantSignaturesCapacity = 0;
+    if (m_nesting.variant) {
+        signatureStorage(m_nesting.variant);
+        memcpy(m_variantSignatures, other.m_variantSignatures, m_nesting.variant * MaxFullSignatureLength);
+    }
+    m_signature.ptr = signatureStorage(m_nesting.variant);
 
     m_nilArrayNesting = other.m_nilArrayNesting;
     m_error = other.m_error;
 
-    m_variantSignatures = other.m_variantSignatures;
+    closeFds(&m_fileDescriptors);
+    for (int fd : other.m_fileDescriptors) {
+        m_fileDescriptors.push_back(duplicateFd(fd));
+    }
 
     m_aggregateStack = other.m_aggregateStack;
-    m_elements = other.m_elements;
+}
+
+char *Arguments::Writer::Private::signatureStorage(uint32 level)
+{
+    if (!level) {
+        return reinterpret_cast<char *>(m_data) + 1;
+    }
+    if (level > m_variantSignaturesCapacity) {
+        m_variantSignaturesCapacity = std::max(level, std::max(m_variantSignaturesCapacity * 2, uint32(4)));
+        m_variantSignatures = reinterpret_cast<byte *>(realloc(m_variantSignatures,
+                                                  m_variantSignaturesCapacity * MaxFullSignatureLength));
+    }
+    // reserve a byte for length prefix
+    return reinterpret_cast<char *>(m_variantSignatures) + (level - 1) * MaxFullSignatureLength + 1;
+}
+
+bool Arguments::Writer::Private::finishVariant(uint32 variantStart, cstring signature)
+{
+    // In beginVariant(), we made room for a one-letter signature, which is by far the most common
+    // case. Otherwise we have to move the contents. If the contents' alignment requirements allow,
+    // we can simply move the block. Otherwise, alignment padding in the contents changes and they
+    // must be rewritten.
+    const uint32 guessedContentsStart = variantStart + 3;
+    const uint32 contentsStart = variantStart + signature.length + 2;
+    if (contentsStart != guessedContentsStart) {
+        assert(contentsStart > guessedContentsStart);
+        std::shared_ptr<const SignatureProgram> uncached;
+        const SignatureProgram *program = SignatureProgram::get(signature, &uncached);
+        if (!program) {
+            assert(false); // we have checked everything while writing
+            return false;
+        }
+        const uint32 shift = contentsStart - guessedContentsStart;
+        if (isAligned(shift, program->maxAlignment())) {
+            reserveData(m_dataPosition + shift);
+            memmove(m_data + contentsStart, m_data + guessedContentsStart, m_dataPosition - guessedContentsStart);
+            m_dataPosition += shift;
+        } else {
+            // copy with the same alignment as the source position
+            const uint32 srcBase = guessedContentsStart & ~uint32(7);
+            const uint32 srcLength = m_dataPosition - srcBase;
+            byte *src = reinterpret_cast<byte *>(malloc(srcLength));
+            memcpy(src, m_data + srcBase, srcLength);
+
+            uint32 srcPos = guessedContentsStart - srcBase;
+            uint32 signaturePosition = 0;
+            m_dataPosition = contentsStart;
+            const bool ok = relayoutElement(src, &srcPos, program, &signaturePosition);
+            assert(!ok || srcPos == srcLength);
+            free(src);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    m_data[variantStart] = byte(signature.length);
+    memcpy(m_data + variantStart + 1, signature.ptr, signature.length);
+    m_data[variantStart + 1 + signature.length] = '\0';
+    return true;
+}
+
+// Copies one single complete type from src to the end of m_data, with alignment padding as needed at
+// the new position. src contains data written by us, so it is not validated.
+bool Arguments::Writer::Private::relayoutElement(const byte *src, uint32 *srcPos,
+                                                 const SignatureProgram *program, uint32 *signaturePosition)
+{
+    const SignatureProgram::Instruction &ty = program->at((*signaturePosition)++);
+    if (ty.isPrimitive || ty.isString) {
+        *srcPos = align(*srcPos, ty.alignment);
+        uint32 size = ty.alignment;
+        if (ty.isString) {
+            // length prefix + string + null terminator
+            const uint32 length = ty.alignment == 1 ? src[*srcPos] : basic::readUint32(src + *srcPos, false);
+            size += length + 1;
+        }
+        alignData(ty.alignment, size);
+        memcpy(m_data + m_dataPosition, src + *srcPos, size);
+        m_dataPosition += size;
+        *srcPos += size;
+        return true;
+    }
+
+    switch (ty.state()) {
+    case BeginVariant: {
+        const uint32 length = src[*srcPos] + 2; // + length prefix and null terminator
+        reserveData(m_dataPosition + length);
+        memcpy(m_data + m_dataPosition, src + *srcPos, length);
+        m_dataPosition += length;
+        const cstring innerSignature(reinterpret_cast<const char *>(src) + *srcPos + 1, length - 2);
+        *srcPos += length;
+        std::shared_ptr<const SignatureProgram> uncached;
+        const SignatureProgram *innerProgram = SignatureProgram::get(innerSignature, &uncached);
+        if (!innerProgram) {
+            assert(false);
+            return false;
+        }
+        uint32 innerSignaturePosition = 0;
+        return relayoutElement(src, srcPos, innerProgram, &innerSignaturePosition); }
+    case BeginStruct:
+    case BeginDict: {
+        *srcPos = align(*srcPos, structAlignment);
+        alignData(structAlignment, 0);
+        const uint32 end = ty.end - 1; // position of the closing ')' or '}'
+        while (*signaturePosition < end) {
+            if (!relayoutElement(src, srcPos, program, signaturePosition)) {
+                return false;
+            }
+        }
+        (*signaturePosition)++;
+        return true; }
+    case BeginArray: {
+        *srcPos = align(*srcPos, 4);
+        const uint32 srcLength = basic::readUint32(src + *srcPos, false);
+        *srcPos += sizeof(uint32);
+        alignData(4, sizeof(uint32));
+        const uint32 lengthFieldPosition = m_dataPosition;
+        m_dataPosition += sizeof(uint32);
+
+        const uint32 elementAlignment = program->at(*signaturePosition).alignment;
+        *srcPos = align(*srcPos, elementAlignment);
+        alignData(elementAlignment, srcLength);
+        const uint32 dataStart = m_dataPosition;
+
+        const uint32 srcEnd = *srcPos + srcLength;
+        const uint32 elementSignaturePosition = *signaturePosition;
+        *signaturePosition = ty.end;
+        while (*srcPos < srcEnd) {
+            uint32 pos = elementSignaturePosition;
+            if (!relayoutElement(src, srcPos, program, &pos)) {
+                return false;
+            }
+        }
+        const uint32 length = m_dataPosition - dataStart;
+        if (length > SpecMaxArrayLength) {
+            m_error.setCode(Error::ArrayOrDictTooLong);
+            return false;
+        }
+        basic::writeUint32(m_data + lengthFieldPosition, length);
+        return true; }
+    default:
+        assert(false);
+        return false;
+    }
+}
+
+// Writes a minimal value of the single complete type at *signaturePosition, which sets up the
+// signature and the framing of aggregates for copyAggregateRaw()
+static void writeSkeleton(Arguments::Writer *writer, const SignatureProgram *program,
+                          uint32 *signaturePosition)
+{
+    const SignatureProgram::Instruction &ins = program->at(*signaturePosition);
+    switch (ins.state()) {
+    case Arguments::Byte:
+        writer->writeByte(0);
+        break;
+    case Arguments::Boolean:
+        writer->writeBoolean(false);
+        break;
+    case Arguments::Int16:
+        writer->writeInt16(0);
+        break;
+    case Arguments::Uint16:
+        writer->writeUint16(0);
+        break;
+    case Arguments::Int32:
+        writer->writeInt32(0);
+        break;
+    case Arguments::Uint32:
+        writer->writeUint32(0);
+        break;
+    case Arguments::Int64:
+        writer->writeInt64(0);
+        break;
+    case Arguments::Uint64:
+        writer->writeUint64(0);
+        break;
+    case Arguments::Double:
+        writer->writeDouble(0.0);
+        break;
+    case Arguments::String:
+        writer->writeString(cstring(""));
+        break;
+    case Arguments::ObjectPath:
+        writer->writeObjectPath(cstring("/"));
+        break;
+    case Arguments::Signature:
+        writer->writeSignature(cstring(""));
+        break;
+    case Arguments::UnixFd:
+        writer->writeUnixFd(0);
+        break;
+    case Arguments::BeginVariant:
+        writer->beginVariant();
+        writer->writeByte(0);
+        writer->endVariant();
+        break;
+    case Arguments::BeginStruct: {
+        writer->beginStruct();
+        const uint32 end = ins.end - 1; // position of the closing ')'
+        uint32 pos = *signaturePosition + 1;
+        while (pos < end) {
+            writeSkeleton(writer, program, &pos);
+        }
+        writer->endStruct();
+        break; }
+    case Arguments::BeginArray: {
+        uint32 pos = *signaturePosition + 1;
+        if (program->at(pos).state() == Arguments::BeginDict) {
+            writer->beginDict(Arguments::Writer::WriteTypesOfEmptyArray);
+#ifdef WITH_DICT_ENTRY
+            writer->beginDictEntry();
+#endif
+            pos++; // skip '{'
+            writeSkeleton(writer, program, &pos);
+            writeSkeleton(writer, program, &pos);
+#ifdef WITH_DICT_ENTRY
+            writer->endDictEntry();
+#endif
+            writer->endDict();
+        } else {
+            writer->beginArray(Arguments::Writer::WriteTypesOfEmptyArray);
+            writeSkeleton(writer, program, &pos);
+            writer->endArray();
+        }
+        break; }
+    default:
+        assert(false);
+        break;
+    }
+    *signaturePosition = ins.end;
+}
+
+bool Arguments::Writer::copyAggregateRaw(Reader *reader)
+{
+    Reader::Private *const rd = reader->d;
+    const IoState state = reader->m_state;
+    // Unix fd indexes would need to be renumbered for the destination
+    if (m_state == InvalidData || rd->m_args->d->m_isByteSwapped || rd->m_nilArrayNesting ||
+        d->m_nilArrayNesting || !rd->m_args->d->m_fileDescriptors.empty()) {
+        return false;
+    }
+    // Anything that was within the nesting limits in the source must be within them here, too.
+    // The reader has already entered the aggregate in its nesting counters.
+    const uint32 arrays = state == BeginArray || state == BeginDict ? 1 : 0;
+    const uint32 parens = state == BeginStruct || state == BeginDict ? 1 : 0;
+    const uint32 variants = state == BeginVariant ? 1 : 0;
+    if (d->m_nesting.array + arrays > rd->m_nesting.array ||
+        d->m_nesting.paren + parens > rd->m_nesting.paren ||
+        d->m_nesting.variant + variants > rd->m_nesting.variant) {
+        return false;
+    }
+
+    const SignatureProgram *const program = rd->m_program;
+    const uint32 signaturePosition = rd->m_signaturePosition;
+    // Only the offsets of the source and destination need to agree modulo the largest alignment in
+    // the contents, then all padding comes out the same.
+    uint32 srcBegin = 0;
+    uint32 srcEnd = 0;
+    bool isCompatible = true;
+    if (state == BeginStruct) {
+        srcBegin = rd->m_dataPosition; // both sides 8 byte aligned
+    } else if (state == BeginVariant) {
+        srcBegin = reinterpret_cast<const byte *>(reader->m_u.String.ptr) - rd->m_data.ptr - 1;
+        isCompatible = isAligned(srcBegin - d->m_dataPosition, rd->m_variantProgram->maxAlignment());
+    } else {
+        srcBegin = rd->m_dataPosition;
+        srcEnd = reader->m_u.Uint32;
+        if (srcEnd == srcBegin) {
+            return false; // empty arrays are about as fast either way
+        }
+        const uint32 elementBegin = signaturePosition + 1;
+        const uint32 elementEnd = program->at(signaturePosition).end;
+        uint32 maxAlignment = 1;
+        for (uint32 i = elementBegin; i < elementEnd; i++) {
+            const SignatureProgram::Instruction &ins = program->at(i);
+            maxAlignment = std::max(maxAlignment, ins.state() == BeginVariant ? 8u : uint32(ins.alignment));
+        }
+        const uint32 dstBegin = align(align(d->m_dataPosition, 4) + sizeof(uint32),
+                                      program->at(elementBegin).alignment);
+        isCompatible = isAligned(srcBegin - dstBegin, maxAlignment);
+    }
+    if (!isCompatible) {
+        return false;
+    }
+
+    // Validate the aggregate by reading it, which is still cheaper than reading and writing every
+    // element. Fixed size arrays and uninteresting data inside arrays are checked in one step.
+    uint32 depth = 0;
+    do {
+        switch (reader->m_state) {
+        case BeginStruct:
+            reader->beginStruct();
+            depth++;
+            break;
+        case BeginVariant:
+            reader->beginVariant();
+            depth++;
+            break;
+        case BeginArray: {
+            FixedArray fixedArray;
+            if (!reader->readFixedArray(&fixedArray)) {
+                reader->beginArray(Reader::ReadTypesOnlyIfEmpty);
+                depth++;
+            }
+            break; }
+        case BeginDict:
+            reader->beginDict(Reader::ReadTypesOnlyIfEmpty);
+            depth++;
+            break;
+        case EndStruct:
+        case EndVariant:
+        case EndArray:
+        case EndDict:
+            if (depth == 1 && state != BeginArray && state != BeginDict) {
+                srcEnd = rd->m_dataPosition;
+            }
+            if (reader->m_state == EndStruct) {
+                reader->endStruct();
+            } else if (reader->m_state == EndVariant) {
+                reader->endVariant();
+            } else if (reader->m_state == EndArray) {
+                reader->endArray();
+            } else {
+                reader->endDict();
+            }
+            depth--;
+            break;
+        case InvalidData:
+        case NeedMoreData:
+        case Finished:
+            // Bad data - nothing to copy. The reader's state tells the caller.
+            return true;
+        default:
+            reader->skipCurrentElement();
+            break;
+        }
+    } while (depth);
+
+    // Let the public API take care of the signature and the aggregate framing, then fill in the data
+    const uint32 dataBegin = d->m_dataPosition;
+    uint32 skeletonSignaturePosition = signaturePosition;
+    writeSkeleton(this, program, &skeletonSignaturePosition);
+    if (m_state == InvalidData) {
+        return true;
+    }
+    const uint32 length = srcEnd - srcBegin;
+    uint32 dstBegin = dataBegin;
+    if (state == BeginStruct) {
+        dstBegin = align(dataBegin, structAlignment);
+    } else if (state != BeginVariant) {
+        // the empty array's length field is followed by the padding for the first element
+        dstBegin = d->m_dataPosition;
+        basic::writeUint32(d->m_data + align(dataBegin, 4), length);
+    }
+    d->reserveData(dstBegin + length);
+    memcpy(d->m_data + dstBegin, rd->m_data.ptr + srcBegin, length);
+    d->m_dataPosition = dstBegin + length;
+    return true;
 }
 
 Arguments::Writer::Writer()
@@ -2034,6 +2501,15 @@ Arguments::Writer::Writer()
 {
 }
 
+Arguments::Writer::Writer(uint32 headerSpace)
+   : d(new(allocCaches.writerPrivate.allocate()) Private),
+     m_state(AnyData)
+{
+    d->m_dataStart = Private::MaxFullSignatureLength + align(headerSpace, 8);
+    d->m_dataPosition = d->m_dataStart;
+    d->reserveData(d->m_dataStart);
+}
+
 Arguments::Writer::Writer(Writer &&other)
    : d(other.d),
      m_state(other.m_state),
@@ -2086,6 +2562,8 @@ Arguments::Writer::~Writer()
         free(d->m_data);
     }
     d->m_data = nullptr;
+    free(d->m_variantSignatures);
+    closeFds(&d->m_fileDescriptors);
     d->~Private();
     allocCaches.writerPrivate.free(d);
     d = nullptr;
@@ -2120,9 +2598,8 @@ cstring Arguments::Writer::currentSignature() const
 
 void Arguments::Writer::doWritePrimitiveType(IoState type, uint32 alignAndSize)
 {
-    d->m_dataPosition = align(d->m_dataPosition, alignAndSize);
+    d->alignData(alignAndSize, alignAndSize);
     const uint32 newDataPosition = d->m_dataPosition + alignAndSize;
-    d->reserveData(newDataPosition);
 
     switch(type) {
     case Boolean: {
@@ -2154,7 +2631,14 @@ void Arguments::Writer::doWritePrimitiveType(IoState type, uint32 alignAndSize)
         basic::writeDouble(d->m_data + d->m_dataPosition, m_u.Double);
         break;
     case UnixFd: {
-        uint32 index = 0; // TODO = index of the FD we actually want to send
+        uint32 index = 0;
+        // data inside empty arrays is thrown away, so there is nothing to send
+        if (likely(!d->m_nilArrayNesting)) {
+            const int fd = duplicateFd(int(m_u.Uint32));
+            VALID_IF(fd >= 0, Error::InvalidUnixFd);
+            index = d->m_fileDescriptors.size();
+            d->m_fileDescriptors.push_back(fd);
+        }
         basic::writeUint32(d->m_data + d->m_dataPosition, index);
         break; }
     default:
@@ -2163,7 +2647,6 @@ void Arguments::Writer::doWritePrimitiveType(IoState type, uint32 alignAndSize)
     }
 
     d->m_dataPosition = newDataPosition;
-    d->m_elements.push_back(Private::ElementInfo(alignAndSize, alignAndSize));
 }
 
 void Arguments::Writer::doWriteString(IoState type, uint32 lengthPrefixSize)
@@ -2179,9 +2662,8 @@ void Arguments::Writer::doWriteString(IoState type, uint32 lengthPrefixSize)
                  Error::InvalidSignature);
     }
 
-    d->m_dataPosition = align(d->m_dataPosition, lengthPrefixSize);
+    d->alignData(lengthPrefixSize, lengthPrefixSize + m_u.String.length + 1);
     const uint32 newDataPosition = d->m_dataPosition + lengthPrefixSize + m_u.String.length + 1;
-    d->reserveData(newDataPosition);
 
     if (lengthPrefixSize == 1) {
         d->m_data[d->m_dataPosition] = m_u.String.length;
@@ -2189,15 +2671,9 @@ void Arguments::Writer::doWriteString(IoState type, uint32 lengthPrefixSize)
         basic::writeUint32(d->m_data + d->m_dataPosition, m_u.String.length);
     }
     d->m_dataPosition += lengthPrefixSize;
-    d->m_elements.push_back(Private::ElementInfo(lengthPrefixSize, lengthPrefixSize));
 
     memcpy(d->m_data + d->m_dataPosition, m_u.String.ptr, m_u.String.length + 1);
     d->m_dataPosition = newDataPosition;
-    for (uint32 l = m_u.String.length + 1; l; ) {
-        uint32 chunkSize = std::min(l, uint32(Private::ElementInfo::LargestSize));
-        d->m_elements.push_back(Private::ElementInfo(1, chunkSize));
-        l -= chunkSize;
-    }
 }
 
 void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState)
@@ -2212,9 +2688,8 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
     //    of final data stream size - due to alignment padding, a variant signature longer by one can
     //    cause an up to seven bytes longer message. in other cases it won't change message length at all.)
     // - increase size of data buffer when it gets too small
-    // - store information about variants and arrays, in order to:
-    //   - know what the final binary message size will be
-    //   - in finish(), create the final data stream with inline variant signatures and array lengths
+    // - write data in its final form: fill in array lengths when arrays end, insert variant
+    //   signatures when variants end
 
     if (unlikely(m_state == InvalidData)) {
         return;
@@ -2308,7 +2783,7 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
                 // Start the next dict entry
                 d->m_nesting.parenCount += 1;
                 // align to dict entry
-                d->m_elements.push_back(Private::ElementInfo(structAlignment, 0));
+                d->alignData(structAlignment, 0);
                 d->m_signaturePosition = aggregateInfo.arr.containedTypeBegin;
                 isWritingSignature = false;
                 m_state = DictKey;
@@ -2363,11 +2838,6 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
         // allowed to be garbage) is not validated and no wild pointer is dereferenced.
         if (likely(!d->m_nilArrayNesting)) {
             doWriteString(newState, alignment);
-        } else {
-            // The code that ensures that even empty arrays respect the alignment of their contents
-            // expects *some* kind of data element in the array. Since a string after an array length
-            // field can never change the alignment, just add something that does nothing.
-            d->m_elements.push_back(Private::ElementInfo(1, 0));
         }
         return;
     }
@@ -2381,7 +2851,7 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
         aggregateInfo.sct.containedTypeBegin = d->m_signaturePosition;
         d->m_aggregateStack.reserve(8);
         d->m_aggregateStack.push_back(aggregateInfo);
-        d->m_elements.push_back(Private::ElementInfo(alignment, 0)); // align only
+        d->alignData(alignment, 0);
         break;
     case EndStruct:
         d->m_nesting.endParen();
@@ -2398,22 +2868,20 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
         aggregateInfo.aggregateType = BeginVariant;
 
         Private::VariantInfo &variantInfo = aggregateInfo.var;
-        variantInfo.prevSignatureOffset = uint32(reinterpret_cast<byte *>(d->m_signature.ptr) - d->m_data);
         d->m_signature.ptr[-1] = byte(d->m_signature.length);
         variantInfo.prevSignaturePosition = d->m_signaturePosition;
+        variantInfo.dataStart = d->m_dataPosition;
 
         d->m_aggregateStack.reserve(8);
         d->m_aggregateStack.push_back(aggregateInfo);
 
-        // arrange for finish() to take a signature from d->m_variantSignatures
-        d->m_elements.push_back(Private::ElementInfo(1, Private::ElementInfo::VariantSignature));
-
-        const uint32 newDataPosition = d->m_dataPosition + Private::MaxFullSignatureLength;
-        d->reserveData(newDataPosition);
-        // allocate new signature in the data buffer, reserve one byte for length prefix
-        d->m_signature.ptr = reinterpret_cast<char *>(d->m_data) + d->m_dataPosition + 1;
+        d->m_signature.ptr = d->signatureStorage(d->m_nesting.variant);
         d->m_signature.length = 0;
         d->m_signaturePosition = 0;
+
+        // leave room for length prefix, a one-letter signature and null terminator; see finishVariant()
+        const uint32 newDataPosition = d->m_dataPosition + 3;
+        d->reserveData(newDataPosition);
         d->m_dataPosition = newDataPosition;
         break; }
     case EndVariant: {
@@ -2428,14 +2896,15 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
             // do with the wire format)
             VALID_IF(d->m_signaturePosition > 0, Error::EmptyVariant);
             assert(d->m_signaturePosition <= MaxSignatureLength); // should have been caught earlier
-            d->m_variantSignaturesWastedSpace += -1 // we don't store the null terminator but output does
-                + Private::MaxFullSignatureLength - d->m_signaturePosition;
+            VALID_IF(d->finishVariant(aggregateInfo.var.dataStart,
+                                      cstring(d->m_signature.ptr, d->m_signaturePosition)),
+                     Error::ArrayOrDictTooLong);
         }
-        d->m_signature.ptr[-1] = byte(d->m_signaturePosition);
+        // else the data is going to be discarded at the end of the outermost nil array
 
         Private::VariantInfo &variantInfo = aggregateInfo.var;
-        d->m_signature.ptr = reinterpret_cast<char *>(d->m_data) + variantInfo.prevSignatureOffset;
-        d->m_signature.length = d->m_signature.ptr[-1];
+        d->m_signature.ptr = d->signatureStorage(d->m_nesting.variant);
+        d->m_signature.length = byte(d->m_signature.ptr[-1]);
         d->m_signaturePosition = variantInfo.prevSignaturePosition;
         d->m_aggregateStack.pop_back();
         break; }
@@ -2451,9 +2920,12 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
         aggregateInfo.aggregateType = newState;
         aggregateInfo.arr.containedTypeBegin = d->m_signaturePosition;
 
-        d->m_elements.push_back(Private::ElementInfo(4, Private::ElementInfo::ArrayLengthField));
+        // reserve the length field
+        d->alignData(4, sizeof(uint32));
+        aggregateInfo.arr.lengthFieldPosition = d->m_dataPosition;
+        d->m_dataPosition += sizeof(uint32);
         if (newState == BeginDict) {
-            d->m_elements.push_back(Private::ElementInfo(structAlignment, 0)); // align to dict entry
+            d->alignData(structAlignment, 0); // align to dict entry
 #ifdef WITH_DICT_ENTRY
             m_state = BeginDictEntry;
             aggregateInfo.arr.dictEntryState = Private::RequireBeginDictEntry;
@@ -2479,21 +2951,25 @@ void Arguments::Writer::advanceState(cstring signatureFragment, IoState newState
         VALID_IF(d->m_signaturePosition >= aggregateInfo.arr.containedTypeBegin + (isDict ? 3 : 1),
                  Error::TooFewTypesInArrayOrDict);
         d->m_aggregateStack.pop_back();
+
+        // Even empty arrays contain the alignment padding for the first element
+        const uint32 elementAlignment = isDict ? structAlignment
+                        : typeInfo(d->m_signature.ptr[aggregateInfo.arr.containedTypeBegin]).alignment;
+        const uint32 lengthFieldPosition = aggregateInfo.arr.lengthFieldPosition;
+        const uint32 dataStart = align(lengthFieldPosition + sizeof(uint32), elementAlignment);
         if (unlikely(d->m_nilArrayNesting)) {
             if (--d->m_nilArrayNesting == 0) {
-                assert(d->m_elements.begin() + d->m_dataElementsCountBeforeNilArray <= d->m_elements.end());
-                d->m_elements.erase(d->m_elements.begin() + d->m_dataElementsCountBeforeNilArray,
-                                    d->m_elements.end());
-                assert((d->m_elements.end() - 2)->size == Private::ElementInfo::ArrayLengthField);
-                // align, but don't have actual data for the first element
-                d->m_elements.back().size = 0;
-                d->m_dataPosition = d->m_dataPositionBeforeNilArray;
+                // throw away the data that was only written to determine the types
+                d->m_dataPosition = lengthFieldPosition + sizeof(uint32);
+                d->alignData(elementAlignment, 0);
+                basic::writeUint32(d->m_data + lengthFieldPosition, 0);
             }
+        } else {
+            assert(d->m_dataPosition >= dataStart);
+            const uint32 arrayLength = d->m_dataPosition - dataStart;
+            VALID_IF(arrayLength <= SpecMaxArrayLength, Error::ArrayOrDictTooLong);
+            basic::writeUint32(d->m_data + lengthFieldPosition, arrayLength);
         }
-
-        // ### not checking array size here, it may change by a few bytes in the final data stream
-        //     due to alignment changes from a different start address
-        d->m_elements.push_back(Private::ElementInfo(1, Private::ElementInfo::ArrayLengthEndMark));
         break; }
 #ifdef WITH_DICT_ENTRY
     case BeginDictEntry:
@@ -2521,10 +2997,6 @@ void Arguments::Writer::beginArrayOrDict(IoState beginWhat, ArrayOption option)
                     // The code is a slightly modified version of code below under: if (isEmpty) {
                     if (!d->m_nilArrayNesting) {
                         d->m_nilArrayNesting = 1;
-                        d->m_dataElementsCountBeforeNilArray = d->m_elements.size() + 2; // +2 as below
-                        // Now correct for the elements already added in advanceState() with BeginArray / BeginDict
-                        d->m_dataElementsCountBeforeNilArray -= (beginWhat == BeginDict) ? 2 : 1;
-                        d->m_dataPositionBeforeNilArray = d->m_dataPosition;
                     } else {
                         // The array may be implicitly nil (so our poor API client doesn't notice) because
                         // an array below in the aggregate stack is nil, so just allow this as a no-op.
@@ -2538,15 +3010,10 @@ void Arguments::Writer::beginArrayOrDict(IoState beginWhat, ArrayOption option)
 
     const bool isEmpty = (option != NonEmptyArray) || d->m_nilArrayNesting;
     if (isEmpty) {
-        if (!d->m_nilArrayNesting++) {
-            // For simplictiy and performance in the fast path, we keep storing the data chunks and any
-            // variant signatures written inside an empty array. When we close the array, though, we
-            // throw away all that data and signatures and keep only changes in the signature containing
-            // the topmost empty array.
-            // +2 -> keep ArrayLengthField, and first data element for alignment purposes
-            d->m_dataElementsCountBeforeNilArray = d->m_elements.size() + 2;
-            d->m_dataPositionBeforeNilArray = d->m_dataPosition;
-        }
+        // For simplictiy and performance in the fast path, we keep writing the data inside an empty
+        // array. When we close the outermost empty array, we throw away all that data and keep only
+        // changes in the signature containing the topmost empty array.
+        d->m_nilArrayNesting++;
     }
     if (beginWhat == BeginArray) {
         advanceState(cstring("a", strlen("a")), beginWhat);
@@ -2644,7 +3111,6 @@ void Arguments::Writer::writePrimitiveArray(IoState type, chunk data)
 
     // undo the dummy write
     d->m_dataPosition -= elementType.alignment;
-    d->m_elements.pop_back();
 
     // ensure that we have room for the data
     const uint32 newDataPosition = d->m_dataPosition + data.length;
@@ -2654,19 +3120,63 @@ void Arguments::Writer::writePrimitiveArray(IoState type, chunk data)
     memcpy(d->m_data + d->m_dataPosition, data.ptr, data.length);
     d->m_dataPosition = newDataPosition;
 
-    // Store ElementInfos about the data
-    // Align only the first of the back-to-back data chunks - otherwise, when storing values which
-    // are 8 byte aligned, the second half of an element straddling a chunk boundary
-    // (Private::ElementInfo::LargestSize == 60) would start at an 8-byte aligned position (so 64)
-    // instead of 60 where we want it in order to just write a contiguous block of data.
-    // Also, it's somewhat faster to skip alignment logic altogether.
-    uint32 alignment = elementType.alignment;
-    for (uint32 l = data.length; l; ) {
-        uint32 chunkSize = std::min(l, uint32(Private::ElementInfo::LargestSize));
-        d->m_elements.push_back(Private::ElementInfo(alignment, chunkSize));
-        alignment = 1;
-        l -= chunkSize;
+    endArray();
+}
+
+void Arguments::Writer::writeFixedArray(cstring elementSignature, chunk data)
+{
+    std::shared_ptr<const SignatureProgram> uncached;
+    const SignatureProgram *program = SignatureProgram::get(elementSignature, &uncached);
+    FixedArray layout;
+    std::vector<PaddingRange> padding;
+    VALID_IF(program && program->completeTypeCount() == 1, Error::InvalidSignature);
+    VALID_IF(fixedArrayLayout(program, 0, &layout, &padding), Error::InvalidType);
+    VALID_IF(data.length <= SpecMaxArrayLength, Error::ArrayOrDictTooLong);
+    // serialized form or C array form, which includes the padding after the last element
+    uint32 count = 0;
+    if (data.length >= layout.elementSize) {
+        count = (data.length - layout.elementSize) / layout.stride + 1;
     }
+    VALID_IF(data.length == (count ? (count - 1) * layout.stride + layout.elementSize : 0) ||
+             data.length == count * layout.stride, Error::MalformedMessageData);
+
+    beginArray(count ? NonEmptyArray : WriteTypesOfEmptyArray);
+
+    // dummy write of one element to write the signature...
+    for (uint32 i = 0; i < program->length(); i++) {
+        const SignatureProgram::Instruction &ins = program->at(i);
+        if (ins.state() == BeginStruct) {
+            beginStruct();
+        } else if (ins.state() == EndStruct) {
+            endStruct();
+        } else {
+            m_u.Uint64 = 0;
+            advanceState(cstring(elementSignature.ptr + i, 1), ins.state());
+        }
+    }
+
+    if (!count || m_state == InvalidData) {
+        // oh! a nil array.
+        endArray();
+        return;
+    }
+
+    // undo the dummy write
+    d->m_dataPosition -= layout.elementSize;
+
+    const uint32 size = (count - 1) * layout.stride + layout.elementSize;
+    const uint32 newDataPosition = d->m_dataPosition + size;
+    d->reserveData(newDataPosition);
+
+    byte *const dest = d->m_data + d->m_dataPosition;
+    memcpy(dest, data.ptr, size);
+    // the input might come from C structs, which may contain garbage in their padding
+    for (const PaddingRange &range : padding) {
+        for (uint32 offset = range.begin; offset < size; offset += layout.stride) {
+            memset(dest + offset, 0, range.end - range.begin);
+        }
+    }
+    d->m_dataPosition = newDataPosition;
 
     endArray();
 }
@@ -2677,25 +3187,61 @@ Arguments Arguments::Writer::finish()
         // TODO proper error - what must have happened is that finish() was called > 1 times
         return Arguments();
     }
-    finishInternal();
+    finishInternal(nullptr);
 
     d->m_args.d->m_error = d->m_error;
 
     return std::move(d->m_args);
 }
 
-struct ArrayLengthField
+uint32 Arguments::Writer::finishedSize() const
 {
-    uint32 lengthFieldPosition;
-    uint32 dataStartPosition;
-};
+    if (!d->m_signaturePosition) {
+        return 0;
+    }
+    return align(d->m_signaturePosition + 1, 8) + d->m_dataPosition - d->m_dataStart;
+}
+
+Arguments Arguments::Writer::finishInto(chunk buffer)
+{
+    if (!d->m_args.d) {
+        return Arguments();
+    }
+    if (m_state != InvalidData && buffer.length < finishedSize()) {
+        m_state = InvalidData;
+        d->m_error.setCode(Error::BufferTooSmall);
+    }
+    finishInternal(buffer.ptr);
+
+    d->m_args.d->m_error = d->m_error;
+
+    return std::move(d->m_args);
+}
 
-void Arguments::Writer::finishInternal()
+void Arguments::Writer::reset()
+{
+    if (!d->m_args.d) {
+        d->m_args = Arguments();
+    }
+    d->m_nesting = NestingWithParenCounter();
+    d->m_signature.ptr = reinterpret_cast<char *>(d->m_data) + 1;
+    d->m_signature.length = 0;
+    d->m_signaturePosition = 0;
+    d->m_dataPosition = d->m_dataStart;
+    d->reserveData(d->m_dataStart);
+    d->m_nilArrayNesting = 0;
+    d->m_error = Error();
+    d->m_aggregateStack.clear();
+    closeFds(&d->m_fileDescriptors);
+    m_state = AnyData;
+}
+
+void Arguments::Writer::finishInternal(byte *externalBuffer)
 {
     // what needs to happen here:
     // - check if the message can be closed - basically the aggregate stack must be empty
-    // - assemble the message, inserting variant signatures and array lengths
     // - close the signature by adding the terminating null
+    // - hand over the data, which is already in its final form
     if (m_state == InvalidData) {
         return;
     }
@@ -2706,133 +3252,65 @@ void Arguments::Writer::finishInternal()
     // we're going to use the following identity to help the compiler
     assert(d->m_signature.ptr == reinterpret_cast<char *>(d->m_data) + 1);
     d->m_signature.length = d->m_signaturePosition;
+    d->m_aggregateStack.clear();
 
-    bool success = true;
-    const uint32 count = d->m_elements.size();
-
-    if (count) {
-        // Note: if one of signature or data is nonempty, the other must also be nonempty.
-        // Even "empty" things like empty arrays or null strings have a size field, in that case
-        // (for all(?) types) of value zero.
-
-        // Copy the signature and main data (thus the whole contents) into one allocated block,
-        // which is good to have for performance and simplicity reasons.
-
-        // The maximum alignment blowup for naturally aligned types is just less than a factor of 2.
-        // Structs and dict entries are always 8 byte aligned so they add a maximum blowup of 7 bytes
-        // each (when they contain a byte).
-        // Those estimates are very conservative (but easy!), so some space optimization is possible.
-
-        // This one gets no length prefix, it's just the backing buffer for a cstring instance!
-        const uint32 alignedSigLength = align(d->m_signature.length + 1, 8);
-
-        const uint32 safeEstimatedDataSize =
-            2 * (d->m_dataPosition - Private::MaxFullSignatureLength // signature is in alignedSigLength
-                 - d->m_variantSignaturesWastedSpace)
-            + d->m_nesting.parenCount * 7 // max alignment padding in front of data structures
-            + alignedSigLength;
-
-        byte *buffer = reinterpret_cast<byte *>(malloc(std::max(uint32(Private::InitialDataCapacity),
-                                                                safeEstimatedDataSize)));
-        memcpy(buffer, d->m_data + 1, d->m_signature.length);
-        uint32 bufferPos = d->m_signature.length;
-        for (; bufferPos < alignedSigLength; bufferPos++) {
-            buffer[bufferPos] = '\0';
-        }
-
-        d->m_dataPosition = Private::MaxFullSignatureLength;
-
-        std::vector<ArrayLengthField> lengthFieldStack;
-
-        for (uint32 i = 0; i < count; i++) {
-            const Private::ElementInfo ei = d->m_elements[i];
-            switch (ei.size) {
-            case 0: {
-                    // if !ei.size, the current element is alignment padding which does not apply
-                    // to source data, so only add padding and only advance the output stream (not input)
-                    zeroPad(buffer, ei.alignment(), &bufferPos);
-                }
-                break;
-            default: {
-                    assert(ei.size && ei.size <= Private::ElementInfo::LargestSize);
-                    // apply alignment padding in output and input
-                    zeroPad(buffer, ei.alignment(), &bufferPos);
-                    d->m_dataPosition = align(d->m_dataPosition, ei.alignment());
-                    // copy data chunk
-                    memcpy(buffer + bufferPos, d->m_data + d->m_dataPosition, ei.size);
-                    bufferPos += ei.size;
-                    d->m_dataPosition += ei.size;
-                }
-                break;
-            case Private::ElementInfo::ArrayLengthField: {
-                    //   start of an array
-                    // alignment padding before length field in output
-                    zeroPad(buffer, ei.alignment(), &bufferPos);
-                    // reserve length field
-                    ArrayLengthField al;
-                    al.lengthFieldPosition = bufferPos;
-                    bufferPos += sizeof(uint32);
-                    // alignment padding before first array element in output
-                    assert(i + 1 < d->m_elements.size());
-                    zeroPad(buffer, d->m_elements[i + 1].alignment(), &bufferPos);
-                    // array data starts at the first array element position
-                    al.dataStartPosition = bufferPos;
-                    lengthFieldStack.push_back(al);
-                }
-                break;
-            case Private::ElementInfo::ArrayLengthEndMark: {
-                    //   end of an array
-                    // just put the now known array length in front of the array
-                    const ArrayLengthField al = lengthFieldStack.back();
-                    const uint32 arrayLength = bufferPos - al.dataStartPosition;
-                    if (arrayLength > SpecMaxArrayLength) {
-                        d->m_error.setCode(Error::ArrayOrDictTooLong);
-                        success = false;
-                        break;
-                    }
-                    basic::writeUint32(buffer + al.lengthFieldPosition, arrayLength);
-                    lengthFieldStack.pop_back();
-                }
-                break;
-            case Private::ElementInfo::VariantSignature: {
-                    // fill in signature and add null terminator
-                    const uint32 length = d->m_data[d->m_dataPosition] + 1; // + length prefix
-                    memcpy(buffer + bufferPos, d->m_data + d->m_dataPosition, length);
-                    buffer[bufferPos + length] = '\0';
-                    bufferPos += length + 1; // + null terminator
-                    d->m_dataPosition += Private::MaxFullSignatureLength;
-                }
-                break;
-            }
-        }
-
-        // OK, so this length check is more like a sanity check. The actual limit is about the size of the
-        // full message. Here we take the size of the "payload" plus the signature string and its alignment
-        // padding. However, messages have a header of nontrivial size, so our "estimate" of full message
-        // size is still too small.
-        if (success && bufferPos > SpecMaxMessageLength) {
-            success = false;
-            d->m_error.setCode(Error::ArgumentsTooLong);
-        }
-
-        d->m_aggregateStack.clear();
-        if (success) {
-            assert(lengthFieldStack.empty());
-            d->m_args.d->m_memOwnership = buffer;
-            d->m_args.d->m_signature = cstring(buffer, d->m_signature.length);
-            d->m_args.d->m_data = chunk(buffer + alignedSigLength, bufferPos - alignedSigLength);
-        }
+    // Note: if one of signature or data is nonempty, the other must also be nonempty.
+    // Even "empty" things like empty arrays or null strings have a size field, in that case
+    // (for all(?) types) of value zero.
+    if (!d->m_signature.length) {
+        d->m_args.d->m_memOwnership = nullptr;
+        d->m_args.d->m_signature = cstring();
+        d->m_args.d->m_data = chunk();
+        m_state = Finished;
+        return;
     }
 
-    if (!count || !success) {
+    const uint32 alignedSigLength = align(d->m_signature.length + 1, 8);
+    const uint32 dataLength = d->m_dataPosition - d->m_dataStart;
+
+    // OK, so this length check is more like a sanity check. The actual limit is about the size of the
+    // full message. Here we take the size of the "payload" plus the signature string and its alignment
+    // padding. However, messages have a header of nontrivial size, so our "estimate" of full message
+    // size is still too small.
+    if (alignedSigLength + dataLength > SpecMaxMessageLength) {
         d->m_args.d->m_memOwnership = nullptr;
         d->m_args.d->m_signature = cstring();
         d->m_args.d->m_data = chunk();
+        VALID_IF(false, Error::ArgumentsTooLong);
     }
 
-    d->m_elements.clear();
+    d->m_signature.ptr[d->m_signature.length] = '\0';
+    if (externalBuffer || d->m_data == d->m_initialDataBuffer) {
+        // Copy into the caller's buffer or a compact heap block, the Arguments may live a lot longer
+        // than the Writer
+        byte *buffer = externalBuffer;
+        if (!buffer) {
+            buffer = reinterpret_cast<byte *>(malloc(alignedSigLength + dataLength));
+        }
+        memcpy(buffer, d->m_signature.ptr, d->m_signature.length + 1);
+        uint32 bufferPos = d->m_signature.length + 1;
+        zeroPad(buffer, 8, &bufferPos);
+        memcpy(buffer + alignedSigLength, d->m_data + d->m_dataStart, dataLength);
+
+        d->m_args.d->m_memOwnership = externalBuffer ? nullptr : buffer;
+        d->m_args.d->m_signature = cstring(buffer, d->m_signature.length);
+        d->m_args.d->m_data = chunk(buffer + alignedSigLength, dataLength);
+    } else {
+        // Just hand over the buffer
+        d->m_args.d->m_memOwnership = d->m_data;
+        d->m_args.d->m_signature = d->m_signature;
+        d->m_args.d->m_data = chunk(d->m_data + d->m_dataStart, dataLength);
+
+        d->m_data = d->m_initialDataBuffer;
+        d->m_dataCapacity = Private::InitialDataCapacity;
+        d->m_dataPosition = d->m_dataStart;
+        // keep currentSignature() working
+        memcpy(d->m_data, d->m_args.d->m_signature.ptr - 1, d->m_signature.length + 2);
+        d->m_signature.ptr = reinterpret_cast<char *>(d->m_data) + 1;
+    }
+    std::swap(d->m_args.d->m_fileDescriptors, d->m_fileDescriptors);
 
-    m_state = success ? Finished : InvalidData;
+    m_state = Finished;
 }
 
 std::vector<Arguments::IoState> Arguments::Writer::aggregateStack() const
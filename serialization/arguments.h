@@ -31,6 +31,8 @@
 #include <string>
 #include <vector>
 
+class ArgumentsIndex;
+class MessagePrivate;
 class Error;
 class Message;
 
@@ -109,8 +111,9 @@ public:
     // (A notable user of this is Message - you can only get a const ref to its internal Arguments
     //  so you need to copy to take the Arguments away from the Message, which copies out of the
     //  borrowed memory into heap memory so the copy is safe)
-    // The copy contructor and assignment operator will always copy the data, so copying is safe
-    // regarding memory correctness but has a significant performance impact.
+    // The copy contructor and assignment operator copy the data if it is borrowed or if there are
+    // Unix fds, so copying is safe regarding memory correctness. Otherwise, copies share the data,
+    // which is immutable (except through convertToHostByteOrder(), which detaches the copy).
     Arguments(byte *memOwnership, cstring signature, chunk data, bool isByteSwapped = false);
 
     // use these wherever possible if you care at all about efficiency!!
@@ -130,15 +133,60 @@ public:
 
     cstring signature() const;
     chunk data() const;
+    bool isByteSwapped() const;
+    // The Unix file descriptors that UnixFd values refer to by index. The Arguments owns them - they
+    // are duplicates of the ones written, closed when it is destroyed and duplicated again in copies.
+    const std::vector<int> &fileDescriptors() const;
+    // Converts byte-swapped data to host byte order, in place, so that e.g. the zero-copy
+    // Reader::readPrimitiveArray() works with it. Returns false, without changing anything, if the
+    // data is too malformed to convert. Note that this modifies the data even in "borrowed" memory.
+    bool convertToHostByteOrder();
 
     static bool isStringValid(cstring string);
     static bool isObjectPathValid(cstring objectPath);
     static bool isObjectPathElementValid(cstring pathElement);
     static bool isSignatureValid(cstring signature, SignatureType type = MethodSignature);
 
-    static void copyOneElement(Reader *reader, Writer *writer);
+    enum CopyMode
+    {
+        CopyElementWise = 0,
+        // In Begin... states, copy the whole aggregate. That is done as raw data where the data
+        // layout allows it, which is much faster. The matching End... state is not seen by the caller.
+        CopyWholeAggregates
+    };
+    static void copyOneElement(Reader *reader, Writer *writer, CopyMode mode = CopyElementWise);
+
+    // An array of fixed size elements in serialized form, see Reader::readFixedArray() and
+    // Writer::writeFixedArray(). Elements are primitives (except booleans and Unix fds) or structs of
+    // them. Fields are at naturally aligned offsets, structs are 8 byte aligned and padding is zero,
+    // which matches C structs without nested structs on common 64 bit platforms - except that the
+    // last element has no trailing padding in the serialized data.
+    struct FixedArray
+    {
+        struct Field
+        {
+            IoState type;
+            uint32 offset;
+        };
+        cstring elementSignature; // e.g. "i" or "(iidd)"
+        chunk data;
+        uint32 count;
+        uint32 stride; // distance between the starts of consecutive elements
+        uint32 elementSize; // size of an element without trailing padding
+        std::vector<Field> fields; // all primitive fields of an element, nested structs flattened
+    };
 
 private:
+    friend class ::MessagePrivate;
+    // unused bytes right in front of the data, in memory owned by this Arguments
+    uint32 spaceBeforeData() const;
+    // for received messages, whose fds come separately from the data
+    void swapFileDescriptors(std::vector<int> *fds);
+    // gives this its own copy of a shared Private
+    void detach();
+    // an Arguments borrowing signature and data, with this one's byte order and a copy of its fds
+    Arguments withData(cstring signature, chunk data) const;
+
     struct podCstring // Same as cstring but without ctor.
                       // Can't put the cstring type into a union because it has a constructor :/
     {
@@ -247,6 +295,7 @@ public:
         cstring readString() { cstring ret(m_u.String.ptr, m_u.String.length); advanceState(); return ret; }
         cstring readObjectPath() { cstring ret(m_u.String.ptr, m_u.String.length); advanceState(); return ret; }
         cstring readSignature() { cstring ret(m_u.String.ptr, m_u.String.length); advanceState(); return ret; }
+        // returns a file descriptor from Arguments::fileDescriptors(), which stays owned by the Arguments
         uint32 readUnixFd() { uint32 ret = m_u.Uint32; advanceState(); return ret; }
 
         void skipCurrentElement(); // works on single values and Begin... states. In the Begin... states,
@@ -257,7 +306,7 @@ public:
         // with replaceData().
         // If the array is empty, that does not constitute a special case with this function: It will return
         // the type in the first return value as usual and an empty chunk in the second return value.
-        // (### it might be possible to extend this feature to all fixed-length types including structs)
+        // See readFixedArray() for arrays of structs.
         std::pair<Arguments::IoState, chunk> readPrimitiveArray();
         // In state BeginArray, check if the array is a primitive array, in order to check whether to use
         // readPrimitiveArray(). Returns a primitive type if readPrimitiveArray() will succeed, BeginArray
@@ -266,6 +315,18 @@ public:
         // If option is SkipIfEmpty, an empty array of primitives will result in a return value of BeginArray
         // instead of the type of primitive.
         Arguments::IoState peekPrimitiveArray(EmptyArrayOption option = SkipIfEmpty) const;
+        // Like readPrimitiveArray(), but copies the data into @p buffer, converting it to host byte order
+        // if necessary - so unlike readPrimitiveArray(), it also works with byte-swapped data.
+        // Returns the type and the number of bytes copied. If the array is not an array of primitives or
+        // @p bufferSize is less than primitiveArraySize(), returns InvalidData and does not move on.
+        std::pair<Arguments::IoState, uint32> readPrimitiveArray(void *buffer, uint32 bufferSize);
+        // In state BeginArray, the size in bytes of the array's data; 0 in other states
+        uint32 primitiveArraySize() const;
+        // The generalization of readPrimitiveArray() to arrays with fixed size elements, including structs.
+        // Checks the layout of the whole array once and then hands out its raw data, which you must copy
+        // before destroying the Reader or changing its backing store. Returns false, without moving on,
+        // if not in BeginArray state of such an array or if the data is byte-swapped.
+        bool readFixedArray(FixedArray *array);
 
 #ifdef WITH_DICT_ENTRY
         void beginDictEntry();
@@ -275,6 +336,12 @@ public:
     private:
         class Private;
         friend class Private;
+        friend class ::ArgumentsIndex;
+        friend class Writer;
+        // Starts reading at the given positions, which must be those of a top-level single complete type
+        // (either from the main signature or a substring of it) and of the data right after the previous
+        // element. A null signature makes an invalid Reader.
+        Reader(const Arguments &al, cstring signature, uint32 signaturePosition, uint32 dataPosition);
         void beginRead();
         void doReadPrimitiveType();
         void doReadString(uint32 lengthPrefixSize);
@@ -282,6 +349,9 @@ public:
         void beginArrayOrDict(bool isDict, EmptyArrayOption option);
         void skipArrayOrDictSignature(bool isDict);
         void skipArrayOrDict(bool isDict);
+        // returns the element type and size if in BeginArray of a primitive array, else InvalidData
+        IoState primitiveArrayType(uint32 *elementSize) const;
+        void leaveFixedArray();
 
         Private *d;
 
@@ -297,6 +367,9 @@ public:
     {
     public:
         explicit Writer();
+        // Leaves at least @p headerSpace bytes of room in front of the data, where a Message can put its
+        // header instead of copying the data behind it. See Message::bodyWriter().
+        explicit Writer(uint32 headerSpace);
         Writer(Writer &&other);
         void operator=(Writer &&other);
         // TODO unit-test copy and assignment
@@ -335,6 +408,15 @@ public:
         void endVariant();
 
         Arguments finish();
+        // The exact buffer size that finishInto() needs, if all aggregates are closed and nothing more
+        // is written
+        uint32 finishedSize() const;
+        // Like finish(), but puts the signature and data into @p buffer, which must be at least
+        // finishedSize() bytes long and outlive the returned Arguments. Unlike finish(), it never gives
+        // up the Writer's own data buffer, so a Writer that is reused through reset() stays allocated.
+        Arguments finishInto(chunk buffer);
+        // Returns to the initial state, keeping any memory allocated for data and aggregates
+        void reset();
 
         std::vector<IoState> aggregateStack() const; // the aggregates the writer is currently in
         uint32 aggregateDepth() const; // like calling aggregateStack().size() but much faster
@@ -352,15 +434,25 @@ public:
         void writeString(cstring string);
         void writeObjectPath(cstring objectPath);
         void writeSignature(cstring signature);
+        // writes the index of a duplicate of fd, see Arguments::fileDescriptors()
         void writeUnixFd(uint32 fd);
 
         void writePrimitiveArray(IoState type, chunk data);
+        // Writes an array of elements of type @p elementSignature (see FixedArray) from @p data. The data
+        // may be in serialized form, or an array of C structs including the padding after the last element;
+        // padding in the input is ignored and written as zero.
+        void writeFixedArray(cstring elementSignature, chunk data);
 
 #ifdef WITH_DICT_ENTRY
         void beginDictEntry();
         void endDictEntry();
 #endif
 
+        friend class Arguments;
+        // for copyOneElement(): copies the aggregate that reader is at the beginning of as raw data,
+        // after validating it. Returns false if that isn't possible, without changing anything.
+        bool copyAggregateRaw(Reader *reader);
+
         class Private;
         friend class Private;
 
@@ -369,7 +461,7 @@ public:
         void doWriteString(IoState type, uint32 lengthPrefixSize);
         void advanceState(cstring signatureFragment, IoState newState);
         void beginArrayOrDict(IoState beginWhat, ArrayOption option);
-        void finishInternal();
+        void finishInternal(byte *externalBuffer);
 
         Private *d;
 
@@ -0,0 +1,331 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "argumentsindex.h"
+
+#include "basictypeio.h"
+#include "datawalker.h"
+#include "fnvhash.h"
+#include "signatureprogram.h"
+
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+static const uint32 s_maxArrayLength = 67108864; // 64 MiB
+static const uint32 s_noDict = ~0u;
+
+class ArgumentsIndex::Private
+{
+public:
+    struct Element
+    {
+        uint32 signaturePosition;
+        uint32 dataPosition; // right after the previous element, before any alignment padding
+        uint32 dict; // index into m_dicts or s_noDict
+    };
+
+    struct Dict
+    {
+        uint32 signaturePosition; // of the 'a'
+        uint32 tableBegin; // in m_table
+        uint32 tableSize; // a power of two
+    };
+
+    struct Entry
+    {
+        uint32 keyPosition;
+        uint32 valuePosition; // right after the key
+    };
+
+    // a key to look up, as it would be indexed
+    struct Key
+    {
+        bool isString;
+        cstring string;
+        uint64 integer;
+    };
+
+    static bool isIndexableKey(Arguments::IoState type) { return type != Arguments::Double; }
+    Key keyAt(Arguments::IoState type, uint32 position) const;
+    static uint32 hashKey(const Key &key);
+    static bool keysEqual(const Key &a, const Key &b);
+
+    bool indexDict(DataWalker *walker, uint32 *signaturePosition);
+    Arguments::Reader dictValue(uint32 i, const Key &key) const;
+
+    const Arguments *m_args;
+    const SignatureProgram *m_program;
+    std::shared_ptr<const SignatureProgram> m_uncachedProgram;
+    bool m_isValid;
+    std::vector<Element> m_elements;
+    std::vector<Dict> m_dicts;
+    std::vector<Entry> m_entries;
+    std::vector<uint32> m_table; // open addressing; entry index + 1, 0 for empty slots
+};
+
+ArgumentsIndex::Private::Key ArgumentsIndex::Private::keyAt(Arguments::IoState type, uint32 position) const
+{
+    const byte *p = m_args->data().ptr + position;
+    const bool swap = m_args->isByteSwapped();
+    Key ret;
+    ret.isString = false;
+    ret.integer = 0;
+    switch (type) {
+    case Arguments::String:
+    case Arguments::ObjectPath:
+        ret.isString = true;
+        ret.string = cstring(const_cast<byte *>(p) + sizeof(uint32), basic::readUint32(p, swap));
+        break;
+    case Arguments::Signature:
+        ret.isString = true;
+        ret.string = cstring(const_cast<byte *>(p) + 1, *p);
+        break;
+    case Arguments::Byte:
+        ret.integer = *p;
+        break;
+    case Arguments::Int16:
+        ret.integer = uint64(int64(basic::readInt16(p, swap)));
+        break;
+    case Arguments::Uint16:
+        ret.integer = basic::readUint16(p, swap);
+        break;
+    case Arguments::Int32:
+        ret.integer = uint64(int64(basic::readInt32(p, swap)));
+        break;
+    case Arguments::Boolean:
+    case Arguments::Uint32:
+    case Arguments::UnixFd:
+        ret.integer = basic::readUint32(p, swap);
+        break;
+    case Arguments::Int64:
+    case Arguments::Uint64:
+        ret.integer = basic::readUint64(p, swap);
+        break;
+    default:
+        assert(false);
+    }
+    return ret;
+}
+
+// static
+uint32 ArgumentsIndex::Private::hashKey(const Key &key)
+{
+    FnvHash hash;
+    if (key.isString) {
+        hash.add(key.string);
+    } else {
+        for (uint32 i = 0; i < sizeof(uint64); i++) {
+            hash.add(byte(key.integer >> (i * 8)));
+        }
+    }
+    return hash.result();
+}
+
+// static
+bool ArgumentsIndex::Private::keysEqual(const Key &a, const Key &b)
+{
+    if (a.isString != b.isString) {
+        return false;
+    }
+    if (!a.isString) {
+        return a.integer == b.integer;
+    }
+    return a.string.length == b.string.length && !memcmp(a.string.ptr, b.string.ptr, a.string.length);
+}
+
+bool ArgumentsIndex::Private::indexDict(DataWalker *walker, uint32 *signaturePosition)
+{
+    const uint32 keySignaturePosition = *signaturePosition + 2; // skip "a{"
+    const Arguments::IoState keyType = m_program->at(keySignaturePosition).state();
+
+    if (!walker->alignTo(sizeof(uint32)) || !walker->has(sizeof(uint32))) {
+        return false;
+    }
+    const uint32 arrayLength = walker->readUint32();
+    if (arrayLength > s_maxArrayLength || !walker->alignTo(8) || !walker->has(arrayLength)) {
+        return false;
+    }
+    const uint32 arrayEnd = walker->position() + arrayLength;
+    const uint32 entryBegin = m_entries.size();
+    while (walker->position() < arrayEnd) {
+        // dict entries are 8 byte aligned and so are all keys, there is no padding in front of them
+        if (!walker->alignTo(8)) {
+            return false;
+        }
+        Entry entry;
+        entry.keyPosition = walker->position();
+        uint32 fieldPosition = keySignaturePosition;
+        if (!walker->skipSingleCompleteType(m_program, &fieldPosition)) {
+            return false;
+        }
+        entry.valuePosition = walker->position();
+        if (!walker->skipSingleCompleteType(m_program, &fieldPosition)) {
+            return false;
+        }
+        m_entries.push_back(entry);
+    }
+    if (walker->position() != arrayEnd) {
+        return false;
+    }
+
+    Dict dict;
+    dict.signaturePosition = *signaturePosition;
+    dict.tableBegin = m_table.size();
+    const uint32 entryCount = m_entries.size() - entryBegin;
+    dict.tableSize = 4;
+    while (dict.tableSize < entryCount * 2) {
+        dict.tableSize *= 2;
+    }
+    m_table.resize(m_table.size() + dict.tableSize, 0);
+    uint32 *const table = &m_table[dict.tableBegin];
+    const uint32 mask = dict.tableSize - 1;
+    for (uint32 e = entryBegin; e < m_entries.size(); e++) {
+        uint32 slot = hashKey(keyAt(keyType, m_entries[e].keyPosition)) & mask;
+        while (table[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = e + 1;
+    }
+    m_dicts.push_back(dict);
+
+    *signaturePosition = m_program->at(*signaturePosition).end;
+    return true;
+}
+
+Arguments::Reader ArgumentsIndex::Private::dictValue(uint32 i, const Key &key) const
+{
+    if (i >= m_elements.size() || m_elements[i].dict == s_noDict) {
+        return Arguments::Reader(*m_args, cstring(), 0, 0);
+    }
+    const Dict &dict = m_dicts[m_elements[i].dict];
+    const uint32 keySignaturePosition = dict.signaturePosition + 2;
+    const Arguments::IoState keyType = m_program->at(keySignaturePosition).state();
+    const uint32 *const table = &m_table[dict.tableBegin];
+    const uint32 mask = dict.tableSize - 1;
+    for (uint32 slot = hashKey(key) & mask; table[slot]; slot = (slot + 1) & mask) {
+        const Entry &entry = m_entries[table[slot] - 1];
+        if (keysEqual(keyAt(keyType, entry.keyPosition), key)) {
+            const uint32 valueSignaturePosition = keySignaturePosition + 1;
+            const cstring valueSignature(m_args->signature().ptr + valueSignaturePosition,
+                                         m_program->at(valueSignaturePosition).end - valueSignaturePosition);
+            return Arguments::Reader(*m_args, valueSignature, 0, entry.valuePosition);
+        }
+    }
+    return Arguments::Reader(*m_args, cstring(), 0, 0);
+}
+
+ArgumentsIndex::ArgumentsIndex(const Arguments &args, Option option)
+   : d(new Private)
+{
+    d->m_args = &args;
+    d->m_isValid = false;
+    d->m_program = SignatureProgram::get(args.signature(), &d->m_uncachedProgram);
+    if (!d->m_program) {
+        return;
+    }
+
+    DataWalker walker(args.data(), args.isByteSwapped());
+    uint32 signaturePosition = 0;
+    while (signaturePosition < d->m_program->length()) {
+        Private::Element element;
+        element.signaturePosition = signaturePosition;
+        element.dataPosition = walker.position();
+        element.dict = s_noDict;
+
+        bool ok;
+        if (option == IndexDicts && d->m_program->at(signaturePosition).state() == Arguments::BeginArray &&
+            d->m_program->at(signaturePosition + 1).state() == Arguments::BeginDict &&
+            Private::isIndexableKey(d->m_program->at(signaturePosition + 2).state())) {
+            element.dict = d->m_dicts.size();
+            ok = d->indexDict(&walker, &signaturePosition);
+        } else {
+            ok = walker.skipSingleCompleteType(d->m_program, &signaturePosition);
+        }
+        if (!ok) {
+            d->m_elements.clear();
+            d->m_dicts.clear();
+            d->m_entries.clear();
+            d->m_table.clear();
+            return;
+        }
+        d->m_elements.push_back(element);
+    }
+    d->m_isValid = walker.position() == args.data().length;
+    if (!d->m_isValid) {
+        d->m_elements.clear();
+    }
+}
+
+ArgumentsIndex::~ArgumentsIndex()
+{
+    delete d;
+    d = nullptr;
+}
+
+bool ArgumentsIndex::isValid() const
+{
+    return d->m_isValid;
+}
+
+uint32 ArgumentsIndex::count() const
+{
+    return d->m_elements.size();
+}
+
+cstring ArgumentsIndex::signature(uint32 i) const
+{
+    if (i >= d->m_elements.size()) {
+        return cstring();
+    }
+    const uint32 begin = d->m_elements[i].signaturePosition;
+    return cstring(d->m_args->signature().ptr + begin, d->m_program->at(begin).end - begin);
+}
+
+Arguments::Reader ArgumentsIndex::reader(uint32 i) const
+{
+    if (i >= d->m_elements.size()) {
+        return Arguments::Reader(*d->m_args, cstring(), 0, 0);
+    }
+    const Private::Element &element = d->m_elements[i];
+    return Arguments::Reader(*d->m_args, d->m_args->signature(), element.signaturePosition,
+                             element.dataPosition);
+}
+
+Arguments::Reader ArgumentsIndex::dictValue(uint32 i, cstring key) const
+{
+    Private::Key k;
+    k.isString = true;
+    k.string = key;
+    k.integer = 0;
+    return d->dictValue(i, k);
+}
+
+Arguments::Reader ArgumentsIndex::dictValue(uint32 i, int64 key) const
+{
+    Private::Key k;
+    k.isString = false;
+    k.integer = uint64(key);
+    return d->dictValue(i, k);
+}
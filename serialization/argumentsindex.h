@@ -0,0 +1,68 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#ifndef ARGUMENTSINDEX_H
+#define ARGUMENTSINDEX_H
+
+#include "arguments.h"
+
+// An index of the top-level arguments of an Arguments, and optionally of the entries of top-level
+// dicts, for random access without decoding everything in front of the interesting parts.
+// Building the index only looks at the structure of the data, which is much cheaper than reading
+// it with a Reader; elements are fully validated when they are read.
+// The Arguments must not be changed or destroyed while the index is in use.
+class DFERRY_EXPORT ArgumentsIndex
+{
+public:
+    enum Option
+    {
+        TopLevelOnly = 0,
+        IndexDicts // also index the entries of top-level dicts with integer or string-like keys
+    };
+
+    explicit ArgumentsIndex(const Arguments &args, Option option = TopLevelOnly);
+    ~ArgumentsIndex();
+
+    ArgumentsIndex(const ArgumentsIndex &other) = delete;
+    void operator=(const ArgumentsIndex &other) = delete;
+
+    bool isValid() const; // false if the data is malformed
+    uint32 count() const;
+    // the signature of argument @p i (which is not null-terminated!)
+    cstring signature(uint32 i) const;
+
+    // Returns a Reader at argument @p i, as if all arguments before it had been read. After that
+    // argument, it continues normally with the next one.
+    Arguments::Reader reader(uint32 i) const;
+    // If argument @p i is an indexed dict, returns a Reader for only the value of the entry with
+    // @p key. If there is no such entry, the Reader is in InvalidData state.
+    Arguments::Reader dictValue(uint32 i, cstring key) const;
+    // For integer keys, including booleans. Unsigned 64 bit keys are cast to int64.
+    Arguments::Reader dictValue(uint32 i, int64 key) const;
+
+private:
+    class Private;
+    Private *d;
+};
+
+#endif // ARGUMENTSINDEX_H
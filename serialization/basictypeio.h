@@ -25,8 +25,10 @@
 #define BASICTYPEIO_H
 
 #include "types.h"
+#include "validation.h"
 
 #include <algorithm> // for std::min on Windows...
+#include <cstring>
 
 static inline uint32 align(uint32 index, uint32 alignment)
 {
@@ -37,21 +39,13 @@ static inline uint32 align(uint32 index, uint32 alignment)
 static inline bool isPaddingZero(const chunk &buffer, uint32 padStart, uint32 padEnd)
 {
     padEnd = std::min(padEnd, buffer.length);
-    for (; padStart < padEnd; padStart++) {
-        if (unlikely(buffer.ptr[padStart] != '\0')) {
-            return false;
-        }
-    }
-    return true;
+    return padStart >= padEnd || validation::isZero(buffer.ptr + padStart, padEnd - padStart);
 }
 
 static inline void zeroPad(byte *buffer, uint32 alignment, uint32 *bufferPos)
 {
-    uint32 i = *bufferPos;
-    const uint32 padEnd = align(i, alignment);
-    for (; i < padEnd; i++) {
-        buffer[i] = '\0';
-    }
+    const uint32 padEnd = align(*bufferPos, alignment);
+    memset(buffer + *bufferPos, 0, padEnd - *bufferPos);
     *bufferPos = padEnd;
 }
 
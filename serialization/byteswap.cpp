@@ -0,0 +1,157 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "byteswap.h"
+
+#include "cpufeatures.h"
+
+#include <cassert>
+#include <cstring>
+
+// The loops go through memcpy() because the data is only guaranteed to be aligned if it comes
+// straight from a D-Bus message; buffers of users need not be.
+
+// written portably; compilers recognize these patterns and emit byte swap instructions
+static inline uint16 swapped(uint16 v)
+{
+    return uint16((v << 8) | (v >> 8));
+}
+
+static inline uint32 swapped(uint32 v)
+{
+    v = ((v << 8) & 0xff00ff00u) | ((v >> 8) & 0x00ff00ffu);
+    return (v << 16) | (v >> 16);
+}
+
+static inline uint64 swapped(uint64 v)
+{
+    return (uint64(swapped(uint32(v))) << 32) | swapped(uint32(v >> 32));
+}
+
+template<typename T>
+static void copySwappedScalarT(byte *dest, const byte *src, uint32 count)
+{
+    for (uint32 i = 0; i < count; i++) {
+        T value;
+        memcpy(&value, src + i * sizeof(T), sizeof(T));
+        value = swapped(value);
+        memcpy(dest + i * sizeof(T), &value, sizeof(T));
+    }
+}
+
+static void copySwappedScalar(byte *dest, const byte *src, uint32 count, uint32 elementSize)
+{
+    switch (elementSize) {
+    case 2:
+        copySwappedScalarT<uint16>(dest, src, count);
+        break;
+    case 4:
+        copySwappedScalarT<uint32>(dest, src, count);
+        break;
+    case 8:
+        copySwappedScalarT<uint64>(dest, src, count);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+#ifdef DFERRY_X86_KERNELS
+
+// pshufb control masks reversing each 2, 4 or 8 byte element in a 16 byte lane
+static const byte s_shuffleMasks[3][16] = {
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 }
+};
+
+static const byte *shuffleMask(uint32 elementSize)
+{
+    return s_shuffleMasks[elementSize == 2 ? 0 : (elementSize == 4 ? 1 : 2)];
+}
+
+__attribute__((target("ssse3")))
+static void copySwappedSsse3(byte *dest, const byte *src, uint32 count, uint32 elementSize)
+{
+    const uint32 length = count * elementSize;
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(shuffleMask(elementSize)));
+    uint32 i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), _mm_shuffle_epi8(v, mask));
+    }
+    copySwappedScalar(dest + i, src + i, (length - i) / elementSize, elementSize);
+}
+
+__attribute__((target("avx2")))
+static void copySwappedAvx2(byte *dest, const byte *src, uint32 count, uint32 elementSize)
+{
+    const uint32 length = count * elementSize;
+    const __m128i mask128 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(shuffleMask(elementSize)));
+    const __m256i mask = _mm256_broadcastsi128_si256(mask128);
+    uint32 i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + i), _mm256_shuffle_epi8(v, mask));
+    }
+    if (i + 16 <= length) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), _mm_shuffle_epi8(v, mask128));
+        i += 16;
+    }
+    copySwappedScalar(dest + i, src + i, (length - i) / elementSize, elementSize);
+}
+
+#endif // DFERRY_X86_KERNELS
+
+typedef void (*CopySwappedKernel)(byte *dest, const byte *src, uint32 count, uint32 elementSize);
+
+// not cached, so that tests can switch kernels with setCpuFeatures()
+static CopySwappedKernel selectKernel()
+{
+    CopySwappedKernel ret = copySwappedScalar;
+#ifdef DFERRY_X86_KERNELS
+    const CpuFeatures &cpu = cpuFeatures();
+    if (cpu.avx2) {
+        ret = copySwappedAvx2;
+    } else if (cpu.ssse3) {
+        ret = copySwappedSsse3;
+    }
+#endif
+    return ret;
+}
+
+namespace byteswap
+{
+
+void copySwapped(byte *dest, const byte *src, uint32 count, uint32 elementSize)
+{
+    // for few elements, the indirect call and setup cost more than they save
+    if (count * elementSize < 16) {
+        copySwappedScalar(dest, src, count, elementSize);
+    } else {
+        selectKernel()(dest, src, count, elementSize);
+    }
+}
+
+} // namespace byteswap
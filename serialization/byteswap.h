@@ -0,0 +1,42 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#ifndef BYTESWAP_H
+#define BYTESWAP_H
+
+#include "export.h"
+#include "types.h"
+
+// Bulk byte order conversion for arrays of primitives. Like the validation functions, the hot loops
+// have SSSE3 and AVX2 variants which are selected at runtime.
+
+namespace byteswap
+{
+
+// Copies count elements of elementSize (2, 4 or 8) bytes from src to dest, reversing the byte order
+// of each element. dest and src may be the same (in-place conversion), but must not overlap otherwise.
+void DFERRY_EXPORT copySwapped(byte *dest, const byte *src, uint32 count, uint32 elementSize);
+
+} // namespace byteswap
+
+#endif // BYTESWAP_H
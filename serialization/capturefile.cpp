@@ -0,0 +1,547 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "capturefile.h"
+
+#include "basictypeio.h"
+#include "fnvhash.h"
+#include "message.h"
+#include "message_p.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct CaptureFileHeader
+{
+    char magic[8];
+    byte endianness;
+    byte version;
+    byte reserved[6];
+    uint64 indexOffset;
+    uint64 messageCount;
+};
+
+struct CaptureRecordHeader
+{
+    int64 timestamp;
+    uint32 length;
+    uint32 reserved;
+};
+
+static_assert(sizeof(CaptureFileHeader) == 32, "The file format must not change");
+static_assert(sizeof(CaptureRecordHeader) == 16, "The file format must not change");
+static_assert(sizeof(CaptureIndexEntry) == 40, "The file format must not change");
+
+static const char s_magic[8] = { 'd', 'f', 'e', 'r', 'c', 'a', 'p', '\0' };
+static const byte s_version = 1;
+#ifdef BIGENDIAN
+static const byte s_thisMachineEndianness = 'B';
+#else
+static const byte s_thisMachineEndianness = 'l';
+#endif
+static const byte s_zeroPadding[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+// written data is collected up to this size, larger messages are written directly
+static const uint32 s_writeBufferSize = 256 * 1024;
+// index entries are collected up to this number, then written to the index file
+static const uint32 s_indexBlockLength = 1024;
+static const uint32 s_maxMessageCount = 0xffffffff;
+
+// static
+uint32 CaptureIndexEntry::hashHeaders(const Message &message)
+{
+    static const Message::VariableHeader hashedHeaders[4] = {
+        Message::PathHeader,
+        Message::InterfaceHeader,
+        Message::MethodHeader,
+        Message::ErrorNameHeader
+    };
+    // a zero byte after each header so that moving characters between them matters
+    FnvHash hash;
+    for (Message::VariableHeader header : hashedHeaders) {
+        hash.add(message.stringHeaderRaw(header));
+        hash.add(byte(0));
+    }
+    return hash.result();
+}
+
+static void fillIndexEntry(CaptureIndexEntry *entry, const Message &message, uint64 offset,
+                           int64 timestamp, uint32 length)
+{
+    memset(entry, 0, sizeof(CaptureIndexEntry));
+    entry->offset = offset;
+    entry->timestamp = timestamp;
+    entry->length = length;
+    entry->serial = message.serial();
+    entry->replySerial = message.replySerial();
+    entry->headerHash = CaptureIndexEntry::hashHeaders(message);
+    entry->messageType = byte(message.type());
+}
+
+class CaptureWriterPrivate
+{
+public:
+    // buffered
+    bool write(const byte *data, size_t length);
+    bool flush();
+    bool writeAll(int fd, const byte *data, size_t length);
+    bool appendIndexEntry(const CaptureIndexEntry &entry);
+    bool flushIndex();
+    // appends the index file to the capture file
+    bool copyIndex();
+    void setError(Error::Code code);
+
+    int m_fd = -1;
+    int m_indexFd = -1; // unlinked right after creating it; copied to m_fd in finish()
+    uint64 m_fileSize = 0; // including the buffer
+    uint32 m_messageCount = 0;
+    Error m_error;
+    std::vector<byte> m_buffer;
+    std::vector<CaptureIndexEntry> m_indexBuffer;
+};
+
+bool CaptureWriterPrivate::write(const byte *data, size_t length)
+{
+    if (m_buffer.size() + length > s_writeBufferSize && !flush()) {
+        return false;
+    }
+    if (length >= s_writeBufferSize) {
+        if (!writeAll(m_fd, data, length)) {
+            return false;
+        }
+    } else {
+        m_buffer.insert(m_buffer.end(), data, data + length);
+    }
+    m_fileSize += length;
+    return true;
+}
+
+bool CaptureWriterPrivate::flush()
+{
+    const bool ok = writeAll(m_fd, m_buffer.data(), m_buffer.size());
+    m_buffer.clear();
+    return ok;
+}
+
+bool CaptureWriterPrivate::writeAll(int fd, const byte *data, size_t length)
+{
+#ifdef __unix__
+    while (length) {
+        const ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            setError(Error::CaptureFileIo);
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+#else
+    (void)fd;
+    (void)data;
+    (void)length;
+    setError(Error::CaptureFileIo);
+    return false;
+#endif
+}
+
+bool CaptureWriterPrivate::appendIndexEntry(const CaptureIndexEntry &entry)
+{
+    m_indexBuffer.push_back(entry);
+    m_messageCount++;
+    return m_indexBuffer.size() < s_indexBlockLength || flushIndex();
+}
+
+bool CaptureWriterPrivate::flushIndex()
+{
+    const bool ok = writeAll(m_indexFd, reinterpret_cast<const byte *>(m_indexBuffer.data()),
+                             m_indexBuffer.size() * sizeof(CaptureIndexEntry));
+    m_indexBuffer.clear();
+    return ok;
+}
+
+bool CaptureWriterPrivate::copyIndex()
+{
+#ifdef __unix__
+    if (lseek(m_indexFd, 0, SEEK_SET) != 0) {
+        setError(Error::CaptureFileIo);
+        return false;
+    }
+    m_buffer.resize(s_writeBufferSize);
+    while (true) {
+        const ssize_t count = ::read(m_indexFd, m_buffer.data(), m_buffer.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            setError(Error::CaptureFileIo);
+            return false;
+        }
+        if (!count || !writeAll(m_fd, m_buffer.data(), count)) {
+            return count == 0;
+        }
+    }
+#else
+    setError(Error::CaptureFileIo);
+    return false;
+#endif
+}
+
+void CaptureWriterPrivate::setError(Error::Code code)
+{
+    if (!m_error.isError()) {
+        m_error.setCode(code);
+    }
+}
+
+CaptureWriter::CaptureWriter()
+   : d(new CaptureWriterPrivate)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    finish();
+    delete d;
+}
+
+bool CaptureWriter::open(const std::string &fileName)
+{
+    finish();
+    d->m_error = Error();
+    d->m_fileSize = 0;
+    d->m_messageCount = 0;
+#ifdef __unix__
+    d->m_fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (d->m_fd >= 0) {
+        // next to the capture file, which is probably where there is room for it
+        const std::string indexFileName = fileName + ".index";
+        d->m_indexFd = ::open(indexFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (d->m_indexFd >= 0) {
+            unlink(indexFileName.c_str());
+        } else {
+            ::close(d->m_fd);
+            d->m_fd = -1;
+        }
+    }
+#else
+    (void)fileName;
+#endif
+    if (d->m_fd < 0) {
+        d->setError(Error::CaptureFileIo);
+        return false;
+    }
+    CaptureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_magic, sizeof(s_magic));
+    header.endianness = s_thisMachineEndianness;
+    header.version = s_version;
+    return d->write(reinterpret_cast<const byte *>(&header), sizeof(header));
+}
+
+bool CaptureWriter::isOpen() const
+{
+    return d->m_fd >= 0;
+}
+
+Error CaptureWriter::error() const
+{
+    return d->m_error;
+}
+
+bool CaptureWriter::append(const Message &message, int64 timestamp)
+{
+    if (d->m_fd < 0 || d->m_error.isError()) {
+        return false;
+    }
+    if (d->m_messageCount >= s_maxMessageCount) {
+        d->setError(Error::CaptureFileIo);
+        return false;
+    }
+    chunk data = MessagePrivate::get(&message)->serializedData();
+    std::vector<byte> saved;
+    if (!data.length) {
+        Message copy(message);
+        saved = copy.save();
+        if (saved.empty()) {
+            return false;
+        }
+        data = chunk(saved.data(), saved.size());
+    }
+
+    CaptureRecordHeader record;
+    record.timestamp = timestamp;
+    record.length = data.length;
+    record.reserved = 0;
+    CaptureIndexEntry entry;
+    fillIndexEntry(&entry, message, d->m_fileSize + sizeof(record), timestamp, data.length);
+
+    if (!d->write(reinterpret_cast<const byte *>(&record), sizeof(record)) ||
+        !d->write(data.ptr, data.length) ||
+        !d->write(s_zeroPadding, align(data.length, 8) - data.length)) {
+        return false;
+    }
+    return d->appendIndexEntry(entry);
+}
+
+uint32 CaptureWriter::messageCount() const
+{
+    return d->m_messageCount;
+}
+
+bool CaptureWriter::finish()
+{
+    if (d->m_fd < 0) {
+        return !d->m_error.isError();
+    }
+    const uint64 indexOffset = d->m_fileSize;
+    bool ok = !d->m_error.isError() && d->flush() && d->flushIndex() && d->copyIndex();
+#ifdef __unix__
+    if (ok) {
+        // the file header is complete now
+        CaptureFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, s_magic, sizeof(s_magic));
+        header.endianness = s_thisMachineEndianness;
+        header.version = s_version;
+        header.indexOffset = indexOffset;
+        header.messageCount = d->m_messageCount;
+        ok = pwrite(d->m_fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+    ok = ::close(d->m_fd) == 0 && ok;
+    ::close(d->m_indexFd);
+#endif
+    if (!ok) {
+        d->setError(Error::CaptureFileIo);
+    }
+    d->m_fd = -1;
+    d->m_indexFd = -1;
+    d->m_buffer.clear();
+    d->m_buffer.shrink_to_fit();
+    d->m_indexBuffer.clear();
+    d->m_indexBuffer.shrink_to_fit();
+    return ok;
+}
+
+class CaptureReaderPrivate
+{
+public:
+    bool useStoredIndex(const CaptureFileHeader &header);
+    void rebuildIndex();
+
+    SharedBuffer *m_mapping = nullptr;
+    size_t m_size = 0;
+    uint64 m_dataEnd = 0; // end of the message records
+    Error m_error;
+    bool m_hasStoredIndex = false;
+    const CaptureIndexEntry *m_index = nullptr;
+    uint32 m_messageCount = 0;
+    std::vector<CaptureIndexEntry> m_rebuiltIndex;
+};
+
+bool CaptureReaderPrivate::useStoredIndex(const CaptureFileHeader &header)
+{
+    const uint64 offset = header.indexOffset;
+    if (offset < sizeof(CaptureFileHeader) || offset % 8 || offset > m_size ||
+        header.messageCount > s_maxMessageCount ||
+        (m_size - offset) != header.messageCount * sizeof(CaptureIndexEntry)) {
+        return false;
+    }
+    // The entries are checked when they are used, so opening doesn't need to touch all of them
+    m_index = reinterpret_cast<const CaptureIndexEntry *>(m_mapping->data() + offset);
+    m_messageCount = header.messageCount;
+    m_dataEnd = offset;
+    m_hasStoredIndex = true;
+    return true;
+}
+
+void CaptureReaderPrivate::rebuildIndex()
+{
+    m_dataEnd = m_size;
+    uint64 pos = sizeof(CaptureFileHeader);
+    // an unfinished write of the last record is just ignored
+    while (m_size - pos >= sizeof(CaptureRecordHeader) && m_rebuiltIndex.size() < s_maxMessageCount) {
+        CaptureRecordHeader record;
+        memcpy(&record, m_mapping->data() + pos, sizeof(record));
+        const uint64 offset = pos + sizeof(record);
+        if (!record.length || record.length > m_size - offset) {
+            break;
+        }
+        CaptureIndexEntry entry;
+        m_mapping->ref();
+        Message message;
+        MessagePrivate::get(&message)->adoptReceivedData(chunk(m_mapping->data() + offset, record.length),
+                                                         m_mapping);
+        fillIndexEntry(&entry, message, offset, record.timestamp, record.length);
+        m_rebuiltIndex.push_back(entry);
+        pos = offset + align(record.length, 8);
+        if (pos > m_size) {
+            break;
+        }
+    }
+    m_index = m_rebuiltIndex.data();
+    m_messageCount = m_rebuiltIndex.size();
+    m_hasStoredIndex = false;
+}
+
+CaptureReader::CaptureReader()
+   : d(new CaptureReaderPrivate)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+    delete d;
+}
+
+bool CaptureReader::open(const std::string &fileName)
+{
+    close();
+    d->m_error = Error();
+#ifdef __unix__
+    const int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        d->m_error.setCode(Error::CaptureFileIo);
+        return false;
+    }
+    if (size_t(st.st_size) < sizeof(CaptureFileHeader)) {
+        ::close(fd);
+        d->m_error.setCode(Error::MalformedCaptureFile);
+        return false;
+    }
+    d->m_size = st.st_size;
+    // Private and writable, so that messages can be converted to host byte order in place without
+    // changing the file
+    void *mapping = mmap(nullptr, d->m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        d->m_size = 0;
+        d->m_error.setCode(Error::CaptureFileIo);
+        return false;
+    }
+    d->m_mapping = SharedBuffer::adoptFileMapping(mapping, d->m_size);
+    if (!d->m_mapping) {
+        munmap(mapping, d->m_size);
+        d->m_size = 0;
+        d->m_error.setCode(Error::CaptureFileIo);
+        return false;
+    }
+#else
+    (void)fileName;
+    d->m_error.setCode(Error::CaptureFileIo);
+    return false;
+#endif
+
+    CaptureFileHeader header;
+    memcpy(&header, d->m_mapping->data(), sizeof(header));
+    if (memcmp(header.magic, s_magic, sizeof(s_magic)) || header.endianness != s_thisMachineEndianness ||
+        header.version != s_version) {
+        close();
+        d->m_error.setCode(Error::MalformedCaptureFile);
+        return false;
+    }
+    if (!header.indexOffset) {
+        d->rebuildIndex();
+    } else if (!d->useStoredIndex(header)) {
+        close();
+        d->m_error.setCode(Error::MalformedCaptureFile);
+        return false;
+    }
+    return true;
+}
+
+void CaptureReader::close()
+{
+    if (d->m_mapping) {
+        d->m_mapping->deref();
+        d->m_mapping = nullptr;
+    }
+    d->m_size = 0;
+    d->m_dataEnd = 0;
+    d->m_hasStoredIndex = false;
+    d->m_index = nullptr;
+    d->m_messageCount = 0;
+    d->m_rebuiltIndex.clear();
+    d->m_rebuiltIndex.shrink_to_fit();
+}
+
+bool CaptureReader::isOpen() const
+{
+    return d->m_mapping;
+}
+
+Error CaptureReader::error() const
+{
+    return d->m_error;
+}
+
+bool CaptureReader::hasStoredIndex() const
+{
+    return d->m_hasStoredIndex;
+}
+
+uint32 CaptureReader::messageCount() const
+{
+    return d->m_messageCount;
+}
+
+const CaptureIndexEntry &CaptureReader::indexEntry(uint32 index) const
+{
+    assert(index < d->m_messageCount);
+    return d->m_index[index];
+}
+
+Message CaptureReader::message(uint32 index) const
+{
+    Message ret;
+    if (index >= d->m_messageCount) {
+        return ret;
+    }
+    const CaptureIndexEntry &entry = d->m_index[index];
+    // the data must be 8 byte aligned like received messages
+    if (entry.offset < sizeof(CaptureFileHeader) + sizeof(CaptureRecordHeader) || entry.offset % 8 ||
+        entry.length > d->m_dataEnd || entry.offset > d->m_dataEnd - entry.length) {
+        return ret;
+    }
+    d->m_mapping->ref();
+    MessagePrivate::get(&ret)->adoptReceivedData(chunk(d->m_mapping->data() + entry.offset, entry.length),
+                                                 d->m_mapping);
+    return ret;
+}
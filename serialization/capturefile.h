@@ -0,0 +1,127 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef CAPTUREFILE_H
+#define CAPTUREFILE_H
+
+#include "error.h"
+#include "types.h"
+
+#include <string>
+
+class CaptureReaderPrivate;
+class CaptureWriterPrivate;
+class Message;
+
+/*
+ Capture files store messages exactly as they were on the bus, for recording long stretches of
+ traffic and opening them again quickly. All fields are in host byte order, which the file header
+ records; files from machines with the other byte order are rejected.
+
+ - file header, 32 bytes: the magic "dfercap\0", the byte order ('l' or 'B'), the version (1),
+   6 reserved bytes, the uint64 file offset of the index and the uint64 message count. Both are 0
+   until CaptureWriter::finish() fills them in.
+ - for each message, 8 byte aligned: the int64 timestamp, the uint32 message length, 4 reserved
+   bytes, then the message data, zero padded to 8 bytes.
+ - the index: one CaptureIndexEntry per message, up to the end of the file.
+
+ Files whose writer did not finish, e.g. because it was killed, are still readable: their index is
+ rebuilt by reading all messages.
+*/
+
+// The summary of one message in the index of a capture file, which is used in place in the file
+struct DFERRY_EXPORT CaptureIndexEntry
+{
+    uint64 offset; // of the message data, after the record header
+    int64 timestamp; // as given to CaptureWriter::append()
+    uint32 length;
+    uint32 serial;
+    uint32 replySerial; // 0 if not a reply
+    uint32 headerHash; // see hashHeaders()
+    byte messageType; // a Message::Type
+    byte reserved[7];
+
+    // A hash of the path, interface, method and error name headers, to quickly find messages that
+    // probably match without looking at them
+    static uint32 hashHeaders(const Message &message);
+};
+
+class DFERRY_EXPORT CaptureWriter
+{
+public:
+    CaptureWriter();
+    ~CaptureWriter(); // calls finish()
+    CaptureWriter(const CaptureWriter &other) = delete;
+    CaptureWriter &operator=(const CaptureWriter &other) = delete;
+
+    // Creates the file, or truncates it if it exists. Returns false if that fails.
+    bool open(const std::string &fileName);
+    bool isOpen() const;
+    // the first error since open(), if any. After an error, nothing more is written.
+    Error error() const;
+
+    // Appends message in serialized form; it is serialized if needed, which requires it to be valid.
+    // Unix fds are not stored. The unit and clock of timestamp are up to the caller, but the index
+    // should be in ascending order of time, so it should be monotonic. dfer uses nanoseconds since
+    // the Unix epoch.
+    bool append(const Message &message, int64 timestamp);
+    uint32 messageCount() const;
+
+    // Writes the index and closes the file. Until then, the index is collected in a deleted
+    // temporary file next to the capture file, so memory use doesn't grow with the message count.
+    bool finish();
+
+private:
+    CaptureWriterPrivate *d;
+};
+
+class DFERRY_EXPORT CaptureReader
+{
+public:
+    CaptureReader();
+    ~CaptureReader();
+    CaptureReader(const CaptureReader &other) = delete;
+    CaptureReader &operator=(const CaptureReader &other) = delete;
+
+    // Maps the file into memory. Returns false if it is not a readable capture file.
+    bool open(const std::string &fileName);
+    void close();
+    bool isOpen() const;
+    Error error() const;
+    // false if the index was rebuilt because the writer did not finish
+    bool hasStoredIndex() const;
+
+    uint32 messageCount() const;
+    // index must be less than messageCount()
+    const CaptureIndexEntry &indexEntry(uint32 index) const;
+    // Returns the message without copying it: the message and its copies point into the file
+    // mapping, which they keep alive even after close(). Returns an invalid message if the data is
+    // malformed.
+    Message message(uint32 index) const;
+
+private:
+    CaptureReaderPrivate *d;
+};
+
+#endif // CAPTUREFILE_H
@@ -0,0 +1,186 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "datawalker.h"
+
+#include "arguments.h"
+#include "basictypeio.h"
+#include "byteswap.h"
+#include "signatureprogram.h"
+
+#include <cassert>
+#include <memory>
+
+static const uint32 s_maxArrayLength = 67108864; // 64 MiB
+static const uint32 s_maxTotalNesting = 64;
+
+DataWalker::DataWalker(chunk data, bool isByteSwapped, Mode mode)
+   : m_data(data),
+     m_pos(0),
+     m_isByteSwapped(isByteSwapped),
+     m_doConvert(mode == ConvertToHostByteOrder)
+{
+    assert(!m_doConvert || m_isByteSwapped);
+}
+
+bool DataWalker::skipAll(const SignatureProgram *program)
+{
+    uint32 sigPos = 0;
+    while (sigPos < program->length()) {
+        if (!skipSingleCompleteType(program, &sigPos)) {
+            return false;
+        }
+    }
+    return m_pos == m_data.length;
+}
+
+bool DataWalker::alignTo(uint32 alignment)
+{
+    m_pos = align(m_pos, alignment);
+    return m_pos <= m_data.length;
+}
+
+uint32 DataWalker::readUint32()
+{
+    assert(has(sizeof(uint32)));
+    const uint32 ret = basic::readUint32(m_data.ptr + m_pos, m_isByteSwapped);
+    swap(1, sizeof(uint32));
+    m_pos += sizeof(uint32);
+    return ret;
+}
+
+void DataWalker::swap(uint32 count, uint32 elementSize)
+{
+    if (m_doConvert && elementSize > 1) {
+        byte *p = m_data.ptr + m_pos;
+        byteswap::copySwapped(p, p, count, elementSize);
+    }
+}
+
+bool DataWalker::skipSingleCompleteType(const SignatureProgram *program, uint32 *sigPos, uint32 depth)
+{
+    const SignatureProgram::Instruction &ins = program->at(*sigPos);
+    if (!alignTo(ins.alignment)) {
+        return false;
+    }
+
+    if (ins.isPrimitive) {
+        if (!has(ins.alignment)) {
+            return false;
+        }
+        swap(1, ins.alignment);
+        m_pos += ins.alignment;
+        *sigPos += 1;
+        return true;
+    }
+
+    switch (ins.state()) {
+    case Arguments::String:
+    case Arguments::ObjectPath:
+    case Arguments::Signature: {
+        const uint32 prefixSize = ins.alignment; // 4, or 1 for signatures
+        if (!has(prefixSize)) {
+            return false;
+        }
+        const uint32 length = prefixSize == 1 ? m_data.ptr[m_pos++] : readUint32();
+        if (length >= s_maxArrayLength || !has(length + 1)) {
+            return false;
+        }
+        m_pos += length + 1;
+        *sigPos += 1;
+        return true;
+    }
+    case Arguments::BeginVariant: {
+        if (!has(1)) {
+            return false;
+        }
+        const uint32 sigLength = m_data.ptr[m_pos++];
+        if (!has(sigLength + 1) || m_data.ptr[m_pos + sigLength] != 0) {
+            return false;
+        }
+        std::shared_ptr<const SignatureProgram> uncached;
+        const SignatureProgram *variantProgram =
+            SignatureProgram::get(cstring(m_data.ptr + m_pos, sigLength), &uncached);
+        m_pos += sigLength + 1;
+        if (!variantProgram || variantProgram->completeTypeCount() != 1 ||
+            depth + 1 + variantProgram->at(0).totalDepth > s_maxTotalNesting) {
+            return false;
+        }
+        uint32 variantSigPos = 0;
+        if (!skipSingleCompleteType(variantProgram, &variantSigPos, depth + 1)) {
+            return false;
+        }
+        *sigPos += 1;
+        return true;
+    }
+    case Arguments::BeginStruct:
+    case Arguments::BeginDict: {
+        // a dict entry is handled here when iterating over the elements of a dict
+        uint32 fieldPos = *sigPos + 1;
+        while (fieldPos + 1 < ins.end) {
+            if (!skipSingleCompleteType(program, &fieldPos, depth + 1)) {
+                return false;
+            }
+        }
+        *sigPos = ins.end;
+        return true;
+    }
+    case Arguments::BeginArray: {
+        if (!has(4)) {
+            return false;
+        }
+        const uint32 arrayLength = readUint32();
+        const uint32 elementPos = *sigPos + 1;
+        const SignatureProgram::Instruction &element = program->at(elementPos);
+        if (arrayLength > s_maxArrayLength || !alignTo(element.alignment) || !has(arrayLength)) {
+            return false;
+        }
+        const uint32 arrayEnd = m_pos + arrayLength;
+        if (element.isPrimitive) {
+            if (arrayLength % element.alignment) {
+                return false;
+            }
+            swap(arrayLength / element.alignment, element.alignment);
+            m_pos = arrayEnd;
+        } else if (element.isFixedSize && !m_isByteSwapped) {
+            // nothing to find inside, Reader checks the layout. Not when byte-swapped, so that
+            // a checking pass before converting checks everything that converting relies on.
+            m_pos = arrayEnd;
+        } else {
+            while (m_pos < arrayEnd) {
+                uint32 pos = elementPos;
+                if (!skipSingleCompleteType(program, &pos, depth + 1)) {
+                    return false;
+                }
+            }
+            if (m_pos != arrayEnd) {
+                return false;
+            }
+        }
+        *sigPos = ins.end;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
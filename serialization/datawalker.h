@@ -0,0 +1,68 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#ifndef DATAWALKER_H
+#define DATAWALKER_H
+
+#include "types.h"
+
+class SignatureProgram;
+
+// Walks over serialized data using only its structure - array and string lengths and variant
+// signatures - which is much cheaper than going through a Reader. It checks just what it needs to find
+// the elements; the rest is up to Reader, later. It can also convert the data to host byte order on
+// the way. Lengths are always read in the original byte order, so a checking pass and a converting
+// pass see the same lengths.
+class DataWalker
+{
+public:
+    enum Mode
+    {
+        Skip = 0,
+        ConvertToHostByteOrder
+    };
+
+    DataWalker(chunk data, bool isByteSwapped, Mode mode = Skip);
+
+    // all of the data, which must end exactly after the last element
+    bool skipAll(const SignatureProgram *program);
+    // on success, *signaturePosition is one past the element
+    bool skipSingleCompleteType(const SignatureProgram *program, uint32 *signaturePosition,
+                                uint32 depth = 0);
+
+    uint32 position() const { return m_pos; }
+    bool alignTo(uint32 alignment);
+    bool has(uint32 length) const { return length <= m_data.length - m_pos; }
+    // reads and skips an array length or string length prefix (which must be there)
+    uint32 readUint32();
+
+private:
+    void swap(uint32 count, uint32 elementSize);
+
+    chunk m_data;
+    uint32 m_pos;
+    bool m_isByteSwapped;
+    bool m_doConvert;
+};
+
+#endif // DATAWALKER_H
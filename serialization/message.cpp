@@ -26,14 +26,22 @@
 
 #include "basictypeio.h"
 #include "malloccache.h"
+#include "stringinterner.h"
 #include "stringtools.h"
+#include "validation.h"
 
 #ifndef DFERRY_SERDES_ONLY
 #include "icompletionclient.h"
 #include "iconnection.h"
 #endif
 
+#ifdef __unix__
+#include <sys/mman.h>
+#endif
+
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <sstream>
 #include <thread>
@@ -48,14 +56,20 @@ static const byte s_thisMachineEndianness = 'b';
 static const byte s_thisMachineEndianness = 'l';
 #endif
 
+// small message buffers, which e.g. receiving starts with, come from a cache
+static const uint32 s_cachedBufferCapacity = 256;
+
 struct MsgAllocCaches
 {
     MallocCache<sizeof(MessagePrivate), 4> msgPrivate;
-    MallocCache<256, 4> msgBuffer;
+    MallocCache<sizeof(SharedBuffer) + s_cachedBufferCapacity, 4> msgBuffer;
 };
 
 thread_local static MsgAllocCaches msgAllocCaches;
 
+static std::atomic<uint32> s_mappedBufferThreshold(1024 * 1024);
+static std::atomic<bool> s_isHeaderInterningEnabled(false);
+
 static const byte s_storageForHeader[Message::UnixFdsHeader + 1] = {
     0, // dummy entry: there is no enum value for 0
     0xf0 | 0, // PathHeader
@@ -98,25 +112,27 @@ VarHeaderStorage::VarHeaderStorage()
 {} // initialization values are in class declaration
 
 VarHeaderStorage::VarHeaderStorage(const VarHeaderStorage &other)
+   : m_headerPresenceBitmap(other.m_headerPresenceBitmap),
+     m_ownedStringBitmap(other.m_ownedStringBitmap)
 {
-    // ### very suboptimal
-    for (int i = 0; i < Message::UnixFdsHeader + 1; i++) {
-        Message::VariableHeader vh = static_cast<Message::VariableHeader>(i);
-        if (other.hasHeader(vh)) {
-            if (isStringHeader(vh)) {
-                setStringHeader(vh, other.stringHeader(vh));
-            } else {
-                setIntHeader(vh, other.intHeader(vh));
-            }
+    for (int i = 0; i < s_stringHeaderCount; i++) {
+        const Message::VariableHeader field = s_stringHeaderAtIndex[i];
+        if (m_ownedStringBitmap & (1u << field)) {
+            new(stringHeaders() + i) string(other.stringHeaders()[i]);
+        } else {
+            m_borrowedStrings[i] = other.m_borrowedStrings[i];
         }
     }
+    for (int i = 0; i < s_intHeaderCount; i++) {
+        m_intHeaders[i] = other.m_intHeaders[i];
+    }
 }
 
 VarHeaderStorage::~VarHeaderStorage()
 {
     for (int i = 0; i < s_stringHeaderCount; i++) {
         const Message::VariableHeader field = s_stringHeaderAtIndex[i];
-        if (hasHeader(field)) {
+        if (m_ownedStringBitmap & (1u << field)) {
             stringHeaders()[i].~string();
         }
     }
@@ -139,21 +155,22 @@ bool VarHeaderStorage::hasIntHeader(Message::VariableHeader header) const
 
 string VarHeaderStorage::stringHeader(Message::VariableHeader header) const
 {
-    return hasStringHeader(header) ? stringHeaders()[indexOfHeader(header)] : string();
+    const cstring str = hasStringHeader(header) ? stringHeaderRaw(header) : cstring();
+    return str.ptr ? string(str.ptr, str.length) : string();
 }
 
-cstring VarHeaderStorage::stringHeaderRaw(Message::VariableHeader header)
+cstring VarHeaderStorage::stringHeaderRaw(Message::VariableHeader header) const
 {
-    // this one is supposed to be a const method in the intended use, but it is dangerous so
-    // outwardly non-const is kind of okay as a warning
-    cstring ret;
     assert(isStringHeader(header));
-    if (hasHeader(header)) {
-        string &str = stringHeaders()[indexOfHeader(header)];
-        ret.ptr = const_cast<char *>(str.c_str());
-        ret.length = str.length();
+    if (!hasHeader(header)) {
+        return cstring();
     }
-    return ret;
+    const int idx = indexOfHeader(header);
+    if (m_ownedStringBitmap & (1u << header)) {
+        const string &str = stringHeaders()[idx];
+        return cstring(str.c_str(), str.length());
+    }
+    return m_borrowedStrings[idx];
 }
 
 void VarHeaderStorage::setStringHeader(Message::VariableHeader header, const string &value)
@@ -162,10 +179,11 @@ void VarHeaderStorage::setStringHeader(Message::VariableHeader header, const str
         return;
     }
     const int idx = indexOfHeader(header);
-    if (hasHeader(header)) {
+    if (m_ownedStringBitmap & (1u << header)) {
         stringHeaders()[idx] = value;
     } else {
         m_headerPresenceBitmap |= 1u << header;
+        m_ownedStringBitmap |= 1u << header;
         new(stringHeaders() + idx) string(value);
     }
 }
@@ -177,7 +195,7 @@ bool VarHeaderStorage::setStringHeader_deser(Message::VariableHeader header, cst
         return false;
     }
     m_headerPresenceBitmap |= 1u << header;
-    new(stringHeaders() + indexOfHeader(header)) string(value.ptr, value.length);
+    m_borrowedStrings[indexOfHeader(header)] = value;
     return true;
 }
 
@@ -186,10 +204,72 @@ void VarHeaderStorage::clearStringHeader(Message::VariableHeader header)
     if (!isStringHeader(header)) {
         return;
     }
-    if (hasHeader(header)) {
-        m_headerPresenceBitmap &= ~(1u << header);
+    if (m_ownedStringBitmap & (1u << header)) {
         stringHeaders()[indexOfHeader(header)].~string();
     }
+    m_headerPresenceBitmap &= ~(1u << header);
+    m_ownedStringBitmap &= ~(1u << header);
+}
+
+static bool isInBuffer(const char *ptr, chunk buffer)
+{
+    const byte *p = reinterpret_cast<const byte *>(ptr);
+    return p >= buffer.ptr && p < buffer.ptr + buffer.length;
+}
+
+void VarHeaderStorage::makeOwned(int index)
+{
+    const cstring str = m_borrowedStrings[index];
+    new(stringHeaders() + index) string(str.ptr, str.length);
+    m_ownedStringBitmap |= 1u << s_stringHeaderAtIndex[index];
+}
+
+void VarHeaderStorage::detachFromBuffer(chunk buffer)
+{
+    for (int i = 0; i < s_stringHeaderCount; i++) {
+        const uint32 bit = 1u << s_stringHeaderAtIndex[i];
+        if ((m_headerPresenceBitmap & bit) && !(m_ownedStringBitmap & bit) &&
+            isInBuffer(m_borrowedStrings[i].ptr, buffer)) {
+            makeOwned(i);
+        }
+    }
+}
+
+void VarHeaderStorage::makeAllOwned()
+{
+    for (int i = 0; i < s_stringHeaderCount; i++) {
+        const uint32 bit = 1u << s_stringHeaderAtIndex[i];
+        if ((m_headerPresenceBitmap & bit) && !(m_ownedStringBitmap & bit)) {
+            makeOwned(i);
+        }
+    }
+}
+
+void VarHeaderStorage::borrowFrom(const VarHeaderStorage &other)
+{
+    assert(!m_headerPresenceBitmap);
+    m_headerPresenceBitmap = other.m_headerPresenceBitmap;
+    for (int i = 0; i < s_stringHeaderCount; i++) {
+        if (m_headerPresenceBitmap & (1u << s_stringHeaderAtIndex[i])) {
+            m_borrowedStrings[i] = other.stringHeaderRaw(s_stringHeaderAtIndex[i]);
+        }
+    }
+    for (int i = 0; i < s_intHeaderCount; i++) {
+        m_intHeaders[i] = other.m_intHeaders[i];
+    }
+}
+
+void VarHeaderStorage::rebaseBorrowedStrings(chunk oldBuffer, byte *newBuffer)
+{
+    for (int i = 0; i < s_stringHeaderCount; i++) {
+        const Message::VariableHeader field = s_stringHeaderAtIndex[i];
+        const uint32 bit = 1u << field;
+        cstring &str = m_borrowedStrings[i];
+        if ((m_headerPresenceBitmap & bit) && !(m_ownedStringBitmap & bit) &&
+            isInBuffer(str.ptr, oldBuffer)) {
+            str.ptr = reinterpret_cast<char *>(newBuffer) + (str.ptr - reinterpret_cast<char *>(oldBuffer.ptr));
+        }
+    }
 }
 
 uint32 VarHeaderStorage::intHeader(Message::VariableHeader header) const
@@ -236,6 +316,9 @@ MessagePrivate::MessagePrivate(Message *parent)
      m_flags(0),
      m_protocolVersion(1),
      m_dirty(true),
+     m_isBufferInArguments(false),
+     m_isHeaderFromTemplate(false),
+     m_sharedBuffer(nullptr),
      m_headerLength(0),
      m_headerPadding(0),
      m_bodyLength(0),
@@ -251,23 +334,39 @@ MessagePrivate::MessagePrivate(const MessagePrivate &other, Message *parent)
      m_flags(other.m_flags),
      m_protocolVersion(other.m_protocolVersion),
      m_dirty(other.m_dirty),
+     m_isBufferInArguments(false),
+     m_isHeaderFromTemplate(other.m_isHeaderFromTemplate),
+     m_sharedBuffer(nullptr),
      m_headerLength(other.m_headerLength),
      m_headerPadding(other.m_headerPadding),
      m_bodyLength(other.m_bodyLength),
      m_serial(other.m_serial),
      m_error(other.m_error),
-     m_mainArguments(other.m_mainArguments),
+     // copying Arguments that borrow from the buffer would copy their data, but the buffer is shared
+     m_mainArguments(other.isBufferShareable() && other.m_sharedBuffer && other.areArgumentsInBuffer()
+                     ? other.m_mainArguments.withData(other.m_mainArguments.signature(),
+                                                      other.m_mainArguments.data())
+                     : other.m_mainArguments),
+     m_template(other.m_template),
      m_varHeaders(other.m_varHeaders)
 {
-    if (other.m_buffer.ptr) {
-        // we don't keep pointers into the buffer (only indexes), right? right?
-        m_buffer.ptr = static_cast<byte *>(malloc(other.m_buffer.length));
-        m_buffer.length = other.m_buffer.length;
+    if (!other.m_buffer.ptr) {
+        assert(!m_buffer.length);
+    } else if (other.isBufferShareable() && other.m_sharedBuffer) {
+        other.m_sharedBuffer->ref();
+        m_sharedBuffer = other.m_sharedBuffer;
+        m_buffer = other.m_buffer;
+    } else if (other.isBufferShareable() && m_mainArguments.d == other.m_mainArguments.d) {
+        // the buffer is in the memory of the arguments, which are shared now
+        m_buffer = other.m_buffer;
+        m_isBufferInArguments = true;
+    } else {
+        m_sharedBuffer = SharedBuffer::create(other.m_buffer.length);
+        m_buffer = chunk(m_sharedBuffer->data(), other.m_buffer.length);
         // Simplification: don't try to figure out which part of other.m_buffer contains "valid" data,
         // just copy everything.
         memcpy(m_buffer.ptr, other.m_buffer.ptr, other.m_buffer.length);
-    } else {
-        assert(!m_buffer.length);
+        m_varHeaders.rebaseBorrowedStrings(other.m_buffer, m_buffer.ptr);
     }
     // ### Maybe warn when copying a Message which is currently (de)serializing. It might even be impossible
     //     to do that from client code. If that is the case, the "warning" could even be an assertion because
@@ -276,7 +375,7 @@ MessagePrivate::MessagePrivate(const MessagePrivate &other, Message *parent)
 
 MessagePrivate::~MessagePrivate()
 {
-    clearBuffer();
+    releaseBuffer(); // no need to detach anything from it
 }
 
 Message::Message()
@@ -358,7 +457,13 @@ void Message::setCall(const string &path, const string &interface, const string
 
 void Message::setCall(const string &path, const string &method)
 {
-    setCall(path, string(), method);
+    // the interface header is optional for method calls, but must not be empty when present
+    setType(MethodCallMessage);
+    setPath(path);
+    d->m_dirty = true;
+    d->m_isHeaderFromTemplate = false;
+    d->m_varHeaders.clearStringHeader(InterfaceHeader);
+    setMethod(method);
 }
 
 void Message::setReplyTo(const Message &call)
@@ -607,6 +712,29 @@ string Message::stringHeader(VariableHeader header, bool *isPresent) const
     return exists ? d->m_varHeaders.stringHeader(header) : string();
 }
 
+cstring Message::stringHeaderRaw(VariableHeader header) const
+{
+    return d->m_varHeaders.hasStringHeader(header) ? d->m_varHeaders.stringHeaderRaw(header) : cstring();
+}
+
+// static
+void Message::setHeaderInterningEnabled(bool enabled)
+{
+    s_isHeaderInterningEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+// static
+bool Message::isHeaderInterningEnabled()
+{
+    return s_isHeaderInterningEnabled.load(std::memory_order_relaxed);
+}
+
+// static
+cstring Message::internString(cstring str)
+{
+    return StringInterner::intern(str);
+}
+
 void Message::setStringHeader(VariableHeader header, const string &value)
 {
     if (header == SignatureHeader) {
@@ -614,6 +742,7 @@ void Message::setStringHeader(VariableHeader header, const string &value)
         return;
     }
     d->m_dirty = true;
+    d->m_isHeaderFromTemplate = false;
     d->m_varHeaders.setStringHeader(header, value);
 }
 
@@ -629,6 +758,7 @@ uint32 Message::intHeader(VariableHeader header, bool *isPresent) const
 void Message::setIntHeader(VariableHeader header, uint32 value)
 {
     d->m_dirty = true;
+    d->m_isHeaderFromTemplate = false;
     d->m_varHeaders.setIntHeader(header, value);
 }
 
@@ -648,7 +778,10 @@ void Message::setExpectsReply(bool expectsReply)
 
 void Message::setArguments(Arguments arguments)
 {
+    // if that fails, the serialized data is gone, but it would be serialized again anyway
+    d->detachBufferFromArguments();
     d->m_dirty = true;
+    d->m_isHeaderFromTemplate = false;
     d->m_error = arguments.error();
     d->m_mainArguments = std::move(arguments);
 
@@ -665,9 +798,45 @@ const Arguments &Message::arguments() const
     return d->m_mainArguments;
 }
 
+// This much is enough for the headers of most messages, in addition to the unused part of the
+// space reserved for the signature
+static const uint32 s_bodyWriterHeaderSpace = 256;
+
+// static
+Arguments::Writer Message::bodyWriter()
+{
+    return Arguments::Writer(s_bodyWriterHeaderSpace);
+}
+
 static const uint32 s_properFixedHeaderLength = 12;
 static const uint32 s_extendedFixedHeaderLength = 16;
 static const uint32 s_maxMessageLength = 134217728;
+// SCM_MAX_FD of Linux, the most that can be passed with one write to a local socket
+static const uint32 s_maxUnixFds = 253;
+
+bool Message::convertToHostByteOrder()
+{
+    if (!d->m_isByteSwapped) {
+        return true;
+    }
+    if (d->m_state != MessagePrivate::Deserialized || !d->unshareBuffer() ||
+        !d->m_mainArguments.convertToHostByteOrder()) {
+        return false;
+    }
+    // the variable headers were validated when receiving, so this can't fail. It also converts the
+    // serial, which serves as a fake int to start the header array 8 byte aligned in headerArgs.
+    byte *base = d->m_buffer.ptr + s_properFixedHeaderLength - sizeof(int32);
+    chunk headerData(base, d->m_headerLength - d->m_headerPadding - s_properFixedHeaderLength +
+                           sizeof(int32));
+    Arguments headerArgs(nullptr, cstring("ia(yv)"), headerData, true);
+    const bool ok = headerArgs.convertToHostByteOrder();
+    assert(ok);
+    (void)ok;
+    basic::writeUint32(d->m_buffer.ptr + sizeof(uint32), d->m_bodyLength);
+    d->m_buffer.ptr[0] = s_thisMachineEndianness;
+    d->m_isByteSwapped = false;
+    return true;
+}
 
 #ifndef DFERRY_SERDES_ONLY
 void MessagePrivate::receive(IConnection *conn)
@@ -676,6 +845,8 @@ void MessagePrivate::receive(IConnection *conn)
         std::cerr << "MessagePrivate::receive() Error A.\n";
         return;
     }
+    clearBuffer();
+    m_isHeaderFromTemplate = false;
     conn->addClient(this);
     setReadNotificationEnabled(true);
     m_state = MessagePrivate::Deserializing;
@@ -741,7 +912,10 @@ void MessagePrivate::notifyConnectionReadyRead()
             // reading variable headers and/or body
             readMax = m_headerLength + m_bodyLength - m_bufferPos;
         }
-        reserveBuffer(m_bufferPos + readMax);
+        if (!reserveBuffer(m_bufferPos + readMax)) {
+            isError = true;
+            break;
+        }
 
         const bool headersDone = m_headerLength > 0 && m_bufferPos >= m_headerLength;
 
@@ -821,19 +995,29 @@ void MessagePrivate::notifyConnectionReadyWrite()
 
 std::vector<byte> Message::save()
 {
-    vector<byte> ret;
+    const chunk data = saveView();
+    return vector<byte>(data.ptr, data.ptr + data.length);
+}
+
+chunk Message::saveView()
+{
     if (d->m_state > MessagePrivate::LastSteadyState) {
-        return ret;
+        return chunk();
     }
     if (!d->m_buffer.length && !d->serialize()) {
         // TODO report error?
-        return ret;
+        return chunk();
     }
-    ret.reserve(d->m_buffer.length);
-    for (uint32 i = 0; i < d->m_buffer.length; i++) {
-        ret.push_back(d->m_buffer.ptr[i]);
+    return d->serializedData();
+}
+
+uint32 Message::saveInto(chunk buffer)
+{
+    const chunk data = saveView();
+    if (data.length && data.length <= buffer.length) {
+        memcpy(buffer.ptr, data.ptr, data.length);
     }
-    return ret;
+    return data.length;
 }
 
 // This does not return bool because full validation of the main arguments would take quite
@@ -843,31 +1027,98 @@ void Message::load(const std::vector<byte> &data)
     if (d->m_state > MessagePrivate::LastSteadyState) {
         return;
     }
-    d->m_headerLength = 0;
-    d->m_bodyLength = 0;
+    SharedBuffer *buffer = SharedBuffer::create(data.size());
+    if (!buffer) {
+        return;
+    }
+    memcpy(buffer->data(), data.data(), data.size());
+    d->adoptReceivedData(chunk(buffer->data(), data.size()), buffer);
+}
+
+bool Message::loadView(chunk data, std::shared_ptr<const void> owner)
+{
+    if (d->m_state > MessagePrivate::LastSteadyState) {
+        return false;
+    }
+    SharedBuffer *buffer = nullptr;
+    // Readers hand out pointers to array data, so the data must be aligned like it is in the message
+    if (reinterpret_cast<uintptr_t>(data.ptr) & 7) {
+        buffer = SharedBuffer::create(data.length);
+        if (buffer) {
+            memcpy(buffer->data(), data.ptr, data.length);
+        }
+    } else {
+        buffer = SharedBuffer::createExternal(data.ptr, std::move(owner));
+    }
+    if (!buffer) {
+        return false;
+    }
+    return d->adoptReceivedData(chunk(buffer->data(), data.length), buffer);
+}
+
+// static
+bool MessagePrivate::peekMessageLength(chunk data, uint32 *length)
+{
+    *length = 0;
+    if (data.length < s_extendedFixedHeaderLength) {
+        return true;
+    }
+    // data may be unaligned
+    uint32 fixedHeader[s_extendedFixedHeaderLength / sizeof(uint32)];
+    memcpy(fixedHeader, data.ptr, s_extendedFixedHeaderLength);
+    const byte endianness = data.ptr[0];
+    if (endianness != 'l' && endianness != 'B') {
+        return false;
+    }
+    const bool isByteSwapped = endianness != s_thisMachineEndianness;
+    const byte *p = reinterpret_cast<const byte *>(fixedHeader);
+    const uint32 bodyLength = basic::readUint32(p + sizeof(uint32), isByteSwapped);
+    const uint32 varArrayLength = basic::readUint32(p + 3 * sizeof(uint32), isByteSwapped);
+    // check the parts first so that the sum can't overflow
+    if (bodyLength > s_maxMessageLength || varArrayLength > s_maxMessageLength) {
+        return false;
+    }
+    const uint32 messageLength = align(s_extendedFixedHeaderLength + varArrayLength, 8) + bodyLength;
+    if (messageLength > s_maxMessageLength) {
+        return false;
+    }
+    *length = messageLength;
+    return true;
+}
 
-    d->clearBuffer();
-    d->m_buffer.length = data.size();
-    d->m_bufferPos = d->m_buffer.length;
-    d->m_buffer.ptr = reinterpret_cast<byte *>(malloc(d->m_buffer.length));
-    memcpy(d->m_buffer.ptr, &data[0], d->m_buffer.length);
+bool MessagePrivate::adoptReceivedData(chunk data, SharedBuffer *buffer)
+{
+    m_headerLength = 0;
+    m_bodyLength = 0;
 
-    bool ok = d->m_buffer.length >= s_extendedFixedHeaderLength;
-    ok = ok && d->deserializeFixedHeaders();
-    ok = ok && d->m_buffer.length >= d->m_headerLength;
-    ok = ok && d->deserializeVariableHeaders();
-    ok = ok && d->m_buffer.length == d->m_headerLength + d->m_bodyLength;
+    clearBuffer();
+    m_isHeaderFromTemplate = false;
+    m_buffer = data;
+    m_bufferPos = data.length;
+    m_sharedBuffer = buffer;
+
+    bool ok = m_buffer.length >= s_extendedFixedHeaderLength;
+    ok = ok && deserializeFixedHeaders();
+    ok = ok && m_buffer.length >= m_headerLength;
+    ok = ok && deserializeVariableHeaders();
+    ok = ok && m_buffer.length == m_headerLength + m_bodyLength;
 
     if (!ok) {
-        d->m_state = MessagePrivate::Empty;
-        d->clearBuffer();
-        return;
+        m_state = Empty;
+        clearBuffer();
+        return false;
     }
 
-    chunk bodyData(d->m_buffer.ptr + d->m_headerLength, d->m_bodyLength);
-    d->m_mainArguments = Arguments(nullptr, d->m_varHeaders.stringHeaderRaw(SignatureHeader),
-                                   bodyData, d->m_isByteSwapped);
-    d->m_state = MessagePrivate::Deserialized;
+    chunk bodyData(m_buffer.ptr + m_headerLength, m_bodyLength);
+    m_mainArguments = Arguments(nullptr, m_varHeaders.stringHeaderRaw(Message::SignatureHeader),
+                                bodyData, m_isByteSwapped);
+    m_state = Deserialized;
+    return true;
+}
+
+void MessagePrivate::adoptFileDescriptors(std::vector<int> *fds)
+{
+    m_mainArguments.swapFileDescriptors(fds);
 }
 
 bool MessagePrivate::requiredHeadersPresent()
@@ -952,78 +1203,122 @@ bool MessagePrivate::deserializeFixedHeaders()
     return m_headerLength + m_bodyLength <= s_maxMessageLength;
 }
 
-bool MessagePrivate::deserializeVariableHeaders()
+// value must be null-terminated
+static bool isStringHeaderValueValid(Message::VariableHeader header, cstring value)
 {
-    // use Arguments to parse the variable header fields
-    // HACK: the fake first int argument is there to start the Arguments's data 8 byte aligned
-    byte *base = m_buffer.ptr + s_properFixedHeaderLength - sizeof(int32);
-    chunk headerData(base, m_headerLength - m_headerPadding - s_properFixedHeaderLength + sizeof(int32));
-    cstring varHeadersSig("ia(yv)");
-    Arguments argList(nullptr, varHeadersSig, headerData, m_isByteSwapped);
+    switch (header) {
+    case Message::InterfaceHeader:
+    case Message::ErrorNameHeader:
+        return validation::isInterfaceName(value);
+    case Message::MethodHeader:
+        return validation::isMemberName(value);
+    case Message::DestinationHeader:
+    case Message::SenderHeader:
+        return validation::isBusName(value);
+    default:
+        return validation::isUtf8(value);
+    }
+}
 
-    Arguments::Reader reader(argList);
-    assert(reader.isValid());
+// The wire type of each header field, which is the only valid variant signature for it
+static const char s_typeOfHeader[Message::UnixFdsHeader + 1] = {
+    0, // dummy entry: there is no enum value for 0
+    'o', // PathHeader
+    's', // InterfaceHeader
+    's', // MethodHeader
+    's', // ErrorNameHeader
+    'u', // ReplySerialHeader
+    's', // DestinationHeader
+    's', // SenderHeader
+    'g', // SignatureHeader
+    'u'  // UnixFdsHeader
+};
 
-    if (reader.state() != Arguments::Int32) {
-        return false;
-    }
-    reader.readInt32();
-    if (reader.state() != Arguments::BeginArray) {
-        return false;
-    }
-    reader.beginArray();
+// Aligns *pos, checking that the padding is zero and within end
+static bool skipPadding(const byte *data, uint32 *pos, uint32 alignment, uint32 end)
+{
+    const uint32 padStart = *pos;
+    *pos = align(padStart, alignment);
+    return *pos <= end && validation::isZero(data + padStart, *pos - padStart);
+}
 
-    while (reader.state() == Arguments::BeginStruct) {
-        reader.beginStruct();
-        const byte headerField = reader.readByte();
+// This parses the "a(yv)" variable header array directly instead of with an Arguments::Reader,
+// which is much faster. The checks are the same as the Reader's, plus the ones for the header
+// fields: each field must occur at most once and have its specific type, as if by a variant
+// signature of one letter.
+bool MessagePrivate::deserializeVariableHeaders()
+{
+    const byte *const data = m_buffer.ptr;
+    // the array length, which is at s_properFixedHeaderLength, determines the header length
+    const uint32 end = m_headerLength - m_headerPadding;
+    const bool isInterning = Message::isHeaderInterningEnabled();
+
+    // the first element is at an 8 byte aligned position, so there is no padding before it
+    uint32 pos = s_extendedFixedHeaderLength;
+    while (pos < end) {
+        // struct (yv)
+        if (!skipPadding(data, &pos, 8, end) || pos + 4 > end) {
+            return false;
+        }
+        const byte headerField = data[pos];
         if (headerField < Message::PathHeader || headerField > Message::UnixFdsHeader) {
             return false;
         }
         const Message::VariableHeader eHeader = static_cast<Message::VariableHeader>(headerField);
-
-        reader.beginVariant();
-
-        bool ok = true; // short-circuit evaluation ftw
-        if (isStringHeader(headerField)) {
-            if (headerField == Message::PathHeader) {
-                ok = ok && reader.state() == Arguments::ObjectPath;
-                ok = ok && m_varHeaders.setStringHeader_deser(eHeader, reader.readObjectPath());
-            } else if (headerField == Message::SignatureHeader) {
-                ok = ok && reader.state() == Arguments::Signature;
-                // The spec allows having no signature header, which means "empty signature". However...
-                // We do not drop empty signature headers when deserializing, in order to preserve
-                // the original message contents. This could be useful for debugging and testing.
-                ok = ok && m_varHeaders.setStringHeader_deser(eHeader, reader.readSignature());
-            } else {
-                ok = ok && reader.state() == Arguments::String;
-                ok = ok && m_varHeaders.setStringHeader_deser(eHeader, reader.readString());
-            }
+        const char type = s_typeOfHeader[headerField];
+        // variant signature
+        if (data[pos + 1] != 1 || data[pos + 2] != type || data[pos + 3] != '\0') {
+            return false;
+        }
+        pos += 4;
+
+        // variant value
+        bool ok = true;
+        if (type == 'u') {
+            ok = skipPadding(data, &pos, 4, end) && pos + sizeof(uint32) <= end;
+            ok = ok && m_varHeaders.setIntHeader_deser(eHeader, basic::readUint32(data + pos,
+                                                                                  m_isByteSwapped));
+            pos += sizeof(uint32);
         } else {
-            ok = ok && reader.state() == Arguments::Uint32;
-            if (headerField == Message::UnixFdsHeader) {
-                reader.readUint32(); // discard it, for now (TODO)
+            uint32 length = 0;
+            if (type == 'g') {
+                ok = pos + 1 <= end;
+                length = ok ? data[pos] : 0;
+                pos += 1;
             } else {
-                ok = ok && m_varHeaders.setIntHeader_deser(eHeader, reader.readUint32());
+                ok = skipPadding(data, &pos, 4, end) && pos + sizeof(uint32) <= end;
+                length = ok ? basic::readUint32(data + pos, m_isByteSwapped) : 0;
+                pos += sizeof(uint32);
+            }
+            // the sum can't overflow because end is less than the maximum message length
+            ok = ok && length < end && pos + length + 1 <= end && data[pos + length] == '\0';
+            cstring value = ok ? cstring(reinterpret_cast<const char *>(data) + pos, length) : cstring();
+            pos += length + 1;
+
+            if (ok && type == 'o') {
+                ok = validation::isObjectPath(value);
+            } else if (ok && type == 'g') {
+                ok = Arguments::isSignatureValid(value);
+            } else if (ok) {
+                // the checks for each kind of name are stricter than (and imply) valid UTF-8
+                ok = isStringHeaderValueValid(eHeader, value);
+                if (ok && isInterning) {
+                    const cstring interned = StringInterner::intern(value);
+                    if (interned.ptr) {
+                        value = interned;
+                    }
+                }
             }
+            ok = ok && m_varHeaders.setStringHeader_deser(eHeader, value);
         }
-
         if (!ok) {
             return false;
         }
-        reader.endVariant();
-        reader.endStruct();
     }
-    reader.endArray();
+    assert(pos == end);
 
     // check that header->body padding is in fact zero filled
-    base = m_buffer.ptr;
-    for (uint32 i = m_headerLength - m_headerPadding; i < m_headerLength; i++) {
-        if (base[i] != '\0') {
-            return false;
-        }
-    }
-
-    return true;
+    return validation::isZero(m_buffer.ptr + m_headerLength - m_headerPadding, m_headerPadding);
 }
 
 bool MessagePrivate::serialize()
@@ -1037,18 +1332,28 @@ bool MessagePrivate::serialize()
         return false;
     }
 
-    Arguments headerArgs = serializeVariableHeaders();
-
-    // we need to cut out alignment padding bytes 4 to 7 in the variable header data stream because
-    // the original dbus code aligns based on address in the final data stream
-    // (offset s_properFixedHeaderLength == 12), we align based on address in the Arguments's buffer
-    // (offset 0) - note that our modification keeps the stream valid because length is measured from end
-    // of padding
-
-    assert(headerArgs.data().length > 0); // if this fails the headerLength hack will break down
+    const uint32 fdCount = m_mainArguments.fileDescriptors().size();
+    if (fdCount > s_maxUnixFds) {
+        m_error.setCode(Error::MessageUnixFds);
+        return false;
+    }
+    if (fdCount) {
+        m_varHeaders.setIntHeader(Message::UnixFdsHeader, fdCount);
+    } else {
+        m_varHeaders.clearIntHeader(Message::UnixFdsHeader);
+    }
 
-    const uint32 unalignedHeaderLength = s_properFixedHeaderLength + headerArgs.data().length - sizeof(uint32);
-    m_headerLength = align(unalignedHeaderLength, 8);
+    // with Unix fds, the template's header lacks the UnixFdsHeader
+    const bool isHeaderFromTemplate = m_isHeaderFromTemplate && !fdCount;
+    uint32 varArrayLength = 0;
+    if (isHeaderFromTemplate) {
+        m_headerLength = m_template->m_serializedHeader.size();
+    } else {
+        if (!measureVariableHeaders(m_varHeaders, &varArrayLength, &m_error)) {
+            return false;
+        }
+        m_headerLength = align(s_extendedFixedHeaderLength + varArrayLength, 8);
+    }
     m_bodyLength = m_mainArguments.data().length;
     const uint32 messageLength = m_headerLength + m_bodyLength;
 
@@ -1056,22 +1361,24 @@ bool MessagePrivate::serialize()
         return false; // TODO set error ArgumentsTooLong? is this the correct error code, and if so should it be renamed?
     }
 
-    reserveBuffer(messageLength);
+    if (m_bodyLength && m_mainArguments.spaceBeforeData() >= m_headerLength) {
+        // put the header right in front of the body, which then doesn't need to be copied
+        m_buffer = chunk(m_mainArguments.data().ptr - m_headerLength, messageLength);
+        m_isBufferInArguments = true;
+    } else if (!reserveBuffer(messageLength)) {
+        return false;
+    }
 
     serializeFixedHeaders();
-
-    // copy header data: uint32 length...
-    memcpy(m_buffer.ptr + s_properFixedHeaderLength, headerArgs.data().ptr, sizeof(uint32));
-    // skip four bytes of padding and copy the rest
-    memcpy(m_buffer.ptr + s_properFixedHeaderLength + sizeof(uint32),
-           headerArgs.data().ptr + 2 * sizeof(uint32),
-           headerArgs.data().length - 2 * sizeof(uint32));
-    // zero padding between variable headers and message body
-    for (uint32 i = unalignedHeaderLength; i < m_headerLength; i++) {
-        m_buffer.ptr[i] = '\0';
+    if (isHeaderFromTemplate) {
+        memcpy(m_buffer.ptr + s_properFixedHeaderLength,
+               m_template->m_serializedHeader.data() + s_properFixedHeaderLength,
+               m_headerLength - s_properFixedHeaderLength);
+    } else {
+        serializeVariableHeaders(m_varHeaders, varArrayLength, m_buffer.ptr);
     }
     // copy message body (if any - arguments are not mandatory)
-    if (m_mainArguments.data().length) {
+    if (m_mainArguments.data().length && !m_isBufferInArguments) {
         memcpy(m_buffer.ptr + m_headerLength, m_mainArguments.data().ptr, m_mainArguments.data().length);
     }
     m_bufferPos = m_headerLength + m_mainArguments.data().length;
@@ -1100,76 +1407,145 @@ void MessagePrivate::serializeFixedHeaders()
     basic::writeUint32(p + sizeof(uint32), m_serial);
 }
 
-static void doVarHeaderPrologue(Arguments::Writer *writer, Message::VariableHeader field)
+// static
+bool MessagePrivate::measureVariableHeaders(const VarHeaderStorage &headers, uint32 *arrayLength,
+                                            Error *error)
 {
-    writer->beginStruct();
-    writer->writeByte(byte(field));
-    writer->beginVariant();
-}
-
-static void doVarHeaderEpilogue(Arguments::Writer *writer)
-{
-    writer->endVariant();
-    writer->endStruct();
+    // the same order as in serializeVariableHeaders()
+    uint32 pos = s_extendedFixedHeaderLength;
+    for (int i = 0; i < VarHeaderStorage::s_stringHeaderCount; i++) {
+        const Message::VariableHeader field = s_stringHeaderAtIndex[i];
+        if (!headers.hasHeader(field)) {
+            continue;
+        }
+        const cstring str = headers.stringHeaderRaw(field);
+        bool isValid = false;
+        pos = align(pos, 8) + 4; // field code and variant signature
+        if (field == Message::PathHeader) {
+            isValid = Arguments::isObjectPathValid(str);
+            pos = align(pos, 4) + sizeof(uint32);
+        } else if (field == Message::SignatureHeader) {
+            isValid = Arguments::isSignatureValid(str);
+            pos += 1;
+        } else {
+            isValid = Arguments::isStringValid(str);
+            pos = align(pos, 4) + sizeof(uint32);
+        }
+        if (unlikely(!isValid)) {
+            static const Error::Code stringHeaderErrors[VarHeaderStorage::s_stringHeaderCount] = {
+                Error::MessagePath,
+                Error::MessageInterface,
+                Error::MessageMethod,
+                Error::MessageErrorName,
+                Error::MessageDestination,
+                Error::MessageSender,
+                Error::MessageSignature
+            };
+            error->setCode(stringHeaderErrors[i]);
+            return false;
+        }
+        // strings are limited to 64 MiB by the validity checks, so this can't overflow
+        pos += str.length + 1;
+    }
+    for (int i = 0; i < VarHeaderStorage::s_intHeaderCount; i++) {
+        if (headers.hasHeader(s_intHeaderAtIndex[i])) {
+            pos = align(pos, 8) + 4;
+            pos = align(pos, 4) + sizeof(uint32);
+        }
+    }
+    *arrayLength = pos - s_extendedFixedHeaderLength;
+    return true;
 }
 
-Arguments MessagePrivate::serializeVariableHeaders()
-{
-    Arguments::Writer writer;
-
-    // note that we don't have to deal with empty arrays because all valid message types require
-    // at least one of the variable headers
-    writer.beginArray();
+// Writes the variable header array as measured by measureVariableHeaders(), with its length and
+// the padding up to the body, into the message header at data
+// static
+void MessagePrivate::serializeVariableHeaders(const VarHeaderStorage &headers, uint32 arrayLength,
+                                              byte *data)
+{
+    basic::writeUint32(data + s_properFixedHeaderLength, arrayLength);
+    uint32 pos = s_extendedFixedHeaderLength;
+    const auto pad = [data, &pos](uint32 alignment) {
+        const uint32 padStart = pos;
+        pos = align(pos, alignment);
+        memset(data + padStart, 0, pos - padStart);
+    };
+    const auto writePrologue = [data, &pos, &pad](Message::VariableHeader field) {
+        pad(8);
+        data[pos++] = byte(field);
+        data[pos++] = 1;
+        data[pos++] = s_typeOfHeader[field];
+        data[pos++] = '\0';
+    };
 
     for (int i = 0; i < VarHeaderStorage::s_stringHeaderCount; i++) {
         const Message::VariableHeader field = s_stringHeaderAtIndex[i];
-        if (m_varHeaders.hasHeader(field)) {
-            doVarHeaderPrologue(&writer, field);
-
-            const string &str = m_varHeaders.stringHeaders()[i];
-            if (field == Message::PathHeader) {
-                writer.writeObjectPath(cstring(str.c_str(), str.length()));
-            } else if (field == Message::SignatureHeader) {
-                writer.writeSignature(cstring(str.c_str(), str.length()));
-            } else {
-                writer.writeString(cstring(str.c_str(), str.length()));
-            }
-
-            doVarHeaderEpilogue(&writer);
-
-            if (unlikely(writer.error().isError())) {
-                static const Error::Code stringHeaderErrors[VarHeaderStorage::s_stringHeaderCount] = {
-                    Error::MessagePath,
-                    Error::MessageInterface,
-                    Error::MessageMethod,
-                    Error::MessageErrorName,
-                    Error::MessageDestination,
-                    Error::MessageSender,
-                    Error::MessageSignature
-                };
-                m_error.setCode(stringHeaderErrors[i]);
-                return Arguments();
-            }
+        if (!headers.hasHeader(field)) {
+            continue;
+        }
+        const cstring str = headers.stringHeaderRaw(field);
+        writePrologue(field);
+        if (field == Message::SignatureHeader) {
+            data[pos++] = byte(str.length);
+        } else {
+            pad(4);
+            basic::writeUint32(data + pos, str.length);
+            pos += sizeof(uint32);
         }
+        memcpy(data + pos, str.ptr, str.length + 1);
+        pos += str.length + 1;
     }
 
     for (int i = 0; i < VarHeaderStorage::s_intHeaderCount; i++) {
         const Message::VariableHeader field = s_intHeaderAtIndex[i];
-        if (m_varHeaders.hasHeader(field)) {
-            doVarHeaderPrologue(&writer, field);
-            writer.writeUint32(m_varHeaders.m_intHeaders[i]);
-            doVarHeaderEpilogue(&writer);
+        if (headers.hasHeader(field)) {
+            writePrologue(field);
+            pad(4);
+            basic::writeUint32(data + pos, headers.m_intHeaders[i]);
+            pos += sizeof(uint32);
         }
     }
+    assert(pos == s_extendedFixedHeaderLength + arrayLength);
+    // zero padding between variable headers and message body
+    pad(8);
+}
 
-    writer.endArray();
-    return writer.finish();
+// static
+bool MessagePrivate::serializeTemplateHeader(const VarHeaderStorage &headers, std::vector<byte> *header,
+                                             Error *error)
+{
+    uint32 arrayLength = 0;
+    if (!measureVariableHeaders(headers, &arrayLength, error)) {
+        return false;
+    }
+    header->resize(align(s_extendedFixedHeaderLength + arrayLength, 8));
+    serializeVariableHeaders(headers, arrayLength, header->data());
+    return true;
 }
 
 void MessagePrivate::clearBuffer()
+{
+    if (m_buffer.ptr && !m_isBufferInArguments) {
+        // received headers and arguments point into the buffer
+        m_varHeaders.detachFromBuffer(m_buffer);
+        if (areArgumentsInBuffer()) {
+            std::vector<int> fds;
+            m_mainArguments.swapFileDescriptors(&fds);
+            m_mainArguments = Arguments(m_mainArguments);
+            m_mainArguments.swapFileDescriptors(&fds);
+        }
+    }
+    releaseBuffer();
+}
+
+void MessagePrivate::releaseBuffer()
 {
     if (m_buffer.ptr) {
-        free(m_buffer.ptr);
+        if (m_sharedBuffer) {
+            m_sharedBuffer->deref();
+            m_sharedBuffer = nullptr;
+        }
+        m_isBufferInArguments = false;
         m_buffer = chunk();
         m_bufferPos = 0;
     } else {
@@ -1178,39 +1554,187 @@ void MessagePrivate::clearBuffer()
     }
 }
 
-static uint32 nextPowerOf2(uint32 x)
+bool MessagePrivate::detachBufferFromArguments()
+{
+    if (!m_isBufferInArguments) {
+        return true;
+    }
+    // the buffer may still be sending, or used by save() - keep it as if it had been separate all along
+    SharedBuffer *copy = SharedBuffer::create(m_buffer.length);
+    if (!copy) {
+        releaseBuffer();
+        return false;
+    }
+    memcpy(copy->data(), m_buffer.ptr, m_buffer.length);
+    m_sharedBuffer = copy;
+    m_buffer.ptr = copy->data();
+    m_isBufferInArguments = false;
+    return true;
+}
+
+bool MessagePrivate::unshareBuffer()
+{
+    // only received messages are changed in place, and their buffer is never in the arguments
+    assert(!m_isBufferInArguments);
+    if (!m_sharedBuffer || (!m_sharedBuffer->isShared() && m_sharedBuffer->isWritable())) {
+        return true;
+    }
+    SharedBuffer *copy = SharedBuffer::create(m_buffer.length);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy->data(), m_buffer.ptr, m_buffer.length);
+    m_varHeaders.rebaseBorrowedStrings(m_buffer, copy->data());
+    if (areArgumentsInBuffer()) {
+        m_mainArguments = m_mainArguments.withData(m_varHeaders.stringHeaderRaw(Message::SignatureHeader),
+                                                   chunk(copy->data() + m_headerLength, m_bodyLength));
+    }
+    m_sharedBuffer->deref();
+    m_sharedBuffer = copy;
+    m_buffer.ptr = copy->data();
+    return true;
+}
+
+chunk MessagePrivate::serializedData() const
 {
-    --x;
-    x |= x >> 1;
-    x |= x >> 2;
-    x |= x >> 4;
-    x |= x >> 8;
-    x |= x >> 16;
-    return ++x;
+    if (m_state > LastSteadyState) {
+        return chunk();
+    }
+    // when receiving, m_buffer.length may be a larger capacity
+    const uint32 length = m_headerLength + m_bodyLength;
+    return m_buffer.ptr && length && m_buffer.length >= length ? chunk(m_buffer.ptr, length) : chunk();
+}
+
+bool MessagePrivate::areArgumentsInBuffer() const
+{
+    const chunk argsData = m_mainArguments.data();
+    return (argsData.length && isInBuffer(reinterpret_cast<char *>(argsData.ptr), m_buffer)) ||
+           isInBuffer(m_mainArguments.signature().ptr, m_buffer);
 }
 
-void MessagePrivate::reserveBuffer(uint32 newLen)
+bool MessagePrivate::isBufferShareable() const
 {
+    // while (de)serializing, the buffer is still being written, or its end isn't known yet
+    return m_state <= LastSteadyState;
+}
+
+bool MessagePrivate::reserveBuffer(uint32 newLen)
+{
+    assert(!m_isBufferInArguments && (!m_sharedBuffer || !m_sharedBuffer->isShared()));
     const uint32 oldLen = m_buffer.length;
     if (newLen <= oldLen) {
-        return;
+        return true;
     }
-    if (newLen <= 256) {
-        assert(oldLen == 0);
-        newLen = 256;
-        m_buffer.ptr = reinterpret_cast<byte *>(msgAllocCaches.msgBuffer.allocate());
-    } else {
-        newLen = nextPowerOf2(newLen);
-        if (oldLen == 256) {
-            byte *newAlloc = reinterpret_cast<byte *>(malloc(newLen));
-            memcpy(newAlloc, m_buffer.ptr, oldLen);
+    // Callers know the final size - the message length from the fixed header or the serialized
+    // length - so don't add any slack. The buffer grows at most once, from the small initial size
+    // used to receive the fixed header.
+    SharedBuffer *buffer = SharedBuffer::create(newLen);
+    if (!buffer) {
+        return false;
+    }
+    if (oldLen) {
+        memcpy(buffer->data(), m_buffer.ptr, oldLen);
+        m_sharedBuffer->deref();
+    }
+    m_sharedBuffer = buffer;
+    m_buffer = chunk(buffer->data(), buffer->capacity());
+    return true;
+}
 
-            msgAllocCaches.msgBuffer.free(m_buffer.ptr);
-            m_buffer.ptr = newAlloc;
-        } else {
-            m_buffer.ptr = reinterpret_cast<byte *>(realloc(m_buffer.ptr, newLen));
+// static
+SharedBuffer *SharedBuffer::create(uint32 capacity)
+{
+    void *mem = nullptr;
+    Allocation allocation = Malloced;
+    if (capacity <= s_cachedBufferCapacity) {
+        capacity = s_cachedBufferCapacity;
+        mem = msgAllocCaches.msgBuffer.allocate();
+        allocation = Cached;
+    }
+#ifdef __unix__
+    if (!mem && capacity >= s_mappedBufferThreshold.load(std::memory_order_relaxed)) {
+        mem = mmap(nullptr, sizeof(SharedBuffer) + capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            mem = nullptr;
         }
+        allocation = Mapped;
+    }
+#endif
+    if (!mem) {
+        mem = malloc(sizeof(SharedBuffer) + capacity);
+        allocation = Malloced;
+    }
+    return mem ? new(mem) SharedBuffer(capacity, allocation) : nullptr;
+}
+
+// static
+SharedBuffer *SharedBuffer::adoptFileMapping(void *mapping, size_t size)
+{
+    void *mem = malloc(sizeof(SharedBuffer));
+    if (!mem) {
+        return nullptr;
+    }
+    SharedBuffer *ret = new(mem) SharedBuffer(0, FileMapping);
+    ret->m_data = static_cast<byte *>(mapping);
+    ret->m_fileMappingSize = size;
+    return ret;
+}
+
+// static
+SharedBuffer *SharedBuffer::createExternal(byte *data, std::shared_ptr<const void> owner)
+{
+    void *mem = malloc(sizeof(SharedBuffer) + sizeof(std::shared_ptr<const void>));
+    if (!mem) {
+        return nullptr;
     }
+    SharedBuffer *ret = new(mem) SharedBuffer(0, External);
+    new(ret + 1) std::shared_ptr<const void>(std::move(owner));
+    ret->m_data = data;
+    return ret;
+}
 
-    m_buffer.length = newLen;
+// static
+void SharedBuffer::destroy(SharedBuffer *buffer)
+{
+    const Allocation allocation = buffer->m_allocation;
+    const size_t size = allocation == FileMapping ? buffer->m_fileMappingSize
+                                                  : sizeof(SharedBuffer) + buffer->m_capacity;
+    byte *const data = buffer->m_data;
+    if (allocation == External) {
+        typedef std::shared_ptr<const void> Owner;
+        reinterpret_cast<Owner *>(buffer + 1)->~Owner();
+    }
+    buffer->~SharedBuffer();
+    switch (allocation) {
+    case Cached:
+        msgAllocCaches.msgBuffer.free(buffer);
+        break;
+#ifdef __unix__
+    case Mapped:
+        munmap(buffer, size);
+        break;
+    case FileMapping:
+        munmap(data, size);
+        free(buffer);
+        break;
+#endif
+    default:
+        free(buffer);
+        break;
+    }
+    (void)size;
+    (void)data;
+}
+
+// static
+void Message::setMappedBufferThreshold(uint32 size)
+{
+    s_mappedBufferThreshold.store(size, std::memory_order_relaxed);
+}
+
+// static
+uint32 Message::mappedBufferThreshold()
+{
+    return s_mappedBufferThreshold.load(std::memory_order_relaxed);
 }
@@ -27,6 +27,7 @@
 #include "arguments.h"
 #include "types.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -47,6 +48,8 @@ public:
     Message(Message &&other);
     Message &operator=(Message &&other);
 
+    // Copies of received or serialized messages share the buffer and copy only the header data.
+    // Changing a copy doesn't change the original.
     Message(const Message &other);
     Message &operator=(const Message &other);
 
@@ -91,6 +94,7 @@ public:
     void setDestination(const std::string &destination);
     void setSender(const std::string &sender);
     // no setSignature() - setArguments() also sets the signature
+    // Serialization overwrites this with the number of fds in arguments().fileDescriptors()
     void setUnixFdCount(uint32 fdCount);
 
     std::string path() const;
@@ -128,21 +132,61 @@ public:
     uint32 intHeader(VariableHeader header, bool *isPresent = nullptr) const;
     void setIntHeader(VariableHeader header, uint32 value);
 
+    // Access to a string header without copying: null if the header is not present, otherwise
+    // null-terminated and valid until the header is changed or the message is destroyed. For received
+    // messages, it points into the message buffer or the table of interned strings (see below).
+    cstring stringHeaderRaw(VariableHeader header) const;
+
+    // When enabled, the interface, member, error name, destination and sender headers of messages
+    // received afterwards are interned in a process-wide table, and stringHeaderRaw() points to the
+    // interned string, which lives as long as the process. If internString() returned a string that
+    // is not null, equal headers then have the same address, so they can be compared by pointer.
+    // The table is bounded; when it is full, new strings are not interned anymore. Off by default.
+    static void setHeaderInterningEnabled(bool enabled);
+    static bool isHeaderInterningEnabled();
+    // Returns the interned copy of str, or a null cstring if the table is full or str is too long
+    // to be a valid header of the above kinds.
+    static cstring internString(cstring str);
+
     // TODO a method that returns if the message is valid in its current state (flags have valid
     //      values, mandatory variable header fields for the message type are present, ...?
 
     // setArguments also sets the signature header of the message
     void setArguments(Arguments arguments);
+    // A Writer for the body that leaves room for the header in front of the data. With the result of
+    // its finish() passed to setArguments(), the header is put there during serialization instead of
+    // copying the body into a new buffer, which is much cheaper for large bodies.
+    static Arguments::Writer bodyWriter();
     const Arguments &arguments() const;
+    // Converts a received message in the other byte order to host byte order in place, see
+    // Arguments::convertToHostByteOrder(). Returns false, leaving the message unchanged, if that fails.
+    bool convertToHostByteOrder();
 
     std::vector<byte> save();
+    // The serialized message, serializing it first if needed, without copying it. It is valid until
+    // the message is changed or destroyed. Returns an empty chunk if the message can't be serialized.
+    chunk saveView();
+    // Serializes the message into buffer and returns its length. If buffer is too short, nothing is
+    // written, but the length is still returned. Returns 0 if the message can't be serialized.
+    uint32 saveInto(chunk buffer);
     void load(const std::vector<byte> &data);
+    // Loads data, which must contain exactly one message, without copying it unless it is not 8 byte
+    // aligned. The message and its copies keep a reference to owner, which must keep data valid and
+    // unchanged. If owner is null, data is only borrowed and must outlive them. data is never changed,
+    // convertToHostByteOrder() copies it. Returns false if the data is not a valid message.
+    bool loadView(chunk data, std::shared_ptr<const void> owner = std::shared_ptr<const void>());
 
     // The rest of public methods is low-level API that should only be used in very special situations
 
     void setSerial(uint32 serial);
     uint32 serial() const;
 
+    // Message buffers of at least this size are mapped directly from the OS where possible, so that
+    // their memory is returned to it when they are freed - the heap tends to keep freed memory. This
+    // applies to buffers allocated afterwards, in all threads. The default is 1 MiB.
+    static void setMappedBufferThreshold(uint32 size);
+    static uint32 mappedBufferThreshold();
+
 #ifndef DFERRY_SERDES_ONLY
     bool isReceiving() const;
     bool isSending() const;
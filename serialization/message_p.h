@@ -30,21 +30,82 @@
 #include "error.h"
 #include "iconnectionclient.h"
 
+#include <atomic>
+#include <memory>
 #include <type_traits>
+#include <vector>
 
 class ICompletionClient;
 
+// The memory of all message buffers. Copies of a message share its buffer, and MessageFramer fills
+// one with several received messages that all point into it. The contents must not change while
+// it is shared. Messages may be moved to other threads, hence the atomic reference count.
+class alignas(8) SharedBuffer
+{
+public:
+    // Allocates at least capacity bytes, mapped from the OS if capacity is at least
+    // Message::mappedBufferThreshold(). Small buffers all have the same capacity and are cached.
+    // Returns nullptr if out of memory.
+    static SharedBuffer *create(uint32 capacity);
+    // Takes over a private, writable mapping of a file, e.g. for CaptureReader. The data is the
+    // mapping, which is unmapped when the last reference is gone. capacity() is 0.
+    static SharedBuffer *adoptFileMapping(void *mapping, size_t size);
+    // For memory that belongs to someone else, which keeps a reference to owner (which may be null)
+    // and must not be written to. capacity() is 0.
+    static SharedBuffer *createExternal(byte *data, std::shared_ptr<const void> owner);
+
+    void ref() { m_refCount.fetch_add(1, std::memory_order_relaxed); }
+    void deref()
+    {
+        if (m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            destroy(this);
+        }
+    }
+    bool isShared() const { return m_refCount.load(std::memory_order_acquire) > 1; }
+    bool isWritable() const { return m_allocation != External; }
+
+    byte *data() { return m_data; } // 8 byte aligned
+    uint32 capacity() const { return m_capacity; }
+
+private:
+    enum Allocation : uint32 {
+        Malloced = 0,
+        Cached,
+        Mapped,
+        FileMapping,
+        External // followed by a std::shared_ptr<const void> owning the data
+    };
+    SharedBuffer(uint32 capacity, Allocation allocation)
+       : m_refCount(1), m_capacity(capacity), m_allocation(allocation),
+         m_data(reinterpret_cast<byte *>(this + 1)), m_fileMappingSize(0) {}
+    SharedBuffer(const SharedBuffer &) = delete;
+    void operator=(const SharedBuffer &) = delete;
+    static void destroy(SharedBuffer *buffer);
+
+    std::atomic<uint32> m_refCount;
+    uint32 m_capacity;
+    Allocation m_allocation;
+    byte *m_data; // normally right after this, in the same allocation
+    size_t m_fileMappingSize;
+};
+
+// String headers set through the API are stored as std::string. Received string headers are only
+// borrowed from the message buffer (or from StringInterner), so receiving a message does not
+// construct any strings; they must be made owned with detachFromBuffer() before the buffer goes away.
 class VarHeaderStorage {
 public:
     VarHeaderStorage();
+    // borrowed strings stay borrowed from the same memory, see rebaseBorrowedStrings()
     VarHeaderStorage(const VarHeaderStorage &other);
     ~VarHeaderStorage();
+    void operator=(const VarHeaderStorage &other) = delete;
 
     bool hasHeader(Message::VariableHeader header) const;
 
     bool hasStringHeader(Message::VariableHeader header) const;
     std::string stringHeader(Message::VariableHeader header) const;
-    cstring stringHeaderRaw(Message::VariableHeader header);
+    // valid until the header is changed or the storage is destroyed or detached from its buffer
+    cstring stringHeaderRaw(Message::VariableHeader header) const;
     void setStringHeader(Message::VariableHeader header, const std::string &value);
     void clearStringHeader(Message::VariableHeader header);
 
@@ -56,8 +117,17 @@ public:
     // for use during header deserialization: returns false if a header occurs twice,
     // but does not check if the given header is of the right type (int / string).
     bool setIntHeader_deser(Message::VariableHeader header, uint32 value);
+    // value is borrowed, not copied
     bool setStringHeader_deser(Message::VariableHeader header, cstring value);
 
+    // makes the borrowed strings in buffer owned
+    void detachFromBuffer(chunk buffer);
+    void makeAllOwned();
+    // for an empty storage: takes the headers of other, borrowing its strings, so other must outlive this
+    void borrowFrom(const VarHeaderStorage &other);
+    // points the borrowed strings in oldBuffer to the same offsets in newBuffer, for copies of buffers
+    void rebaseBorrowedStrings(chunk oldBuffer, byte *newBuffer);
+
     const std::string *stringHeaders() const
     {
         return reinterpret_cast<const std::string *>(m_stringStorage);
@@ -72,14 +142,36 @@ public:
 
     // Uninitialized storage for strings, to avoid con/destructing strings we'd never touch otherwise.
     std::aligned_storage<sizeof(std::string)>::type m_stringStorage[VarHeaderStorage::s_stringHeaderCount];
+    cstring m_borrowedStrings[s_stringHeaderCount];
     uint32 m_intHeaders[s_intHeaderCount];
     uint32 m_headerPresenceBitmap = 0;
+    uint32 m_ownedStringBitmap = 0; // which present string headers are in m_stringStorage
+
+private:
+    void makeOwned(int index);
+};
+
+// The shared, immutable data of a MessageTemplate. Messages created from it borrow its header
+// strings and keep a reference to it.
+class MessageTemplatePrivate
+{
+public:
+    explicit MessageTemplatePrivate(const VarHeaderStorage &headers) : m_varHeaders(headers) {}
+
+    Message::Type m_messageType;
+    byte m_flags;
+    Error m_error;
+    VarHeaderStorage m_varHeaders; // all strings owned
+    // The whole header including padding, empty if there is an error. The fixed header fields are
+    // written for each message.
+    std::vector<byte> m_serializedHeader;
 };
 
 class MessagePrivate : public IConnectionClient
 {
 public:
     static MessagePrivate *get(Message *m) { return m->d; }
+    static const MessagePrivate *get(const Message *m) { return m->d; }
 
     MessagePrivate(Message *parent);
     MessagePrivate(const MessagePrivate &other, Message *parent);
@@ -95,16 +187,49 @@ public:
     // happen simultaneously)
     void setCompletionClient(ICompletionClient *client);
 
+    // For MessageFramer: determines the total length of the message at the beginning of data from
+    // its fixed header. Returns false if the data is invalid, sets *length to 0 if there isn't enough
+    // data to tell.
+    static bool peekMessageLength(chunk data, uint32 *length);
+    // Takes over data, which must contain exactly one complete and 8 byte aligned message. data is
+    // in buffer, and one reference to buffer is taken over. Returns false if the message is invalid.
+    bool adoptReceivedData(chunk data, SharedBuffer *buffer);
+
+    // Gives the Unix fds received with the message to its arguments, which must be set already.
+    // Leaves the previous fds of the arguments, normally none, in *fds.
+    void adoptFileDescriptors(std::vector<int> *fds);
+
     bool requiredHeadersPresent();
     Error checkRequiredHeaders() const;
     bool deserializeFixedHeaders();
     bool deserializeVariableHeaders();
     bool serialize();
     void serializeFixedHeaders();
-    Arguments serializeVariableHeaders();
+    // validates the variable headers and determines the length of their array
+    static bool measureVariableHeaders(const VarHeaderStorage &headers, uint32 *arrayLength,
+                                       Error *error);
+    static void serializeVariableHeaders(const VarHeaderStorage &headers, uint32 arrayLength,
+                                         byte *data);
+    // for MessageTemplate: serializes the header without the fixed header fields into *header
+    static bool serializeTemplateHeader(const VarHeaderStorage &headers, std::vector<byte> *header,
+                                        Error *error);
 
+    // makes the headers and arguments independent of the buffer, then releases it
     void clearBuffer();
-    void reserveBuffer(uint32 newSize);
+    void releaseBuffer();
+    bool reserveBuffer(uint32 newSize); // returns false if out of memory
+    // call before replacing m_mainArguments, which the buffer may be in. Returns false if out of
+    // memory, and then releases the buffer.
+    bool detachBufferFromArguments();
+    // call before changing the buffer in place; gives this its own copy if the buffer is shared or
+    // not writable. Returns false if out of memory.
+    bool unshareBuffer();
+    // the complete message in the buffer, or an empty chunk if it isn't there
+    chunk serializedData() const;
+    // received arguments point into the buffer
+    bool areArgumentsInBuffer() const;
+    // the buffer and arguments can be shared with a copy, see the copy constructor
+    bool isBufferShareable() const;
 
     void notifyCompletionClient();
 
@@ -129,6 +254,10 @@ public:
     byte m_flags;
     byte m_protocolVersion;
     bool m_dirty : 1;
+    bool m_isBufferInArguments : 1; // the header was put in front of the body, see serialize()
+    bool m_isHeaderFromTemplate : 1; // the variable headers are still those of m_template
+    // if not null, m_buffer is in it, else m_buffer is null or in m_mainArguments' memory
+    SharedBuffer *m_sharedBuffer;
     uint32 m_headerLength;
     uint32 m_headerPadding;
     uint32 m_bodyLength;
@@ -138,6 +267,8 @@ public:
 
     Arguments m_mainArguments;
 
+    // declared before m_varHeaders, which may borrow strings from it
+    std::shared_ptr<const MessageTemplatePrivate> m_template;
     VarHeaderStorage m_varHeaders;
 
     ICompletionClient *m_completionClient;
@@ -0,0 +1,87 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "messagetemplate.h"
+
+#include "message_p.h"
+
+#include <cstring>
+
+MessageTemplate::MessageTemplate()
+{
+}
+
+MessageTemplate::MessageTemplate(const Message &prototype)
+{
+    const MessagePrivate *proto = MessagePrivate::get(&prototype);
+    std::shared_ptr<MessageTemplatePrivate> priv =
+        std::make_shared<MessageTemplatePrivate>(proto->m_varHeaders);
+    priv->m_messageType = proto->m_messageType;
+    priv->m_flags = proto->m_flags;
+    priv->m_varHeaders.makeAllOwned();
+    // set from the arguments of each message during serialization
+    priv->m_varHeaders.clearIntHeader(Message::UnixFdsHeader);
+    MessagePrivate::serializeTemplateHeader(priv->m_varHeaders, &priv->m_serializedHeader,
+                                            &priv->m_error);
+    d = std::move(priv);
+}
+
+bool MessageTemplate::isValid() const
+{
+    return d && !d->m_error.isError();
+}
+
+Error MessageTemplate::error() const
+{
+    return d ? d->m_error : Error();
+}
+
+static bool isSameSignature(cstring a, cstring b)
+{
+    return a.length == b.length && (!a.length || !memcmp(a.ptr, b.ptr, a.length));
+}
+
+Message MessageTemplate::createMessage(Arguments arguments) const
+{
+    Message ret;
+    if (!d) {
+        ret.setArguments(std::move(arguments));
+        return ret;
+    }
+    MessagePrivate *msg = MessagePrivate::get(&ret);
+    msg->m_messageType = d->m_messageType;
+    msg->m_flags = d->m_flags;
+    msg->m_template = d;
+    msg->m_varHeaders.borrowFrom(d->m_varHeaders);
+
+    if (isSameSignature(arguments.signature(),
+                        d->m_varHeaders.stringHeaderRaw(Message::SignatureHeader))) {
+        msg->m_error = arguments.error();
+        msg->m_mainArguments = std::move(arguments);
+        msg->m_isHeaderFromTemplate = !d->m_serializedHeader.empty();
+    } else {
+        ret.setArguments(std::move(arguments));
+    }
+    return ret;
+}
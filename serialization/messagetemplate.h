@@ -0,0 +1,62 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef MESSAGETEMPLATE_H
+#define MESSAGETEMPLATE_H
+
+#include "arguments.h"
+#include "error.h"
+#include "message.h"
+#include "types.h"
+
+#include <memory>
+
+class MessageTemplatePrivate;
+
+// Serializes the variable headers of a message once, for messages sent often with the same headers,
+// like frequent signals. Messages created from the template share those headers, so serializing them
+// only takes writing the fixed header (serial, body length...) and copying the header bytes.
+// Templates are immutable; copies are cheap and share the data.
+class DFERRY_EXPORT MessageTemplate
+{
+public:
+    MessageTemplate(); // constructs an invalid template
+    // Takes the type, flags and headers of prototype, including the signature of its arguments.
+    // prototype's arguments are not used otherwise.
+    explicit MessageTemplate(const Message &prototype);
+
+    // false if default-constructed or if prototype's headers can't be serialized, see error()
+    bool isValid() const;
+    Error error() const;
+
+    // Creates a message with the headers of the template and arguments. Changing its headers
+    // afterwards (but not its serial and flags) makes it serialize its headers as usual, same as
+    // having arguments with a different signature than the template or with Unix fds.
+    Message createMessage(Arguments arguments) const;
+
+private:
+    std::shared_ptr<const MessageTemplatePrivate> d;
+};
+
+#endif // MESSAGETEMPLATE_H
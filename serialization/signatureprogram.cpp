@@ -0,0 +1,285 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "signatureprogram.h"
+
+#include "basictypeio.h"
+#include "fnvhash.h"
+#include "interntable.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// nesting limits of the D-Bus spec
+static const uint32 s_arrayMax = 32;
+static const uint32 s_parenMax = 32;
+static const uint32 s_totalMax = 64;
+
+static bool isBasicType(char letter)
+{
+    switch (letter) {
+    case 'y':
+    case 'b':
+    case 'n':
+    case 'q':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 't':
+    case 'd':
+    case 's':
+    case 'o':
+    case 'g':
+    case 'h':
+        return true;
+    default:
+        return false;
+    }
+}
+
+struct SignatureCompiler
+{
+    bool compileSingleCompleteType();
+    void closeAggregate(Arguments::IoState state);
+    // adds the nested element at elementBegin to the layout and depth of an aggregate
+    void addField(uint32 elementBegin, SignatureProgram::Instruction *aggregate, uint32 *size);
+
+    const char *signature;
+    uint32 length;
+    uint32 position;
+    SignatureProgram::Instruction *instructions;
+    uint32 maxAlignment;
+};
+
+void SignatureCompiler::closeAggregate(Arguments::IoState state)
+{
+    SignatureProgram::Instruction &ins = instructions[position];
+    memset(&ins, 0, sizeof(ins));
+    ins._state = state;
+    ins.alignment = 1;
+    ins.end = position + 1;
+    position++;
+}
+
+void SignatureCompiler::addField(uint32 elementBegin, SignatureProgram::Instruction *aggregate,
+                                 uint32 *size)
+{
+    const SignatureProgram::Instruction &field = instructions[elementBegin];
+    aggregate->arrayDepth = std::max(aggregate->arrayDepth, field.arrayDepth);
+    aggregate->parenDepth = std::max(aggregate->parenDepth, field.parenDepth);
+    aggregate->totalDepth = std::max(aggregate->totalDepth, field.totalDepth);
+    if (aggregate->isFixedSize && field.isFixedSize) {
+        *size = align(*size, field.alignment) + field.fixedSize;
+    } else {
+        aggregate->isFixedSize = false;
+    }
+}
+
+bool SignatureCompiler::compileSingleCompleteType()
+{
+    if (position >= length) {
+        return false;
+    }
+    const uint32 begin = position;
+    const char letter = signature[begin];
+    SignatureProgram::Instruction ins;
+    memset(&ins, 0, sizeof(ins));
+
+    if (isBasicType(letter)) {
+        const TypeInfo &ty = typeInfo(letter);
+        ins._state = ty._state;
+        ins.alignment = ty.alignment;
+        ins.isPrimitive = ty.isPrimitive;
+        ins.isString = ty.isString;
+        ins.isFixedSize = ty.isPrimitive;
+        ins.fixedSize = ty.isPrimitive ? ty.alignment : 0;
+        position++;
+    } else if (letter == 'v') {
+        ins._state = Arguments::BeginVariant;
+        ins.alignment = 1;
+        ins.totalDepth = 1;
+        maxAlignment = 8;
+        position++;
+    } else if (letter == '(') {
+        ins._state = Arguments::BeginStruct;
+        ins.alignment = 8;
+        ins.isFixedSize = true;
+        uint32 size = 0;
+        position++;
+        while (position < length && signature[position] != ')') {
+            const uint32 fieldBegin = position;
+            if (!compileSingleCompleteType()) {
+                return false;
+            }
+            addField(fieldBegin, &ins, &size);
+        }
+        if (position >= length || position == begin + 1) {
+            return false; // unterminated or empty struct
+        }
+        closeAggregate(Arguments::EndStruct);
+        ins.parenDepth++;
+        ins.totalDepth++;
+        ins.isFixedSize = ins.isFixedSize && size <= 0xffff;
+        ins.fixedSize = ins.isFixedSize ? size : 0;
+    } else if (letter == 'a') {
+        ins._state = Arguments::BeginArray;
+        ins.alignment = 4;
+        position++;
+        if (position < length && signature[position] == '{') {
+            // dict entry: exactly one basic type key and one value of any type
+            const uint32 entryBegin = position++;
+            SignatureProgram::Instruction entry;
+            memset(&entry, 0, sizeof(entry));
+            entry._state = Arguments::BeginDict;
+            entry.alignment = 8;
+            entry.isFixedSize = true;
+            uint32 size = 0;
+            if (position >= length || !isBasicType(signature[position])) {
+                return false;
+            }
+            for (int i = 0; i < 2; i++) {
+                const uint32 fieldBegin = position;
+                if (!compileSingleCompleteType()) {
+                    return false;
+                }
+                addField(fieldBegin, &entry, &size);
+            }
+            if (position >= length || signature[position] != '}') {
+                return false;
+            }
+            closeAggregate(Arguments::EndDict);
+            entry.parenDepth++;
+            entry.totalDepth++;
+            entry.isFixedSize = entry.isFixedSize && size <= 0xffff;
+            entry.fixedSize = entry.isFixedSize ? size : 0;
+            entry.end = position;
+            instructions[entryBegin] = entry;
+            maxAlignment = std::max(maxAlignment, uint32(entry.alignment));
+        } else {
+            if (!compileSingleCompleteType()) {
+                return false;
+            }
+        }
+        const SignatureProgram::Instruction &element = instructions[begin + 1];
+        ins.arrayDepth = element.arrayDepth + 1;
+        ins.parenDepth = element.parenDepth;
+        ins.totalDepth = element.totalDepth + 1;
+    } else {
+        return false;
+    }
+
+    if (ins.arrayDepth > s_arrayMax || ins.parenDepth > s_parenMax || ins.totalDepth > s_totalMax) {
+        return false;
+    }
+    maxAlignment = std::max(maxAlignment, uint32(ins.alignment));
+    ins.end = position;
+    instructions[begin] = ins;
+    return true;
+}
+
+// static
+SignatureProgram *SignatureProgram::compile(cstring signature)
+{
+    if (signature.length > Arguments::MaxSignatureLength) {
+        return nullptr;
+    }
+    const size_t size = sizeof(SignatureProgram) + (signature.length + 1) * sizeof(Instruction) +
+                        signature.length + 1;
+    void *mem = malloc(size);
+    if (!mem) {
+        return nullptr;
+    }
+    SignatureProgram *ret = new(mem) SignatureProgram;
+    ret->m_length = signature.length;
+    ret->m_completeTypeCount = 0;
+    ret->m_hash = FnvHash::hash(signature);
+    ret->m_isInterned = false;
+
+    SignatureCompiler compiler;
+    compiler.signature = signature.ptr;
+    compiler.length = signature.length;
+    compiler.position = 0;
+    compiler.instructions = ret->instructions();
+    compiler.maxAlignment = 1;
+    while (compiler.position < signature.length) {
+        if (!compiler.compileSingleCompleteType()) {
+            destroy(ret);
+            return nullptr;
+        }
+        ret->m_completeTypeCount++;
+    }
+    ret->m_maxAlignment = compiler.maxAlignment;
+
+    Instruction &sentinel = ret->instructions()[signature.length];
+    memset(&sentinel, 0, sizeof(sentinel));
+    sentinel._state = Arguments::InvalidData;
+    sentinel.alignment = 1;
+    sentinel.end = signature.length;
+
+    char *sigCopy = const_cast<char *>(ret->signature().ptr);
+    memcpy(sigCopy, signature.ptr, signature.length);
+    sigCopy[signature.length] = '\0';
+    return ret;
+}
+
+// static
+void SignatureProgram::destroy(const SignatureProgram *program)
+{
+    free(const_cast<SignatureProgram *>(program));
+}
+
+// static
+SignatureProgram *SignatureProgram::createInterned(cstring signature, uint32 hash)
+{
+    SignatureProgram *program = compile(signature);
+    if (program) {
+        assert(program->m_hash == hash);
+        (void) hash;
+        program->m_isInterned = true;
+    }
+    return program;
+}
+
+// static
+const SignatureProgram *SignatureProgram::get(cstring signature,
+                                              std::shared_ptr<const SignatureProgram> *uncached)
+{
+    if (!signature.length) {
+        signature = cstring("", 0); // no null pointers for memcpy() and friends
+    }
+    bool isFull = false;
+    const SignatureProgram *program = InternTable<SignatureProgram>::get(signature, &isFull);
+    if (program || !isFull) {
+        return program;
+    }
+    // the cache is full
+    SignatureProgram *compiled = compile(signature);
+    if (!compiled) {
+        return nullptr;
+    }
+    uncached->reset(compiled, &SignatureProgram::destroy);
+    return compiled;
+}
@@ -0,0 +1,168 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#ifndef SIGNATUREPROGRAM_H
+#define SIGNATUREPROGRAM_H
+
+#include "arguments.h"
+
+#include <cassert>
+#include <memory>
+
+template<typename T> class InternTable;
+
+struct TypeInfo
+{
+    Arguments::IoState state() const { return static_cast<Arguments::IoState>(_state); }
+    byte _state;
+    byte alignment : 6;
+    bool isPrimitive : 1;
+    bool isString : 1;
+};
+
+inline const TypeInfo &typeInfo(char letterCode)
+{
+    assert(letterCode >= '(');
+    static const TypeInfo low[2] = {
+        { Arguments::BeginStruct,  8, false, false }, // (
+        { Arguments::EndStruct,    1, false, false }  // )
+    };
+    if (letterCode <= ')') {
+        return low[letterCode - '('];
+    }
+    assert(letterCode >= 'a' && letterCode <= '}');
+    // entries for invalid letters are designed to be as inert as possible in the code using the data,
+    // which may make it possible to catch errors at a common point with less special case code.
+    static const TypeInfo high['}' - 'a' + 1] = {
+        { Arguments::BeginArray,   4, false, false }, // a
+        { Arguments::Boolean,      4, true,  false }, // b
+        { Arguments::InvalidData,  1, true,  false }, // c
+        { Arguments::Double,       8, true,  false }, // d
+        { Arguments::InvalidData,  1, true,  false }, // e
+        { Arguments::InvalidData,  1, true,  false }, // f
+        { Arguments::Signature,    1, false, true  }, // g
+        { Arguments::UnixFd,       4, true,  false }, // h
+        { Arguments::Int32,        4, true,  false }, // i
+        { Arguments::InvalidData,  1, true,  false }, // j
+        { Arguments::InvalidData,  1, true,  false }, // k
+        { Arguments::InvalidData,  1, true,  false }, // l
+        { Arguments::InvalidData,  1, true,  false }, // m
+        { Arguments::Int16,        2, true,  false }, // n
+        { Arguments::ObjectPath,   4, false, true  }, // o
+        { Arguments::InvalidData,  1, true,  false }, // p
+        { Arguments::Uint16,       2, true,  false }, // q
+        { Arguments::InvalidData,  1, true,  false }, // r
+        { Arguments::String,       4, false, true  }, // s
+        { Arguments::Uint64,       8, true,  false }, // t
+        { Arguments::Uint32,       4, true,  false }, // u
+        { Arguments::BeginVariant, 1, false, false }, // v
+        { Arguments::InvalidData,  1, true,  false }, // w
+        { Arguments::Int64,        8, true,  false }, // x
+        { Arguments::Byte,         1, true,  false }, // y
+        { Arguments::InvalidData,  1, true,  false }, // z
+        { Arguments::BeginDict,    8, false, false }, // {
+        { Arguments::InvalidData,  1, true,  false }, // |
+        { Arguments::EndDict,      1, false, false }  // }
+    };
+    return high[letterCode - 'a'];
+}
+
+// A validated signature, pre-parsed into one instruction per signature letter so that signature
+// positions can be used as instruction indices. Programs are immutable and usually interned in a
+// process-wide cache, so that each distinct signature is parsed only once.
+class SignatureProgram
+{
+public:
+    struct Instruction
+    {
+        Arguments::IoState state() const { return static_cast<Arguments::IoState>(_state); }
+        byte _state; // like TypeInfo: for the letter '{', it is BeginDict (for the dict entry)
+        byte alignment;
+        bool isPrimitive : 1;
+        bool isString : 1;
+        bool isFixedSize : 1; // only primitives and structs / dict entries of them
+        // maximum nesting depth within the single complete type starting here, including itself
+        byte arrayDepth;
+        byte parenDepth;
+        byte totalDepth;
+        // position one past the single complete type starting here; for ')' and '}', one past itself
+        uint16 end;
+        // serialized size, if isFixedSize, when starting at an 8 byte aligned position. For arrays of
+        // the type, the element stride is that size aligned to the type's alignment.
+        uint16 fixedSize;
+    };
+
+    cstring signature() const
+    {
+        return cstring(reinterpret_cast<const char *>(instructions() + m_length + 1), m_length);
+    }
+    uint32 length() const { return m_length; }
+    // number of single complete types at top level; exactly one for a valid variant signature
+    uint32 completeTypeCount() const { return m_completeTypeCount; }
+    // the largest alignment of any contained type, where a variant counts as 8 because its contents
+    // may need that
+    uint32 maxAlignment() const { return m_maxAlignment; }
+    bool isInterned() const { return m_isInterned; }
+
+    // position may be length(), which returns an InvalidData sentinel
+    const Instruction &at(uint32 position) const
+    {
+        assert(position <= m_length);
+        return instructions()[position];
+    }
+
+    // Returns the program for signature, or nullptr if the signature is invalid. Programs are
+    // normally interned and live forever. If the cache is full, the program is compiled into
+    // *uncached instead, which the caller must then keep alive while it uses the program.
+    static const SignatureProgram *get(cstring signature,
+                                       std::shared_ptr<const SignatureProgram> *uncached);
+
+private:
+    SignatureProgram() = default;
+    SignatureProgram(const SignatureProgram &) = delete;
+    void operator=(const SignatureProgram &) = delete;
+
+    friend struct SignatureCompiler;
+    friend class InternTable<SignatureProgram>;
+    static SignatureProgram *compile(cstring signature);
+    static void destroy(const SignatureProgram *program);
+
+    // for InternTable, which bounds the cache so that peers sending endless distinct signatures
+    // can't make it grow forever
+    static const uint32 MaxInterned = 4096;
+    static SignatureProgram *createInterned(cstring signature, uint32 hash);
+    cstring key() const { return signature(); }
+    uint32 hash() const { return m_hash; }
+
+    const Instruction *instructions() const { return reinterpret_cast<const Instruction *>(this + 1); }
+    Instruction *instructions() { return reinterpret_cast<Instruction *>(this + 1); }
+
+    // followed in memory by m_length + 1 instructions, then the null-terminated signature
+    uint32 m_length;
+    uint32 m_completeTypeCount;
+    uint32 m_hash;
+    byte m_maxAlignment;
+    bool m_isInterned;
+};
+
+#endif // SIGNATUREPROGRAM_H
@@ -0,0 +1,71 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "stringinterner.h"
+
+#include "interntable.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+
+// followed in memory by the null-terminated string
+struct Entry
+{
+    static const uint32 MaxInterned = 4096;
+
+    static Entry *createInterned(cstring str, uint32 hash)
+    {
+        void *mem = malloc(sizeof(Entry) + str.length + 1);
+        if (!mem) {
+            return nullptr;
+        }
+        Entry *entry = static_cast<Entry *>(mem);
+        entry->m_hash = hash;
+        entry->m_length = str.length;
+        char *strCopy = reinterpret_cast<char *>(entry + 1);
+        memcpy(strCopy, str.ptr, str.length);
+        strCopy[str.length] = '\0';
+        return entry;
+    }
+
+    cstring key() const { return cstring(reinterpret_cast<const char *>(this + 1), m_length); }
+    uint32 hash() const { return m_hash; }
+
+    uint32 m_hash;
+    uint32 m_length;
+};
+
+} // namespace
+
+cstring StringInterner::intern(cstring str)
+{
+    if (str.length > MaxLength) {
+        return cstring();
+    }
+    const Entry *entry = InternTable<Entry>::get(str);
+    return entry ? entry->key() : cstring();
+}
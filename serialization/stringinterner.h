@@ -0,0 +1,47 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef STRINGINTERNER_H
+#define STRINGINTERNER_H
+
+#include "types.h"
+
+// A process-wide set of strings that are never freed, so that equal interned strings have the same
+// address and can be compared by pointer. It is bounded, see InternTable.
+namespace StringInterner
+{
+
+// The longest string that is interned, which is the maximum length of interface and bus names
+enum
+{
+    MaxLength = 255
+};
+
+// Returns the interned, null-terminated copy of str, or a null cstring if str is too long or if
+// it is not interned yet and the table is full.
+cstring intern(cstring str);
+
+} // namespace StringInterner
+
+#endif // STRINGINTERNER_H
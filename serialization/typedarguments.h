@@ -0,0 +1,1006 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#ifndef TYPEDARGUMENTS_H
+#define TYPEDARGUMENTS_H
+
+#include "arguments.h"
+#include "error.h"
+#include "types.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// TypedWriter and TypedReader (de)serialize argument lists whose shape is known at compile time.
+// The signature is generated from the C++ types at compile time and data is emitted directly in
+// wire format, without the bookkeeping that Arguments::Writer and Arguments::Reader need to support
+// arbitrary, dynamically built argument lists.
+// The output is byte for byte the same as what Arguments::Writer produces for the same values, so
+// it can go into Message::setArguments() and be read with Arguments::Reader, and TypedReader can
+// read what Arguments::Writer wrote.
+//
+// Type mapping:
+// bool, byte, int16, uint16, int32, uint32, int64, uint64, double -> b y n q i u x t d
+// std::string, cstring -> s (a cstring read by TypedReader points into the Arguments' data)
+// TypedObjectPath -> o, TypedSignature -> g, TypedVariant -> v (containing a basic type)
+// std::vector<T> -> aT, std::map<K, V> -> a{KV}, std::tuple<Ts...> -> (Ts...)
+// a struct T -> (...) when TypedStruct<T> is specialized as shown below.
+
+template<typename T, typename Enable = void>
+struct TypedMarshaller;
+
+struct TypedObjectPath
+{
+    TypedObjectPath() {}
+    explicit TypedObjectPath(const std::string &p) : path(p) {}
+    std::string path;
+};
+
+struct TypedSignature
+{
+    TypedSignature() {}
+    explicit TypedSignature(const std::string &s) : signature(s) {}
+    std::string signature;
+};
+
+// A variant containing a single value of basic type, which covers the common uses like property
+// maps of type a{sv}. Aggregates inside variants are not supported by the typed API - use
+// Arguments::Writer / Arguments::Reader for those.
+class TypedVariant
+{
+public:
+    TypedVariant() : m_type(Arguments::NotStarted) { m_u.Uint64 = 0; }
+    TypedVariant(bool b) : m_type(Arguments::Boolean) { m_u.Uint64 = 0; m_u.Boolean = b; }
+    TypedVariant(byte b) : m_type(Arguments::Byte) { m_u.Uint64 = 0; m_u.Byte = b; }
+    TypedVariant(int16 i) : m_type(Arguments::Int16) { m_u.Uint64 = 0; m_u.Int16 = i; }
+    TypedVariant(uint16 i) : m_type(Arguments::Uint16) { m_u.Uint64 = 0; m_u.Uint16 = i; }
+    TypedVariant(int32 i) : m_type(Arguments::Int32) { m_u.Uint64 = 0; m_u.Int32 = i; }
+    TypedVariant(uint32 i) : m_type(Arguments::Uint32) { m_u.Uint64 = 0; m_u.Uint32 = i; }
+    TypedVariant(int64 i) : m_type(Arguments::Int64) { m_u.Int64 = i; }
+    TypedVariant(uint64 i) : m_type(Arguments::Uint64) { m_u.Uint64 = i; }
+    TypedVariant(double d) : m_type(Arguments::Double) { m_u.Double = d; }
+    TypedVariant(const char *s) : m_type(Arguments::String), m_string(s) { m_u.Uint64 = 0; }
+    TypedVariant(const std::string &s) : m_type(Arguments::String), m_string(s) { m_u.Uint64 = 0; }
+    TypedVariant(const TypedObjectPath &o) : m_type(Arguments::ObjectPath), m_string(o.path) { m_u.Uint64 = 0; }
+    TypedVariant(const TypedSignature &g) : m_type(Arguments::Signature), m_string(g.signature) { m_u.Uint64 = 0; }
+
+    // NotStarted for a default-constructed instance, otherwise one of the basic type states
+    Arguments::IoState type() const { return m_type; }
+
+    // calling the accessor that does not match type() returns garbage
+    bool toBoolean() const { return m_u.Boolean; }
+    byte toByte() const { return m_u.Byte; }
+    int16 toInt16() const { return m_u.Int16; }
+    uint16 toUint16() const { return m_u.Uint16; }
+    int32 toInt32() const { return m_u.Int32; }
+    uint32 toUint32() const { return m_u.Uint32; }
+    int64 toInt64() const { return m_u.Int64; }
+    uint64 toUint64() const { return m_u.Uint64; }
+    double toDouble() const { return m_u.Double; }
+    const std::string &toString() const { return m_string; } // String, ObjectPath and Signature
+
+private:
+    template<typename T, typename Enable> friend struct TypedMarshaller;
+    Arguments::IoState m_type;
+    union
+    {
+        bool Boolean;
+        byte Byte;
+        int16 Int16;
+        uint16 Uint16;
+        int32 Int32;
+        uint32 Uint32;
+        int64 Int64;
+        uint64 Uint64;
+        double Double;
+    } m_u;
+    std::string m_string;
+};
+
+// Specialize TypedStruct to map a struct to a D-Bus struct. fields() returns a tuple of member
+// pointers in wire order, e.g.:
+// template<> struct TypedStruct<Point>
+// {
+//     static std::tuple<int32 Point::*, int32 Point::*> fields()
+//     { return std::make_tuple(&Point::x, &Point::y); }
+// };
+template<typename T>
+struct TypedStruct
+{
+};
+
+// The implementation details follow; TypedWriter and TypedReader are at the end of the file.
+
+namespace typed
+{
+
+enum : uint32
+{
+    MaxArrayLength = 67108864, // 64 MiB
+    MaxArgumentsLength = 134217728 // 128 MiB
+};
+
+constexpr uint32 alignUp(uint32 index, uint32 alignment)
+{
+    return (index + alignment - 1) & ~(alignment - 1);
+}
+
+constexpr uint32 maxOf(uint32 a, uint32 b)
+{
+    return a > b ? a : b;
+}
+
+template<char... Cs>
+struct Signature
+{
+    enum : uint32 { Length = sizeof...(Cs) };
+    static const char value[sizeof...(Cs) + 1];
+};
+
+template<char... Cs>
+const char Signature<Cs...>::value[sizeof...(Cs) + 1] = { Cs..., '\0' };
+
+template<typename... Sigs>
+struct Concat;
+
+template<>
+struct Concat<>
+{
+    typedef Signature<> Type;
+};
+
+template<char... Cs>
+struct Concat<Signature<Cs...>>
+{
+    typedef Signature<Cs...> Type;
+};
+
+template<char... As, char... Bs, typename... Rest>
+struct Concat<Signature<As...>, Signature<Bs...>, Rest...>
+{
+    typedef typename Concat<Signature<As..., Bs...>, Rest...>::Type Type;
+};
+
+// C++11 has no std::index_sequence
+template<uint32... Is>
+struct Indices
+{
+};
+
+template<uint32 N, uint32... Is>
+struct MakeIndices : MakeIndices<N - 1, N - 1, Is...>
+{
+};
+
+template<uint32... Is>
+struct MakeIndices<0, Is...>
+{
+    typedef Indices<Is...> Type;
+};
+
+template<typename T>
+inline T load(const byte *p, bool swap)
+{
+    T ret;
+    if (unlikely(swap)) {
+        byte buf[sizeof(T)];
+        for (uint32 i = 0; i < sizeof(T); i++) {
+            buf[i] = p[sizeof(T) - 1 - i];
+        }
+        memcpy(&ret, buf, sizeof(T));
+    } else {
+        memcpy(&ret, p, sizeof(T));
+    }
+    return ret;
+}
+
+class OutBuffer
+{
+public:
+    // the first @p prefix bytes are reserved for the signature
+    OutBuffer(uint32 prefix, uint32 sizeHint)
+       : m_buffer(static_cast<byte *>(malloc(prefix + sizeHint))),
+         m_capacity(prefix + sizeHint),
+         m_pos(prefix)
+    {}
+    ~OutBuffer() { free(m_buffer); }
+
+    // pads with zeros to @p alignment, then makes room for @p size bytes and returns a pointer to them
+    byte *claim(uint32 alignment, uint32 size)
+    {
+        const uint32 start = alignUp(m_pos, alignment);
+        const uint32 end = start + size;
+        if (unlikely(end > m_capacity)) {
+            grow(end);
+        }
+        for (; m_pos < start; m_pos++) {
+            m_buffer[m_pos] = 0;
+        }
+        m_pos = end;
+        return m_buffer + start;
+    }
+    void reserve(uint32 size)
+    {
+        if (unlikely(m_pos + size > m_capacity)) {
+            grow(m_pos + size);
+        }
+    }
+    uint32 position() const { return m_pos; }
+    byte *at(uint32 pos) { return m_buffer + pos; }
+
+    byte *takeBuffer() { byte *ret = m_buffer; m_buffer = nullptr; return ret; }
+
+    Error error;
+
+private:
+    void grow(uint32 minCapacity)
+    {
+        uint32 newCapacity = m_capacity;
+        while (newCapacity < minCapacity) {
+            newCapacity *= 2;
+        }
+        m_buffer = static_cast<byte *>(realloc(m_buffer, newCapacity));
+        m_capacity = newCapacity;
+    }
+
+    byte *m_buffer;
+    uint32 m_capacity;
+    uint32 m_pos;
+};
+
+class InBuffer
+{
+public:
+    InBuffer(chunk data, bool isByteSwapped)
+       : m_data(data),
+         m_pos(0),
+         m_isByteSwapped(isByteSwapped)
+    {}
+
+    // checks padding up to @p alignment and availability of @p size bytes, then returns a pointer
+    // to them. Returns null after any error.
+    const byte *take(uint32 alignment, uint32 size)
+    {
+        if (unlikely(error.isError())) {
+            return nullptr;
+        }
+        const uint32 start = alignUp(m_pos, alignment);
+        if (unlikely(start > m_data.length || size > m_data.length - start)) {
+            error.setCode(Error::MalformedMessageData);
+            return nullptr;
+        }
+        for (; m_pos < start; m_pos++) {
+            if (unlikely(m_data.ptr[m_pos] != 0)) {
+                error.setCode(Error::MalformedMessageData);
+                return nullptr;
+            }
+        }
+        m_pos = start + size;
+        return m_data.ptr + start;
+    }
+    bool isByteSwapped() const { return m_isByteSwapped; }
+    uint32 position() const { return m_pos; }
+    uint32 length() const { return m_data.length; }
+
+    Error error;
+
+private:
+    chunk m_data;
+    uint32 m_pos;
+    bool m_isByteSwapped;
+};
+
+inline void writeString(OutBuffer *out, cstring str, Arguments::IoState type)
+{
+    uint32 prefixSize = 4;
+    if (type == Arguments::String) {
+        if (unlikely(!Arguments::isStringValid(str))) {
+            out->error.setCode(Error::InvalidString);
+            return;
+        }
+    } else if (type == Arguments::ObjectPath) {
+        if (unlikely(!Arguments::isObjectPathValid(str))) {
+            out->error.setCode(Error::InvalidObjectPath);
+            return;
+        }
+    } else {
+        if (unlikely(!Arguments::isSignatureValid(str))) {
+            out->error.setCode(Error::InvalidSignature);
+            return;
+        }
+        prefixSize = 1;
+    }
+    byte *p = out->claim(prefixSize, prefixSize + str.length + 1);
+    if (prefixSize == 1) {
+        *p = byte(str.length);
+    } else {
+        memcpy(p, &str.length, sizeof(uint32));
+    }
+    memcpy(p + prefixSize, str.ptr, str.length + 1);
+}
+
+inline cstring readString(InBuffer *in, Arguments::IoState type)
+{
+    uint32 length = 0;
+    if (type == Arguments::Signature) {
+        const byte *p = in->take(1, 1);
+        if (p) {
+            length = *p;
+        }
+    } else {
+        const byte *p = in->take(4, 4);
+        if (p) {
+            length = load<uint32>(p, in->isByteSwapped());
+            if (unlikely(length + 1 >= MaxArrayLength)) {
+                in->error.setCode(Error::MalformedMessageData);
+            }
+        }
+    }
+    const byte *p = in->take(1, length + 1);
+    if (!p) {
+        return cstring();
+    }
+    cstring ret(reinterpret_cast<const char *>(p), length);
+    bool isValid = false;
+    if (type == Arguments::String) {
+        isValid = Arguments::isStringValid(ret);
+    } else if (type == Arguments::ObjectPath) {
+        isValid = Arguments::isObjectPathValid(ret);
+    } else {
+        isValid = Arguments::isSignatureValid(ret);
+    }
+    if (unlikely(!isValid)) {
+        in->error.setCode(Error::MalformedMessageData);
+        return cstring();
+    }
+    return ret;
+}
+
+} // namespace typed
+
+// Marshaller for each supported type. Members:
+// Sig: the type signature as typed::Signature<...>
+// Alignment, FixedSize: wire alignment and size if all values have the same size, otherwise 0
+// IsMemcpyable: wire format equals in-memory format (modulo byte order), allows bulk copies
+// write(), read(): (de)serialize one value
+// store(): only for fixed size types, write a value at a known aligned position
+
+template<typename T, char C>
+struct TypedPrimitiveMarshaller
+{
+    typedef typed::Signature<C> Sig;
+    enum : uint32 { Alignment = sizeof(T), FixedSize = sizeof(T) };
+    enum : bool { IsMemcpyable = true };
+
+    static void store(byte *p, T value) { memcpy(p, &value, sizeof(T)); }
+    static void write(typed::OutBuffer *out, T value) { store(out->claim(sizeof(T), sizeof(T)), value); }
+    static void read(typed::InBuffer *in, T *value)
+    {
+        const byte *p = in->take(sizeof(T), sizeof(T));
+        if (likely(p)) {
+            *value = typed::load<T>(p, in->isByteSwapped());
+        }
+    }
+};
+
+template<> struct TypedMarshaller<byte> : TypedPrimitiveMarshaller<byte, 'y'> {};
+template<> struct TypedMarshaller<int16> : TypedPrimitiveMarshaller<int16, 'n'> {};
+template<> struct TypedMarshaller<uint16> : TypedPrimitiveMarshaller<uint16, 'q'> {};
+template<> struct TypedMarshaller<int32> : TypedPrimitiveMarshaller<int32, 'i'> {};
+template<> struct TypedMarshaller<uint32> : TypedPrimitiveMarshaller<uint32, 'u'> {};
+template<> struct TypedMarshaller<int64> : TypedPrimitiveMarshaller<int64, 'x'> {};
+template<> struct TypedMarshaller<uint64> : TypedPrimitiveMarshaller<uint64, 't'> {};
+template<> struct TypedMarshaller<double> : TypedPrimitiveMarshaller<double, 'd'> {};
+
+template<>
+struct TypedMarshaller<bool>
+{
+    typedef typed::Signature<'b'> Sig;
+    enum : uint32 { Alignment = 4, FixedSize = 4 };
+    enum : bool { IsMemcpyable = false };
+
+    static void store(byte *p, bool value) { const uint32 num = value ? 1 : 0; memcpy(p, &num, 4); }
+    static void write(typed::OutBuffer *out, bool value) { store(out->claim(4, 4), value); }
+    static void read(typed::InBuffer *in, bool *value)
+    {
+        const byte *p = in->take(4, 4);
+        if (likely(p)) {
+            const uint32 num = typed::load<uint32>(p, in->isByteSwapped());
+            if (unlikely(num > 1)) {
+                in->error.setCode(Error::MalformedMessageData);
+            }
+            *value = num == 1;
+        }
+    }
+};
+
+template<typename T, char C, Arguments::IoState State>
+struct TypedStringMarshaller
+{
+    typedef typed::Signature<C> Sig;
+    enum : uint32 { Alignment = State == Arguments::Signature ? 1 : 4, FixedSize = 0 };
+    enum : bool { IsMemcpyable = false };
+};
+
+template<>
+struct TypedMarshaller<std::string> : TypedStringMarshaller<std::string, 's', Arguments::String>
+{
+    static void write(typed::OutBuffer *out, const std::string &value)
+    {
+        typed::writeString(out, cstring(value.c_str(), value.length()), Arguments::String);
+    }
+    static void read(typed::InBuffer *in, std::string *value)
+    {
+        const cstring s = typed::readString(in, Arguments::String);
+        value->assign(s.ptr, s.length);
+    }
+};
+
+template<>
+struct TypedMarshaller<cstring> : TypedStringMarshaller<cstring, 's', Arguments::String>
+{
+    static void write(typed::OutBuffer *out, cstring value)
+    {
+        typed::writeString(out, value, Arguments::String);
+    }
+    static void read(typed::InBuffer *in, cstring *value)
+    {
+        *value = typed::readString(in, Arguments::String);
+    }
+};
+
+template<>
+struct TypedMarshaller<TypedObjectPath> : TypedStringMarshaller<TypedObjectPath, 'o', Arguments::ObjectPath>
+{
+    static void write(typed::OutBuffer *out, const TypedObjectPath &value)
+    {
+        typed::writeString(out, cstring(value.path.c_str(), value.path.length()), Arguments::ObjectPath);
+    }
+    static void read(typed::InBuffer *in, TypedObjectPath *value)
+    {
+        const cstring s = typed::readString(in, Arguments::ObjectPath);
+        value->path.assign(s.ptr, s.length);
+    }
+};
+
+template<>
+struct TypedMarshaller<TypedSignature> : TypedStringMarshaller<TypedSignature, 'g', Arguments::Signature>
+{
+    static void write(typed::OutBuffer *out, const TypedSignature &value)
+    {
+        typed::writeString(out, cstring(value.signature.c_str(), value.signature.length()),
+                           Arguments::Signature);
+    }
+    static void read(typed::InBuffer *in, TypedSignature *value)
+    {
+        const cstring s = typed::readString(in, Arguments::Signature);
+        value->signature.assign(s.ptr, s.length);
+    }
+};
+
+template<>
+struct TypedMarshaller<TypedVariant>
+{
+    typedef typed::Signature<'v'> Sig;
+    enum : uint32 { Alignment = 1, FixedSize = 0 };
+    enum : bool { IsMemcpyable = false };
+
+    static void write(typed::OutBuffer *out, const TypedVariant &value)
+    {
+        static const char letters[Arguments::LastState] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            'b', 'y', 'n', 'q', 'i', 'u', 'x', 't', 'd', 's', 'o', 'g', 0 };
+        const char letter = value.m_type < Arguments::LastState ? letters[value.m_type] : 0;
+        if (unlikely(!letter)) {
+            out->error.setCode(Error::InvalidType);
+            return;
+        }
+        byte *sig = out->claim(1, 3);
+        sig[0] = 1;
+        sig[1] = byte(letter);
+        sig[2] = 0;
+        switch (value.m_type) {
+        case Arguments::Boolean:
+            TypedMarshaller<bool>::write(out, value.m_u.Boolean); break;
+        case Arguments::Byte:
+            TypedMarshaller<byte>::write(out, value.m_u.Byte); break;
+        case Arguments::Int16:
+            TypedMarshaller<int16>::write(out, value.m_u.Int16); break;
+        case Arguments::Uint16:
+            TypedMarshaller<uint16>::write(out, value.m_u.Uint16); break;
+        case Arguments::Int32:
+            TypedMarshaller<int32>::write(out, value.m_u.Int32); break;
+        case Arguments::Uint32:
+            TypedMarshaller<uint32>::write(out, value.m_u.Uint32); break;
+        case Arguments::Int64:
+            TypedMarshaller<int64>::write(out, value.m_u.Int64); break;
+        case Arguments::Uint64:
+            TypedMarshaller<uint64>::write(out, value.m_u.Uint64); break;
+        case Arguments::Double:
+            TypedMarshaller<double>::write(out, value.m_u.Double); break;
+        default:
+            typed::writeString(out, cstring(value.m_string.c_str(), value.m_string.length()), value.m_type);
+            break;
+        }
+    }
+
+    static void read(typed::InBuffer *in, TypedVariant *value)
+    {
+        const byte *sig = in->take(1, 3);
+        if (unlikely(!sig)) {
+            return;
+        }
+        if (unlikely(sig[0] != 1 || sig[2] != 0)) {
+            // a longer signature may be valid, but it is not supported by TypedVariant
+            in->error.setCode(sig[0] > 1 ? Error::ReadWrongType : Error::MalformedMessageData);
+            return;
+        }
+        switch (sig[1]) {
+        case 'b':
+            value->m_type = Arguments::Boolean; TypedMarshaller<bool>::read(in, &value->m_u.Boolean); break;
+        case 'y':
+            value->m_type = Arguments::Byte; TypedMarshaller<byte>::read(in, &value->m_u.Byte); break;
+        case 'n':
+            value->m_type = Arguments::Int16; TypedMarshaller<int16>::read(in, &value->m_u.Int16); break;
+        case 'q':
+            value->m_type = Arguments::Uint16; TypedMarshaller<uint16>::read(in, &value->m_u.Uint16); break;
+        case 'i':
+            value->m_type = Arguments::Int32; TypedMarshaller<int32>::read(in, &value->m_u.Int32); break;
+        case 'u':
+            value->m_type = Arguments::Uint32; TypedMarshaller<uint32>::read(in, &value->m_u.Uint32); break;
+        case 'x':
+            value->m_type = Arguments::Int64; TypedMarshaller<int64>::read(in, &value->m_u.Int64); break;
+        case 't':
+            value->m_type = Arguments::Uint64; TypedMarshaller<uint64>::read(in, &value->m_u.Uint64); break;
+        case 'd':
+            value->m_type = Arguments::Double; TypedMarshaller<double>::read(in, &value->m_u.Double); break;
+        case 's':
+        case 'o':
+        case 'g': {
+            value->m_type = sig[1] == 's' ? Arguments::String
+                                          : (sig[1] == 'o' ? Arguments::ObjectPath : Arguments::Signature);
+            const cstring s = typed::readString(in, value->m_type);
+            value->m_string.assign(s.ptr, s.length);
+            break; }
+        default:
+            in->error.setCode(Error::ReadWrongType);
+            break;
+        }
+    }
+};
+
+namespace typed
+{
+
+// Layout of a struct whose members are all fixed size: offsets relative to the (8-aligned) start
+template<uint32 Offset, typename... Ms>
+struct FixedLayout
+{
+    enum : uint32 { End = Offset };
+    static void store(byte *) {}
+};
+
+template<uint32 Offset, typename M, typename... Ms>
+struct FixedLayout<Offset, M, Ms...>
+{
+    enum : uint32 {
+        Begin = alignUp(Offset, TypedMarshaller<M>::Alignment),
+        End = FixedLayout<Begin + TypedMarshaller<M>::FixedSize, Ms...>::End
+    };
+    template<typename V, typename... Vs>
+    static void store(byte *p, const V &value, const Vs &... values)
+    {
+        for (uint32 i = Offset; i < Begin; i++) {
+            p[i] = 0;
+        }
+        TypedMarshaller<M>::store(p + Begin, value);
+        FixedLayout<Begin + TypedMarshaller<M>::FixedSize, Ms...>::store(p, values...);
+    }
+};
+
+template<typename... Ms>
+struct AllFixedSize;
+
+template<>
+struct AllFixedSize<>
+{
+    enum : bool { Value = true };
+};
+
+template<typename M, typename... Ms>
+struct AllFixedSize<M, Ms...>
+{
+    enum : bool { Value = TypedMarshaller<M>::FixedSize != 0 && AllFixedSize<Ms...>::Value };
+};
+
+inline void expand(std::initializer_list<int>) {}
+
+// Common part of std::tuple and TypedStruct marshalling; Access provides get<I>(const T &) and
+// ref<I>(T *) and the member types as Members...
+template<typename T, typename Access, typename... Ms>
+struct StructMarshaller
+{
+    typedef typename Concat<Signature<'('>, typename TypedMarshaller<Ms>::Sig..., Signature<')'>>::Type Sig;
+    enum : bool { IsFixed = AllFixedSize<Ms...>::Value };
+    enum : uint32 { Alignment = 8, FixedSize = IsFixed ? uint32(FixedLayout<0, Ms...>::End) : 0 };
+    enum : bool { IsMemcpyable = false };
+
+    static_assert(sizeof...(Ms) > 0, "D-Bus does not allow empty structs");
+
+    template<uint32... Is>
+    static void storeImpl(byte *p, const T &value, Indices<Is...>)
+    {
+        FixedLayout<0, Ms...>::store(p, Access::template get<Is>(value)...);
+    }
+    static void store(byte *p, const T &value)
+    {
+        storeImpl(p, value, typename MakeIndices<sizeof...(Ms)>::Type());
+    }
+
+    template<uint32... Is>
+    static void writeImpl(OutBuffer *out, const T &value, Indices<Is...>, std::true_type)
+    {
+        // all member offsets are known at compile time
+        FixedLayout<0, Ms...>::store(out->claim(8, FixedSize), Access::template get<Is>(value)...);
+    }
+    template<uint32... Is>
+    static void writeImpl(OutBuffer *out, const T &value, Indices<Is...>, std::false_type)
+    {
+        out->claim(8, 0);
+        expand({ (TypedMarshaller<Ms>::write(out, Access::template get<Is>(value)), 0)... });
+    }
+    static void write(OutBuffer *out, const T &value)
+    {
+        writeImpl(out, value, typename MakeIndices<sizeof...(Ms)>::Type(),
+                  std::integral_constant<bool, IsFixed>());
+    }
+
+    template<uint32... Is>
+    static void readImpl(InBuffer *in, T *value, Indices<Is...>)
+    {
+        in->take(8, 0);
+        expand({ (TypedMarshaller<Ms>::read(in, Access::template ref<Is>(value)), 0)... });
+    }
+    static void read(InBuffer *in, T *value)
+    {
+        readImpl(in, value, typename MakeIndices<sizeof...(Ms)>::Type());
+    }
+};
+
+template<typename... Ms>
+struct TupleAccess
+{
+    template<uint32 I>
+    static const typename std::tuple_element<I, std::tuple<Ms...>>::type &get(const std::tuple<Ms...> &t)
+    { return std::get<I>(t); }
+    template<uint32 I>
+    static typename std::tuple_element<I, std::tuple<Ms...>>::type *ref(std::tuple<Ms...> *t)
+    { return &std::get<I>(*t); }
+};
+
+template<typename P>
+struct MemberPointerType;
+
+template<typename M, typename C>
+struct MemberPointerType<M C::*>
+{
+    typedef M Type;
+};
+
+template<typename T, typename Fields>
+struct MemberAccess
+{
+    template<uint32 I>
+    static const typename MemberPointerType<typename std::tuple_element<I, Fields>::type>::Type &get(const T &t)
+    { return t.*std::get<I>(TypedStruct<T>::fields()); }
+    template<uint32 I>
+    static typename MemberPointerType<typename std::tuple_element<I, Fields>::type>::Type *ref(T *t)
+    { return &(t->*std::get<I>(TypedStruct<T>::fields())); }
+};
+
+template<typename T, typename Fields>
+struct MappedStructMarshaller;
+
+template<typename T, typename... Ps>
+struct MappedStructMarshaller<T, std::tuple<Ps...>>
+    : StructMarshaller<T, MemberAccess<T, std::tuple<Ps...>>, typename MemberPointerType<Ps>::Type...>
+{
+};
+
+template<typename T>
+struct HasTypedStruct
+{
+    template<typename U>
+    static std::true_type test(decltype(TypedStruct<U>::fields()) *);
+    template<typename U>
+    static std::false_type test(...);
+    enum : bool { Value = decltype(test<T>(nullptr))::value };
+};
+
+} // namespace typed
+
+template<typename... Ms>
+struct TypedMarshaller<std::tuple<Ms...>>
+    : typed::StructMarshaller<std::tuple<Ms...>, typed::TupleAccess<Ms...>, Ms...>
+{
+};
+
+template<typename T>
+struct TypedMarshaller<T, typename std::enable_if<typed::HasTypedStruct<T>::Value>::type>
+    : typed::MappedStructMarshaller<T, decltype(TypedStruct<T>::fields())>
+{
+};
+
+template<typename E>
+struct TypedMarshaller<std::vector<E>>
+{
+    typedef TypedMarshaller<E> Element;
+    typedef typename typed::Concat<typed::Signature<'a'>, typename Element::Sig>::Type Sig;
+    enum : uint32 { Alignment = 4, FixedSize = 0 };
+    enum : bool { IsMemcpyable = false };
+
+    static void writeElements(typed::OutBuffer *out, const std::vector<E> &value, std::true_type)
+    {
+        // contiguous and identical in memory and on the wire
+        if (!value.empty()) {
+            memcpy(out->claim(Element::Alignment, value.size() * sizeof(E)), &value[0], value.size() * sizeof(E));
+        }
+    }
+    static void writeElements(typed::OutBuffer *out, const std::vector<E> &value, std::false_type)
+    {
+        if (Element::FixedSize != 0) {
+            out->reserve(value.size() * typed::alignUp(Element::FixedSize, Element::Alignment));
+        }
+        for (const E &e : value) {
+            Element::write(out, e);
+        }
+    }
+
+    static void write(typed::OutBuffer *out, const std::vector<E> &value)
+    {
+        const uint32 lengthPos = uint32(out->claim(4, 4) - out->at(0));
+        out->claim(Element::Alignment, 0);
+        const uint32 dataStart = out->position();
+        writeElements(out, value, std::integral_constant<bool, Element::IsMemcpyable>());
+        const uint32 length = out->position() - dataStart;
+        if (unlikely(length > typed::MaxArrayLength)) {
+            out->error.setCode(Error::ArrayOrDictTooLong);
+        }
+        memcpy(out->at(lengthPos), &length, sizeof(uint32));
+    }
+
+    template<typename V>
+    static void readElement(typed::InBuffer *in, std::vector<V> *value)
+    {
+        value->emplace_back();
+        Element::read(in, &value->back());
+    }
+    static void readElement(typed::InBuffer *in, std::vector<bool> *value)
+    {
+        bool b = false;
+        Element::read(in, &b);
+        value->push_back(b);
+    }
+
+    static void readElements(typed::InBuffer *in, uint32 length, std::vector<E> *value, std::true_type)
+    {
+        if (length % sizeof(E)) {
+            in->error.setCode(Error::MalformedMessageData);
+            return;
+        }
+        const byte *p = in->take(1, length);
+        if (!p) {
+            return;
+        }
+        value->resize(length / sizeof(E));
+        if (value->empty()) {
+            return;
+        }
+        if (in->isByteSwapped()) {
+            for (uint32 i = 0; i < value->size(); i++) {
+                (*value)[i] = typed::load<E>(p + i * sizeof(E), true);
+            }
+        } else {
+            memcpy(&(*value)[0], p, length);
+        }
+    }
+    static void readElements(typed::InBuffer *in, uint32 length, std::vector<E> *value, std::false_type)
+    {
+        const uint32 end = in->position() + length;
+        if (end > in->length()) {
+            in->error.setCode(Error::MalformedMessageData);
+            return;
+        }
+        while (in->position() < end && !in->error.isError()) {
+            readElement(in, value);
+        }
+        if (in->position() != end) {
+            in->error.setCode(Error::MalformedMessageData);
+        }
+    }
+
+    static void read(typed::InBuffer *in, std::vector<E> *value)
+    {
+        value->clear();
+        const byte *p = in->take(4, 4);
+        if (!p) {
+            return;
+        }
+        const uint32 length = typed::load<uint32>(p, in->isByteSwapped());
+        if (unlikely(length > typed::MaxArrayLength)) {
+            in->error.setCode(Error::MalformedMessageData);
+            return;
+        }
+        in->take(Element::Alignment, 0);
+        readElements(in, length, value, std::integral_constant<bool, Element::IsMemcpyable>());
+    }
+};
+
+template<typename K, typename V>
+struct TypedMarshaller<std::map<K, V>>
+{
+    typedef TypedMarshaller<K> Key;
+    typedef TypedMarshaller<V> Value;
+    typedef typename typed::Concat<typed::Signature<'a', '{'>, typename Key::Sig, typename Value::Sig,
+                                   typed::Signature<'}'>>::Type Sig;
+    enum : uint32 { Alignment = 4, FixedSize = 0 };
+    enum : bool { IsMemcpyable = false };
+
+    static_assert(Key::Sig::Length == 1 && !std::is_same<K, TypedVariant>::value,
+                  "Dict keys must be of basic type");
+
+    static void write(typed::OutBuffer *out, const std::map<K, V> &value)
+    {
+        const uint32 lengthPos = uint32(out->claim(4, 4) - out->at(0));
+        out->claim(8, 0);
+        const uint32 dataStart = out->position();
+        for (const std::pair<const K, V> &entry : value) {
+            out->claim(8, 0);
+            Key::write(out, entry.first);
+            Value::write(out, entry.second);
+        }
+        const uint32 length = out->position() - dataStart;
+        if (unlikely(length > typed::MaxArrayLength)) {
+            out->error.setCode(Error::ArrayOrDictTooLong);
+        }
+        memcpy(out->at(lengthPos), &length, sizeof(uint32));
+    }
+
+    static void read(typed::InBuffer *in, std::map<K, V> *value)
+    {
+        value->clear();
+        const byte *p = in->take(4, 4);
+        if (!p) {
+            return;
+        }
+        const uint32 length = typed::load<uint32>(p, in->isByteSwapped());
+        in->take(8, 0);
+        const uint32 end = in->position() + length;
+        if (unlikely(length > typed::MaxArrayLength || end > in->length())) {
+            in->error.setCode(Error::MalformedMessageData);
+            return;
+        }
+        while (in->position() < end && !in->error.isError()) {
+            in->take(8, 0);
+            K key;
+            Key::read(in, &key);
+            Value::read(in, &(*value)[std::move(key)]);
+        }
+        if (in->position() != end) {
+            in->error.setCode(Error::MalformedMessageData);
+        }
+    }
+};
+
+template<typename... Ts>
+class TypedWriter
+{
+public:
+    typedef typename typed::Concat<typename TypedMarshaller<Ts>::Sig...>::Type Sig;
+    static_assert(uint32(Sig::Length) <= uint32(Arguments::MaxSignatureLength), "Signature too long");
+
+    static cstring signature() { return cstring(Sig::value, Sig::Length); }
+
+    // Returns the serialized values, or an empty Arguments if a value was invalid. In the latter
+    // case, error() tells what went wrong.
+    Arguments write(const Ts &... values)
+    {
+        // same layout as Arguments::Writer::finish() produces: signature, padding, data
+        const uint32 dataOffset = typed::alignUp(Sig::Length + 1, 8);
+        typed::OutBuffer out(dataOffset, sizeHint());
+        memcpy(out.at(0), Sig::value, Sig::Length + 1);
+        memset(out.at(Sig::Length + 1), 0, dataOffset - (Sig::Length + 1));
+
+        typed::expand({ (TypedMarshaller<Ts>::write(&out, values), 0)... });
+
+        const uint32 dataLength = out.position() - dataOffset;
+        if (unlikely(!out.error.isError() && out.position() > typed::MaxArgumentsLength)) {
+            out.error.setCode(Error::ArgumentsTooLong);
+        }
+        m_error = out.error;
+        if (unlikely(m_error.isError())) {
+            return Arguments();
+        }
+        if (!dataLength) {
+            return Arguments(nullptr, cstring(Sig::value, Sig::Length), chunk());
+        }
+        byte *buffer = out.takeBuffer();
+        return Arguments(buffer, cstring(buffer, Sig::Length), chunk(buffer + dataOffset, dataLength));
+    }
+
+    Error error() const { return m_error; }
+
+private:
+    static uint32 sizeHint()
+    {
+        const uint32 fixedSize = typed::FixedLayout<0, Ts...>::End;
+        return typed::AllFixedSize<Ts...>::Value ? typed::maxOf(fixedSize, 8) : fixedSize + 256;
+    }
+
+    Error m_error;
+};
+
+template<typename... Ts>
+class TypedReader
+{
+public:
+    typedef typename typed::Concat<typename TypedMarshaller<Ts>::Sig...>::Type Sig;
+
+    explicit TypedReader(const Arguments &args) : m_args(&args) {}
+
+    static cstring signature() { return cstring(Sig::value, Sig::Length); }
+
+    // Reads all values and returns true on success. On failure, the output values are unspecified
+    // and error() tells what went wrong: ReadWrongType if the signature of the Arguments does not
+    // match, MalformedMessageData if the data is invalid.
+    bool read(Ts *... values)
+    {
+        const cstring sig = m_args->signature();
+        if (sig.length != Sig::Length || memcmp(sig.ptr, Sig::value, Sig::Length) != 0) {
+            m_error.setCode(Error::ReadWrongType);
+            return false;
+        }
+        typed::InBuffer in(m_args->data(), m_args->isByteSwapped());
+        typed::expand({ (TypedMarshaller<Ts>::read(&in, values), 0)... });
+        if (!in.error.isError() && in.position() != in.length()) {
+            in.error.setCode(Error::MalformedMessageData);
+        }
+        m_error = in.error;
+        return !m_error.isError();
+    }
+
+    Error error() const { return m_error; }
+
+private:
+    const Arguments *m_args;
+    Error m_error;
+};
+
+#endif // TYPEDARGUMENTS_H
@@ -0,0 +1,424 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "validation.h"
+
+#include "cpufeatures.h"
+
+static const uint32 s_maxNameLength = 255;
+
+static inline bool isObjectNameLetter(byte c)
+{
+    return (c >= 'a' && c <= 'z') || c == '_' || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static inline bool isNameLetter(byte c, byte extra1, byte extra2)
+{
+    return isObjectNameLetter(c) || c == extra1 || c == extra2;
+}
+
+static inline bool isDigit(byte c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Validates one multi-byte UTF-8 sequence starting at *pos, according to table 3-7 in the
+// Unicode standard (no overlong forms, no surrogates, nothing above U+10FFFF).
+static inline bool stepUtf8Sequence(const byte *s, uint32 length, uint32 *pos)
+{
+    uint32 i = *pos;
+    const byte c = s[i];
+    uint32 continuationCount;
+    byte secondMin = 0x80;
+    byte secondMax = 0xbf;
+    if (c < 0xc2) {
+        return false; // stray continuation byte or overlong two-byte form
+    } else if (c < 0xe0) {
+        continuationCount = 1;
+    } else if (c < 0xf0) {
+        continuationCount = 2;
+        if (c == 0xe0) {
+            secondMin = 0xa0; // overlong
+        } else if (c == 0xed) {
+            secondMax = 0x9f; // surrogates
+        }
+    } else if (c < 0xf5) {
+        continuationCount = 3;
+        if (c == 0xf0) {
+            secondMin = 0x90; // overlong
+        } else if (c == 0xf4) {
+            secondMax = 0x8f; // > U+10FFFF
+        }
+    } else {
+        return false;
+    }
+    if (unlikely(length - i <= continuationCount)) {
+        return false;
+    }
+    if (s[i + 1] < secondMin || s[i + 1] > secondMax) {
+        return false;
+    }
+    for (uint32 j = 2; j <= continuationCount; j++) {
+        if ((s[i + j] & 0xc0) != 0x80) {
+            return false;
+        }
+    }
+    *pos = i + 1 + continuationCount;
+    return true;
+}
+
+static bool utf8ScalarFrom(const byte *s, uint32 i, uint32 length)
+{
+    static const uint64 highBits = 0x8080808080808080ull;
+    static const uint64 lowBits = 0x0101010101010101ull;
+    while (i < length) {
+        // skip ASCII without nulls a word at a time
+        for (; i + 8 <= length; i += 8) {
+            uint64 word;
+            memcpy(&word, s + i, sizeof(word));
+            const uint64 hasZeroByte = (word - lowBits) & ~word & highBits;
+            if ((word & highBits) | hasZeroByte) {
+                break;
+            }
+        }
+        if (i >= length) {
+            break;
+        }
+        const byte c = s[i];
+        if (c < 0x80) {
+            if (c == 0) {
+                return false;
+            }
+            i++;
+        } else if (!stepUtf8Sequence(s, length, &i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool utf8Scalar(const byte *s, uint32 length)
+{
+    return utf8ScalarFrom(s, 0, length);
+}
+
+static bool inClassScalarFrom(const byte *s, uint32 i, uint32 length, byte extra1, byte extra2)
+{
+    for (; i < length; i++) {
+        if (!isNameLetter(s[i], extra1, extra2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool inClassScalar(const byte *s, uint32 length, byte extra1, byte extra2)
+{
+    return inClassScalarFrom(s, 0, length, extra1, extra2);
+}
+
+// The caller has checked that s[0] == '/' and length > 1. prevSlash tells if s[i - 1] == '/'.
+static bool objectPathScalarFrom(const byte *s, uint32 i, uint32 length, bool prevSlash)
+{
+    for (; i < length; i++) {
+        const byte c = s[i];
+        if (c == '/') {
+            if (prevSlash) {
+                return false;
+            }
+            prevSlash = true;
+        } else {
+            if (!isObjectNameLetter(c)) {
+                return false;
+            }
+            prevSlash = false;
+        }
+    }
+    return !prevSlash;
+}
+
+static bool objectPathScalar(const byte *s, uint32 length)
+{
+    return objectPathScalarFrom(s, 1, length, true);
+}
+
+#ifdef DFERRY_X86_KERNELS
+
+// For the character class checks, bytes >= 0x80 are negative in signed comparisons, so they fail
+// all range checks without extra work.
+
+__attribute__((target("sse2")))
+static inline uint32 nameLetterMaskSse2(__m128i v, __m128i extra1, __m128i extra2)
+{
+    const __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20)); // ASCII letters to lowercase
+    const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                        _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+    const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                        _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    const __m128i other = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, extra1),
+                                                    _mm_cmpeq_epi8(v, extra2)));
+    return uint32(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), other)));
+}
+
+__attribute__((target("sse2")))
+static bool utf8Sse2(const byte *s, uint32 length)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32 i = 0;
+    while (i + 16 <= length) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        const uint32 special = uint32(_mm_movemask_epi8(v)) |
+                               uint32(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+        if (likely(!special)) {
+            i += 16;
+            continue;
+        }
+        // skip to the first non-ASCII or null byte and validate one sequence from there
+        i += __builtin_ctz(special);
+        if (!s[i] || !stepUtf8Sequence(s, length, &i)) {
+            return false;
+        }
+    }
+    return utf8ScalarFrom(s, i, length);
+}
+
+__attribute__((target("sse2")))
+static bool inClassSse2(const byte *s, uint32 length, byte extra1, byte extra2)
+{
+    const __m128i vExtra1 = _mm_set1_epi8(char(extra1));
+    const __m128i vExtra2 = _mm_set1_epi8(char(extra2));
+    uint32 i = 0;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        if (nameLetterMaskSse2(v, vExtra1, vExtra2) != 0xffff) {
+            return false;
+        }
+    }
+    return inClassScalarFrom(s, i, length, extra1, extra2);
+}
+
+__attribute__((target("sse2")))
+static bool objectPathSse2(const byte *s, uint32 length)
+{
+    const __m128i slash = _mm_set1_epi8('/');
+    uint32 prevSlash = 1;
+    uint32 i = 1;
+    for (; i + 16 <= length; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        if (nameLetterMaskSse2(v, slash, slash) != 0xffff) {
+            return false;
+        }
+        const uint32 slashes = uint32(_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash)));
+        if (slashes & ((slashes << 1) | prevSlash)) {
+            return false; // empty path element
+        }
+        prevSlash = slashes >> 15;
+    }
+    return objectPathScalarFrom(s, i, length, prevSlash);
+}
+
+__attribute__((target("avx2")))
+static inline uint32 nameLetterMaskAvx2(__m256i v, __m256i extra1, __m256i extra2)
+{
+    const __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    const __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)),
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), folded));
+    const __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    const __m256i other = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(v, extra1),
+                                                          _mm256_cmpeq_epi8(v, extra2)));
+    return uint32(_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), other)));
+}
+
+__attribute__((target("avx2")))
+static bool utf8Avx2(const byte *s, uint32 length)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint32 i = 0;
+    while (i + 32 <= length) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+        const uint32 special = uint32(_mm256_movemask_epi8(v)) |
+                               uint32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+        if (likely(!special)) {
+            i += 32;
+            continue;
+        }
+        i += __builtin_ctz(special);
+        if (!s[i] || !stepUtf8Sequence(s, length, &i)) {
+            return false;
+        }
+    }
+    return utf8ScalarFrom(s, i, length);
+}
+
+__attribute__((target("avx2")))
+static bool inClassAvx2(const byte *s, uint32 length, byte extra1, byte extra2)
+{
+    const __m256i vExtra1 = _mm256_set1_epi8(char(extra1));
+    const __m256i vExtra2 = _mm256_set1_epi8(char(extra2));
+    uint32 i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+        if (nameLetterMaskAvx2(v, vExtra1, vExtra2) != 0xffffffffu) {
+            return false;
+        }
+    }
+    return inClassScalarFrom(s, i, length, extra1, extra2);
+}
+
+__attribute__((target("avx2")))
+static bool objectPathAvx2(const byte *s, uint32 length)
+{
+    const __m256i slash = _mm256_set1_epi8('/');
+    uint32 prevSlash = 1;
+    uint32 i = 1;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+        if (nameLetterMaskAvx2(v, slash, slash) != 0xffffffffu) {
+            return false;
+        }
+        const uint32 slashes = uint32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, slash)));
+        if (slashes & ((slashes << 1) | prevSlash)) {
+            return false;
+        }
+        prevSlash = slashes >> 31;
+    }
+    return objectPathScalarFrom(s, i, length, prevSlash);
+}
+
+#endif // DFERRY_X86_KERNELS
+
+namespace {
+struct Kernels
+{
+    bool (*utf8)(const byte *s, uint32 length);
+    bool (*inClass)(const byte *s, uint32 length, byte extra1, byte extra2);
+    bool (*objectPath)(const byte *s, uint32 length);
+};
+}
+
+static const Kernels s_scalarKernels = { utf8Scalar, inClassScalar, objectPathScalar };
+#ifdef DFERRY_X86_KERNELS
+static const Kernels s_sse2Kernels = { utf8Sse2, inClassSse2, objectPathSse2 };
+static const Kernels s_avx2Kernels = { utf8Avx2, inClassAvx2, objectPathAvx2 };
+#endif
+
+// not cached, so that tests can switch kernels with setCpuFeatures(). It's just two branches.
+static const Kernels &kernels()
+{
+#ifdef DFERRY_X86_KERNELS
+    const CpuFeatures &cpu = cpuFeatures();
+    if (cpu.avx2) {
+        return s_avx2Kernels;
+    } else if (cpu.sse2) {
+        return s_sse2Kernels;
+    }
+#endif
+    return s_scalarKernels;
+}
+
+static inline const byte *bytes(cstring str)
+{
+    return reinterpret_cast<const byte *>(str.ptr);
+}
+
+// Checks the structure of a dot-separated name whose characters have already been checked
+static bool isDottedNameStructureValid(const char *s, uint32 length, bool allowLeadingDigits)
+{
+    const char *const end = s + length;
+    uint32 elementCount = 0;
+    while (true) {
+        const char *dot = static_cast<const char *>(memchr(s, '.', end - s));
+        if (!dot) {
+            dot = end;
+        }
+        if (dot == s) {
+            return false; // empty element
+        }
+        if (!allowLeadingDigits && isDigit(*s)) {
+            return false;
+        }
+        elementCount++;
+        if (dot == end) {
+            break;
+        }
+        s = dot + 1;
+    }
+    return elementCount >= 2;
+}
+
+namespace validation
+{
+
+bool isUtf8(cstring str)
+{
+    return kernels().utf8(bytes(str), str.length);
+}
+
+bool isObjectPath(cstring path)
+{
+    if (!path.length || path.ptr[0] != '/') {
+        return false;
+    }
+    if (path.length == 1) {
+        return true; // "/" special case
+    }
+    return kernels().objectPath(bytes(path), path.length);
+}
+
+bool isObjectPathElement(cstring element)
+{
+    return element.length && kernels().inClass(bytes(element), element.length, '_', '_');
+}
+
+bool isMemberName(cstring name)
+{
+    if (!name.length || name.length > s_maxNameLength || isDigit(name.ptr[0])) {
+        return false;
+    }
+    return kernels().inClass(bytes(name), name.length, '_', '_');
+}
+
+bool isInterfaceName(cstring name)
+{
+    if (!name.length || name.length > s_maxNameLength) {
+        return false;
+    }
+    return kernels().inClass(bytes(name), name.length, '.', '.') &&
+           isDottedNameStructureValid(name.ptr, name.length, false);
+}
+
+bool isBusName(cstring name)
+{
+    if (!name.length || name.length > s_maxNameLength) {
+        return false;
+    }
+    const bool isUnique = name.ptr[0] == ':';
+    const uint32 offset = isUnique ? 1 : 0;
+    return kernels().inClass(bytes(name) + offset, name.length - offset, '.', '-') &&
+           isDottedNameStructureValid(name.ptr + offset, name.length - offset, isUnique);
+}
+
+} // namespace validation
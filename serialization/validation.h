@@ -0,0 +1,76 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#ifndef VALIDATION_H
+#define VALIDATION_H
+
+#include "types.h"
+
+#include <cstring>
+
+// Validation of untrusted string data. The hot loops have SSE2 and AVX2 variants which are
+// selected at runtime according to CPU support, with a portable fallback for other CPUs.
+// None of these functions look at the terminating null (if any) at ptr[length], callers that
+// care about it must check it themselves.
+
+namespace validation
+{
+
+// valid UTF-8 without embedded nulls, as required for D-Bus strings
+bool isUtf8(cstring str);
+// "/" or "/element(/element)*" with elements consisting of [A-Za-z0-9_]
+bool isObjectPath(cstring path);
+bool isObjectPathElement(cstring element);
+// [A-Za-z_][A-Za-z0-9_]*, at most 255 characters
+bool isMemberName(cstring name);
+// at least two member name-like elements separated by '.', at most 255 characters.
+// error names have the same syntax.
+bool isInterfaceName(cstring name);
+// unique (":1.42") or well-known ("org.example.Service") bus name
+bool isBusName(cstring name);
+
+// this is mostly used for alignment padding, which is short - no need for SIMD
+inline bool isZero(const byte *data, uint32 length)
+{
+    uint64 acc = 0;
+    uint32 i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64 word;
+        memcpy(&word, data + i, sizeof(word));
+        acc |= word;
+    }
+    if (i + 4 <= length) {
+        uint32 word;
+        memcpy(&word, data + i, sizeof(word));
+        acc |= word;
+        i += 4;
+    }
+    for (; i < length; i++) {
+        acc |= data[i];
+    }
+    return acc == 0;
+}
+
+} // namespace validation
+
+#endif // VALIDATION_H
@@ -0,0 +1,231 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "arguments.h"
+#include "connectioninfo.h"
+#include "error.h"
+#include "eventdispatcher.h"
+#include "imessagereceiver.h"
+#include "message.h"
+#include "pendingreply.h"
+#include "transceiver.h"
+
+#include "../testutil.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __unix__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static const char *framingPath = "/framing";
+static const char *framingInterface = "org.example_5c0e1a4f27d4b9e3.framing";
+static const char *framingMethod = "payload";
+
+// odd sizes to misalign following messages, and sizes around and above the receive buffer size
+static const uint32 payloadSizes[] = {
+    0, 1, 3, 7, 8, 100, 1001, 4095, 16383, 16385, 20000, 65535, 65536, 70001, 5, 300000, 2, 9, 64000
+};
+static const uint32 payloadCount = sizeof(payloadSizes) / sizeof(payloadSizes[0]);
+
+static std::vector<byte> payload(uint32 index)
+{
+    std::vector<byte> ret(payloadSizes[index % payloadCount]);
+    for (uint32 i = 0; i < ret.size(); i++) {
+        ret[i] = byte(index * 7 + i);
+    }
+    return ret;
+}
+
+class PayloadChecker : public IMessageReceiver
+{
+public:
+    void spontaneousMessageReceived(Message msg) override
+    {
+        if (msg.interface() != framingInterface) {
+            return; // probably something from connection setup
+        }
+        Arguments::Reader reader(msg.arguments());
+        TEST(reader.state() == Arguments::Uint32);
+        const uint32 index = reader.readUint32();
+        TEST(index == m_received);
+        TEST(reader.state() == Arguments::BeginArray);
+        std::pair<Arguments::IoState, chunk> data = reader.readPrimitiveArray();
+        TEST(data.first == Arguments::Byte);
+        const std::vector<byte> expected = payload(index);
+        TEST(data.second.length == expected.size());
+        TEST(expected.empty() || !memcmp(data.second.ptr, &expected[0], expected.size()));
+        TEST(reader.state() == Arguments::Finished);
+
+        m_received++;
+        if (m_received == m_expected) {
+            m_eventDispatcher->interrupt();
+        }
+    }
+
+    EventDispatcher *m_eventDispatcher;
+    uint32 m_expected;
+    uint32 m_received = 0;
+};
+
+// Many messages of mixed sizes, sent to ourselves in one go, arrive in big chunks and must be cut
+// into messages correctly
+static void testManyMessages()
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, ConnectionInfo::Bus::Session);
+    while (trans.uniqueName().empty()) {
+        eventDispatcher.poll();
+    }
+
+    PayloadChecker checker;
+    checker.m_eventDispatcher = &eventDispatcher;
+    checker.m_expected = 5 * payloadCount;
+    trans.setSpontaneousMessageReceiver(&checker);
+
+    for (uint32 i = 0; i < checker.m_expected; i++) {
+        Message msg = Message::createSignal(framingPath, framingInterface, framingMethod);
+        msg.setDestination(trans.uniqueName());
+        Arguments::Writer writer;
+        writer.writeUint32(i);
+        const std::vector<byte> data = payload(i);
+        writer.writePrimitiveArray(Arguments::Byte, chunk(const_cast<byte *>(data.data()), data.size()));
+        msg.setArguments(writer.finish());
+        trans.sendNoReply(std::move(msg));
+    }
+
+    while (eventDispatcher.poll()) {
+    }
+    TEST(checker.m_received == checker.m_expected);
+}
+
+class CountingReceiver : public IMessageReceiver
+{
+public:
+    void spontaneousMessageReceived(Message msg) override
+    {
+        if (msg.interface() != framingInterface) {
+            return;
+        }
+        Arguments::Reader reader(msg.arguments());
+        TEST(reader.readUint32() == m_received);
+        m_received++;
+        if (m_received == m_expected) {
+            m_eventDispatcher->interrupt();
+        }
+    }
+
+    EventDispatcher *m_eventDispatcher;
+    uint32 m_expected;
+    uint32 m_received = 0;
+};
+
+// A burst of small messages is sent in batches, which are partially written when the socket buffer
+// is full
+static void testBurst()
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, ConnectionInfo::Bus::Session);
+
+    CountingReceiver receiver;
+    receiver.m_eventDispatcher = &eventDispatcher;
+    receiver.m_expected = 20000;
+    trans.setSpontaneousMessageReceiver(&receiver);
+
+    while (trans.uniqueName().empty()) {
+        eventDispatcher.poll();
+    }
+    for (uint32 i = 0; i < receiver.m_expected; i++) {
+        Message msg = Message::createSignal(framingPath, framingInterface, framingMethod);
+        msg.setDestination(trans.uniqueName());
+        Arguments::Writer writer;
+        writer.writeUint32(i);
+        msg.setArguments(writer.finish());
+        trans.sendNoReply(std::move(msg));
+    }
+
+    while (eventDispatcher.poll()) {
+    }
+    TEST(receiver.m_received == receiver.m_expected);
+}
+
+#ifdef __unix__
+// After garbage, message boundaries are lost. The connection must be closed, and pending replies
+// must fail right away instead of timing out.
+static void testGarbage()
+{
+    EventDispatcher eventDispatcher;
+    ConnectionInfo serverInfo(ConnectionInfo::Bus::PeerToPeer);
+    serverInfo.setSocketType(ConnectionInfo::SocketType::Ip);
+    serverInfo.setPort(6802);
+    serverInfo.setRole(ConnectionInfo::Role::Server);
+    Transceiver server(&eventDispatcher, serverInfo);
+
+    PendingReply reply = server.send(Message::createCall(framingPath, framingInterface, framingMethod));
+    TEST(!reply.isFinished());
+
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST(fd >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(6802);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST(connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+    const std::string garbage(64, 'x');
+    TEST(write(fd, garbage.c_str(), garbage.length()) == ssize_t(garbage.length()));
+
+    while (!reply.isFinished()) {
+        eventDispatcher.poll();
+    }
+    TEST(reply.error().code() == Error::Connection);
+    TEST(!server.isConnected());
+
+    PendingReply reply2 = server.send(Message::createCall(framingPath, framingInterface, framingMethod));
+    TEST(reply2.error().code() == Error::Connection);
+
+    close(fd);
+}
+#endif
+
+int main(int, char *[])
+{
+    testManyMessages();
+    // the same with large messages in buffers mapped from the OS
+    const uint32 oldThreshold = Message::mappedBufferThreshold();
+    Message::setMappedBufferThreshold(16384);
+    testManyMessages();
+    Message::setMappedBufferThreshold(oldThreshold);
+    testBurst();
+#ifdef __unix__
+    testGarbage();
+#endif
+    std::cout << "Passed!\n";
+}
@@ -0,0 +1,357 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "arguments.h"
+#include "connectioninfo.h"
+#include "error.h"
+#include "eventdispatcher.h"
+#include "imessagereceiver.h"
+#include "iobjecthandler.h"
+#include "message.h"
+#include "objectinterface.h"
+#include "pendingreply.h"
+#include "transceiver.h"
+
+#include "../testutil.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char *s_interface = "org.example.Counter";
+
+static void test_objectInterface()
+{
+    ObjectInterface interface(s_interface);
+    TEST(interface.isValid());
+    TEST(interface.name() == s_interface);
+    TEST(interface.addMethod("Add", "i", "i") == 0);
+    TEST(interface.addMethod("Reset") == 1);
+    TEST(interface.addSignal("Changed", "i") == 0);
+    TEST(interface.addProperty("Value", "i", ObjectInterface::ReadOnly) == 0);
+    TEST(interface.isValid());
+
+    // copies are independent
+    ObjectInterface copy = interface;
+    copy.addMethod("Add");
+    TEST(copy.error().code() == Error::DuplicateInterfaceMember);
+    TEST(interface.isValid());
+
+    copy = interface;
+    copy.addProperty("Pair", "ii", ObjectInterface::ReadOnly);
+    TEST(copy.error().code() == Error::InvalidSignature);
+    copy = interface;
+    copy.addSignal("Not.A.Name");
+    TEST(copy.error().code() == Error::MessageMethod);
+    TEST(ObjectInterface("Counter").error().code() == Error::MessageInterface);
+}
+
+class Counter : public IObjectHandler
+{
+public:
+    void methodCalled(Message call, uint32 methodIndex) override
+    {
+        m_calledPaths.push_back(call.path());
+        Message reply = Message::createReplyTo(call);
+        if (methodIndex == m_addIndex) {
+            Arguments::Reader reader(call);
+            m_value += reader.readInt32();
+            Arguments::Writer writer;
+            writer.writeInt32(m_value);
+            reply.setArguments(writer.finish());
+        } else if (methodIndex == m_unregisterIndex) {
+            TEST(m_transceiver->unregisterObject(m_registrationId));
+        }
+        m_transceiver->sendNoReply(move(reply));
+    }
+
+    bool readProperty(const Message &, uint32 propertyIndex, Arguments::Writer *writer) override
+    {
+        if (propertyIndex == m_valueIndex) {
+            writer->writeInt32(m_value);
+        } else if (propertyIndex == m_nameIndex) {
+            writer->writeString(cstring(m_name.c_str(), m_name.length()));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    bool writeProperty(const Message &, uint32 propertyIndex, Arguments::Reader *reader) override
+    {
+        if (propertyIndex != m_nameIndex) {
+            return false;
+        }
+        const cstring name = reader->readString();
+        m_name = string(name.ptr, name.length);
+        return true;
+    }
+
+    Transceiver *m_transceiver = nullptr;
+    uint32 m_registrationId = 0;
+    uint32 m_addIndex = 0;
+    uint32 m_unregisterIndex = 0;
+    uint32 m_valueIndex = 0;
+    uint32 m_nameIndex = 0;
+    int32 m_value = 0;
+    string m_name = "counter";
+    vector<string> m_calledPaths;
+};
+
+class Fallback : public IMessageReceiver
+{
+public:
+    void spontaneousMessageReceived(Message message) override
+    {
+        if (message.type() == Message::MethodCallMessage) {
+            m_paths.push_back(message.path());
+        }
+    }
+
+    vector<string> m_paths;
+};
+
+class ObjectTest
+{
+public:
+    ObjectTest()
+       : m_transceiver(&m_dispatcher, ConnectionInfo::Bus::Session)
+    {
+        while (m_transceiver.uniqueName().empty()) {
+            m_dispatcher.poll();
+        }
+    }
+
+    // calls a method of our own objects through the bus and returns the reply
+    Message call(const string &path, const string &interface, const string &method,
+                 Arguments arguments = Arguments())
+    {
+        Message msg = interface.empty() ? Message::createCall(path, method)
+                                        : Message::createCall(path, interface, method);
+        msg.setDestination(m_transceiver.uniqueName());
+        msg.setArguments(move(arguments));
+        PendingReply reply = m_transceiver.send(move(msg));
+        while (!reply.isFinished()) {
+            m_dispatcher.poll();
+        }
+        return reply.reply() ? reply.takeReply() : Message();
+    }
+
+    EventDispatcher m_dispatcher;
+    Transceiver m_transceiver;
+};
+
+static Arguments int32Argument(int32 value)
+{
+    Arguments::Writer writer;
+    writer.writeInt32(value);
+    return writer.finish();
+}
+
+static Arguments stringArguments(const vector<string> &values)
+{
+    Arguments::Writer writer;
+    for (const string &value : values) {
+        writer.writeString(cstring(value.c_str(), value.length()));
+    }
+    return writer.finish();
+}
+
+static int32 int32Result(const Message &reply)
+{
+    TEST(reply.type() == Message::MethodReturnMessage);
+    Arguments::Reader reader(reply);
+    TEST(reader.state() == Arguments::Int32);
+    return reader.readInt32();
+}
+
+static string introspect(ObjectTest *test, const string &path)
+{
+    const Message reply = test->call(path, "org.freedesktop.DBus.Introspectable", "Introspect");
+    TEST(reply.type() == Message::MethodReturnMessage);
+    Arguments::Reader reader(reply);
+    TEST(reader.state() == Arguments::String);
+    const cstring xml = reader.readString();
+    return string(xml.ptr, xml.length);
+}
+
+static bool isError(const Message &reply, const char *name)
+{
+    return reply.type() == Message::ErrorMessage &&
+           reply.errorName() == string("org.freedesktop.DBus.Error.") + name;
+}
+
+static void test_objects()
+{
+    ObjectTest test;
+    Transceiver *const transceiver = &test.m_transceiver;
+
+    ObjectInterface interface(s_interface);
+    Counter counter;
+    counter.m_transceiver = transceiver;
+    counter.m_addIndex = interface.addMethod("Add", "i", "i");
+    counter.m_unregisterIndex = interface.addMethod("Unregister");
+    interface.addSignal("Changed", "i");
+    counter.m_valueIndex = interface.addProperty("Value", "i", ObjectInterface::ReadOnly);
+    counter.m_nameIndex = interface.addProperty("Name", "s", ObjectInterface::ReadWrite);
+
+    TEST(!transceiver->registerObject("/org/example/counter", interface, nullptr));
+    TEST(!transceiver->registerObject("org/example/counter", interface, &counter));
+    TEST(!transceiver->registerObject("/org/example/counter", ObjectInterface("Invalid"), &counter));
+    TEST(!transceiver->registerObject("/org/example/counter",
+                                      ObjectInterface("org.freedesktop.DBus.Properties"), &counter));
+    counter.m_registrationId = transceiver->registerObject("/org/example/counter", interface, &counter);
+    TEST(counter.m_registrationId);
+    TEST(!transceiver->registerObject("/org/example/counter", interface, &counter));
+
+    // method calls
+    TEST(int32Result(test.call("/org/example/counter", s_interface, "Add", int32Argument(5))) == 5);
+    TEST(int32Result(test.call("/org/example/counter", string(), "Add", int32Argument(2))) == 7);
+    TEST(counter.m_calledPaths == (vector<string>{ "/org/example/counter", "/org/example/counter" }));
+
+    // errors
+    TEST(isError(test.call("/org/example/counter", s_interface, "Add"), "InvalidArgs"));
+    TEST(isError(test.call("/org/example/counter", s_interface, "Subtract"), "UnknownMethod"));
+    TEST(isError(test.call("/org/example/counter", "org.example.Nope", "Add"), "UnknownInterface"));
+    TEST(isError(test.call("/org/example/nope", s_interface, "Add"), "UnknownObject"));
+    TEST(isError(test.call("/org/example", s_interface, "Add"), "UnknownObject"));
+    TEST(counter.m_calledPaths.size() == 2);
+
+    // properties
+    {
+        const Message reply = test.call("/org/example/counter", "org.freedesktop.DBus.Properties",
+                                        "Get", stringArguments({ s_interface, "Value" }));
+        TEST(reply.type() == Message::MethodReturnMessage);
+        Arguments::Reader reader(reply);
+        reader.beginVariant();
+        TEST(reader.state() == Arguments::Int32);
+        TEST(reader.readInt32() == 7);
+    }
+    {
+        Arguments::Writer writer;
+        writer.writeString(cstring(s_interface));
+        writer.writeString(cstring("Name"));
+        writer.beginVariant();
+        writer.writeString(cstring("renamed"));
+        writer.endVariant();
+        const Message reply = test.call("/org/example/counter", "org.freedesktop.DBus.Properties",
+                                        "Set", writer.finish());
+        TEST(reply.type() == Message::MethodReturnMessage);
+        TEST(counter.m_name == "renamed");
+    }
+    {
+        Arguments::Writer writer;
+        writer.writeString(cstring(s_interface));
+        writer.writeString(cstring("Value"));
+        writer.beginVariant();
+        writer.writeInt32(1);
+        writer.endVariant();
+        TEST(isError(test.call("/org/example/counter", "org.freedesktop.DBus.Properties", "Set",
+                               writer.finish()), "PropertyReadOnly"));
+    }
+    TEST(isError(test.call("/org/example/counter", "org.freedesktop.DBus.Properties", "Get",
+                           stringArguments({ s_interface, "Nope" })), "UnknownProperty"));
+    {
+        const Message reply = test.call("/org/example/counter", "org.freedesktop.DBus.Properties",
+                                        "GetAll", stringArguments({ s_interface }));
+        TEST(reply.type() == Message::MethodReturnMessage);
+        TEST(reply.signature() == "a{sv}");
+        Arguments::Reader reader(reply);
+        TEST(reader.beginDict());
+        vector<string> names;
+        while (reader.state() == Arguments::String) {
+            const cstring name = reader.readString();
+            names.push_back(string(name.ptr, name.length));
+            reader.skipCurrentElement();
+        }
+        TEST(names == (vector<string>{ "Value", "Name" }));
+    }
+
+    // introspection, also of the nodes on the way
+    {
+        const string xml = introspect(&test, "/org/example/counter");
+        TEST(xml.find("<interface name=\"org.example.Counter\">") != string::npos);
+        TEST(xml.find("<arg type=\"i\" direction=\"in\"/>") != string::npos);
+        TEST(xml.find("<property name=\"Name\" type=\"s\" access=\"readwrite\"/>") != string::npos);
+        TEST(xml.find("org.freedesktop.DBus.Properties") != string::npos);
+        TEST(xml.find("<node name=") == string::npos);
+    }
+    {
+        const string xml = introspect(&test, "/");
+        TEST(xml.find("<node name=\"org\"/>") != string::npos);
+        TEST(xml.find("org.example.Counter") == string::npos);
+    }
+
+    // subtrees
+    Counter items;
+    items.m_transceiver = transceiver;
+    items.m_addIndex = counter.m_addIndex;
+    items.m_unregisterIndex = counter.m_unregisterIndex;
+    items.m_registrationId = transceiver->registerObject("/org/example/items", interface, &items, true);
+    TEST(items.m_registrationId);
+    TEST(int32Result(test.call("/org/example/items/a/b", s_interface, "Add", int32Argument(1))) == 1);
+    TEST(int32Result(test.call("/org/example/items", s_interface, "Add", int32Argument(1))) == 2);
+    TEST(isError(test.call("/org/example/itemsx", s_interface, "Add"), "UnknownObject"));
+    TEST(items.m_calledPaths == (vector<string>{ "/org/example/items/a/b", "/org/example/items" }));
+    TEST(introspect(&test, "/org/example/items/c").find("org.example.Counter") != string::npos);
+
+    // unregistering from the handler
+    TEST(test.call("/org/example/items/x", s_interface, "Unregister").type() ==
+         Message::MethodReturnMessage);
+    TEST(!transceiver->unregisterObject(items.m_registrationId));
+    TEST(isError(test.call("/org/example/items/x", s_interface, "Add"), "UnknownObject"));
+    TEST(introspect(&test, "/org/example").find("<node name=\"items\"/>") == string::npos);
+
+    // unknown paths go to the spontaneous message receiver, if there is one
+    Fallback fallback;
+    transceiver->setSpontaneousMessageReceiver(&fallback);
+    Message noReply = Message::createCall("/elsewhere", s_interface, "Add");
+    noReply.setDestination(transceiver->uniqueName());
+    noReply.setExpectsReply(false);
+    TEST(!transceiver->sendNoReply(move(noReply)).isError());
+    TEST(int32Result(test.call("/org/example/counter", s_interface, "Add", int32Argument(1))) == 8);
+    TEST(fallback.m_paths == vector<string>{ "/elsewhere" });
+    transceiver->setSpontaneousMessageReceiver(nullptr);
+
+    // without any objects, nothing answers calls, so keep one that is elsewhere
+    const uint32 otherId = transceiver->registerObject("/other", interface, &items);
+    TEST(otherId);
+    TEST(transceiver->unregisterObject(counter.m_registrationId));
+    TEST(!transceiver->unregisterObject(counter.m_registrationId));
+    {
+        const string xml = introspect(&test, "/");
+        TEST(xml.find("<node name=\"other\"/>") != string::npos);
+        TEST(xml.find("<node name=\"org\"/>") == string::npos);
+    }
+    TEST(transceiver->unregisterObject(otherId));
+}
+
+int main(int, char *[])
+{
+    test_objectInterface();
+    test_objects();
+    std::cout << "Passed!\n";
+}
@@ -27,12 +27,14 @@
 #include "imessagereceiver.h"
 #include "message.h"
 #include "pendingreply.h"
+#include "serialmap.h"
 #include "transceiver.h"
 
 #include "../testutil.h"
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -129,11 +131,143 @@ static void testTimeout()
     }
 }
 
+static void testSerialMap()
+{
+    {
+        SerialMap<int> map;
+        TEST(map.empty());
+        for (uint32 i = 1; i <= 1000; i++) {
+            map.insert(i, int(i));
+        }
+        TEST(map.size() == 1000);
+        for (uint32 i = 1; i <= 1000; i += 2) {
+            int value = 0;
+            TEST(map.take(i, &value));
+            TEST(value == int(i));
+        }
+        TEST(!map.take(1));
+        TEST(!map.find(0));
+        TEST(!map.find(1001));
+        for (uint32 i = 2; i <= 1000; i += 2) {
+            TEST(map.find(i) && *map.find(i) == int(i));
+        }
+        map.eraseIf([](uint32 serial, const int &) { return serial % 4 == 0; });
+        TEST(map.size() == 250);
+        uint32 serial = 0;
+        int value = 0;
+        while (map.takeAny(&serial, &value)) {
+            TEST(serial % 4 == 2 && value == int(serial));
+        }
+        TEST(map.empty());
+    }
+    {
+        // an old entry that outlives very many newer ones, and an old serial that arrives late
+        SerialMap<int> map;
+        map.insert(1, 1);
+        for (uint32 i = 2; i <= 100000; i++) {
+            map.insert(i, int(i));
+            TEST(map.take(i));
+        }
+        map.insert(100001, 100001);
+        map.insert(50, 50);
+        TEST(map.size() == 3);
+        TEST(map.find(1) && *map.find(1) == 1);
+        TEST(map.find(50) && *map.find(50) == 50);
+        TEST(map.find(100001) && *map.find(100001) == 100001);
+        map.insert(100000, 100000);
+        TEST(map.find(100000) && *map.find(100000) == 100000);
+    }
+    {
+        // serials wrap around
+        SerialMap<int> map;
+        for (uint32 i = 0xfffffff0; i != 0; i++) {
+            map.insert(i, 1);
+        }
+        for (uint32 i = 1; i <= 16; i++) {
+            map.insert(i, 2);
+        }
+        TEST(map.size() == 32);
+        TEST(map.find(0xffffffff) && *map.find(0xffffffff) == 1);
+        TEST(map.find(16) && *map.find(16) == 2);
+        TEST(!map.find(0));
+        for (uint32 i = 0xfffffff0; i != 17; i++) {
+            TEST(map.take(i) == (i != 0));
+        }
+        TEST(map.empty());
+    }
+    {
+        // a serial counter that wraps around while some replies are still awaited
+        SerialMap<int> map;
+        for (uint32 serial : { 0xfffffffeu, 0xffffffffu, 1u, 2u, 4u }) {
+            map.insert(serial, 1);
+        }
+        uint32 counter = 0xfffffffd;
+        TEST(map.takeFreeSerial(&counter) == 0xfffffffd);
+        TEST(map.takeFreeSerial(&counter) == 3);
+        TEST(counter == 4);
+        TEST(map.takeFreeSerial(&counter) == 5);
+        counter = 0;
+        TEST(map.takeFreeSerial(&counter) == 3);
+    }
+}
+
+class ManyRepliesCheck : public IMessageReceiver
+{
+public:
+    void pendingReplyFinished(PendingReply *reply) override
+    {
+        if (reply->hasNonErrorReply()) {
+            m_replies++;
+        } else {
+            TEST(reply->error().code() == Error::Timeout);
+            m_timeouts++;
+        }
+    }
+    uint32 m_replies = 0;
+    uint32 m_timeouts = 0;
+};
+
+static void testManyPendingReplies()
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, ConnectionInfo::Bus::Session);
+    while (trans.uniqueName().empty()) {
+        eventDispatcher.poll();
+    }
+
+    // the bus answers pings, we don't answer calls to ourself; some PendingReplies go away early
+    ManyRepliesCheck check;
+    std::vector<PendingReply> replies;
+    uint32 expectedReplies = 0;
+    uint32 expectedTimeouts = 0;
+    for (int i = 0; i < 5000; i++) {
+        const bool toSelf = i % 10 == 0;
+        Message msg = Message::createCall("/org/freedesktop/DBus", "org.freedesktop.DBus.Peer", "Ping");
+        msg.setDestination(toSelf ? trans.uniqueName() : string("org.freedesktop.DBus"));
+        replies.push_back(trans.send(move(msg), toSelf ? i % 50 : -1));
+        replies.back().setReceiver(&check);
+        if (i % 7 == 3) {
+            replies.back() = PendingReply();
+        } else if (toSelf) {
+            expectedTimeouts++;
+        } else {
+            expectedReplies++;
+        }
+    }
+    while (check.m_replies + check.m_timeouts < expectedReplies + expectedTimeouts) {
+        eventDispatcher.poll();
+    }
+    TEST(check.m_replies == expectedReplies);
+    TEST(check.m_timeouts == expectedTimeouts);
+}
+
 int main(int, char *[])
 {
     testBusAddress(false);
     testBusAddress(true);
     testTimeout();
+    testSerialMap();
+    testManyPendingReplies();
     // TODO testBadCall
     std::cout << "Passed!\n";
 }
@@ -0,0 +1,384 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "arguments.h"
+#include "connectioninfo.h"
+#include "error.h"
+#include "eventdispatcher.h"
+#include "imessagereceiver.h"
+#include "matchrule.h"
+#include "message.h"
+#include "pendingreply.h"
+#include "transceiver.h"
+
+#include "../testutil.h"
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+static void test_matchRule()
+{
+    {
+        MatchRule rule;
+        TEST(rule.isValid());
+        TEST(rule.toString() == "type='signal'");
+    }
+    {
+        MatchRule rule;
+        rule.setSender("org.example.Sender");
+        rule.setPathNamespace("/org/example");
+        rule.setInterface("org.example.Interface");
+        rule.setMember("Changed");
+        rule.setArgument(2, "it's");
+        rule.setArgument(0, "");
+        TEST(rule.isValid());
+        TEST(rule.toString() == "type='signal',sender='org.example.Sender',"
+                                "interface='org.example.Interface',member='Changed',"
+                                "path_namespace='/org/example',arg0='',arg2='it'\\''s'");
+        bool isPresent = false;
+        TEST(rule.argument(2, &isPresent) == "it's");
+        TEST(isPresent);
+        rule.argument(1, &isPresent);
+        TEST(!isPresent);
+
+        MatchRule copy = rule;
+        TEST(copy.toString() == rule.toString());
+        copy.clearArgument(2);
+        TEST(copy.toString() != rule.toString());
+
+        copy = rule;
+        copy.setPath("/org/example");
+        TEST(copy.error().code() == Error::MatchRulePathConflict);
+        copy.setPathNamespace(string());
+        TEST(copy.isValid());
+        copy.setPath("org/example");
+        TEST(copy.error().code() == Error::MessagePath);
+    }
+    {
+        MatchRule rule;
+        rule.setInterface("Interface");
+        TEST(rule.error().code() == Error::MessageInterface);
+        rule.setInterface(string());
+        rule.setMember("Changed.Really");
+        TEST(rule.error().code() == Error::MessageMethod);
+        rule.setMember(string());
+        rule.setArgument(MatchRule::MaxArgumentIndex, "x");
+        TEST(rule.isValid());
+        rule.setArgument(MatchRule::MaxArgumentIndex + 1, "x");
+        TEST(rule.error().code() == Error::MatchRuleArgumentIndex);
+    }
+}
+
+static const char *s_testInterface = "org.example.SignalTest";
+
+class SignalRecorder : public IMessageReceiver
+{
+public:
+    void signalReceived(Message signal, uint32 subscriptionId) override
+    {
+        TEST(signal.type() == Message::SignalMessage);
+        m_received.emplace_back(subscriptionId, signal.method());
+        if (subscriptionId == m_unsubscribeOnReceipt) {
+            TEST(m_transceiver->unsubscribeFromSignal(subscriptionId));
+            TEST(!m_transceiver->unsubscribeFromSignal(subscriptionId));
+        }
+    }
+
+    void spontaneousMessageReceived(Message message) override
+    {
+        if (message.type() == Message::SignalMessage && message.interface() == s_testInterface) {
+            m_unmatched.push_back(message.method());
+        }
+    }
+
+    vector<pair<uint32, string>> takeReceived()
+    {
+        vector<pair<uint32, string>> ret;
+        swap(ret, m_received);
+        return ret;
+    }
+
+    Transceiver *m_transceiver = nullptr;
+    uint32 m_unsubscribeOnReceipt = 0;
+    vector<pair<uint32, string>> m_received;
+    vector<string> m_unmatched;
+};
+
+static void emitSignal(Transceiver *transceiver, const string &path, const string &member,
+                       const char *arg0 = nullptr)
+{
+    Message signal = Message::createSignal(path, s_testInterface, member);
+    if (arg0) {
+        Arguments::Writer writer;
+        writer.writeString(arg0);
+        writer.writeUint32(1);
+        signal.setArguments(writer.finish());
+    }
+    TEST(!transceiver->sendNoReply(move(signal)).isError());
+}
+
+// When the reply arrives, the bus has processed everything sent before, and we have received the
+// signals that it sent back to us.
+static void syncWithBus(EventDispatcher *dispatcher, Transceiver *transceiver)
+{
+    Message call = Message::createCall("/org/freedesktop/DBus", "org.freedesktop.DBus", "GetId");
+    call.setDestination("org.freedesktop.DBus");
+    PendingReply reply = transceiver->send(move(call));
+    while (!reply.isFinished()) {
+        dispatcher->poll();
+    }
+    TEST(reply.hasNonErrorReply());
+}
+
+static MatchRule memberRule(const string &member)
+{
+    MatchRule rule;
+    rule.setInterface(s_testInterface);
+    rule.setMember(member);
+    return rule;
+}
+
+static void test_subscriptions()
+{
+    EventDispatcher dispatcher;
+    Transceiver transceiver(&dispatcher, ConnectionInfo::Bus::Session);
+    while (transceiver.uniqueName().empty()) {
+        dispatcher.poll();
+    }
+
+    SignalRecorder a;
+    SignalRecorder b;
+    SignalRecorder c;
+    for (SignalRecorder *recorder : { &a, &b, &c }) {
+        recorder->m_transceiver = &transceiver;
+    }
+    transceiver.setSpontaneousMessageReceiver(&c);
+
+    TEST(transceiver.subscribeToSignal(MatchRule(), nullptr) == 0);
+    {
+        MatchRule invalid;
+        invalid.setPath("nope");
+        TEST(transceiver.subscribeToSignal(invalid, &a) == 0);
+    }
+
+    const uint32 ping = transceiver.subscribeToSignal(memberRule("Ping"), &a);
+    const uint32 pingAgain = transceiver.subscribeToSignal(memberRule("Ping"), &b);
+    MatchRule namespaceRule;
+    namespaceRule.setPathNamespace("/org/example");
+    const uint32 inNamespace = transceiver.subscribeToSignal(namespaceRule, &b);
+    MatchRule exactRule;
+    exactRule.setPath("/org/example/object");
+    exactRule.setArgument(0, "yes");
+    const uint32 exactWithArgument = transceiver.subscribeToSignal(exactRule, &c);
+    MatchRule senderRule = memberRule("Pong");
+    senderRule.setSender(transceiver.uniqueName());
+    const uint32 fromUs = transceiver.subscribeToSignal(senderRule, &c);
+    senderRule.setSender(":1.4294967295");
+    const uint32 fromSomeoneElse = transceiver.subscribeToSignal(senderRule, &c);
+    for (uint32 id : { ping, pingAgain, inNamespace, exactWithArgument, fromUs, fromSomeoneElse }) {
+        TEST(id != 0);
+    }
+
+    // each subscriber gets only the signals of its own subscriptions
+    emitSignal(&transceiver, "/other", "Ping");
+    emitSignal(&transceiver, "/org/example/object", "Pong", "yes");
+    emitSignal(&transceiver, "/org/example/object/child", "Pong", "no");
+    emitSignal(&transceiver, "/org/examples", "Pong", "yes");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived() == (vector<pair<uint32, string>>{ { ping, "Ping" } }));
+    TEST(b.takeReceived() == (vector<pair<uint32, string>>{ { pingAgain, "Ping" },
+                                                             { inNamespace, "Pong" },
+                                                             { inNamespace, "Pong" } }));
+    TEST(c.takeReceived() == (vector<pair<uint32, string>>{ { exactWithArgument, "Pong" },
+                                                             { fromUs, "Pong" },
+                                                             { fromUs, "Pong" },
+                                                             { fromUs, "Pong" } }));
+    TEST(c.m_unmatched.empty());
+
+    // the rule stays on the bus while a subscription with an equal rule is left
+    TEST(transceiver.unsubscribeFromSignal(pingAgain));
+    TEST(!transceiver.unsubscribeFromSignal(pingAgain));
+    emitSignal(&transceiver, "/other", "Ping");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived() == (vector<pair<uint32, string>>{ { ping, "Ping" } }));
+    TEST(b.takeReceived().empty());
+
+    // ...and is removed with the last one
+    TEST(transceiver.unsubscribeFromSignal(ping));
+    emitSignal(&transceiver, "/other", "Ping");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived().empty());
+    TEST(c.m_unmatched.empty());
+
+    // unsubscribing while receiving; the bus still sends the second signal, which then doesn't
+    // match anymore
+    const uint32 once = transceiver.subscribeToSignal(memberRule("Once"), &a);
+    a.m_unsubscribeOnReceipt = once;
+    emitSignal(&transceiver, "/other", "Once");
+    emitSignal(&transceiver, "/other", "Once");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived() == (vector<pair<uint32, string>>{ { once, "Once" } }));
+    TEST(c.m_unmatched == vector<string>{ "Once" });
+    c.m_unmatched.clear();
+
+    // many subscriptions
+    vector<uint32> manyIds;
+    for (int i = 0; i < 200; i++) {
+        MatchRule rule;
+        rule.setPath("/many/object" + to_string(i));
+        manyIds.push_back(transceiver.subscribeToSignal(rule, &a));
+    }
+    emitSignal(&transceiver, "/many/object7", "Many");
+    emitSignal(&transceiver, "/many/object199", "Many");
+    emitSignal(&transceiver, "/many", "Many");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived() == (vector<pair<uint32, string>>{ { manyIds[7], "Many" },
+                                                             { manyIds[199], "Many" } }));
+    for (uint32 id : manyIds) {
+        TEST(transceiver.unsubscribeFromSignal(id));
+    }
+    emitSignal(&transceiver, "/many/object7", "Many");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived().empty());
+    TEST(c.m_unmatched.empty());
+}
+
+static void callBusWithName(EventDispatcher *dispatcher, Transceiver *transceiver,
+                            const char *method, const string &name)
+{
+    Message call = Message::createCall("/org/freedesktop/DBus", "org.freedesktop.DBus", method);
+    call.setDestination("org.freedesktop.DBus");
+    Arguments::Writer writer;
+    writer.writeString(name.c_str());
+    if (!strcmp(method, "RequestName")) {
+        writer.writeUint32(0);
+    }
+    call.setArguments(writer.finish());
+    PendingReply reply = transceiver->send(move(call));
+    while (!reply.isFinished()) {
+        dispatcher->poll();
+    }
+    TEST(reply.reply() && reply.reply()->type() == Message::MethodReturnMessage);
+}
+
+static void test_wellKnownSender()
+{
+    EventDispatcher dispatcher;
+    Transceiver transceiver(&dispatcher, ConnectionInfo::Bus::Session);
+    while (transceiver.uniqueName().empty()) {
+        dispatcher.poll();
+    }
+    SignalRecorder a;
+    SignalRecorder b;
+    transceiver.setSpontaneousMessageReceiver(&b);
+
+    // the bus sends us the signal for the broader rule, but the sender rule must not match it
+    // while someone else (nobody) owns the name
+    const string name = "org.example.SignalTestSender";
+    MatchRule senderRule = memberRule("Named");
+    senderRule.setSender(name);
+    const uint32 fromName = transceiver.subscribeToSignal(senderRule, &a);
+    const uint32 any = transceiver.subscribeToSignal(memberRule("Named"), &b);
+    syncWithBus(&dispatcher, &transceiver);
+    emitSignal(&transceiver, "/other", "Named");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived().empty());
+    TEST(b.takeReceived() == (vector<pair<uint32, string>>{ { any, "Named" } }));
+
+    // ...and must match while we own it
+    callBusWithName(&dispatcher, &transceiver, "RequestName", name);
+    syncWithBus(&dispatcher, &transceiver);
+    emitSignal(&transceiver, "/other", "Named");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived() == (vector<pair<uint32, string>>{ { fromName, "Named" } }));
+    TEST(b.takeReceived() == (vector<pair<uint32, string>>{ { any, "Named" } }));
+
+    callBusWithName(&dispatcher, &transceiver, "ReleaseName", name);
+    syncWithBus(&dispatcher, &transceiver);
+    emitSignal(&transceiver, "/other", "Named");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived().empty());
+    TEST(b.takeReceived() == (vector<pair<uint32, string>>{ { any, "Named" } }));
+    // the NameOwnerChanged signals were for us, not for the spontaneous message receiver
+    TEST(b.m_unmatched.empty());
+
+    TEST(transceiver.unsubscribeFromSignal(fromName));
+    TEST(transceiver.unsubscribeFromSignal(any));
+}
+
+static void sharedRuleThreadRun(Transceiver::CommRef mainTransceiverRef, std::atomic<bool> *done)
+{
+    EventDispatcher dispatcher;
+    SignalRecorder recorder;
+    {
+        Transceiver transceiver(&dispatcher, std::move(mainTransceiverRef));
+        while (transceiver.uniqueName().empty()) {
+            dispatcher.poll();
+        }
+        TEST(transceiver.subscribeToSignal(memberRule("Shared"), &recorder) != 0);
+        TEST(transceiver.subscribeToSignal(memberRule("Shared"), &recorder) != 0);
+        syncWithBus(&dispatcher, &transceiver);
+        // going away with the subscriptions removes our rule from the bus, and only once
+    }
+    *done = true;
+}
+
+static void test_sharedRuleWithSecondaryThread()
+{
+    EventDispatcher dispatcher;
+    Transceiver transceiver(&dispatcher, ConnectionInfo::Bus::Session);
+    while (transceiver.uniqueName().empty()) {
+        dispatcher.poll();
+    }
+    SignalRecorder a;
+    const uint32 shared = transceiver.subscribeToSignal(memberRule("Shared"), &a);
+
+    std::atomic<bool> done(false);
+    std::thread thread(sharedRuleThreadRun, transceiver.createCommRef(), &done);
+    while (!done) {
+        dispatcher.poll(10);
+    }
+    thread.join();
+
+    // the connection has the same rule from the main thread, which must still be there
+    emitSignal(&transceiver, "/other", "Shared");
+    syncWithBus(&dispatcher, &transceiver);
+    TEST(a.takeReceived() == (vector<pair<uint32, string>>{ { shared, "Shared" } }));
+}
+
+int main(int, char *[])
+{
+    test_matchRule();
+    test_subscriptions();
+    test_wellKnownSender();
+    test_sharedRuleWithSecondaryThread();
+    std::cout << "Passed!\n";
+}
@@ -35,6 +35,7 @@
 #include <atomic>
 #include <iostream>
 #include <thread>
+#include <vector>
 
 static const char *echoPath = "/echo";
 // make the name "fairly unique" because the interface name is our only protection against replying
@@ -228,6 +229,110 @@ static void testThreadedTimeout()
     timeoutThread.join();
 }
 
+//////////////// Many calls from several threads ////////////////
+
+static Message createBusPing()
+{
+    Message ping = Message::createCall("/org/freedesktop/DBus", "org.freedesktop.DBus.Peer", "Ping");
+    ping.setDestination(std::string("org.freedesktop.DBus"));
+    return ping;
+}
+
+static void manyCallsThreadRun(Transceiver::CommRef mainTransceiverRef, std::atomic<int> *done)
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, std::move(mainTransceiverRef));
+    while (!trans.uniqueName().length()) {
+        eventDispatcher.poll();
+    }
+
+    // we write these to the connection ourselves, the main thread receives the replies and puts
+    // them into our event queue
+    static const int callCount = 1000;
+    std::vector<PendingReply> replies;
+    for (int i = 0; i < callCount; i++) {
+        TEST(!trans.sendNoReply(createBusPing()).isError());
+        replies.push_back(trans.send(createBusPing()));
+    }
+    for (const PendingReply &reply : replies) {
+        while (!reply.isFinished()) {
+            eventDispatcher.poll();
+        }
+        TEST(reply.hasNonErrorReply());
+    }
+    (*done)++;
+}
+
+static void testManyThreadedCalls()
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, ConnectionInfo::Bus::Session);
+
+    static const int threadCount = 4;
+    std::atomic<int> done(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; i++) {
+        threads.emplace_back(manyCallsThreadRun, trans.createCommRef(), &done);
+    }
+    while (done < threadCount) {
+        eventDispatcher.poll(10);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+//////////////// Large messages from several threads ////////////////
+
+static void largeCallsThreadRun(Transceiver::CommRef mainTransceiverRef, std::atomic<int> *done)
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, std::move(mainTransceiverRef));
+    while (!trans.uniqueName().length()) {
+        eventDispatcher.poll();
+    }
+
+    // Together, these don't fit into the socket buffer, so some of them must be written by the
+    // main thread once the socket is writable again. The bus replies with errors because Ping
+    // takes no arguments, that's fine.
+    static const int callCount = 16;
+    std::vector<byte> payload(256 * 1024, 'x');
+    std::vector<PendingReply> replies;
+    for (int i = 0; i < callCount; i++) {
+        Message ping = createBusPing();
+        Arguments::Writer writer;
+        writer.writePrimitiveArray(Arguments::Byte, chunk(&payload[0], payload.size()));
+        ping.setArguments(writer.finish());
+        replies.push_back(trans.send(std::move(ping)));
+    }
+    for (const PendingReply &reply : replies) {
+        while (!reply.isFinished()) {
+            eventDispatcher.poll();
+        }
+        TEST(!reply.error().isError());
+        TEST(reply.reply());
+    }
+    (*done)++;
+}
+
+static void testLargeThreadedCalls()
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, ConnectionInfo::Bus::Session);
+
+    static const int threadCount = 2;
+    std::atomic<int> done(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; i++) {
+        threads.emplace_back(largeCallsThreadRun, trans.createCommRef(), &done);
+    }
+    while (done < threadCount) {
+        eventDispatcher.poll(10);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
 
 // more things to test:
 // - (do we want to do this, and if so here??) blocking on a reply through other thread's connection
@@ -238,5 +343,7 @@ int main(int, char *[])
 {
     testPingPong();
     testThreadedTimeout();
+    testManyThreadedCalls();
+    testLargeThreadedCalls();
     std::cout << "Passed!\n";
 }
@@ -0,0 +1,250 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "arguments.h"
+#include "connectioninfo.h"
+#include "error.h"
+#include "eventdispatcher.h"
+#include "imessagereceiver.h"
+#include "memfdbuffer.h"
+#include "message.h"
+#include "pendingreply.h"
+#include "transceiver.h"
+
+#include "../testutil.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+static const char *fdsPath = "/unixfds";
+static const char *fdsInterface = "org.example_3b9d2c71e05a8f46.unixfds";
+static const char *fdsMethod = "frame";
+
+static byte patternByte(uint32 seed, uint32 i)
+{
+    return byte(seed * 13 + i + (i >> 8));
+}
+
+static MemFdBuffer createFrame(uint32 seed, uint32 size)
+{
+    MemFdBuffer buffer = MemFdBuffer::create(size);
+    TEST(buffer.isValid());
+    TEST(buffer.data().length == size);
+    for (uint32 i = 0; i < size; i++) {
+        buffer.data().ptr[i] = patternByte(seed, i);
+    }
+    TEST(buffer.seal() >= 0);
+    return buffer;
+}
+
+static bool isFrameOk(const MemFdBuffer &buffer, uint32 seed, uint32 size)
+{
+    if (!buffer.isValid() || buffer.data().length != size) {
+        return false;
+    }
+    for (uint32 i = 0; i < size; i++) {
+        if (buffer.data().ptr[i] != patternByte(seed, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testMemFdBuffer()
+{
+    MemFdBuffer buffer = MemFdBuffer::create(100000);
+    TEST(buffer.isValid());
+    // not sealed yet, so the sender could still change it
+    TEST(!MemFdBuffer::map(buffer.fileDescriptor()).isValid());
+    buffer.data().ptr[99999] = 42;
+    const int fd = buffer.seal();
+    TEST(fd >= 0);
+    TEST(buffer.seal() == fd);
+    TEST(buffer.data().length == 100000);
+    TEST(buffer.data().ptr[99999] == 42);
+    // no writing anymore through a new mapping
+    TEST(write(fd, "x", 1) < 0);
+
+    MemFdBuffer mapped = MemFdBuffer::map(fd);
+    TEST(mapped.isValid());
+    TEST(mapped.fileDescriptor() != fd);
+    TEST(mapped.data().length == 100000);
+    TEST(mapped.data().ptr[99999] == 42);
+
+    // something that isn't a memfd at all
+    int pipeFds[2];
+    TEST(pipe(pipeFds) == 0);
+    TEST(!MemFdBuffer::map(pipeFds[0]).isValid());
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+
+    MemFdBuffer moved(std::move(mapped));
+    TEST(!mapped.isValid());
+    TEST(moved.isValid());
+}
+
+class FrameReceiver : public IMessageReceiver
+{
+public:
+    void spontaneousMessageReceived(Message msg) override
+    {
+        if (msg.interface() != fdsInterface) {
+            return; // probably something from connection setup
+        }
+        Arguments::Reader reader(msg.arguments());
+        TEST(reader.state() == Arguments::Uint32);
+        const uint32 index = reader.readUint32();
+        TEST(index == m_received);
+        TEST(reader.state() == Arguments::Uint32);
+        const uint32 size = reader.readUint32();
+        if (reader.state() == Arguments::UnixFd) {
+            const int fd = int(reader.readUnixFd());
+            TEST(msg.unixFdCount() == msg.arguments().fileDescriptors().size());
+            TEST(fd == msg.arguments().fileDescriptors()[0]);
+            TEST(isFrameOk(MemFdBuffer::map(fd), index, size));
+            if (reader.state() == Arguments::UnixFd) {
+                // the write end of a pipe, to check that it really is the same pipe
+                const int pipeFd = int(reader.readUnixFd());
+                TEST(write(pipeFd, "!", 1) == 1);
+            }
+            m_framesReceived++;
+        } else {
+            TEST(msg.unixFdCount() == 0);
+        }
+        TEST(reader.state() == Arguments::Finished);
+
+        m_received++;
+        if (m_received == m_expected) {
+            m_eventDispatcher->interrupt();
+        }
+    }
+
+    EventDispatcher *m_eventDispatcher;
+    uint32 m_expected;
+    uint32 m_received = 0;
+    uint32 m_framesReceived = 0;
+};
+
+// Large frames are passed as sealed memfds, interleaved with ordinary messages, so that the fds
+// must be matched to the right messages on the receiving side
+static void testFramesOverBus()
+{
+    EventDispatcher eventDispatcher;
+    Transceiver trans(&eventDispatcher, ConnectionInfo::Bus::Session);
+    while (trans.uniqueName().empty()) {
+        eventDispatcher.poll();
+    }
+    TEST(trans.supportsUnixFdPassing());
+
+    FrameReceiver receiver;
+    receiver.m_eventDispatcher = &eventDispatcher;
+    receiver.m_expected = 60;
+    trans.setSpontaneousMessageReceiver(&receiver);
+
+    int pipeFds[2];
+    TEST(pipe(pipeFds) == 0);
+
+    uint32 framesSent = 0;
+    for (uint32 i = 0; i < receiver.m_expected; i++) {
+        Message msg = Message::createSignal(fdsPath, fdsInterface, fdsMethod);
+        msg.setDestination(trans.uniqueName());
+        Arguments::Writer writer;
+        writer.writeUint32(i);
+        if (i % 3 == 0) {
+            // one big frame, the rest just large enough to be mapped
+            const uint32 size = i == 30 ? 20 * 1024 * 1024 : 5000 + i;
+            writer.writeUint32(size);
+            MemFdBuffer frame = createFrame(i, size);
+            writer.writeUnixFd(frame.fileDescriptor());
+            if (i == 0) {
+                writer.writeUnixFd(pipeFds[1]);
+            }
+            framesSent++;
+            // frame is destroyed here, the Arguments have their own copy of the fd
+        } else {
+            writer.writeUint32(0);
+        }
+        msg.setArguments(writer.finish());
+        TEST(!msg.error().isError());
+        TEST(!trans.sendNoReply(std::move(msg)).isError());
+    }
+    close(pipeFds[1]);
+
+    while (eventDispatcher.poll()) {
+    }
+    TEST(receiver.m_received == receiver.m_expected);
+    TEST(receiver.m_framesReceived == framesSent);
+
+    char c = 0;
+    TEST(read(pipeFds[0], &c, 1) == 1);
+    TEST(c == '!');
+    close(pipeFds[0]);
+}
+
+// A message with fds can be queued before it is known whether the peer accepts fds. If it doesn't,
+// the message can't be sent, and its reply fails.
+static void testUnsendableFds()
+{
+    EventDispatcher eventDispatcher;
+    ConnectionInfo serverInfo(ConnectionInfo::Bus::PeerToPeer);
+    serverInfo.setSocketType(ConnectionInfo::SocketType::Ip);
+    serverInfo.setPort(6801);
+    serverInfo.setRole(ConnectionInfo::Role::Server);
+    Transceiver server(&eventDispatcher, serverInfo);
+
+    int pipeFds[2];
+    TEST(pipe(pipeFds) == 0);
+    Message msg = Message::createCall(fdsPath, fdsInterface, fdsMethod);
+    Arguments::Writer writer;
+    writer.writeUnixFd(pipeFds[1]);
+    msg.setArguments(writer.finish());
+    PendingReply reply = server.send(std::move(msg));
+    TEST(!reply.isFinished());
+
+    // TCP can't pass fds. The client needs no attention, and an EventDispatcher only sends events
+    // to one Transceiver.
+    EventDispatcher clientEventDispatcher;
+    ConnectionInfo clientInfo = serverInfo;
+    clientInfo.setRole(ConnectionInfo::Role::Client);
+    Transceiver client(&clientEventDispatcher, clientInfo);
+    while (!reply.isFinished()) {
+        eventDispatcher.poll();
+    }
+    TEST(!server.supportsUnixFdPassing());
+    TEST(reply.error().code() == Error::UnixFdPassingUnavailable);
+
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
+
+int main(int, char *[])
+{
+    testMemFdBuffer();
+    testFramesOverBus();
+    testUnsendableFds();
+    std::cout << "Passed!\n";
+}
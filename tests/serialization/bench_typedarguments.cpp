@@ -0,0 +1,166 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+// Compares TypedWriter / TypedReader with Arguments::Writer / Arguments::Reader on typical
+// argument lists. Not run as a test because timings are meaningless on a loaded machine.
+
+#include "typedarguments.h"
+
+#include <chrono>
+#include <iostream>
+
+static const int iterations = 200000;
+
+static uint64 elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *what, uint64 dynamicNs, uint64 typedNs)
+{
+    std::cout << what << ": dynamic " << dynamicNs / iterations << " ns, typed " << typedNs / iterations
+              << " ns, speedup " << double(dynamicNs) / double(typedNs) << "x\n";
+}
+
+static void bench_propertiesChanged()
+{
+    const std::string interface = "org.example.Interface";
+    std::map<std::string, TypedVariant> properties;
+    properties["Volume"] = 50;
+    properties["Muted"] = false;
+    properties["Name"] = "Speakers";
+    properties["Position"] = int64(123456789);
+
+    uint32 total = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        Arguments::Writer writer;
+        writer.writeString(cstring(interface.c_str(), interface.length()));
+        writer.beginDict();
+        writer.writeString(cstring("Muted"));
+        writer.beginVariant();
+        writer.writeBoolean(false);
+        writer.endVariant();
+        writer.writeString(cstring("Name"));
+        writer.beginVariant();
+        writer.writeString(cstring("Speakers"));
+        writer.endVariant();
+        writer.writeString(cstring("Position"));
+        writer.beginVariant();
+        writer.writeInt64(123456789);
+        writer.endVariant();
+        writer.writeString(cstring("Volume"));
+        writer.beginVariant();
+        writer.writeInt32(50);
+        writer.endVariant();
+        writer.endDict();
+        writer.beginArray(Arguments::Writer::WriteTypesOfEmptyArray);
+        writer.writeString(cstring());
+        writer.endArray();
+        total += writer.finish().data().length;
+    }
+    const uint64 dynamicNs = elapsedNs(start);
+
+    const std::vector<std::string> invalidated;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        TypedWriter<std::string, std::map<std::string, TypedVariant>, std::vector<std::string>> writer;
+        total -= writer.write(interface, properties, invalidated).data().length;
+    }
+    const uint64 typedNs = elapsedNs(start);
+    if (total != 0) {
+        std::cout << "Output sizes differ!\n";
+    }
+    report("write sa{sv}as", dynamicNs, typedNs);
+}
+
+static void bench_structArray()
+{
+    std::vector<std::tuple<int32, int32>> points;
+    for (int32 i = 0; i < 64; i++) {
+        points.push_back(std::make_tuple(i, -i));
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        Arguments::Writer writer;
+        writer.writeUint32(i);
+        writer.beginArray();
+        for (const std::tuple<int32, int32> &p : points) {
+            writer.beginStruct();
+            writer.writeInt32(std::get<0>(p));
+            writer.writeInt32(std::get<1>(p));
+            writer.endStruct();
+        }
+        writer.endArray();
+        writer.finish();
+    }
+    const uint64 dynamicWriteNs = elapsedNs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        TypedWriter<uint32, std::vector<std::tuple<int32, int32>>> writer;
+        writer.write(i, points);
+    }
+    const uint64 typedWriteNs = elapsedNs(start);
+    report("write ua(ii)", dynamicWriteNs, typedWriteNs);
+
+    TypedWriter<uint32, std::vector<std::tuple<int32, int32>>> writer;
+    const Arguments args = writer.write(1, points);
+    int64 sum = 0;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        Arguments::Reader reader(args);
+        sum += reader.readUint32();
+        reader.beginArray();
+        while (reader.state() == Arguments::BeginStruct) {
+            reader.beginStruct();
+            sum += reader.readInt32();
+            sum += reader.readInt32();
+            reader.endStruct();
+        }
+        reader.endArray();
+    }
+    const uint64 dynamicReadNs = elapsedNs(start);
+
+    start = std::chrono::steady_clock::now();
+    uint32 u;
+    std::vector<std::tuple<int32, int32>> readPoints;
+    for (int i = 0; i < iterations; i++) {
+        TypedReader<uint32, std::vector<std::tuple<int32, int32>>> reader(args);
+        reader.read(&u, &readPoints);
+        sum -= u;
+    }
+    const uint64 typedReadNs = elapsedNs(start);
+    if (sum != 0) {
+        std::cout << "Read values differ!\n";
+    }
+    report("read ua(ii)", dynamicReadNs, typedReadNs);
+}
+
+int main(int, char *[])
+{
+    bench_propertiesChanged();
+    bench_structArray();
+}
@@ -22,12 +22,23 @@
 */
 
 #include "arguments.h"
+#include "byteswap.h"
+#include "cpufeatures.h"
+#include "error.h"
 
 #include "../testutil.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // Handy helpers
 
@@ -707,6 +718,60 @@ static void test_stringValidation()
         TEST(!Arguments::isObjectPathValid(cstring("/abc//def")));
         TEST(Arguments::isObjectPathValid(cstring("/aZ/0123_zAZa9_/_")));
     }
+    {
+        TEST(Arguments::isStringValid(cstring("gr\xc3\xbc\xc3\x9f" "e"))); // U+00FC, U+00DF
+        TEST(Arguments::isStringValid(cstring("\xe2\x82\xac"))); // U+20AC
+        TEST(Arguments::isStringValid(cstring("\xf0\x9f\x98\x80"))); // U+1F600
+        TEST(Arguments::isStringValid(cstring("\xf4\x8f\xbf\xbf"))); // U+10FFFF
+        TEST(!Arguments::isStringValid(cstring("\x80"))); // lone continuation byte
+        TEST(!Arguments::isStringValid(cstring("\xc3"))); // truncated
+        TEST(!Arguments::isStringValid(cstring("\xe2\x82"))); // truncated
+        TEST(!Arguments::isStringValid(cstring("\xc0\xaf"))); // overlong
+        TEST(!Arguments::isStringValid(cstring("\xe0\x80\xaf"))); // overlong
+        TEST(!Arguments::isStringValid(cstring("\xf0\x80\x80\xaf"))); // overlong
+        TEST(!Arguments::isStringValid(cstring("\xed\xa0\x80"))); // surrogate
+        TEST(!Arguments::isStringValid(cstring("\xf4\x90\x80\x80"))); // > U+10FFFF
+        TEST(!Arguments::isStringValid(cstring("\xff")));
+        TEST(!Arguments::isStringValid(cstring("a\0b", 3)));
+    }
+    {
+        // long enough for the vectorized code paths, with the interesting part at every position
+        // and thus in the middle of a block as well as in the scalar tail
+        for (uint32 length = 1; length < 100; length++) {
+            for (uint32 pos = 0; pos < length; pos++) {
+                std::string str(length, 'a');
+                TEST(Arguments::isStringValid(cstring(str.c_str(), str.length())));
+                str[pos] = '\0';
+                TEST(!Arguments::isStringValid(cstring(str.c_str(), str.length())));
+                str[pos] = '\x80';
+                TEST(!Arguments::isStringValid(cstring(str.c_str(), str.length())));
+                if (pos + 2 < length) {
+                    str[pos] = '\xe2';
+                    str[pos + 1] = '\x82';
+                    str[pos + 2] = '\xac';
+                    TEST(Arguments::isStringValid(cstring(str.c_str(), str.length())));
+                    str[pos + 2] = 'a';
+                    TEST(!Arguments::isStringValid(cstring(str.c_str(), str.length())));
+                }
+
+                std::string path(length, 'a');
+                path[0] = '/';
+                TEST(Arguments::isObjectPathValid(cstring(path.c_str(), path.length())));
+                if (pos > 0) {
+                    path[pos] = '-';
+                    TEST(!Arguments::isObjectPathValid(cstring(path.c_str(), path.length())));
+                    path[pos] = '/';
+                    // a slash at the end or next to another slash is invalid
+                    TEST(Arguments::isObjectPathValid(cstring(path.c_str(), path.length())) ==
+                         (pos > 1 && pos < length - 1));
+                    if (pos < length - 1) {
+                        path[pos + 1] = '/';
+                        TEST(!Arguments::isObjectPathValid(cstring(path.c_str(), path.length())));
+                    }
+                }
+            }
+        }
+    }
     {
         cstring maxStruct("((((((((((((((((((((((((((((((((i"
                           "))))))))))))))))))))))))))))))))");
@@ -1516,6 +1581,149 @@ static void test_signatureLengths()
     }
 }
 
+static void test_maxLengthSignatureData()
+{
+    // the signature terminator must not end up in the data, which directly follows the signature
+    // in the writer's buffer
+    Arguments::Writer writer;
+    for (uint32 i = 0; i < Arguments::MaxSignatureLength; i++) {
+        writer.writeByte(7);
+    }
+    Arguments arg = writer.finish();
+    TEST(writer.state() == Arguments::Finished);
+    TEST(arg.signature().length == Arguments::MaxSignatureLength);
+    TEST(arg.data().length == Arguments::MaxSignatureLength);
+    for (uint32 i = 0; i < arg.data().length; i++) {
+        TEST(arg.data().ptr[i] == 7);
+    }
+}
+
+static void test_variantContentsLayout()
+{
+    // Variant contents are written before the variant signature is known, so depending on position
+    // and signature length, they must be moved or re-aligned. Cover all the start alignments.
+    for (uint32 prefixLength = 0; prefixLength < 8; prefixLength++) {
+        Arguments::Writer writer;
+        for (uint32 i = 0; i < prefixLength; i++) {
+            writer.writeByte(i);
+        }
+        // "ax"
+        writer.beginVariant();
+        writer.beginArray();
+        writer.writeInt64(1);
+        writer.writeInt64(-2);
+        writer.endArray();
+        writer.endVariant();
+        // "a(yx)"
+        writer.beginVariant();
+        writer.beginArray();
+        for (int i = 0; i < 2; i++) {
+            writer.beginStruct();
+            writer.writeByte(3 + i);
+            writer.writeInt64(4 + i);
+            writer.endStruct();
+        }
+        writer.endArray();
+        writer.endVariant();
+        // "(yv)" with nested "at"
+        writer.beginVariant();
+        writer.beginStruct();
+        writer.writeByte(5);
+        writer.beginVariant();
+        writer.beginArray();
+        writer.writeUint64(6);
+        writer.endArray();
+        writer.endVariant();
+        writer.endStruct();
+        writer.endVariant();
+        // "aax" with an empty inner array
+        writer.beginVariant();
+        writer.beginArray();
+        writer.beginArray(Arguments::Writer::WriteTypesOfEmptyArray);
+        writer.writeInt64(0);
+        writer.endArray();
+        writer.beginArray();
+        writer.writeInt64(7);
+        writer.endArray();
+        writer.endArray();
+        writer.endVariant();
+        // "a{yx}"
+        writer.beginVariant();
+        writer.beginDict();
+        writer.writeByte(8);
+        writer.writeInt64(9);
+        writer.endDict();
+        writer.endVariant();
+        // "as"
+        writer.beginVariant();
+        writer.beginArray();
+        writer.writeString(cstring("ten"));
+        writer.endArray();
+        writer.endVariant();
+        writer.writeByte(11);
+
+        TEST(writer.state() != Arguments::InvalidData);
+        Arguments arg = writer.finish();
+        TEST(writer.state() == Arguments::Finished);
+        doRoundtrip(arg);
+
+        // the Reader checks alignment and padding
+        Arguments::Reader reader(arg);
+        for (uint32 i = 0; i < prefixLength; i++) {
+            TEST(reader.readByte() == i);
+        }
+        reader.beginVariant();
+        TEST(stringsEqual(reader.currentSignature(), cstring("ax")));
+        reader.beginArray();
+        TEST(reader.readInt64() == 1);
+        TEST(reader.readInt64() == -2);
+        reader.endArray();
+        reader.endVariant();
+        reader.beginVariant();
+        reader.beginArray();
+        for (int i = 0; i < 2; i++) {
+            reader.beginStruct();
+            TEST(reader.readByte() == 3 + i);
+            TEST(reader.readInt64() == 4 + i);
+            reader.endStruct();
+        }
+        reader.endArray();
+        reader.endVariant();
+        reader.beginVariant();
+        reader.beginStruct();
+        TEST(reader.readByte() == 5);
+        reader.beginVariant();
+        reader.beginArray();
+        TEST(reader.readUint64() == 6);
+        reader.endArray();
+        reader.endVariant();
+        reader.endStruct();
+        reader.endVariant();
+        reader.beginVariant();
+        reader.beginArray();
+        TEST(!reader.beginArray());
+        reader.endArray();
+        TEST(reader.beginArray());
+        TEST(reader.readInt64() == 7);
+        reader.endArray();
+        reader.endArray();
+        reader.endVariant();
+        reader.beginVariant();
+        reader.beginDict();
+        TEST(reader.readByte() == 8);
+        TEST(reader.readInt64() == 9);
+        reader.endDict();
+        reader.endVariant();
+        reader.beginVariant();
+        reader.beginArray();
+        TEST(stringsEqual(reader.readString(), cstring("ten")));
+        reader.endArray();
+        reader.endVariant();
+        TEST(reader.readByte() == 11);
+        TEST(reader.state() == Arguments::Finished);
+    }
+}
+
 static void test_emptyArrayAndDict()
 {
     // Arrays
@@ -1868,9 +2076,899 @@ static void test_emptyArrayAndDict()
 
 // TODO test empty dicts, too
 
+static void test_currentSingleCompleteTypeSignature()
+{
+    Arguments::Writer writer;
+    writer.writeInt32(1);
+    writer.beginDict();
+    maybeBeginDictEntry(&writer);
+    writer.writeByte(2);
+    writer.beginVariant();
+    writer.beginStruct();
+    writer.writeString(cstring("x"));
+    writer.writeDouble(3.0);
+    writer.endStruct();
+    writer.endVariant();
+    maybeEndDictEntry(&writer);
+    writer.endDict();
+    Arguments arg = writer.finish();
+    TEST(writer.state() != Arguments::InvalidData);
+
+    Arguments::Reader reader(arg);
+    TEST(stringsEqual(reader.currentSingleCompleteTypeSignature(), cstring("i")));
+    reader.readInt32();
+    TEST(stringsEqual(reader.currentSingleCompleteTypeSignature(), cstring("a{yv}")));
+    reader.beginDict();
+#ifdef WITH_DICT_ENTRY
+    reader.beginDictEntry();
+#endif
+    TEST(stringsEqual(reader.currentSingleCompleteTypeSignature(), cstring("y")));
+    reader.readByte();
+    TEST(stringsEqual(reader.currentSingleCompleteTypeSignature(), cstring("v")));
+    reader.beginVariant();
+    TEST(stringsEqual(reader.currentSingleCompleteTypeSignature(), cstring("(sd)")));
+    reader.skipStruct();
+    reader.endVariant();
+#ifdef WITH_DICT_ENTRY
+    reader.endDictEntry();
+#endif
+    reader.endDict();
+    TEST(reader.state() == Arguments::Finished);
+    TEST(!reader.currentSingleCompleteTypeSignature().ptr);
+}
+
+// must run last because it fills up the process-wide signature cache
+// serializes data like a peer with the other byte order would
+class SwappedSerializer
+{
+public:
+    void padTo(uint32 alignment)
+    {
+        while (data.size() % alignment) {
+            data.push_back(0);
+        }
+    }
+
+    template<typename T>
+    void add(T value)
+    {
+        padTo(sizeof(T));
+        byte raw[sizeof(T)];
+        memcpy(raw, &value, sizeof(T));
+        for (uint32 i = 0; i < sizeof(T); i++) {
+            data.push_back(raw[sizeof(T) - 1 - i]);
+        }
+    }
+
+    void addString(const char *str)
+    {
+        const uint32 length = strlen(str);
+        add(length);
+        data.insert(data.end(), str, str + length + 1);
+    }
+
+    void addSignature(const char *sig)
+    {
+        data.push_back(strlen(sig));
+        data.insert(data.end(), sig, sig + strlen(sig) + 1);
+    }
+
+    chunk asChunk() { return chunk(&data[0], data.size()); }
+
+    std::vector<byte> data;
+};
+
+static void test_copySwapped()
+{
+    // element counts below, at and above the vector widths, and not multiples of them
+    static const uint32 counts[] = { 0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 33, 63, 65, 100 };
+    for (uint32 elementSize = 2; elementSize <= 8; elementSize *= 2) {
+        for (uint32 count : counts) {
+            const uint32 length = count * elementSize;
+            std::vector<byte> src(length + 1);
+            for (uint32 i = 0; i < src.size(); i++) {
+                src[i] = byte(i * 7 + 1);
+            }
+            std::vector<byte> expected(src);
+            for (uint32 i = 0; i < count; i++) {
+                std::reverse(expected.begin() + i * elementSize, expected.begin() + (i + 1) * elementSize);
+            }
+
+            std::vector<byte> dest(length + 1, 0);
+            dest[length] = src[length];
+            byteswap::copySwapped(dest.data(), src.data(), count, elementSize);
+            TEST(dest == expected); // including that the byte after the end is untouched
+
+            byteswap::copySwapped(src.data(), src.data(), count, elementSize);
+            TEST(src == expected);
+        }
+    }
+}
+
+static void test_byteSwapped()
+{
+    // signature "aiqs(yt)anv", the variant containing an "ax"
+    SwappedSerializer ser;
+    {
+        ser.add(uint32(12));
+        ser.add(int32(1));
+        ser.add(int32(2));
+        ser.add(int32(-3));
+        ser.add(uint16(0x1234));
+        ser.addString("hello");
+        ser.padTo(8);
+        ser.data.push_back(7);
+        ser.add(uint64(0x0102030405060708ull));
+        ser.add(uint32(0)); // "an", empty
+        ser.addSignature("ax");
+        ser.add(uint32(16));
+        ser.add(int64(-1000000000000ll));
+        ser.add(int64(42));
+    }
+    const std::vector<byte> swappedData = ser.data;
+    const cstring signature("aiqs(yt)anv");
+
+    Arguments::Writer writer;
+    {
+        writer.beginArray();
+        writer.writeInt32(1);
+        writer.writeInt32(2);
+        writer.writeInt32(-3);
+        writer.endArray();
+        writer.writeUint16(0x1234);
+        writer.writeString(cstring("hello"));
+        writer.beginStruct();
+        writer.writeByte(7);
+        writer.writeUint64(0x0102030405060708ull);
+        writer.endStruct();
+        writer.beginArray(Arguments::Writer::WriteTypesOfEmptyArray);
+        writer.writeInt16(0);
+        writer.endArray();
+        writer.beginVariant();
+        writer.beginArray();
+        writer.writeInt64(-1000000000000ll);
+        writer.writeInt64(42);
+        writer.endArray();
+        writer.endVariant();
+    }
+    Arguments native = writer.finish();
+    TEST(stringsEqual(native.signature(), signature));
+    TEST(native.data().length == swappedData.size());
+
+    // reading byte-swapped data, with copying for the primitive arrays
+    {
+        Arguments swapped(nullptr, signature, ser.asChunk(), true);
+        TEST(swapped.isByteSwapped());
+        Arguments::Reader reader(swapped);
+        TEST(reader.peekPrimitiveArray() == Arguments::BeginArray);
+        TEST(reader.primitiveArraySize() == 12);
+        int32 ints[3];
+        TEST(reader.readPrimitiveArray(ints, 11).first == Arguments::InvalidData); // too small
+        std::pair<Arguments::IoState, uint32> ret = reader.readPrimitiveArray(ints, sizeof(ints));
+        TEST(ret.first == Arguments::Int32);
+        TEST(ret.second == 12);
+        TEST(ints[0] == 1 && ints[1] == 2 && ints[2] == -3);
+        TEST(reader.readUint16() == 0x1234);
+        TEST(stringsEqual(reader.readString(), cstring("hello")));
+        reader.beginStruct();
+        TEST(reader.readByte() == 7);
+        TEST(reader.readUint64() == 0x0102030405060708ull);
+        reader.endStruct();
+        ret = reader.readPrimitiveArray(nullptr, 0);
+        TEST(ret.first == Arguments::Int16);
+        TEST(ret.second == 0);
+        reader.beginVariant();
+        TEST(reader.readPrimitiveArray().first == Arguments::InvalidData); // no zero-copy
+        int64 longs[2];
+        ret = reader.readPrimitiveArray(longs, sizeof(longs));
+        TEST(ret.first == Arguments::Int64);
+        TEST(longs[0] == -1000000000000ll && longs[1] == 42);
+        reader.endVariant();
+        TEST(reader.isFinished());
+    }
+
+    // converting in place yields the same data as serializing natively
+    {
+        Arguments swapped(nullptr, signature, ser.asChunk(), true);
+        TEST(swapped.convertToHostByteOrder());
+        TEST(!swapped.isByteSwapped());
+        TEST(chunksEqual(swapped.data(), native.data()));
+        TEST(swapped.convertToHostByteOrder()); // no-op now
+        Arguments::Reader reader(swapped);
+        std::pair<Arguments::IoState, chunk> ret = reader.readPrimitiveArray();
+        TEST(ret.first == Arguments::Int32);
+        TEST(ret.second.length == 12);
+    }
+
+    // copying falls back to element-wise for byte-swapped data, which converts it
+    {
+        std::vector<byte> data = swappedData; // ser's data has been converted above
+        Arguments swapped(nullptr, signature, chunk(&data[0], data.size()), true);
+        Arguments::Reader reader(swapped);
+        Arguments::Writer copyWriter;
+        while (reader.state() != Arguments::Finished && reader.state() != Arguments::InvalidData) {
+            Arguments::copyOneElement(&reader, &copyWriter, Arguments::CopyWholeAggregates);
+        }
+        TEST(reader.state() == Arguments::Finished);
+        Arguments copy = copyWriter.finish();
+        TEST(stringsEqual(copy.signature(), signature));
+        TEST(chunksEqual(copy.data(), native.data()));
+    }
+
+    // malformed data is left alone
+    {
+        std::vector<byte> broken = swappedData;
+        broken[3] = 13; // first array length, not a multiple of the element size anymore
+        Arguments swapped(nullptr, signature, chunk(&broken[0], broken.size()), true);
+        TEST(!swapped.convertToHostByteOrder());
+        TEST(swapped.isByteSwapped());
+        TEST(broken[3] == 13 && std::equal(broken.begin() + 4, broken.end(), swappedData.begin() + 4));
+    }
+    {
+        std::vector<byte> truncated(swappedData.begin(), swappedData.end() - 1);
+        Arguments swapped(nullptr, signature, chunk(&truncated[0], truncated.size()), true);
+        TEST(!swapped.convertToHostByteOrder());
+        TEST(std::equal(truncated.begin(), truncated.end(), swappedData.begin()));
+    }
+
+    // all the interesting lengths for the vectorized swapping code
+    for (uint32 elementSize = 2; elementSize <= 8; elementSize *= 2) {
+        for (uint32 count = 0; count < 80; count++) {
+            SwappedSerializer arraySer;
+            arraySer.add(uint32(count * elementSize));
+            arraySer.padTo(elementSize);
+            const uint32 contentsBegin = arraySer.data.size();
+            for (uint32 i = 0; i < count; i++) {
+                const uint64 value = 0x0102030405060708ull * (i + 1);
+                if (elementSize == 2) {
+                    arraySer.add(uint16(value));
+                } else if (elementSize == 4) {
+                    arraySer.add(uint32(value));
+                } else {
+                    arraySer.add(value);
+                }
+            }
+            const cstring arraySig(elementSize == 2 ? "aq" : (elementSize == 4 ? "au" : "at"));
+
+            std::vector<byte> buffer(count * elementSize + 1);
+            Arguments swapped(nullptr, arraySig, arraySer.asChunk(), true);
+            Arguments::Reader reader(swapped);
+            TEST(reader.readPrimitiveArray(&buffer[0], buffer.size()).second == count * elementSize);
+            TEST(reader.isFinished());
+            TEST(swapped.convertToHostByteOrder());
+            TEST(chunksEqual(chunk(&buffer[0], count * elementSize),
+                             chunk(swapped.data().ptr + contentsBegin, count * elementSize)));
+            for (uint32 i = 0; i < count; i++) {
+                const uint64 value = 0x0102030405060708ull * (i + 1);
+                uint64 readBack = 0;
+                if (elementSize == 2) {
+                    uint16 v;
+                    memcpy(&v, &buffer[i * 2], 2);
+                    readBack = v;
+                } else if (elementSize == 4) {
+                    uint32 v;
+                    memcpy(&v, &buffer[i * 4], 4);
+                    readBack = v;
+                } else {
+                    memcpy(&readBack, &buffer[i * 8], 8);
+                }
+                const uint64 mask = elementSize == 8 ? ~0ull : (1ull << (elementSize * 8)) - 1;
+                TEST(readBack == (value & mask));
+            }
+        }
+    }
+}
+
+struct TelemetrySample // "(iidd)"
+{
+    int32 a;
+    int32 b;
+    double c;
+    double d;
+};
+
+struct Stamp // "(tu)", with 4 bytes of padding at the end
+{
+    uint64 t;
+    uint32 u;
+};
+
+static void test_fixedArray()
+{
+    static const uint32 count = 1000;
+    // reading
+    {
+        Arguments::Writer writer;
+        writer.beginArray();
+        for (uint32 i = 0; i < count; i++) {
+            writer.beginStruct();
+            writer.writeInt32(i);
+            writer.writeInt32(-int32(i));
+            writer.writeDouble(i * 0.5);
+            writer.writeDouble(i * 2.0);
+            writer.endStruct();
+        }
+        writer.endArray();
+        writer.writeByte(42);
+        Arguments arg = writer.finish();
+
+        Arguments::Reader reader(arg);
+        TEST(reader.readPrimitiveArray().first == Arguments::InvalidData);
+        Arguments::FixedArray array;
+        TEST(reader.readFixedArray(&array));
+        TEST(stringsEqual(array.elementSignature, cstring("(iidd)")));
+        TEST(array.count == count);
+        TEST(array.stride == sizeof(TelemetrySample));
+        TEST(array.elementSize == sizeof(TelemetrySample));
+        TEST(array.data.length == count * sizeof(TelemetrySample));
+        TEST(array.fields.size() == 4);
+        TEST(array.fields[0].type == Arguments::Int32 && array.fields[0].offset == 0);
+        TEST(array.fields[1].type == Arguments::Int32 && array.fields[1].offset == 4);
+        TEST(array.fields[2].type == Arguments::Double && array.fields[2].offset == 8);
+        TEST(array.fields[3].type == Arguments::Double && array.fields[3].offset == 16);
+        const TelemetrySample *samples = reinterpret_cast<const TelemetrySample *>(array.data.ptr);
+        TEST(samples[999].a == 999 && samples[999].b == -999);
+        TEST(samples[999].c == 499.5 && samples[999].d == 1998.0);
+        TEST(reader.readByte() == 42);
+        TEST(reader.isFinished());
+    }
+    // writing from C structs with garbage in the padding, reading back
+    {
+        std::vector<Stamp> stamps(count);
+        memset(&stamps[0], 0xff, count * sizeof(Stamp));
+        for (uint32 i = 0; i < count; i++) {
+            stamps[i].t = uint64(i) << 40;
+            stamps[i].u = i;
+        }
+        Arguments::Writer writer;
+        writer.writeFixedArray(cstring("(tu)"),
+                               chunk(reinterpret_cast<byte *>(&stamps[0]), count * sizeof(Stamp)));
+        Arguments fromFixed = writer.finish();
+        TEST(!fromFixed.error().isError());
+
+        Arguments::Writer writer2;
+        writer2.beginArray();
+        for (uint32 i = 0; i < count; i++) {
+            writer2.beginStruct();
+            writer2.writeUint64(uint64(i) << 40);
+            writer2.writeUint32(i);
+            writer2.endStruct();
+        }
+        writer2.endArray();
+        Arguments fromStructs = writer2.finish();
+        TEST(stringsEqual(fromFixed.signature(), fromStructs.signature()));
+        TEST(chunksEqual(fromFixed.data(), fromStructs.data()));
+
+        Arguments::Reader reader(fromFixed);
+        Arguments::FixedArray array;
+        TEST(reader.readFixedArray(&array));
+        TEST(array.count == count);
+        TEST(array.stride == 16);
+        TEST(array.elementSize == 12);
+        TEST(array.data.length == (count - 1) * 16 + 12);
+        TEST(reader.isFinished());
+
+        // the serialized form, without padding after the last element, works too
+        Arguments::Writer writer3;
+        writer3.writeFixedArray(array.elementSignature, array.data);
+        Arguments copy = writer3.finish();
+        TEST(chunksEqual(copy.data(), fromStructs.data()));
+    }
+    // primitives, nested structs and empty arrays
+    {
+        const uint16 shorts[3] = { 1, 2, 3 };
+        Arguments::Writer writer;
+        writer.writeFixedArray(cstring("q"), chunk(reinterpret_cast<const char *>(shorts), sizeof(shorts)));
+        writer.writeFixedArray(cstring("(y(yt))"), chunk());
+        Arguments arg = writer.finish();
+        TEST(stringsEqual(arg.signature(), cstring("aqa(y(yt))")));
+
+        Arguments::Reader reader(arg);
+        Arguments::FixedArray array;
+        TEST(reader.readFixedArray(&array));
+        TEST(array.count == 3 && array.stride == 2);
+        TEST(!memcmp(array.data.ptr, shorts, sizeof(shorts)));
+        TEST(reader.readFixedArray(&array));
+        TEST(array.count == 0 && array.data.length == 0);
+        TEST(array.elementSize == 24 && array.stride == 24);
+        TEST(array.fields.size() == 3);
+        TEST(array.fields[1].offset == 8 && array.fields[2].offset == 16);
+        TEST(reader.isFinished());
+    }
+    // what doesn't work
+    {
+        Arguments::Writer writer;
+        writer.writeFixedArray(cstring("(ts)"), chunk());
+        TEST(writer.state() == Arguments::InvalidData);
+    }
+    {
+        Arguments::Writer writer;
+        writer.writeFixedArray(cstring("(bu)"), chunk());
+        TEST(writer.state() == Arguments::InvalidData);
+    }
+    {
+        const Stamp stamp = { 1, 2 };
+        Arguments::Writer writer;
+        writer.writeFixedArray(cstring("(tu)"), chunk(reinterpret_cast<const char *>(&stamp), 13));
+        TEST(writer.state() == Arguments::InvalidData);
+    }
+    {
+        Arguments::Writer writer;
+        writer.beginArray();
+        writer.beginStruct();
+        writer.writeUint64(1);
+        writer.writeString(cstring("not fixed"));
+        writer.endStruct();
+        writer.endArray();
+        Arguments arg = writer.finish();
+        Arguments::Reader reader(arg);
+        Arguments::FixedArray array;
+        TEST(!reader.readFixedArray(&array));
+        TEST(reader.state() == Arguments::BeginArray);
+    }
+    {
+        // nonzero padding between elements
+        Arguments::Writer writer;
+        writer.writeFixedArray(cstring("(tu)"), chunk("\1\0\0\0\0\0\0\0\2\0\0\0\0\0\0\0"
+                                                    "\3\0\0\0\0\0\0\0\4\0\0\0", 28));
+        Arguments arg = writer.finish();
+        TEST(!arg.error().isError());
+        std::vector<byte> data(arg.data().ptr, arg.data().ptr + arg.data().length);
+        data[4 + 4 + 12] = 1; // length prefix, alignment padding, first element
+        Arguments broken(nullptr, arg.signature(), chunk(&data[0], data.size()));
+        Arguments::Reader reader(broken);
+        Arguments::FixedArray array;
+        TEST(!reader.readFixedArray(&array));
+    }
+}
+
+static void writeNestedDicts(Arguments::Writer *writer, uint32 prefixLength)
+{
+    for (uint32 i = 0; i < prefixLength; i++) {
+        writer->writeByte(0);
+    }
+    // variants can only be copied raw if source and destination alignment agree
+    writer->beginVariant();
+    writer->writeUint64(7);
+    writer->endVariant();
+    writer->beginArray();
+    writer->beginVariant();
+    writer->writeInt16(-2);
+    writer->endVariant();
+    writer->beginVariant();
+    writer->writeString(cstring("av"));
+    writer->endVariant();
+    writer->endArray();
+    // a{sa{sv}}
+    writer->beginDict();
+    for (int i = 0; i < 3; i++) {
+        maybeBeginDictEntry(writer);
+        writer->writeString(i == 1 ? cstring("org.example.Second") : cstring("org.example.Iface"));
+        writer->beginDict();
+        maybeBeginDictEntry(writer);
+        writer->writeString(cstring("Count"));
+        writer->beginVariant();
+        writer->writeInt32(-17 * i);
+        writer->endVariant();
+        maybeEndDictEntry(writer);
+        maybeBeginDictEntry(writer);
+        writer->writeString(cstring("Stamp"));
+        writer->beginVariant();
+        writer->beginStruct();
+        writer->writeByte(3);
+        writer->writeUint64(123456789012ull);
+        writer->endStruct();
+        writer->endVariant();
+        maybeEndDictEntry(writer);
+        maybeBeginDictEntry(writer);
+        writer->writeString(cstring("Things"));
+        writer->beginVariant();
+        writer->beginArray();
+        writer->beginVariant();
+        writer->writeString(cstring("thing"));
+        writer->endVariant();
+        writer->beginVariant();
+        writer->writeDouble(2.5);
+        writer->endVariant();
+        writer->endArray();
+        writer->endVariant();
+        maybeEndDictEntry(writer);
+        maybeBeginDictEntry(writer);
+        writer->writeString(cstring("Empty"));
+        writer->beginVariant();
+        writer->beginDict(Arguments::Writer::WriteTypesOfEmptyArray);
+        maybeBeginDictEntry(writer);
+        writer->writeString(cstring());
+        writer->beginVariant();
+        writer->endVariant();
+        maybeEndDictEntry(writer);
+        writer->endDict();
+        writer->endVariant();
+        maybeEndDictEntry(writer);
+        writer->endDict();
+        maybeEndDictEntry(writer);
+    }
+    writer->endDict();
+    // (y(xs)ad)
+    writer->beginStruct();
+    writer->writeByte(9);
+    writer->beginStruct();
+    writer->writeInt64(-5);
+    writer->writeString(cstring("inner"));
+    writer->endStruct();
+    writer->beginArray();
+    writer->writeDouble(1.0);
+    writer->writeDouble(-1.0);
+    writer->endArray();
+    writer->endStruct();
+    addSomeVariantStuff(writer);
+    // aai
+    writer->beginArray();
+    for (int i = 0; i < 2; i++) {
+        writer->beginArray();
+        writer->writeInt32(i);
+        writer->endArray();
+    }
+    writer->endArray();
+}
+
+static Arguments copyAll(const Arguments &source, uint32 prefixLength, Arguments::CopyMode mode)
+{
+    Arguments::Writer writer;
+    for (uint32 i = 0; i < prefixLength; i++) {
+        writer.writeByte(0);
+    }
+    Arguments::Reader reader(source);
+    while (reader.state() != Arguments::Finished && reader.state() != Arguments::InvalidData) {
+        Arguments::copyOneElement(&reader, &writer, mode);
+    }
+    TEST(reader.state() == Arguments::Finished);
+    TEST(writer.state() != Arguments::InvalidData);
+    return writer.finish();
+}
+
+static void test_copyWholeAggregates()
+{
+    // all combinations of source and destination alignment
+    for (uint32 srcPrefix = 0; srcPrefix < 8; srcPrefix++) {
+        Arguments::Writer writer;
+        writeNestedDicts(&writer, srcPrefix);
+        Arguments source = writer.finish();
+        TEST(writer.state() != Arguments::InvalidData);
+        for (uint32 dstPrefix = 0; dstPrefix < 8; dstPrefix++) {
+            Arguments elementWise = copyAll(source, dstPrefix, Arguments::CopyElementWise);
+            Arguments wholeAggregates = copyAll(source, dstPrefix, Arguments::CopyWholeAggregates);
+            TEST(stringsEqual(wholeAggregates.signature(), elementWise.signature()));
+            TEST(chunksEqual(wholeAggregates.data(), elementWise.data()));
+            if (dstPrefix == 0) {
+                TEST(chunksEqual(wholeAggregates.data(), source.data()));
+            }
+        }
+    }
+
+    // aggregates in the second and later iterations of an outer array
+    {
+        Arguments::Writer writer;
+        writer.beginArray();
+        for (int i = 0; i < 3; i++) {
+            writer.beginStruct();
+            writer.writeString(cstring("key"));
+            writer.beginVariant();
+            writer.writeUint16(uint16(i));
+            writer.endVariant();
+            writer.endStruct();
+        }
+        writer.endArray();
+        Arguments source = writer.finish();
+
+        Arguments::Reader reader(source);
+        Arguments::Writer copyWriter;
+        reader.beginArray();
+        copyWriter.beginArray();
+        while (reader.state() == Arguments::BeginStruct) {
+            Arguments::copyOneElement(&reader, &copyWriter, Arguments::CopyWholeAggregates);
+        }
+        reader.endArray();
+        copyWriter.endArray();
+        TEST(reader.isFinished());
+        Arguments copy = copyWriter.finish();
+        TEST(stringsEqual(copy.signature(), source.signature()));
+        TEST(chunksEqual(copy.data(), source.data()));
+    }
+
+    // the source is validated as in element-wise copying
+    {
+        // "as" with one string that is not valid UTF-8
+        byte data[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 'a', 0xff, 'c', 0 };
+        const uint32 arrayLength = 8;
+        const uint32 stringLength = 3;
+        memcpy(data, &arrayLength, sizeof(uint32));
+        memcpy(data + 4, &stringLength, sizeof(uint32));
+        Arguments source(nullptr, cstring("as"), chunk(data, sizeof(data)));
+        Arguments::Reader reader(source);
+        Arguments::Writer writer;
+        Arguments::copyOneElement(&reader, &writer, Arguments::CopyWholeAggregates);
+        TEST(reader.state() == Arguments::InvalidData);
+    }
+}
+
+static void writeSomeData(Arguments::Writer *writer, uint32 longStringLength)
+{
+    const std::string longString(longStringLength, 'x');
+    writer->writeUint16(3);
+    writer->beginStruct();
+    writer->writeString(cstring(longString.c_str(), longString.length()));
+    writer->beginVariant();
+    writer->writeDouble(0.25);
+    writer->endVariant();
+    writer->endStruct();
+}
+
+static void test_finishInto()
+{
+    // in the initial buffer and in a heap buffer
+    for (uint32 longStringLength : { 10, 5000 }) {
+        Arguments::Writer referenceWriter;
+        writeSomeData(&referenceWriter, longStringLength);
+        Arguments reference = referenceWriter.finish();
+
+        Arguments::Writer writer;
+        TEST(writer.finishedSize() == 0);
+        writeSomeData(&writer, longStringLength);
+        const uint32 size = writer.finishedSize();
+        TEST(size == ((reference.signature().length + 1 + 7) & ~7u) + reference.data().length);
+
+        std::vector<byte> buffer(size);
+        {
+            Arguments arg = writer.finishInto(chunk(&buffer[0], buffer.size()));
+            TEST(writer.state() == Arguments::Finished);
+            TEST(!arg.error().isError());
+            TEST(stringsEqual(arg.signature(), reference.signature()));
+            TEST(chunksEqual(arg.data(), reference.data()));
+            TEST(arg.data().ptr + arg.data().length == &buffer[0] + size);
+            TEST(reinterpret_cast<const byte *>(arg.signature().ptr) == &buffer[0]);
+        }
+
+        // reuse
+        writer.reset();
+        TEST(writer.state() == Arguments::AnyData);
+        TEST(writer.finishedSize() == 0);
+        TEST(writer.aggregateDepth() == 0);
+        writer.writeByte(1);
+        Arguments small = writer.finish();
+        TEST(stringsEqual(small.signature(), cstring("y")));
+        TEST(small.data().length == 1 && small.data().ptr[0] == 1);
+
+        writer.reset();
+        writeSomeData(&writer, longStringLength);
+        Arguments again = writer.finish();
+        TEST(stringsEqual(again.signature(), reference.signature()));
+        TEST(chunksEqual(again.data(), reference.data()));
+
+        // too small
+        writer.reset();
+        writeSomeData(&writer, longStringLength);
+        Arguments tooSmall = writer.finishInto(chunk(&buffer[0], size - 1));
+        TEST(writer.state() == Arguments::InvalidData);
+        TEST(writer.error().code() == Error::BufferTooSmall);
+        TEST(tooSmall.error().code() == Error::BufferTooSmall);
+
+        // and reusable after an error
+        writer.reset();
+        TEST(writer.isValid());
+        writer.beginVariant();
+        writer.endVariant();
+        TEST(writer.state() == Arguments::InvalidData);
+        writer.reset();
+        writeSomeData(&writer, longStringLength);
+        Arguments afterError = writer.finish();
+        TEST(!afterError.error().isError());
+        TEST(chunksEqual(afterError.data(), reference.data()));
+    }
+}
+
+static void test_signatureCacheOverflow()
+{
+    static const char letters[] = "ybnqiuxtdsogh";
+    const uint32 letterCount = sizeof(letters) - 1;
+    char sig[5] = { 0, 0, 0, 0, 0 };
+    for (uint32 i = 0; i < 5000; i++) {
+        uint32 n = i;
+        for (int j = 0; j < 4; j++) {
+            sig[j] = letters[n % letterCount];
+            n /= letterCount;
+        }
+        TEST(Arguments::isSignatureValid(cstring(sig, 4)));
+    }
+
+    // signatures that can't have been cached before, in the main signature and inside variants
+    Arguments::Writer writer;
+    writer.writeUint16(1);
+    writer.beginVariant();
+    writer.beginArray();
+    writer.beginVariant();
+    writer.beginStruct();
+    writer.writeUint16(2);
+    writer.writeUint16(3);
+    writer.writeUint16(4);
+    writer.endStruct();
+    writer.endVariant();
+    writer.endArray();
+    writer.endVariant();
+    writer.writeUint16(5);
+    Arguments arg = writer.finish();
+    TEST(writer.state() != Arguments::InvalidData);
+    TEST(Arguments::isSignatureValid(cstring("(qqqqqq)"), Arguments::VariantSignature));
+    TEST(!Arguments::isSignatureValid(cstring("(qqqqq"), Arguments::VariantSignature));
+    doRoundtrip(arg);
+}
+
+static void test_sharedCopies()
+{
+    Arguments::Writer writer;
+    writer.writeString(cstring("shared"));
+    writer.writeUint32(12345);
+    Arguments arg = writer.finish();
+
+    // data in owned memory is shared
+    {
+        Arguments copy(arg);
+        TEST(copy.data().ptr == arg.data().ptr);
+        TEST(copy.signature().ptr == arg.signature().ptr);
+        Arguments assigned;
+        assigned = copy;
+        TEST(assigned.data().ptr == arg.data().ptr);
+        arg = Arguments();
+        Arguments::Reader reader(copy);
+        const cstring str = reader.readString();
+        TEST(stringsEqual(str, cstring("shared")));
+        TEST(reader.readUint32() == 12345);
+        arg = copy;
+    }
+
+    // borrowed data is copied because it may not live as long as the copy
+    {
+        Arguments borrowed(nullptr, arg.signature(), arg.data());
+        Arguments copy(borrowed);
+        TEST(copy.data().ptr != borrowed.data().ptr);
+        TEST(chunksEqual(copy.data(), borrowed.data()));
+    }
+
+    // converting the byte order in place gives the copy its own data
+    {
+        SwappedSerializer ser;
+        ser.add(uint32(8));
+        ser.add(int32(1));
+        ser.add(int32(-2));
+        byte *mem = static_cast<byte *>(malloc(8 + ser.data.size()));
+        memcpy(mem, "ai", 3);
+        memcpy(mem + 8, ser.data.data(), ser.data.size());
+        Arguments swapped(mem, cstring(mem, 2), chunk(mem + 8, ser.data.size()), true);
+        Arguments copy(swapped);
+        TEST(copy.data().ptr == swapped.data().ptr);
+        TEST(copy.convertToHostByteOrder());
+        TEST(!copy.isByteSwapped());
+        TEST(copy.data().ptr != swapped.data().ptr);
+        TEST(swapped.isByteSwapped());
+        TEST(chunksEqual(swapped.data(), ser.asChunk()));
+        Arguments::Reader reader(copy);
+        std::pair<Arguments::IoState, chunk> array = reader.readPrimitiveArray();
+        TEST(array.first == Arguments::Int32);
+        int32 second;
+        memcpy(&second, array.second.ptr + sizeof(int32), sizeof(int32));
+        TEST(second == -2);
+    }
+}
+
+#ifdef __unix__
+static bool isFdOpen(int fd)
+{
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+static void test_unixFds()
+{
+    int pipeFds[2];
+    TEST(pipe(pipeFds) == 0);
+    int ownedFd = -1;
+    {
+        Arguments::Writer writer;
+        writer.writeUnixFd(pipeFds[1]);
+        writer.beginArray(Arguments::Writer::WriteTypesOfEmptyArray);
+        writer.writeUnixFd(pipeFds[1]); // in an empty array, there is nothing to send
+        writer.endArray();
+        writer.beginStruct();
+        writer.writeUint32(7);
+        writer.writeUnixFd(pipeFds[1]);
+        writer.endStruct();
+        Arguments arg = writer.finish();
+        TEST(!arg.error().isError());
+        TEST(stringsEqual(arg.signature(), cstring("hah(uh)")));
+
+        // the Arguments owns duplicates, in order of writing
+        TEST(arg.fileDescriptors().size() == 2);
+        ownedFd = arg.fileDescriptors()[0];
+        TEST(ownedFd != pipeFds[1] && arg.fileDescriptors()[1] != pipeFds[1]);
+        TEST(isFdOpen(ownedFd));
+
+        Arguments::Reader reader(arg);
+        TEST(int(reader.readUnixFd()) == arg.fileDescriptors()[0]);
+        reader.beginArray(Arguments::Reader::ReadTypesOnlyIfEmpty);
+        reader.readUnixFd();
+        reader.endArray();
+        reader.beginStruct();
+        TEST(reader.readUint32() == 7);
+        const int fd = int(reader.readUnixFd());
+        TEST(fd == arg.fileDescriptors()[1]);
+        reader.endStruct();
+        TEST(reader.state() == Arguments::Finished);
+        // it really is the pipe
+        TEST(write(fd, "x", 1) == 1);
+        char c = 0;
+        TEST(read(pipeFds[0], &c, 1) == 1 && c == 'x');
+
+        // copies have their own duplicates, and copying element-wise duplicates them again
+        Arguments copy(arg);
+        TEST(copy.fileDescriptors().size() == 2);
+        TEST(copy.fileDescriptors()[0] != ownedFd);
+        Arguments::Reader copyReader(copy);
+        Arguments::Writer copyWriter;
+        while (copyReader.state() != Arguments::Finished && copyReader.state() != Arguments::InvalidData) {
+            Arguments::copyOneElement(&copyReader, &copyWriter, Arguments::CopyWholeAggregates);
+        }
+        Arguments copy2 = copyWriter.finish();
+        TEST(chunksEqual(copy2.data(), arg.data()));
+        TEST(copy2.fileDescriptors().size() == 2);
+    }
+    TEST(!isFdOpen(ownedFd));
+    TEST(isFdOpen(pipeFds[1]));
+
+    // invalid fds can't be written
+    {
+        Arguments::Writer writer;
+        writer.writeUnixFd(uint32(-1));
+        TEST(writer.state() == Arguments::InvalidData);
+        TEST(writer.error().code() == Error::InvalidUnixFd);
+    }
+    // the Writer closes its fds if it is not finished
+    {
+        Arguments::Writer writer;
+        writer.writeUnixFd(pipeFds[1]);
+        Arguments::Writer writerCopy(writer);
+        writer.reset();
+        TEST(writerCopy.finish().fileDescriptors().size() == 1);
+    }
+
+    // an index without a matching fd
+    {
+        byte data[4] = { 0, 0, 0, 0 };
+        Arguments arg(nullptr, cstring("h"), chunk(data, 4));
+        Arguments::Reader reader(arg);
+        TEST(reader.state() == Arguments::InvalidData);
+        TEST(reader.error().code() == Error::InvalidUnixFd);
+    }
+
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
+#endif
+
+// The features that select each set of SIMD kernels, and the portable ones. Those for features
+// that the CPU doesn't have fall back to the next set.
+static const CpuFeatures kernelLevels[] = {
+    { true, true, true },
+    { true, true, false },
+    { false, false, false }
+};
+
 int main(int, char *[])
 {
-    test_stringValidation();
+    for (const CpuFeatures &features : kernelLevels) {
+        setCpuFeatures(features);
+        test_stringValidation();
+        test_copySwapped();
+    }
+    setCpuFeatures(kernelLevels[0]);
     test_nesting();
     test_roundtrip();
     test_writerMisuse();
@@ -1879,11 +2977,23 @@ int main(int, char *[])
     test_complicated();
     test_alignment();
     test_arrayOfVariant();
+    test_variantContentsLayout();
     test_realMessage();
     test_isWritingSignatureBug();
     test_primitiveArray();
     test_signatureLengths();
+    test_maxLengthSignatureData();
     test_emptyArrayAndDict();
+    test_currentSingleCompleteTypeSignature();
+    test_byteSwapped();
+    test_fixedArray();
+    test_copyWholeAggregates();
+    test_finishInto();
+    test_signatureCacheOverflow();
+    test_sharedCopies();
+#ifdef __unix__
+    test_unixFds();
+#endif
 
     // TODO (maybe): specific tests for begin/endDictEntry() for both Reader and Writer.
 
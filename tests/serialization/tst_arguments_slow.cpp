@@ -53,9 +53,8 @@ static void test_payloadLengths()
             writer.writeUint32(i);
         }
         writer.endArray();
-        // The goal of the next check is to ensure that bevior doesn't change by accident, even
-        // though the behavior may be dubious. Because it is dubious, it may still get changed.
-        TEST(writer.state() != Arguments::InvalidData);
+        // The array length is known when the array ends, so the error is reported right there.
+        TEST(writer.state() == Arguments::InvalidData);
         Arguments arg = writer.finish();
         TEST(writer.state() == Arguments::InvalidData);
     }
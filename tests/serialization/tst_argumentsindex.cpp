@@ -0,0 +1,194 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "argumentsindex.h"
+
+#include "../testutil.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static bool stringsEqual(cstring s1, cstring s2)
+{
+    return s1.length == s2.length && !memcmp(s1.ptr, s2.ptr, s1.length);
+}
+
+static Arguments createTestArguments()
+{
+    Arguments::Writer writer;
+    writer.writeString(cstring("first"));
+    writer.beginArray();
+    for (int32 i = 0; i < 1000; i++) {
+        writer.writeInt32(i);
+    }
+    writer.endArray();
+    writer.beginStruct();
+    writer.writeUint64(12345);
+    writer.writeString(cstring("in a struct"));
+    writer.endStruct();
+    writer.beginDict();
+    for (int i = 0; i < 50; i++) {
+        const std::string key = "key" + std::to_string(i);
+        writer.writeString(cstring(key.c_str()));
+        writer.beginVariant();
+        if (i % 2) {
+            writer.writeString(cstring(key.c_str()));
+        } else {
+            writer.writeUint32(i);
+        }
+        writer.endVariant();
+    }
+    writer.endDict();
+    writer.beginDict();
+    for (int32 i = -10; i < 10; i++) {
+        writer.writeInt32(i);
+        writer.writeInt64(int64(i) * 1000000000000ll);
+    }
+    writer.endDict();
+    writer.writeUint32(0xdecafbad);
+    return writer.finish();
+}
+
+static void test_topLevel()
+{
+    Arguments args = createTestArguments();
+    ArgumentsIndex index(args);
+    TEST(index.isValid());
+    TEST(index.count() == 6);
+    TEST(stringsEqual(index.signature(0), cstring("s")));
+    TEST(stringsEqual(index.signature(1), cstring("ai")));
+    TEST(stringsEqual(index.signature(2), cstring("(ts)")));
+    TEST(stringsEqual(index.signature(3), cstring("a{sv}")));
+    TEST(stringsEqual(index.signature(4), cstring("a{ix}")));
+    TEST(stringsEqual(index.signature(5), cstring("u")));
+    TEST(index.signature(6).length == 0);
+
+    {
+        Arguments::Reader reader = index.reader(5);
+        TEST(reader.readUint32() == 0xdecafbad);
+        TEST(reader.isFinished());
+    }
+    {
+        // continues with the following arguments
+        Arguments::Reader reader = index.reader(2);
+        reader.beginStruct();
+        TEST(reader.readUint64() == 12345);
+        TEST(stringsEqual(reader.readString(), cstring("in a struct")));
+        reader.endStruct();
+        TEST(reader.state() == Arguments::BeginDict);
+        reader.skipCurrentElement();
+        TEST(reader.state() == Arguments::BeginDict);
+        reader.skipCurrentElement();
+        TEST(reader.readUint32() == 0xdecafbad);
+        TEST(reader.isFinished());
+    }
+    {
+        Arguments::Reader reader = index.reader(1);
+        const std::pair<Arguments::IoState, chunk> array = reader.readPrimitiveArray();
+        TEST(array.first == Arguments::Int32);
+        TEST(array.second.length == 1000 * sizeof(int32));
+    }
+    TEST(index.reader(6).state() == Arguments::InvalidData);
+    // not indexed
+    TEST(index.dictValue(3, cstring("key1")).state() == Arguments::InvalidData);
+}
+
+static void test_dicts()
+{
+    Arguments args = createTestArguments();
+    ArgumentsIndex index(args, ArgumentsIndex::IndexDicts);
+    TEST(index.isValid());
+    TEST(index.count() == 6);
+
+    for (int i = 0; i < 50; i++) {
+        const std::string key = "key" + std::to_string(i);
+        Arguments::Reader reader = index.dictValue(3, cstring(key.c_str()));
+        TEST(reader.state() == Arguments::BeginVariant);
+        reader.beginVariant();
+        if (i % 2) {
+            TEST(stringsEqual(reader.readString(), cstring(key.c_str())));
+        } else {
+            TEST(reader.readUint32() == uint32(i));
+        }
+        reader.endVariant();
+        TEST(reader.isFinished());
+    }
+    TEST(index.dictValue(3, cstring("key50")).state() == Arguments::InvalidData);
+    TEST(index.dictValue(3, cstring("")).state() == Arguments::InvalidData);
+    TEST(index.dictValue(3, 1).state() == Arguments::InvalidData); // wrong key type
+
+    for (int32 i = -10; i < 10; i++) {
+        Arguments::Reader reader = index.dictValue(4, i);
+        TEST(reader.readInt64() == int64(i) * 1000000000000ll);
+        TEST(reader.isFinished());
+    }
+    TEST(index.dictValue(4, 10).state() == Arguments::InvalidData);
+    TEST(index.dictValue(4, cstring("key1")).state() == Arguments::InvalidData);
+
+    // not dicts
+    TEST(index.dictValue(0, cstring("first")).state() == Arguments::InvalidData);
+    TEST(index.dictValue(5, 0).state() == Arguments::InvalidData);
+    TEST(index.dictValue(6, 0).state() == Arguments::InvalidData);
+
+    // top-level access still works as usual
+    Arguments::Reader reader = index.reader(4);
+    TEST(reader.state() == Arguments::BeginDict);
+}
+
+static void test_malformed()
+{
+    Arguments args = createTestArguments();
+    const chunk data = args.data();
+    // cut off in the middle of the dict, and after the last argument
+    for (uint32 length : { data.length - 1, data.length / 2 }) {
+        std::vector<byte> truncated(data.ptr, data.ptr + length);
+        Arguments broken(nullptr, args.signature(), chunk(&truncated[0], length));
+        ArgumentsIndex index(broken, ArgumentsIndex::IndexDicts);
+        TEST(!index.isValid());
+        TEST(index.count() == 0);
+        TEST(index.reader(0).state() == Arguments::InvalidData);
+    }
+    {
+        // a string length pointing past the end
+        std::vector<byte> copy(data.ptr, data.ptr + data.length);
+        copy[0] = 0xff;
+        Arguments broken(nullptr, args.signature(), chunk(&copy[0], copy.size()));
+        TEST(!ArgumentsIndex(broken).isValid());
+    }
+    {
+        Arguments empty;
+        ArgumentsIndex index(empty);
+        TEST(index.isValid());
+        TEST(index.count() == 0);
+    }
+}
+
+int main(int, char *[])
+{
+    test_topLevel();
+    test_dicts();
+    test_malformed();
+    std::cout << "Passed!\n";
+}
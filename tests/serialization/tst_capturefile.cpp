@@ -0,0 +1,284 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "arguments.h"
+#include "capturefile.h"
+#include "error.h"
+#include "message.h"
+#include "testutil.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __unix__
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef __unix__
+static string tempFileName(const char *suffix)
+{
+    return string("/tmp/tst_capturefile_") + to_string(getpid()) + suffix;
+}
+
+static vector<byte> readFile(const string &fileName)
+{
+    vector<byte> ret;
+    FILE *f = fopen(fileName.c_str(), "rb");
+    TEST(f);
+    byte buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        ret.insert(ret.end(), buf, buf + n);
+    }
+    fclose(f);
+    return ret;
+}
+
+static void writeFile(const string &fileName, const vector<byte> &data)
+{
+    FILE *f = fopen(fileName.c_str(), "wb");
+    TEST(f);
+    TEST(fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+}
+
+static vector<Message> testMessages()
+{
+    vector<Message> ret;
+    {
+        Message call = Message::createCall("/org/example/Object", "org.example.Interface", "Method");
+        call.setDestination("org.example.Service");
+        call.setSender(":1.5");
+        Arguments::Writer writer;
+        writer.writeString(cstring("argument"));
+        writer.writeUint32(12345);
+        call.setArguments(writer.finish());
+        call.setSerial(10);
+        ret.push_back(call);
+    }
+    {
+        Message reply = Message::createReplyTo(ret[0]);
+        reply.setSerial(11);
+        ret.push_back(reply);
+    }
+    {
+        // an odd length, so the following record needs padding
+        Message signal = Message::createSignal("/org/example/Object", "org.example.Interface", "Changed");
+        Arguments::Writer writer;
+        writer.writeByte(7);
+        signal.setArguments(writer.finish());
+        signal.setSerial(12);
+        // a received message, which is appended without serializing it again
+        Message received;
+        received.load(signal.save());
+        ret.push_back(received);
+    }
+    return ret;
+}
+
+static void checkMessages(const CaptureReader &reader, vector<Message> &expected)
+{
+    TEST(reader.messageCount() == expected.size());
+    for (uint32 i = 0; i < reader.messageCount(); i++) {
+        const CaptureIndexEntry &entry = reader.indexEntry(i);
+        TEST(entry.timestamp == int64(i) * 1000);
+        TEST(entry.serial == expected[i].serial());
+        TEST(entry.replySerial == expected[i].replySerial());
+        TEST(entry.messageType == expected[i].type());
+        TEST(entry.headerHash == CaptureIndexEntry::hashHeaders(expected[i]));
+        TEST(entry.offset % 8 == 0);
+
+        Message msg = reader.message(i);
+        TEST(msg.type() == expected[i].type());
+        TEST(msg.save() == expected[i].save());
+    }
+}
+
+static void test_writeAndRead()
+{
+    const string fileName = tempFileName(".cap");
+    vector<Message> messages = testMessages();
+    {
+        CaptureWriter writer;
+        TEST(writer.open(fileName));
+        TEST(writer.isOpen());
+        for (uint32 i = 0; i < messages.size(); i++) {
+            TEST(writer.append(messages[i], int64(i) * 1000));
+        }
+        TEST(writer.messageCount() == messages.size());
+        TEST(writer.finish());
+        TEST(!writer.isOpen());
+        TEST(!writer.error().isError());
+        TEST(!writer.append(messages[0], 0));
+    }
+
+    Message kept;
+    {
+        CaptureReader reader;
+        TEST(reader.open(fileName));
+        TEST(reader.isOpen());
+        TEST(reader.hasStoredIndex());
+        checkMessages(reader, messages);
+        TEST(CaptureIndexEntry::hashHeaders(messages[0]) != CaptureIndexEntry::hashHeaders(messages[2]));
+
+        // messages are views of the file, not copies
+        Message first = reader.message(0);
+        Message again = reader.message(0);
+        TEST(first.arguments().data().ptr == again.arguments().data().ptr);
+        TEST(reader.message(reader.messageCount()).type() == Message::InvalidMessage);
+
+        kept = reader.message(0);
+        reader.close();
+        TEST(!reader.isOpen());
+        TEST(reader.messageCount() == 0);
+    }
+    // ...which keep the file mapped as long as they exist
+    TEST(kept.method() == "Method");
+    TEST(kept.save() == messages[0].save());
+
+    remove(fileName.c_str());
+}
+
+// more messages than the writer keeps index entries for in memory
+static void test_manyMessages()
+{
+    const string fileName = tempFileName("_many.cap");
+    const uint32 count = 5000;
+    Message msg = testMessages()[0];
+    {
+        CaptureWriter writer;
+        TEST(writer.open(fileName));
+        // the temporary index file is gone already
+        TEST(access((fileName + ".index").c_str(), F_OK) != 0);
+        for (uint32 i = 0; i < count; i++) {
+            msg.setSerial(i + 1);
+            TEST(writer.append(msg, int64(i) * 1000));
+        }
+        TEST(writer.messageCount() == count);
+        TEST(writer.finish());
+    }
+
+    CaptureReader reader;
+    TEST(reader.open(fileName));
+    TEST(reader.hasStoredIndex());
+    TEST(reader.messageCount() == count);
+    for (uint32 i = 0; i < count; i++) {
+        const CaptureIndexEntry &entry = reader.indexEntry(i);
+        TEST(entry.serial == i + 1);
+        TEST(entry.timestamp == int64(i) * 1000);
+    }
+    TEST(reader.message(count - 1).serial() == count);
+
+    remove(fileName.c_str());
+}
+
+static void test_unfinishedFile()
+{
+    const string fileName = tempFileName("_unfinished.cap");
+    vector<Message> messages = testMessages();
+    {
+        CaptureWriter writer;
+        TEST(writer.open(fileName));
+        for (uint32 i = 0; i < messages.size(); i++) {
+            TEST(writer.append(messages[i], int64(i) * 1000));
+        }
+    }
+    // make it look like the writer was killed while writing one more message
+    vector<byte> data = readFile(fileName);
+    uint64 indexOffset;
+    memcpy(&indexOffset, &data[16], sizeof(uint64));
+    TEST(indexOffset > 32 && indexOffset < data.size());
+    data.resize(indexOffset);
+    memset(&data[16], 0, 16);
+    const vector<byte> record = messages[0].save();
+    byte recordHeader[16] = {};
+    const uint32 recordLength = record.size();
+    memcpy(recordHeader + 8, &recordLength, sizeof(uint32));
+    data.insert(data.end(), recordHeader, recordHeader + 16);
+    data.insert(data.end(), record.begin(), record.begin() + record.size() / 2);
+    writeFile(fileName, data);
+
+    CaptureReader reader;
+    TEST(reader.open(fileName));
+    TEST(!reader.hasStoredIndex());
+    checkMessages(reader, messages);
+
+    remove(fileName.c_str());
+}
+
+static void test_invalidFiles()
+{
+    const string fileName = tempFileName("_invalid.cap");
+    CaptureReader reader;
+    remove(fileName.c_str());
+    TEST(!reader.open(fileName));
+    TEST(reader.error().code() == Error::CaptureFileIo);
+
+    writeFile(fileName, vector<byte>(100, 'x'));
+    TEST(!reader.open(fileName));
+    TEST(reader.error().code() == Error::MalformedCaptureFile);
+    TEST(!reader.isOpen());
+
+    // an index that doesn't fit the file
+    {
+        CaptureWriter writer;
+        TEST(writer.open(fileName));
+        TEST(writer.append(testMessages()[0], 0));
+    }
+    vector<byte> data = readFile(fileName);
+    data.pop_back();
+    writeFile(fileName, data);
+    TEST(!reader.open(fileName));
+    TEST(reader.error().code() == Error::MalformedCaptureFile);
+
+    // a record that points outside of the message data
+    data.push_back(0);
+    uint64 indexOffset;
+    memcpy(&indexOffset, &data[16], sizeof(uint64));
+    const uint32 badLength = 100000;
+    memcpy(&data[indexOffset + 16], &badLength, sizeof(uint32));
+    writeFile(fileName, data);
+    TEST(reader.open(fileName));
+    TEST(reader.messageCount() == 1);
+    TEST(reader.message(0).type() == Message::InvalidMessage);
+
+    remove(fileName.c_str());
+}
+#endif
+
+int main(int, char *[])
+{
+#ifdef __unix__
+    test_writeAndRead();
+    test_manyMessages();
+    test_unfinishedFile();
+    test_invalidFiles();
+#endif
+    std::cout << "Passed!\n";
+}
@@ -23,13 +23,17 @@
 
 #include "arguments.h"
 #include "connectioninfo.h"
+#include "cpufeatures.h"
 #include "error.h"
 #include "eventdispatcher.h"
 #include "imessagereceiver.h"
 #include "message.h"
+#include "messagetemplate.h"
 #include "testutil.h"
 #include "transceiver.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 using namespace std;
@@ -44,6 +48,498 @@ static void test_signatureHeader()
     TEST(msg.signature() == "yt");
 }
 
+static Message roundTrip(Message msg)
+{
+    msg.setSerial(1);
+    Message ret;
+    ret.load(msg.save());
+    return ret;
+}
+
+static void test_headerValidation()
+{
+    {
+        Message msg = roundTrip(Message::createCall("/foo", "org.foo.interface", "laze"));
+        TEST(msg.type() == Message::MethodCallMessage);
+        TEST(msg.interface() == "org.foo.interface");
+        TEST(msg.method() == "laze");
+    }
+    // loading stops at the first invalid header field
+    TEST(roundTrip(Message::createCall("/foo", "org.foo.interface", "1laze")).method().empty());
+    TEST(roundTrip(Message::createCall("/foo", "org.foo.interface", "la.ze")).method().empty());
+    TEST(roundTrip(Message::createCall("/foo", "interface", "laze")).interface().empty());
+    TEST(roundTrip(Message::createCall("/foo", "org..interface", "laze")).interface().empty());
+    TEST(roundTrip(Message::createCall("/foo", "org.foo.2nterface", "laze")).interface().empty());
+    {
+        Message call = Message::createCall("/foo", "org.foo.interface", "laze");
+        call.setDestination(":1.42");
+        TEST(roundTrip(call).destination() == ":1.42");
+        call.setDestination("org.foo-bar.service");
+        TEST(roundTrip(call).destination() == "org.foo-bar.service");
+        call.setDestination("org.foo.3service");
+        TEST(roundTrip(call).destination().empty());
+        call.setDestination("org.foo.serv\xc3\xaf" "ce");
+        TEST(roundTrip(call).destination().empty());
+    }
+    // long enough for the vectorized code paths, with the bad character in blocks and in the tail
+    for (uint32 length = 3; length < 80; length++) {
+        for (uint32 pos = 1; pos < length - 1; pos++) {
+            string name(length, 'a');
+            name[length / 2] = '.';
+            if (pos == length / 2) {
+                continue;
+            }
+            Message call = Message::createCall("/foo", name, "laze");
+            call.setDestination(name);
+            string path = "/" + name;
+            path[length / 2 + 1] = '/';
+            call.setPath(path);
+            Message copy = roundTrip(call);
+            TEST(copy.interface() == name);
+            TEST(copy.destination() == name);
+            TEST(copy.path() == path);
+
+            name[pos] = '-';
+            call.setInterface(name);
+            TEST(roundTrip(call).interface().empty());
+            call = Message::createCall("/foo", "org.foo.interface", "laze");
+            call.setDestination(name);
+            TEST(roundTrip(call).destination() == name); // '-' is allowed in bus names
+            path[pos + 1] = '-';
+            call.setPath(path);
+            TEST(roundTrip(call).path().empty());
+        }
+    }
+}
+
+static Message loadedMessage(const vector<byte> &data)
+{
+    Message ret;
+    ret.load(data);
+    return ret;
+}
+
+static void test_malformedHeaders()
+{
+    Message msg = Message::createCall("/foo", "org.foo.interface", "laze");
+    msg.setSerial(1);
+    const vector<byte> saved = msg.save();
+    // the header fields: path at 16, interface at 32, method at 64
+    TEST(saved.size() == 80);
+    TEST(saved[16] == Message::PathHeader && saved[32] == Message::InterfaceHeader &&
+         saved[64] == Message::MethodHeader);
+    TEST(loadedMessage(saved).method() == "laze");
+    {
+        vector<byte> data = saved;
+        data[34] = 'o'; // wrong variant type
+        TEST(loadedMessage(data).interface().empty());
+    }
+    {
+        vector<byte> data = saved;
+        data[33] = 2; // variant signature of more than one type
+        TEST(loadedMessage(data).interface().empty());
+    }
+    {
+        vector<byte> data = saved;
+        data[29] = 1; // nonzero alignment padding
+        TEST(loadedMessage(data).interface().empty());
+    }
+    {
+        vector<byte> data = saved;
+        data[57] = 'x'; // string not null-terminated
+        TEST(loadedMessage(data).interface().empty());
+    }
+    {
+        vector<byte> data = saved;
+        data[64] = Message::InterfaceHeader; // duplicate header field
+        Message loaded = loadedMessage(data);
+        TEST(loaded.interface() == "org.foo.interface");
+        TEST(loaded.method().empty());
+    }
+    {
+        vector<byte> data = saved;
+        data[68] = 40; // string longer than the header array
+        TEST(loadedMessage(data).method().empty());
+    }
+    {
+        vector<byte> data = saved;
+        data[64] = 10; // unknown header field
+        TEST(loadedMessage(data).method().empty());
+    }
+}
+
+static void swapBytes(vector<byte> *data, uint32 pos, uint32 size)
+{
+    std::reverse(data->begin() + pos, data->begin() + pos + size);
+}
+
+static uint32 alignedPos(uint32 pos, uint32 alignment)
+{
+    return (pos + alignment - 1) & ~(alignment - 1);
+}
+
+// converts a saved message with body signature "ai" to the other byte order
+static vector<byte> byteSwappedMessage(vector<byte> data)
+{
+    data[0] = data[0] == 'l' ? 'B' : 'l';
+    uint32 headerArrayLength;
+    memcpy(&headerArrayLength, &data[12], sizeof(uint32));
+    for (uint32 pos = 4; pos <= 12; pos += 4) {
+        swapBytes(&data, pos, 4);
+    }
+    const uint32 headerEnd = 16 + headerArrayLength;
+    uint32 pos = 16;
+    while (pos < headerEnd) {
+        pos = alignedPos(pos, 8) + 1; // skip the header field code
+        const char type = data[pos + 1];
+        pos += 3; // the single letter variant signature
+        if (type == 's' || type == 'o' || type == 'u') {
+            pos = alignedPos(pos, 4);
+            uint32 length;
+            memcpy(&length, &data[pos], sizeof(uint32));
+            swapBytes(&data, pos, 4);
+            pos += type == 'u' ? 4 : 4 + length + 1;
+        } else {
+            TEST(type == 'g');
+            pos += 1 + data[pos] + 1;
+        }
+    }
+    pos = alignedPos(pos, 8);
+    for (; pos < data.size(); pos += 4) {
+        swapBytes(&data, pos, 4); // the array length and the ints
+    }
+    return data;
+}
+
+static void test_byteSwapped()
+{
+    Message msg = Message::createCall("/foo", "org.foo.interface", "laze");
+    Arguments::Writer writer;
+    writer.beginArray();
+    for (int32 i = 0; i < 10; i++) {
+        writer.writeInt32(i * 100000);
+    }
+    writer.endArray();
+    msg.setArguments(writer.finish());
+    msg.setSerial(1234);
+    const vector<byte> native = msg.save();
+
+    Message swapped;
+    swapped.load(byteSwappedMessage(native));
+    TEST(swapped.arguments().isByteSwapped());
+    TEST(swapped.serial() == 1234);
+    TEST(swapped.method() == "laze");
+    {
+        Arguments::Reader reader(swapped.arguments());
+        TEST(reader.peekPrimitiveArray() == Arguments::BeginArray);
+    }
+
+    TEST(swapped.convertToHostByteOrder());
+    TEST(!swapped.arguments().isByteSwapped());
+    TEST(swapped.serial() == 1234);
+    TEST(swapped.save() == native);
+    Arguments::Reader reader(swapped.arguments());
+    std::pair<Arguments::IoState, chunk> array = reader.readPrimitiveArray();
+    TEST(array.first == Arguments::Int32);
+    TEST(array.second.length == 10 * sizeof(int32));
+    int32 last;
+    memcpy(&last, array.second.ptr + 9 * sizeof(int32), sizeof(int32));
+    TEST(last == 900000);
+
+    // a freshly loaded copy agrees
+    Message reloaded;
+    reloaded.load(swapped.save());
+    TEST(reloaded.serial() == 1234);
+    TEST(reloaded.interface() == "org.foo.interface");
+    TEST(!reloaded.arguments().isByteSwapped());
+}
+
+static void writeBlobBody(Arguments::Writer *writer, const vector<byte> &blob)
+{
+    writer->writeString(cstring("blob"));
+    writer->writePrimitiveArray(Arguments::Byte, chunk(const_cast<byte *>(&blob[0]), blob.size()));
+    writer->writeUint32(uint32(blob.size()));
+}
+
+static void test_bodyWriter()
+{
+    vector<byte> blob(100000);
+    for (uint32 i = 0; i < blob.size(); i++) {
+        blob[i] = byte(i * 7);
+    }
+    const string longPath = "/org/example/" + string(1000, 'x');
+
+    for (int pathLength = 0; pathLength < 2; pathLength++) {
+        const string path = pathLength ? longPath : string("/org/example/Blob");
+        Message reference = Message::createSignal(path, "org.example.Blobs", "Blob");
+        {
+            Arguments::Writer writer;
+            writeBlobBody(&writer, blob);
+            reference.setArguments(writer.finish());
+        }
+        reference.setSerial(1);
+
+        Message msg = Message::createSignal(path, "org.example.Blobs", "Blob");
+        {
+            Arguments::Writer writer = Message::bodyWriter();
+            writeBlobBody(&writer, blob);
+            msg.setArguments(writer.finish());
+        }
+        msg.setSerial(1);
+        const vector<byte> saved = msg.save();
+        TEST(saved == reference.save());
+
+        // with enough room for the header, the body is not copied: the arguments are the end of
+        // the serialized message
+        {
+            const chunk serialized = msg.saveView();
+            const chunk body = msg.arguments().data();
+            TEST(serialized.length == saved.size());
+            const bool isInPlace = body.ptr == serialized.ptr + serialized.length - body.length;
+            TEST(isInPlace == !pathLength);
+        }
+
+        // the arguments are still intact
+        {
+            Arguments::Reader reader(msg.arguments());
+            const cstring str = reader.readString();
+            TEST(str.length == 4 && !memcmp(str.ptr, "blob", 4));
+            std::pair<Arguments::IoState, chunk> array = reader.readPrimitiveArray();
+            TEST(array.first == Arguments::Byte);
+            TEST(array.second.length == blob.size());
+            TEST(!memcmp(array.second.ptr, &blob[0], blob.size()));
+            TEST(reader.readUint32() == blob.size());
+            TEST(reader.isFinished());
+        }
+
+        Message copy = msg;
+        TEST(copy.save() == saved);
+
+        Message loaded;
+        loaded.load(saved);
+        TEST(loaded.path() == path);
+        TEST(loaded.arguments().data().length == reference.arguments().data().length);
+
+        // the serialized data stays valid when the arguments are replaced
+        Arguments::Writer writer = Message::bodyWriter();
+        writer.writeByte(42);
+        msg.setArguments(writer.finish());
+        TEST(msg.arguments().data().length == 1);
+        TEST(msg.save() == saved);
+    }
+}
+
+static void test_mappedBuffers()
+{
+    const uint32 oldThreshold = Message::mappedBufferThreshold();
+    Message::setMappedBufferThreshold(4096);
+
+    vector<byte> blob(100000);
+    for (uint32 i = 0; i < blob.size(); i++) {
+        blob[i] = byte(i * 3);
+    }
+    Message msg = Message::createSignal("/org/example/Blob", "org.example.Blobs", "Blob");
+    {
+        Arguments::Writer writer;
+        writeBlobBody(&writer, blob);
+        msg.setArguments(writer.finish());
+    }
+    msg.setSerial(1);
+    const vector<byte> saved = msg.save();
+    TEST(!saved.empty());
+
+    Message loaded;
+    loaded.load(saved);
+    Message copy = loaded;
+    for (Message *m : { &loaded, &copy }) {
+        TEST(m->save() == saved);
+        Arguments::Reader reader(m->arguments());
+        const cstring name = reader.readString();
+        TEST(string(name.ptr, name.length) == "blob");
+        std::pair<Arguments::IoState, chunk> data = reader.readPrimitiveArray();
+        TEST(data.first == Arguments::Byte);
+        TEST(data.second.length == blob.size());
+        TEST(!memcmp(data.second.ptr, &blob[0], blob.size()));
+        TEST(reader.readUint32() == blob.size());
+        TEST(reader.state() == Arguments::Finished);
+    }
+
+    // small messages are unaffected
+    Message small = Message::createSignal("/org/example/Blob", "org.example.Blobs", "Small");
+    small.setSerial(2);
+    const vector<byte> smallSaved = small.save();
+    Message smallLoaded;
+    smallLoaded.load(smallSaved);
+    TEST(smallLoaded.save() == smallSaved);
+
+    Message::setMappedBufferThreshold(oldThreshold);
+    TEST(Message::mappedBufferThreshold() == oldThreshold);
+}
+
+static bool stringHeaderRawIs(const Message &msg, Message::VariableHeader header, const char *value)
+{
+    const cstring str = msg.stringHeaderRaw(header);
+    return str.ptr && str.length == strlen(value) && !memcmp(str.ptr, value, str.length) &&
+           str.ptr[str.length] == '\0';
+}
+
+static void test_rawHeaders()
+{
+    Message msg = Message::createCall("/org/example/Object", "org.example.Interface", "Method");
+    msg.setDestination("org.example.Service");
+    {
+        Arguments::Writer writer;
+        writer.writeString("argument");
+        msg.setArguments(writer.finish());
+    }
+    TEST(stringHeaderRawIs(msg, Message::PathHeader, "/org/example/Object"));
+    TEST(!msg.stringHeaderRaw(Message::SenderHeader).ptr);
+    TEST(!msg.stringHeaderRaw(Message::ErrorNameHeader).ptr);
+
+    Message loaded = roundTrip(msg);
+    const vector<byte> saved = loaded.save();
+    TEST(stringHeaderRawIs(loaded, Message::PathHeader, "/org/example/Object"));
+    TEST(stringHeaderRawIs(loaded, Message::InterfaceHeader, "org.example.Interface"));
+    TEST(stringHeaderRawIs(loaded, Message::MethodHeader, "Method"));
+    TEST(stringHeaderRawIs(loaded, Message::DestinationHeader, "org.example.Service"));
+    TEST(stringHeaderRawIs(loaded, Message::SignatureHeader, "s"));
+    TEST(!loaded.stringHeaderRaw(Message::SenderHeader).ptr);
+
+    {
+        // the copy shares the buffer, which outlives the original
+        Message source = roundTrip(msg);
+        Message copy = source;
+        source = Message();
+        TEST(stringHeaderRawIs(copy, Message::InterfaceHeader, "org.example.Interface"));
+        TEST(copy.save() == saved);
+    }
+}
+
+static void test_internedHeaders()
+{
+    Message msg = Message::createSignal("/org/example/Object", "org.example.Interned", "Changed");
+    msg.setDestination(":1.42");
+
+    // not interned by default
+    TEST(!Message::isHeaderInterningEnabled());
+    Message plain = roundTrip(msg);
+    const cstring interned = Message::internString(cstring("org.example.Interned"));
+    TEST(interned.ptr);
+    TEST(plain.stringHeaderRaw(Message::InterfaceHeader).ptr != interned.ptr);
+
+    Message::setHeaderInterningEnabled(true);
+    TEST(Message::isHeaderInterningEnabled());
+    Message a = roundTrip(msg);
+    Message b = roundTrip(msg);
+    TEST(a.stringHeaderRaw(Message::InterfaceHeader).ptr == interned.ptr);
+    TEST(b.stringHeaderRaw(Message::InterfaceHeader).ptr == interned.ptr);
+    TEST(a.stringHeaderRaw(Message::MethodHeader).ptr == b.stringHeaderRaw(Message::MethodHeader).ptr);
+    TEST(a.stringHeaderRaw(Message::DestinationHeader).ptr ==
+         Message::internString(cstring(":1.42")).ptr);
+    TEST(stringHeaderRawIs(a, Message::DestinationHeader, ":1.42"));
+    // paths are not interned
+    TEST(a.stringHeaderRaw(Message::PathHeader).ptr != b.stringHeaderRaw(Message::PathHeader).ptr);
+
+    // interned headers survive their message
+    const cstring fromA = a.stringHeaderRaw(Message::InterfaceHeader);
+    a = Message();
+    TEST(string(fromA.ptr, fromA.length) == "org.example.Interned");
+    TEST(b.save() == plain.save());
+    Message::setHeaderInterningEnabled(false);
+
+    TEST(!Message::internString(cstring(string(300, 'x').c_str())).ptr);
+}
+
+static Arguments templateTestArguments(const char *str, uint32 num)
+{
+    Arguments::Writer writer;
+    writer.writeString(str);
+    writer.writeUint32(num);
+    return writer.finish();
+}
+
+static vector<byte> savedWithSerial(Message msg, uint32 serial)
+{
+    msg.setSerial(serial);
+    return msg.save();
+}
+
+static void test_messageTemplate()
+{
+    TEST(!MessageTemplate().isValid());
+
+    Message prototype = Message::createSignal("/org/example/Object", "org.example.Interface", "Changed");
+    prototype.setDestination(":1.42");
+    prototype.setArguments(templateTestArguments("", 0));
+
+    Message reference = prototype;
+    reference.setArguments(templateTestArguments("value", 123));
+    const vector<byte> referenceSaved = savedWithSerial(reference, 5);
+
+    Message fromTemplate;
+    {
+        MessageTemplate messageTemplate(prototype);
+        TEST(messageTemplate.isValid());
+        TEST(!messageTemplate.error().isError());
+        fromTemplate = messageTemplate.createMessage(templateTestArguments("value", 123));
+        for (uint32 serial = 1; serial < 5; serial++) {
+            Message msg = messageTemplate.createMessage(templateTestArguments("value", 123));
+            TEST(savedWithSerial(msg, serial) != referenceSaved);
+            TEST(savedWithSerial(msg, 5) == referenceSaved);
+        }
+    }
+    // the message keeps the data of the template alive
+    TEST(fromTemplate.type() == Message::SignalMessage);
+    TEST(fromTemplate.path() == "/org/example/Object");
+    TEST(fromTemplate.interface() == "org.example.Interface");
+    TEST(stringHeaderRawIs(fromTemplate, Message::MethodHeader, "Changed"));
+    TEST(fromTemplate.destination() == ":1.42");
+    TEST(fromTemplate.signature() == "su");
+    Message copy = fromTemplate;
+    TEST(savedWithSerial(fromTemplate, 5) == referenceSaved);
+    TEST(savedWithSerial(copy, 5) == referenceSaved);
+
+    MessageTemplate messageTemplate(prototype);
+    {
+        // changed headers
+        Message msg = messageTemplate.createMessage(templateTestArguments("value", 123));
+        msg.setDestination(":1.43");
+        Message changedReference = reference;
+        changedReference.setDestination(":1.43");
+        TEST(savedWithSerial(msg, 5) == savedWithSerial(changedReference, 5));
+        TEST(stringHeaderRawIs(msg, Message::InterfaceHeader, "org.example.Interface"));
+    }
+    {
+        // a different signature
+        Arguments::Writer writer;
+        writer.writeByte(1);
+        Message msg = messageTemplate.createMessage(writer.finish());
+        Message otherReference = prototype;
+        Arguments::Writer otherWriter;
+        otherWriter.writeByte(1);
+        otherReference.setArguments(otherWriter.finish());
+        TEST(msg.signature() == "y");
+        TEST(savedWithSerial(msg, 5) == savedWithSerial(otherReference, 5));
+    }
+    {
+        // the header can go in front of the body
+        Arguments::Writer writer = Message::bodyWriter();
+        writer.writeString("value");
+        writer.writeUint32(123);
+        Message msg = messageTemplate.createMessage(writer.finish());
+        TEST(savedWithSerial(msg, 5) == referenceSaved);
+    }
+    {
+        Message invalid = Message::createSignal("org/example/Object", "org.example.Interface", "Changed");
+        MessageTemplate invalidTemplate(invalid);
+        TEST(!invalidTemplate.isValid());
+        TEST(invalidTemplate.error().code() == Error::MessagePath);
+        Message msg = invalidTemplate.createMessage(Arguments());
+        msg.setSerial(1);
+        TEST(msg.save().empty());
+    }
+}
+
 class PrintAndTerminateClient : public IMessageReceiver
 {
 public:
@@ -99,9 +595,180 @@ void testBasic(const ConnectionInfo &clientConnection)
     }
 }
 
+static void test_sharedBuffers()
+{
+    Message msg = Message::createCall("/foo", "org.foo.interface", "laze");
+    {
+        Arguments::Writer writer;
+        writer.beginArray();
+        for (int32 i = 0; i < 10; i++) {
+            writer.writeInt32(i * 100000);
+        }
+        writer.endArray();
+        msg.setArguments(writer.finish());
+    }
+    msg.setSerial(1234);
+    const vector<byte> native = msg.save();
+
+    // copies of received messages share the buffer, and it lives as long as any of them
+    {
+        Message loaded;
+        loaded.load(native);
+        Message copy = loaded;
+        TEST(copy.arguments().data().ptr == loaded.arguments().data().ptr);
+        TEST(copy.stringHeaderRaw(Message::MethodHeader).ptr ==
+             loaded.stringHeaderRaw(Message::MethodHeader).ptr);
+        Message assigned;
+        assigned = copy;
+        TEST(assigned.arguments().data().ptr == loaded.arguments().data().ptr);
+        loaded = Message();
+        copy = Message();
+        TEST(assigned.method() == "laze");
+        TEST(assigned.save() == native);
+    }
+
+    // so do copies of serialized messages, and changing a copy doesn't change the original
+    {
+        Message copy = msg;
+        TEST(copy.save() == native);
+        copy.setMethod("couch");
+        copy.setArguments(Arguments());
+        TEST(msg.method() == "laze");
+        TEST(msg.save() == native);
+    }
+
+    // changing the byte order in place gives the message its own buffer
+    {
+        Message swapped;
+        swapped.load(byteSwappedMessage(native));
+        Message copy = swapped;
+        TEST(copy.convertToHostByteOrder());
+        TEST(!copy.arguments().isByteSwapped());
+        TEST(swapped.arguments().isByteSwapped());
+        TEST(copy.arguments().data().ptr != swapped.arguments().data().ptr);
+        TEST(copy.method() == "laze");
+        TEST(copy.save() == native);
+        TEST(swapped.save() == byteSwappedMessage(native));
+        TEST(swapped.convertToHostByteOrder());
+        TEST(swapped.save() == native);
+    }
+}
+
+static void test_saveAndLoadViews()
+{
+    Message msg = Message::createCall("/foo", "org.foo.interface", "laze");
+    {
+        Arguments::Writer writer;
+        writer.beginArray();
+        for (int32 i = 0; i < 10; i++) {
+            writer.writeInt32(i * 100000);
+        }
+        writer.endArray();
+        msg.setArguments(writer.finish());
+    }
+    msg.setSerial(1234);
+    const vector<byte> saved = msg.save();
+
+    // saving without copying
+    {
+        const chunk view = msg.saveView();
+        TEST(view.length == saved.size());
+        TEST(!memcmp(view.ptr, saved.data(), view.length));
+        TEST(msg.saveView().ptr == view.ptr);
+
+        vector<byte> buffer(saved.size() - 1, 0xff);
+        TEST(msg.saveInto(chunk(buffer.data(), buffer.size())) == saved.size());
+        TEST(std::count(buffer.begin(), buffer.end(), 0xff) == int(buffer.size()));
+        buffer.resize(saved.size() + 10);
+        TEST(msg.saveInto(chunk(buffer.data(), buffer.size())) == saved.size());
+        TEST(std::equal(saved.begin(), saved.end(), buffer.begin()));
+    }
+
+    // loading borrowed data, which is not copied
+    {
+        vector<byte> data = saved;
+        Message loaded;
+        TEST(loaded.loadView(chunk(data.data(), data.size())));
+        const chunk args = loaded.arguments().data();
+        TEST(args.ptr >= data.data() && args.ptr + args.length <= data.data() + data.size());
+        TEST(loaded.method() == "laze");
+        TEST(loaded.saveView().ptr == data.data());
+        TEST(loaded.save() == saved);
+    }
+
+    // loading refcounted data, which the message keeps alive
+    {
+        std::shared_ptr<vector<byte>> data = std::make_shared<vector<byte>>(saved);
+        std::weak_ptr<vector<byte>> weakData = data;
+        Message loaded;
+        TEST(loaded.loadView(chunk(data->data(), data->size()), data));
+        Message copy = loaded;
+        data.reset();
+        TEST(!weakData.expired());
+        loaded = Message();
+        TEST(copy.serial() == 1234);
+        TEST(copy.save() == saved);
+        copy = Message();
+        TEST(weakData.expired());
+    }
+
+    // unaligned data is copied
+    {
+        vector<byte> data(saved.size() + 1);
+        std::copy(saved.begin(), saved.end(), data.begin() + 1);
+        Message loaded;
+        TEST(loaded.loadView(chunk(data.data() + 1, saved.size())));
+        const chunk args = loaded.arguments().data();
+        TEST(args.ptr < data.data() || args.ptr >= data.data() + data.size());
+        TEST(loaded.save() == saved);
+    }
+
+    // borrowed data is not changed by converting the byte order
+    {
+        const vector<byte> swappedData = byteSwappedMessage(saved);
+        vector<byte> data = swappedData;
+        Message swapped;
+        TEST(swapped.loadView(chunk(data.data(), data.size())));
+        TEST(swapped.convertToHostByteOrder());
+        TEST(data == swappedData);
+        TEST(swapped.save() == saved);
+    }
+
+    // invalid data
+    {
+        vector<byte> data = saved;
+        data[0] = 'x';
+        Message loaded;
+        TEST(!loaded.loadView(chunk(data.data(), data.size())));
+        TEST(!loaded.loadView(chunk(data.data(), 0)));
+    }
+}
+
+// The features that select each set of SIMD kernels, and the portable ones. Those for features
+// that the CPU doesn't have fall back to the next set.
+static const CpuFeatures kernelLevels[] = {
+    { true, true, true },
+    { true, true, false },
+    { false, false, false }
+};
+
 int main(int, char *[])
 {
     test_signatureHeader();
+    for (const CpuFeatures &features : kernelLevels) {
+        setCpuFeatures(features);
+        test_headerValidation();
+    }
+    setCpuFeatures(kernelLevels[0]);
+    test_malformedHeaders();
+    test_byteSwapped();
+    test_bodyWriter();
+    test_mappedBuffers();
+    test_rawHeaders();
+    test_internedHeaders();
+    test_messageTemplate();
+    test_sharedBuffers();
+    test_saveAndLoadViews();
 #ifdef __linux__
     {
         ConnectionInfo clientConnection(ConnectionInfo::Bus::PeerToPeer);
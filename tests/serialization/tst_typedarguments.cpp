@@ -0,0 +1,351 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+#include "typedarguments.h"
+
+#include "../testutil.h"
+
+#include <cstring>
+#include <iostream>
+
+struct Point
+{
+    int32 x;
+    int32 y;
+};
+
+template<>
+struct TypedStruct<Point>
+{
+    static std::tuple<int32 Point::*, int32 Point::*> fields()
+    {
+        return std::make_tuple(&Point::x, &Point::y);
+    }
+};
+
+static bool stringsEqual(cstring s1, cstring s2)
+{
+    return s1.length == s2.length && memcmp(s1.ptr, s2.ptr, s1.length) == 0;
+}
+
+static bool argumentsEqual(const Arguments &a1, const Arguments &a2)
+{
+    if (!stringsEqual(a1.signature(), a2.signature())) {
+        std::cout << "Different signatures: " << a1.signature().ptr << " " << a2.signature().ptr << '\n';
+        return false;
+    }
+    const chunk d1 = a1.data();
+    const chunk d2 = a2.data();
+    if (d1.length != d2.length || memcmp(d1.ptr, d2.ptr, d1.length) != 0) {
+        std::cout << "Different data.\n" << a1.prettyPrint() << a2.prettyPrint();
+        return false;
+    }
+    return true;
+}
+
+static void test_signatures()
+{
+    TEST(stringsEqual(TypedWriter<>::signature(), cstring("")));
+    TEST(stringsEqual(TypedWriter<bool, byte, int16, uint16, int32, uint32, int64, uint64, double>::signature(),
+                      cstring("bynqiuxtd")));
+    TEST(stringsEqual(TypedWriter<std::string, cstring, TypedObjectPath, TypedSignature, TypedVariant>::signature(),
+                      cstring("ssogv")));
+    TEST(stringsEqual(TypedWriter<uint32, std::vector<std::tuple<int32, int32>>>::signature(), cstring("ua(ii)")));
+    TEST(stringsEqual(TypedWriter<std::tuple<std::string, std::map<std::string, TypedVariant>>>::signature(),
+                      cstring("(sa{sv})")));
+    TEST(stringsEqual(TypedWriter<std::vector<Point>, std::map<uint64, std::vector<std::string>>>::signature(),
+                      cstring("a(ii)a{tas}")));
+    TEST(stringsEqual(TypedReader<std::vector<std::vector<byte>>>::signature(), cstring("aay")));
+}
+
+static void test_propertiesSignal()
+{
+    std::map<std::string, TypedVariant> properties;
+    properties["Bool"] = true;
+    properties["Byte"] = byte(200);
+    properties["Int16"] = int16(-300);
+    properties["Int64"] = -(int64(1) << 40);
+    properties["Double"] = 3.25;
+    properties["Name"] = "dferry";
+    properties["Path"] = TypedObjectPath("/org/example/Object");
+    properties["Signature"] = TypedSignature("a{sv}");
+
+    TypedWriter<std::string, std::map<std::string, TypedVariant>, std::vector<std::string>> typedWriter;
+    Arguments typed = typedWriter.write("org.example.Interface", properties, std::vector<std::string>());
+    TEST(!typedWriter.error().isError());
+
+    Arguments::Writer writer;
+    writer.writeString(cstring("org.example.Interface"));
+    writer.beginDict();
+    for (const std::pair<const std::string, TypedVariant> &prop : properties) {
+        writer.writeString(cstring(prop.first.c_str(), prop.first.length()));
+        writer.beginVariant();
+        const TypedVariant &v = prop.second;
+        switch (v.type()) {
+        case Arguments::Boolean: writer.writeBoolean(v.toBoolean()); break;
+        case Arguments::Byte: writer.writeByte(v.toByte()); break;
+        case Arguments::Int16: writer.writeInt16(v.toInt16()); break;
+        case Arguments::Int64: writer.writeInt64(v.toInt64()); break;
+        case Arguments::Double: writer.writeDouble(v.toDouble()); break;
+        case Arguments::String: writer.writeString(cstring(v.toString().c_str())); break;
+        case Arguments::ObjectPath: writer.writeObjectPath(cstring(v.toString().c_str())); break;
+        case Arguments::Signature: writer.writeSignature(cstring(v.toString().c_str())); break;
+        default: TEST(false);
+        }
+        writer.endVariant();
+    }
+    writer.endDict();
+    writer.beginArray(Arguments::Writer::WriteTypesOfEmptyArray);
+    writer.writeString(cstring());
+    writer.endArray();
+    Arguments dynamic = writer.finish();
+    TEST(writer.state() == Arguments::Finished);
+    TEST(argumentsEqual(typed, dynamic));
+
+    // read what the dynamic writer wrote
+    std::string interface;
+    std::map<std::string, TypedVariant> readProperties;
+    std::vector<std::string> invalidated;
+    invalidated.push_back("garbage");
+    TypedReader<std::string, std::map<std::string, TypedVariant>, std::vector<std::string>> reader(dynamic);
+    TEST(reader.read(&interface, &readProperties, &invalidated));
+    TEST(interface == "org.example.Interface");
+    TEST(invalidated.empty());
+    TEST(readProperties.size() == properties.size());
+    TEST(readProperties["Bool"].type() == Arguments::Boolean && readProperties["Bool"].toBoolean());
+    TEST(readProperties["Byte"].toByte() == 200);
+    TEST(readProperties["Int16"].toInt16() == -300);
+    TEST(readProperties["Int64"].toInt64() == -(int64(1) << 40));
+    TEST(readProperties["Double"].toDouble() == 3.25);
+    TEST(readProperties["Name"].type() == Arguments::String && readProperties["Name"].toString() == "dferry");
+    TEST(readProperties["Path"].type() == Arguments::ObjectPath);
+    TEST(readProperties["Path"].toString() == "/org/example/Object");
+    TEST(readProperties["Signature"].type() == Arguments::Signature);
+    TEST(readProperties["Signature"].toString() == "a{sv}");
+}
+
+static void test_fixedSizeStructs()
+{
+    // padding inside and between fixed size structs, computed at compile time by TypedWriter
+    typedef std::tuple<byte, int64, uint16, std::tuple<bool, double>, int16> Padded;
+    std::vector<Padded> padded;
+    padded.push_back(Padded(1, -2, 3, std::make_tuple(true, 4.5), -5));
+    padded.push_back(Padded(6, 7, 8, std::make_tuple(false, -9.5), 10));
+    std::vector<Point> points;
+    for (int32 i = 0; i < 5; i++) {
+        Point p = { i, -i };
+        points.push_back(p);
+    }
+
+    TypedWriter<byte, std::vector<Padded>, std::vector<Point>, std::vector<int64>, std::vector<byte>> typedWriter;
+    std::vector<int64> emptyInt64s;
+    std::vector<byte> bytes(13, 'x');
+    Arguments typed = typedWriter.write(42, padded, points, emptyInt64s, bytes);
+    TEST(!typedWriter.error().isError());
+
+    Arguments::Writer writer;
+    writer.writeByte(42);
+    writer.beginArray();
+    for (const Padded &p : padded) {
+        writer.beginStruct();
+        writer.writeByte(std::get<0>(p));
+        writer.writeInt64(std::get<1>(p));
+        writer.writeUint16(std::get<2>(p));
+        writer.beginStruct();
+        writer.writeBoolean(std::get<0>(std::get<3>(p)));
+        writer.writeDouble(std::get<1>(std::get<3>(p)));
+        writer.endStruct();
+        writer.writeInt16(std::get<4>(p));
+        writer.endStruct();
+    }
+    writer.endArray();
+    writer.beginArray();
+    for (const Point &p : points) {
+        writer.beginStruct();
+        writer.writeInt32(p.x);
+        writer.writeInt32(p.y);
+        writer.endStruct();
+    }
+    writer.endArray();
+    writer.writePrimitiveArray(Arguments::Int64, chunk());
+    writer.writePrimitiveArray(Arguments::Byte, chunk(&bytes[0], bytes.size()));
+    Arguments dynamic = writer.finish();
+    TEST(writer.state() == Arguments::Finished);
+    TEST(argumentsEqual(typed, dynamic));
+
+    byte b = 0;
+    std::vector<Padded> readPadded;
+    std::vector<Point> readPoints;
+    std::vector<int64> readInt64s(3);
+    std::vector<byte> readBytes;
+    TypedReader<byte, std::vector<Padded>, std::vector<Point>, std::vector<int64>, std::vector<byte>> reader(typed);
+    TEST(reader.read(&b, &readPadded, &readPoints, &readInt64s, &readBytes));
+    TEST(b == 42);
+    TEST(readPadded == padded);
+    TEST(readPoints.size() == points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        TEST(readPoints[i].x == points[i].x && readPoints[i].y == points[i].y);
+    }
+    TEST(readInt64s.empty());
+    TEST(readBytes == bytes);
+}
+
+static void test_nestedContainers()
+{
+    std::map<uint64, std::vector<std::string>> map;
+    map[1].push_back("one");
+    map[2];
+    map[3].push_back("three");
+    map[3].push_back("drei");
+    std::vector<bool> bools;
+    bools.push_back(true);
+    bools.push_back(false);
+
+    TypedWriter<std::map<uint64, std::vector<std::string>>, std::vector<bool>, TypedVariant> typedWriter;
+    Arguments typed = typedWriter.write(map, bools, TypedVariant(uint32(7)));
+    TEST(!typedWriter.error().isError());
+
+    // cross-check with the dynamic reader
+    Arguments::Reader reader(typed);
+    TEST(reader.state() == Arguments::BeginDict);
+    reader.beginDict();
+    for (const std::pair<const uint64, std::vector<std::string>> &entry : map) {
+        TEST(reader.readUint64() == entry.first);
+        reader.beginArray(Arguments::Reader::ReadTypesOnlyIfEmpty);
+        for (const std::string &s : entry.second) {
+            TEST(stringsEqual(reader.readString(), cstring(s.c_str())));
+        }
+        if (entry.second.empty()) {
+            reader.readString();
+        }
+        reader.endArray();
+    }
+    reader.endDict();
+    reader.beginArray();
+    TEST(reader.readBoolean() == true);
+    TEST(reader.readBoolean() == false);
+    reader.endArray();
+    reader.beginVariant();
+    TEST(reader.readUint32() == 7);
+    reader.endVariant();
+    TEST(reader.state() == Arguments::Finished);
+
+    std::map<uint64, std::vector<std::string>> readMap;
+    std::vector<bool> readBools;
+    TypedVariant variant;
+    TypedReader<std::map<uint64, std::vector<std::string>>, std::vector<bool>, TypedVariant> typedReader(typed);
+    TEST(typedReader.read(&readMap, &readBools, &variant));
+    TEST(readMap == map);
+    TEST(readBools == bools);
+    TEST(variant.type() == Arguments::Uint32 && variant.toUint32() == 7);
+}
+
+static void test_byteSwapped()
+{
+    // "u(in)" in big endian
+    byte data[16] = { 0x12, 0x34, 0x56, 0x78,   0, 0, 0, 0,
+                      0xff, 0xff, 0xff, 0xfe,   0x01, 0x02 };
+    Arguments args(nullptr, cstring("u(in)"), chunk(data, 14), true);
+    uint32 u = 0;
+    std::tuple<int32, int16> s;
+    TypedReader<uint32, std::tuple<int32, int16>> reader(args);
+    TEST(reader.read(&u, &s));
+    TEST(u == 0x12345678);
+    TEST(std::get<0>(s) == -2);
+    TEST(std::get<1>(s) == 0x0102);
+}
+
+static void test_errors()
+{
+    {
+        TypedWriter<std::string> writer;
+        Arguments args = writer.write(std::string("embedded\0null", 13));
+        TEST(writer.error().code() == Error::InvalidString);
+        TEST(args.data().length == 0);
+    }
+    {
+        TypedWriter<TypedObjectPath> writer;
+        writer.write(TypedObjectPath("no/slash"));
+        TEST(writer.error().code() == Error::InvalidObjectPath);
+    }
+    {
+        TypedWriter<TypedVariant> writer;
+        writer.write(TypedVariant());
+        TEST(writer.error().code() == Error::InvalidType);
+    }
+
+    TypedWriter<uint32, std::string> writer;
+    Arguments args = writer.write(1, "foo");
+    TEST(!writer.error().isError());
+    {
+        int32 i;
+        std::string s;
+        TypedReader<int32, std::string> reader(args);
+        TEST(!reader.read(&i, &s));
+        TEST(reader.error().code() == Error::ReadWrongType);
+    }
+    {
+        // truncated data
+        Arguments truncated(nullptr, args.signature(), chunk(args.data().ptr, args.data().length - 1));
+        uint32 u;
+        std::string s;
+        TypedReader<uint32, std::string> reader(truncated);
+        TEST(!reader.read(&u, &s));
+        TEST(reader.error().code() == Error::MalformedMessageData);
+    }
+    {
+        // non-zero padding
+        byte data[12] = { 1, 5, 0, 0,   3, 0, 0, 0,   'f', 'o', 'o', 0 };
+        Arguments badPadding(nullptr, cstring("ys"), chunk(data, 12));
+        byte b;
+        std::string s;
+        TypedReader<byte, std::string> reader(badPadding);
+        TEST(!reader.read(&b, &s));
+        TEST(reader.error().code() == Error::MalformedMessageData);
+    }
+    {
+        // a variant with an aggregate is valid, but not supported by TypedVariant
+        Arguments::Writer w;
+        w.beginVariant();
+        w.beginArray();
+        w.writeByte(1);
+        w.endArray();
+        w.endVariant();
+        Arguments aggregateVariant = w.finish();
+        TypedVariant v;
+        TypedReader<TypedVariant> reader(aggregateVariant);
+        TEST(!reader.read(&v));
+        TEST(reader.error().code() == Error::ReadWrongType);
+    }
+}
+
+int main(int, char *[])
+{
+    test_signatures();
+    test_propertiesSignal();
+    test_fixedSizeStructs();
+    test_nestedContainers();
+    test_byteSwapped();
+    test_errors();
+    std::cout << "Passed!\n";
+}
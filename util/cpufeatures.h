@@ -0,0 +1,67 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef CPUFEATURES_H
+#define CPUFEATURES_H
+
+#include "export.h"
+
+// For choosing at runtime between implementations that use different instruction set extensions.
+// Where DFERRY_X86_KERNELS is defined, such implementations can be compiled with
+// __attribute__((target(...))) and the intrinsics from <immintrin.h>.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DFERRY_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// Which of the extensions that dferry has kernels for the CPU supports. All false if
+// DFERRY_X86_KERNELS is not defined.
+struct CpuFeatures
+{
+    bool sse2;
+    bool ssse3;
+    bool avx2;
+};
+
+inline CpuFeatures detectCpuFeatures()
+{
+    CpuFeatures ret = { false, false, false };
+#ifdef DFERRY_X86_KERNELS
+    // we may be called from a static constructor, before the CPU feature data is initialized
+    __builtin_cpu_init();
+    ret.sse2 = __builtin_cpu_supports("sse2");
+    ret.ssse3 = __builtin_cpu_supports("ssse3");
+    ret.avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return ret;
+}
+
+// detected once, but see setCpuFeatures()
+DFERRY_EXPORT const CpuFeatures &cpuFeatures();
+
+// For testing the kernels for less capable CPUs: from now on, only the features that are set in
+// features and supported by the CPU are used. Must not be called while other threads use dferry.
+DFERRY_EXPORT void setCpuFeatures(const CpuFeatures &features);
+
+#endif // CPUFEATURES_H
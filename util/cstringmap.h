@@ -0,0 +1,112 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef CSTRINGMAP_H
+#define CSTRINGMAP_H
+
+#include "fnvhash.h"
+#include "types.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A map from strings to T that can be searched with a cstring, so that looking up the headers of
+// received messages doesn't allocate.
+template<typename T>
+class CStringMap
+{
+public:
+    T *find(cstring key);
+    const T *find(cstring key) const { return const_cast<CStringMap *>(this)->find(key); }
+    T &operator[](const std::string &key); // inserts a default-constructed T if not present
+    void erase(const std::string &key);
+    bool empty() const { return m_buckets.empty(); }
+
+    // calls func(const std::string &key, T &value) for each entry, in no particular order
+    template<typename F>
+    void forEach(F func)
+    {
+        for (auto &bucket : m_buckets) {
+            for (std::pair<std::string, T> &entry : bucket.second) {
+                func(entry.first, entry.second);
+            }
+        }
+    }
+
+private:
+    std::unordered_map<uint32, std::vector<std::pair<std::string, T>>> m_buckets;
+};
+
+template<typename T>
+T *CStringMap<T>::find(cstring key)
+{
+    const auto it = m_buckets.find(FnvHash::hash(key));
+    if (it == m_buckets.end()) {
+        return nullptr;
+    }
+    for (std::pair<std::string, T> &entry : it->second) {
+        if (entry.first.length() == key.length && !memcmp(entry.first.c_str(), key.ptr, key.length)) {
+            return &entry.second;
+        }
+    }
+    return nullptr;
+}
+
+template<typename T>
+T &CStringMap<T>::operator[](const std::string &key)
+{
+    std::vector<std::pair<std::string, T>> &bucket =
+        m_buckets[FnvHash::hash(cstring(key.c_str(), key.length()))];
+    for (std::pair<std::string, T> &entry : bucket) {
+        if (entry.first == key) {
+            return entry.second;
+        }
+    }
+    bucket.emplace_back(key, T());
+    return bucket.back().second;
+}
+
+template<typename T>
+void CStringMap<T>::erase(const std::string &key)
+{
+    const auto it = m_buckets.find(FnvHash::hash(cstring(key.c_str(), key.length())));
+    if (it == m_buckets.end()) {
+        return;
+    }
+    std::vector<std::pair<std::string, T>> &bucket = it->second;
+    for (auto entry = bucket.begin(); entry != bucket.end(); ++entry) {
+        if (entry->first == key) {
+            bucket.erase(entry);
+            break;
+        }
+    }
+    if (bucket.empty()) {
+        m_buckets.erase(it);
+    }
+}
+
+#endif // CSTRINGMAP_H
@@ -21,8 +21,7 @@
       - disconnected
       - timeout??
       - (read a malformed message - connection should be closed)
-      - discrepancy in number of file descriptors advertised and actually received - when this
-        is implemented
+      - discrepancy in number of file descriptors advertised and actually received
     - artifacts of the implementation; not much - using a default-constructed PendingReply, anything else?
     - error codes from standardized DBus interfaces like the introspection thing; I think the convenience
       stuff should really be separate! Maybe separate namespace, in any case separate enum
@@ -75,6 +74,8 @@ public:
         InvalidKeyTypeInDict,
         GreaterTwoTypesInDict,
         ArrayOrDictTooLong,
+        BufferTooSmall,
+        InvalidUnixFd, // writing: can't duplicate the fd, reading: index out of range
 
         MissingBeginDictEntry = 1019,
         MisplacedBeginDictEntry,
@@ -116,9 +117,28 @@ public:
         PeerInvalidProperty,
         PeerNoSuchProperty,
         AccessDenied, // for now(?) only properties: writing to read-only / reading from write-only
-        MaxMessageError = 2047
+        MessageUnixFds, // more Unix fds than can be sent with one message
+        UnixFdPassingUnavailable, // the connection or the peer doesn't support passing Unix fds
+        MaxMessageError = 2047,
         // end Message / PendingReply errors
 
+        // CaptureReader / CaptureWriter
+        CaptureFileIo, // the file can't be opened, mapped, read or written
+        MalformedCaptureFile,
+        MaxCaptureFileError = 2111,
+        // end CaptureReader / CaptureWriter errors
+
+        // MatchRule (invalid names use the Message errors above)
+        MatchRulePathConflict, // both path and path namespace are set
+        MatchRuleArgumentIndex, // argN with N > MatchRule::MaxArgumentIndex
+        MaxMatchRuleError = 2175,
+        // end MatchRule errors
+
+        // ObjectInterface (invalid names and signatures use the errors above)
+        DuplicateInterfaceMember, // a method, signal or property name occurs twice
+        MaxObjectInterfaceError = 2239
+        // end ObjectInterface errors
+
 
         // errors for other occasions go here
     };
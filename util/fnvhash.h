@@ -0,0 +1,57 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef FNVHASH_H
+#define FNVHASH_H
+
+#include "types.h"
+
+// FNV-1a, a simple and fast hash for the short keys of the lookup tables.
+// Its results are stored in capture files, so it must not change.
+class FnvHash
+{
+public:
+    FnvHash() : m_hash(2166136261u) {}
+
+    void add(byte b) { m_hash = (m_hash ^ b) * 16777619u; }
+    void add(cstring str)
+    {
+        for (uint32 i = 0; i < str.length; i++) {
+            add(byte(str.ptr[i]));
+        }
+    }
+    uint32 result() const { return m_hash; }
+
+    static uint32 hash(cstring str)
+    {
+        FnvHash hash;
+        hash.add(str);
+        return hash.result();
+    }
+
+private:
+    uint32 m_hash;
+};
+
+#endif // FNVHASH_H
@@ -0,0 +1,159 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef INTERNTABLE_H
+#define INTERNTABLE_H
+
+#include "fnvhash.h"
+#include "spinlock.h"
+#include "types.h"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// A process-wide set of objects of type T, looked up by a string key, which are never freed, so
+// that they can be shared by all threads without reference counting. It is bounded so that peers
+// sending endless distinct keys can't make it grow forever.
+// T must have:
+// - static const uint32 MaxInterned, the maximum number of objects
+// - static T *createInterned(cstring key, uint32 hash), which returns nullptr on failure
+// - cstring key() const and uint32 hash() const, returning what createInterned() got
+template<typename T>
+class InternTable
+{
+public:
+    // Returns the object for key, creating it if necessary. Returns nullptr if creating it failed,
+    // or if the table is full; then *isFull is set to true if isFull is not null.
+    static const T *get(cstring key, bool *isFull = nullptr);
+
+private:
+    InternTable() : m_slots(256, nullptr), m_count(0) {}
+
+    // never destroyed because the objects may be in use until the very end of the process
+    static InternTable *instance()
+    {
+        static InternTable *table = new InternTable;
+        return table;
+    }
+
+    static bool isMatch(const T *object, cstring key, uint32 hash)
+    {
+        return object->hash() == hash && object->key().length == key.length &&
+               !memcmp(object->key().ptr, key.ptr, key.length);
+    }
+
+    const T *findOrInsert(cstring key, uint32 hash, bool *isFull);
+    const T **findSlot(cstring key, uint32 hash);
+    void grow();
+
+    // per-thread, direct-mapped, in front of the shared table
+    static const uint32 s_threadCacheSize = 64;
+    static thread_local const T *tls_cache[s_threadCacheSize];
+
+    // open addressing, only ever growing
+    Spinlock m_lock;
+    std::vector<const T *> m_slots;
+    uint32 m_count;
+};
+
+template<typename T>
+thread_local const T *InternTable<T>::tls_cache[InternTable<T>::s_threadCacheSize];
+
+// static
+template<typename T>
+const T *InternTable<T>::get(cstring key, bool *isFull)
+{
+    if (!key.length) {
+        key = cstring("", 0); // no null pointers for memcmp()
+    }
+    const uint32 hash = FnvHash::hash(key);
+    const T *&cached = tls_cache[hash % s_threadCacheSize];
+    if (likely(cached && isMatch(cached, key, hash))) {
+        return cached;
+    }
+    bool isFullStorage;
+    const T *object = instance()->findOrInsert(key, hash, isFull ? isFull : &isFullStorage);
+    if (object) {
+        cached = object;
+    }
+    return object;
+}
+
+template<typename T>
+const T *InternTable<T>::findOrInsert(cstring key, uint32 hash, bool *isFull)
+{
+    SpinLocker locker(&m_lock);
+    *isFull = false;
+    const T **slot = findSlot(key, hash);
+    if (*slot) {
+        return *slot;
+    }
+    if (m_count >= T::MaxInterned) {
+        *isFull = true;
+        return nullptr;
+    }
+    // creating it under the lock isn't great, but it happens only once per distinct key
+    const T *object = T::createInterned(key, hash);
+    if (!object) {
+        return nullptr;
+    }
+    *slot = object;
+    m_count++;
+    if (m_count * 2 > m_slots.size()) {
+        grow();
+    }
+    return object;
+}
+
+template<typename T>
+const T **InternTable<T>::findSlot(cstring key, uint32 hash)
+{
+    const uint32 mask = m_slots.size() - 1;
+    for (uint32 i = hash & mask; ; i = (i + 1) & mask) {
+        const T *object = m_slots[i];
+        if (!object || isMatch(object, key, hash)) {
+            return &m_slots[i];
+        }
+    }
+}
+
+template<typename T>
+void InternTable<T>::grow()
+{
+    std::vector<const T *> oldSlots(m_slots.size() * 2, nullptr);
+    std::swap(oldSlots, m_slots);
+    const uint32 mask = m_slots.size() - 1;
+    for (const T *object : oldSlots) {
+        if (object) {
+            uint32 i = object->hash() & mask;
+            while (m_slots[i]) {
+                i = (i + 1) & mask;
+            }
+            m_slots[i] = object;
+        }
+    }
+}
+
+#endif // INTERNTABLE_H
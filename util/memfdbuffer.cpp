@@ -0,0 +1,175 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#include "memfdbuffer.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the seals that make the contents immutable
+static const int s_immutableSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+static chunk mapFd(int fd, uint32 size, int protection)
+{
+    if (!size) {
+        return chunk();
+    }
+    void *mem = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+    return mem != MAP_FAILED ? chunk(static_cast<byte *>(mem), size) : chunk();
+}
+#endif
+
+MemFdBuffer::MemFdBuffer()
+   : m_fd(-1),
+     m_isWritable(false)
+{
+}
+
+// static
+MemFdBuffer MemFdBuffer::create(uint32 size, const char *name)
+{
+    MemFdBuffer ret;
+#ifdef __linux__
+    ret.m_fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ret.m_fd < 0 || ftruncate(ret.m_fd, size) != 0) {
+        ret.clear();
+        return ret;
+    }
+    ret.m_data = mapFd(ret.m_fd, size, PROT_READ | PROT_WRITE);
+    if (size && !ret.m_data.ptr) {
+        ret.clear();
+        return ret;
+    }
+    ret.m_isWritable = true;
+#else
+    (void)size;
+    (void)name;
+#endif
+    return ret;
+}
+
+// static
+MemFdBuffer MemFdBuffer::map(int fd)
+{
+    MemFdBuffer ret;
+#ifdef __linux__
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & s_immutableSeals) != s_immutableSeals) {
+        return ret;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || uint64(st.st_size) > 0xffffffffu) {
+        return ret;
+    }
+    ret.m_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (ret.m_fd < 0) {
+        return ret;
+    }
+    ret.m_data = mapFd(ret.m_fd, uint32(st.st_size), PROT_READ);
+    if (st.st_size && !ret.m_data.ptr) {
+        ret.clear();
+    }
+#else
+    (void)fd;
+#endif
+    return ret;
+}
+
+MemFdBuffer::MemFdBuffer(MemFdBuffer &&other)
+   : m_fd(other.m_fd),
+     m_data(other.m_data),
+     m_isWritable(other.m_isWritable)
+{
+    other.m_fd = -1;
+    other.m_data = chunk();
+    other.m_isWritable = false;
+}
+
+MemFdBuffer &MemFdBuffer::operator=(MemFdBuffer &&other)
+{
+    if (this != &other) {
+        clear();
+        m_fd = other.m_fd;
+        m_data = other.m_data;
+        m_isWritable = other.m_isWritable;
+        other.m_fd = -1;
+        other.m_data = chunk();
+        other.m_isWritable = false;
+    }
+    return *this;
+}
+
+MemFdBuffer::~MemFdBuffer()
+{
+    clear();
+}
+
+int MemFdBuffer::seal()
+{
+#ifdef __linux__
+    if (m_fd < 0) {
+        return -1;
+    }
+    if (!m_isWritable) {
+        return m_fd;
+    }
+    // F_SEAL_WRITE fails while there are writable shared mappings
+    const uint32 size = m_data.length;
+    if (m_data.ptr) {
+        munmap(m_data.ptr, m_data.length);
+        m_data = chunk();
+    }
+    m_isWritable = false;
+    if (fcntl(m_fd, F_ADD_SEALS, s_immutableSeals | F_SEAL_SEAL) != 0) {
+        clear();
+        return -1;
+    }
+    m_data = mapFd(m_fd, size, PROT_READ);
+    if (size && !m_data.ptr) {
+        clear();
+        return -1;
+    }
+    return m_fd;
+#else
+    return -1;
+#endif
+}
+
+void MemFdBuffer::clear()
+{
+#ifdef __linux__
+    if (m_data.ptr) {
+        munmap(m_data.ptr, m_data.length);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+#endif
+    m_fd = -1;
+    m_data = chunk();
+    m_isWritable = false;
+}
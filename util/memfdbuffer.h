@@ -0,0 +1,71 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef MEMFDBUFFER_H
+#define MEMFDBUFFER_H
+
+#include "export.h"
+#include "types.h"
+
+// A block of memory in a Linux memfd, for passing large payloads to another process as a Unix fd
+// instead of copying them through the socket. The sender fills the buffer in place and seals it,
+// the receiver maps it after checking that it is sealed - so the sender can't change or truncate
+// it while it is in use.
+// On other operating systems than Linux, create() and map() always return invalid buffers.
+class DFERRY_EXPORT MemFdBuffer
+{
+public:
+    MemFdBuffer(); // constructs an invalid buffer
+    // Creates a writable buffer of size bytes. name only appears in /proc, for debugging.
+    static MemFdBuffer create(uint32 size, const char *name = "dferry");
+    // Maps a received fd, e.g. from Arguments::Reader::readUnixFd(), read-only. Returns an invalid
+    // buffer if fd is not a memfd sealed against writing and resizing. fd is duplicated, not taken over.
+    static MemFdBuffer map(int fd);
+
+    MemFdBuffer(MemFdBuffer &&other);
+    MemFdBuffer &operator=(MemFdBuffer &&other);
+    ~MemFdBuffer();
+
+    MemFdBuffer(const MemFdBuffer &other) = delete;
+    MemFdBuffer &operator=(const MemFdBuffer &other) = delete;
+
+    bool isValid() const { return m_fd >= 0; }
+    // writable from create() until seal(), read-only afterwards and after map()
+    chunk data() const { return m_data; }
+    // Makes the contents immutable and returns the fd to send, e.g. with
+    // Arguments::Writer::writeUnixFd(), or -1 on failure. The data stays readable, but data() may
+    // change because the memory is mapped again. Returns the fd without changes if already sealed.
+    int seal();
+    // owned by the buffer
+    int fileDescriptor() const { return m_fd; }
+
+private:
+    void clear();
+
+    int m_fd;
+    chunk m_data;
+    bool m_isWritable;
+};
+
+#endif // MEMFDBUFFER_H
@@ -0,0 +1,245 @@
+/*
+   Copyright (C) 2016 Andreas Hartmetz <ahartmetz@gmail.com>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LGPL.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+
+   Alternatively, this file is available under the Mozilla Public License
+   Version 1.1.  You may obtain a copy of the License at
+   http://www.mozilla.org/MPL/
+*/
+
+
+#ifndef SERIALMAP_H
+#define SERIALMAP_H
+
+#include "types.h"
+
+#include <cassert>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A map from message serials to T. Serials are taken in ascending order and usually removed soon,
+// so the entries are kept in a ring indexed by serial, which covers a window of consecutive serials.
+// Entries that fall out of the window because they live much longer than the newer ones, and entries
+// that are too old for the window when inserted, go to a hash table.
+// Serial 0 is not valid. Serials may wrap around.
+template<typename T>
+class SerialMap
+{
+public:
+    SerialMap() : m_slots(s_initialCapacity), m_first(0), m_last(0), m_count(0) {}
+
+    bool empty() const { return !m_count && m_overflow.empty(); }
+    uint32 size() const { return m_count + m_overflow.size(); }
+
+    T *find(uint32 serial);
+    // For serial counters: returns *counter, or the next serial after it that is not in the map,
+    // skipping 0, and moves *counter past it. After a wrap-around, replies without a timeout may
+    // still be waited for, and their serials must not be reused.
+    uint32 takeFreeSerial(uint32 *counter);
+    // serial must not be in the map already
+    void insert(uint32 serial, T value);
+    // returns false if serial is not in the map; if value is not null, it receives the removed value
+    bool take(uint32 serial, T *value = nullptr);
+    // removes an arbitrary entry; returns false if the map is empty
+    bool takeAny(uint32 *serial, T *value);
+
+    // removes the entries for which pred(uint32 serial, const T &value) returns true
+    template<typename F>
+    void eraseIf(F pred)
+    {
+        for (Slot &slot : m_slots) {
+            if (slot.serial && pred(slot.serial, const_cast<const T &>(slot.value))) {
+                slot = Slot();
+                m_count--;
+            }
+        }
+        for (auto it = m_overflow.begin(); it != m_overflow.end(); ) {
+            if (pred(it->first, const_cast<const T &>(it->second))) {
+                it = m_overflow.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    struct Slot
+    {
+        uint32 serial = 0; // 0 if unused
+        T value = T();
+    };
+
+    static const uint32 s_initialCapacity = 64;
+    static const uint32 s_maxCapacity = 1 << 20;
+
+    uint32 capacity() const { return m_slots.size(); }
+    bool isInWindow(uint32 serial) const
+    {
+        return serial && m_count && serial - m_first < capacity();
+    }
+    Slot &slotFor(uint32 serial) { return m_slots[serial & (capacity() - 1)]; }
+    void grow();
+
+    std::vector<Slot> m_slots;
+    // all entries in m_slots are in [m_first, m_first + capacity()), and none is after m_last
+    uint32 m_first;
+    uint32 m_last;
+    uint32 m_count;
+    std::unordered_map<uint32, T> m_overflow;
+};
+
+template<typename T>
+T *SerialMap<T>::find(uint32 serial)
+{
+    if (isInWindow(serial)) {
+        Slot &slot = slotFor(serial);
+        if (slot.serial == serial) {
+            return &slot.value;
+        }
+    }
+    if (m_overflow.empty()) {
+        return nullptr;
+    }
+    const auto it = m_overflow.find(serial);
+    return it != m_overflow.end() ? &it->second : nullptr;
+}
+
+template<typename T>
+uint32 SerialMap<T>::takeFreeSerial(uint32 *counter)
+{
+    while (true) {
+        const uint32 serial = (*counter)++;
+        if (unlikely(!*counter)) {
+            *counter = 1;
+        }
+        if (likely(serial && !find(serial))) {
+            return serial;
+        }
+    }
+}
+
+template<typename T>
+void SerialMap<T>::insert(uint32 serial, T value)
+{
+    assert(serial);
+    assert(!find(serial));
+    if (!m_count) {
+        m_first = serial;
+        m_last = serial;
+    } else if (int32(serial - m_first) < 0) {
+        // e.g. a serial that another thread took earlier, but whose message arrives here only now
+        if (m_last - serial >= capacity()) {
+            m_overflow.emplace(serial, std::move(value));
+            return;
+        }
+        m_first = serial;
+    } else {
+        while (serial - m_first >= capacity()) {
+            if (m_count * 2 >= capacity() && capacity() < s_maxCapacity &&
+                serial - m_first < capacity() * 2) {
+                grow();
+                continue;
+            }
+            // move the window forward, moving the oldest entry out of the way if there is one
+            Slot &oldest = slotFor(m_first);
+            if (oldest.serial) {
+                m_overflow.emplace(oldest.serial, std::move(oldest.value));
+                oldest = Slot();
+                if (!--m_count) {
+                    m_first = serial;
+                    m_last = serial;
+                    break;
+                }
+            }
+            m_first++;
+        }
+        if (int32(serial - m_last) > 0) {
+            m_last = serial;
+        }
+    }
+    Slot &slot = slotFor(serial);
+    slot.serial = serial;
+    slot.value = std::move(value);
+    m_count++;
+}
+
+template<typename T>
+bool SerialMap<T>::take(uint32 serial, T *value)
+{
+    if (isInWindow(serial)) {
+        Slot &slot = slotFor(serial);
+        if (slot.serial == serial) {
+            if (value) {
+                *value = std::move(slot.value);
+            }
+            slot = Slot();
+            m_count--;
+            return true;
+        }
+    }
+    if (m_overflow.empty()) {
+        return false;
+    }
+    const auto it = m_overflow.find(serial);
+    if (it == m_overflow.end()) {
+        return false;
+    }
+    if (value) {
+        *value = std::move(it->second);
+    }
+    m_overflow.erase(it);
+    return true;
+}
+
+template<typename T>
+bool SerialMap<T>::takeAny(uint32 *serial, T *value)
+{
+    if (!m_overflow.empty()) {
+        const auto it = m_overflow.begin();
+        *serial = it->first;
+        *value = std::move(it->second);
+        m_overflow.erase(it);
+        return true;
+    }
+    if (!m_count) {
+        return false;
+    }
+    while (!slotFor(m_first).serial) {
+        m_first++;
+    }
+    Slot &slot = slotFor(m_first);
+    *serial = slot.serial;
+    *value = std::move(slot.value);
+    slot = Slot();
+    m_count--;
+    return true;
+}
+
+template<typename T>
+void SerialMap<T>::grow()
+{
+    std::vector<Slot> oldSlots(capacity() * 2);
+    std::swap(oldSlots, m_slots);
+    for (Slot &slot : oldSlots) {
+        if (slot.serial) {
+            slotFor(slot.serial) = std::move(slot);
+        }
+    }
+}
+
+#endif // SERIALMAP_H